@@ -0,0 +1,371 @@
+/*
+ * engine_bench: in-process benchmark of the game engine.
+ *
+ * Logs players in directly, without a server or network clients, and has
+ * a number of threads call one player operation as fast as they can for a
+ * fixed time, for each thread count in a list.  The packets the operations
+ * send go to a sink: /dev/null, or one end of a socketpair per player
+ * whose other ends a drain thread reads.  For each operation the report
+ * gives ops/s at each thread count and the speedup over one thread (the
+ * first count's rate divided by that count, if it is not one).
+ *
+ * Every thread cycles through all the players, each starting at its own
+ * offset, so that all threads see the same mix of cheap operations (a
+ * laser that misses) and dear ones (a hit, which is broadcast), and
+ * threads contend for players as a player's own thread and a shooter's
+ * thread do in the server.
+ *
+ * Only MAX_PLAYERS avatars exist, so that is the most players a room can
+ * have, unless the rooms are large (-X, see room.h): then -n may be up to
+ * the size given, the avatars are shared, and the maze is a random one with
+ * room for them all.  Since a large room tells each event only to the
+ * players nearby, the cost of an operation should then not grow in
+ * proportion to -n.  With -R the players are logged in to each of that many rooms, and
+ * the threads cycle through the players of all of them, so comparing runs
+ * with one room and with several shows how much the per-room locks let more
+ * threads do.  A laser hit sets the victim's hit flag and signals the
+ * thread that logged it in; the benchmark blocks the signal, so victims are
+ * never removed and keep being hit.
+ *
+ * Usage: engine_bench [-n <players per room>] [-R <rooms>] [-X <room size>]
+ *            [-t <threads,...>] [-d <seconds>] [-o <op,...>] [-s null|socketpair]
+ *            [-S <seed>] [-j]
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+
+#include "maze.h"
+#include "maze_ext.h"
+#include "player.h"
+#include "player_ext.h"
+#include "room.h"
+#include "log.h"
+#include "rng.h"
+
+#define MAX_POINTS 16
+
+static char *bench_maze[] = {
+    "******************************",
+    "***** %%%%%%%%% &&&&&&&&&&& **",
+    "***** %%%%%%%%%        $$$$  *",
+    "*           $$$$$$ $$$$$$$$$ *",
+    "*##########                  *",
+    "*########## @@@@@@@@@@@@@@@@@*",
+    "*           @@@@@@@@@@@@@@@@@*",
+    "******************************",
+    NULL
+};
+
+enum op { OP_MOVE, OP_ROTATE, OP_FIRE, OP_UPDATE_VIEW, NOPS };
+
+static const char *op_names[NOPS] = { "move", "rotate", "fire", "update_view" };
+
+struct runner {
+    pthread_t tid;
+    int index;
+    enum op op;
+    unsigned long ops;
+};
+
+static int nplayers = MAX_PLAYERS;     // per room
+static int nrooms = 1;
+static int large = 0;
+static int ntotal;                      // in all rooms
+static int points[MAX_POINTS] = { 1, 2, 4, 8, 16, 32, 64 };
+static int npoints = 7;
+static double duration = 1.0;
+static int run_op[NOPS] = { 1, 1, 1, 1 };
+static int use_socketpair = 0;
+static unsigned long seed = 1;
+static int json = 0;
+
+static PLAYER **players;
+static atomic_int *move_signs;          // direction of each player's next move
+static int (*sink_fds)[2];
+static pthread_barrier_t start_barrier;
+static atomic_int stop = 0;
+static atomic_int draining = 1;
+
+static unsigned long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/*
+ * Read and discard everything sent to the players' sockets.
+ */
+static void *drain_thread(void *arg) {
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    char buf[65536];
+
+    for (int i = 0; i < ntotal; i++) {
+        struct epoll_event ev = { .events = EPOLLIN, .data.fd = sink_fds[i][1] };
+        epoll_ctl(epfd, EPOLL_CTL_ADD, sink_fds[i][1], &ev);
+    }
+    while (atomic_load(&draining)) {
+        struct epoll_event events[MAX_PLAYERS];
+        int n = epoll_wait(epfd, events, MAX_PLAYERS, 10);
+        for (int i = 0; i < n; i++)
+            while (read(events[i].data.fd, buf, sizeof(buf)) > 0)
+                ;
+    }
+    close(epfd);
+    return NULL;
+}
+
+static void *runner_thread(void *arg) {
+    struct runner *r = arg;
+    unsigned long ops = 0;
+    int i = r->index % ntotal;
+
+    pthread_barrier_wait(&start_barrier);
+    while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        PLAYER *p = players[i];
+        switch (r->op) {
+            case OP_MOVE: {
+                // Each player goes forward then back, so it stays in its part
+                // of the maze and, unless boxed in, its moves succeed.  A move
+                // that succeeds is followed by a view update, as in the MOVE
+                // handler.
+                int sign = atomic_fetch_xor_explicit(&move_signs[i], 1, memory_order_relaxed) ? -1 : 1;
+                if (player_move(p, sign) == 0)
+                    player_update_view(p);
+                break;
+            }
+            case OP_ROTATE:
+                player_rotate(p, 1);
+                break;
+            case OP_FIRE:
+                player_fire_laser(p);
+                break;
+            case OP_UPDATE_VIEW:
+                player_update_view(p);
+                break;
+            default:
+                break;
+        }
+        ops++;
+        if (++i == ntotal)
+            i = 0;
+    }
+    r->ops = ops;
+    return NULL;
+}
+
+/*
+ * Run one operation on a number of threads.  Returns ops/s.
+ */
+static double run_point(enum op op, int threads) {
+    struct runner *runners = calloc(threads, sizeof(*runners));
+
+    atomic_store(&stop, 0);
+    pthread_barrier_init(&start_barrier, NULL, threads + 1);
+    for (int t = 0; t < threads; t++) {
+        runners[t].index = t;
+        runners[t].op = op;
+        pthread_create(&runners[t].tid, NULL, runner_thread, &runners[t]);
+    }
+    pthread_barrier_wait(&start_barrier);
+    unsigned long start = now_ns();
+    struct timespec ts = { (time_t)duration, (long)((duration - (time_t)duration) * 1e9) };
+    nanosleep(&ts, NULL);
+    atomic_store(&stop, 1);
+
+    unsigned long total = 0;
+    for (int t = 0; t < threads; t++) {
+        pthread_join(runners[t].tid, NULL);
+        total += runners[t].ops;
+    }
+    double secs = (now_ns() - start) / 1e9;
+    pthread_barrier_destroy(&start_barrier);
+    free(runners);
+    return total / secs;
+}
+
+static int parse_list(char *spec) {
+    npoints = 0;
+    for (char *save = NULL, *tok = strtok_r(spec, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        if (npoints == MAX_POINTS || atoi(tok) <= 0)
+            return -1;
+        points[npoints++] = atoi(tok);
+    }
+    return npoints ? 0 : -1;
+}
+
+static int parse_ops(char *spec) {
+    memset(run_op, 0, sizeof(run_op));
+    for (char *save = NULL, *tok = strtok_r(spec, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        int i;
+        for (i = 0; i < NOPS && strcmp(tok, op_names[i]); i++)
+            ;
+        if (i == NOPS)
+            return -1;
+        run_op[i] = 1;
+    }
+    return 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-n <players per room>] [-R <rooms>] [-X <room size>] "
+            "[-t <threads,...>] [-d <seconds>] "
+            "[-o move,rotate,fire,update_view] [-s null|socketpair] [-S <seed>] [-j]\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:R:X:t:d:o:s:S:j")) != -1) {
+        switch (opt) {
+            case 'n': nplayers = atoi(optarg); break;
+            case 'R': nrooms = atoi(optarg); break;
+            case 'X': large = atoi(optarg); break;
+            case 'd': duration = atof(optarg); break;
+            case 'S': seed = strtoul(optarg, NULL, 0); break;
+            case 'j': json = 1; break;
+            case 't':
+                if (parse_list(optarg) < 0)
+                    usage(argv[0]);
+                break;
+            case 'o':
+                if (parse_ops(optarg) < 0)
+                    usage(argv[0]);
+                break;
+            case 's':
+                if (!strcmp(optarg, "socketpair"))
+                    use_socketpair = 1;
+                else if (strcmp(optarg, "null"))
+                    usage(argv[0]);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (room_init(nrooms, large) < 0 || nplayers <= 0 || nplayers > room_capacity() ||
+        duration <= 0)
+        usage(argv[0]);
+    ntotal = nrooms * nplayers;
+    players = calloc(ntotal, sizeof(*players));
+    sink_fds = calloc(ntotal, sizeof(*sink_fds));
+    move_signs = calloc(ntotal, sizeof(*move_signs));
+
+    // A laser hit signals the thread that logged the victim in.  It is
+    // blocked in every thread, so it stays pending and interrupts nothing.
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    log_init();
+    rng_init(seed, 1);
+    if (large) {
+        // About eight cells for each player, a fifth of them walls.
+        int side = 2;
+        while ((side - 2) * (side - 2) < 8 * nplayers)
+            side++;
+        char **template = maze_generate(side, side);
+        maze_init(template);
+        maze_template_free(template);
+    } else {
+        maze_init(bench_maze);
+    }
+    player_init();
+
+    pthread_t drain_tid;
+    for (int i = 0; i < ntotal; i++) {
+        if (use_socketpair) {
+            if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sink_fds[i]) < 0) {
+                perror("engine_bench: socketpair");
+                exit(EXIT_FAILURE);
+            }
+            fcntl(sink_fds[i][1], F_SETFL, O_NONBLOCK);
+        } else if (i) {
+            // One /dev/null serves them all: it keeps no state to contend on.
+            sink_fds[i][0] = sink_fds[0][0];
+        } else if ((sink_fds[i][0] = open("/dev/null", O_WRONLY | O_CLOEXEC)) < 0) {
+            perror("engine_bench: /dev/null");
+            exit(EXIT_FAILURE);
+        }
+    }
+    // Logins already send views, so the sockets must be drained from here on.
+    if (use_socketpair)
+        pthread_create(&drain_tid, NULL, drain_thread, NULL);
+    for (int i = 0; i < ntotal; i++) {
+        char name[16];
+        snprintf(name, sizeof(name), "bench%d", i);
+        room_enter(i / nplayers);
+        players[i] = player_login(sink_fds[i][0], 'A' + i % nplayers % 26, name);
+        if (!players[i]) {
+            fprintf(stderr, "engine_bench: login of %s failed\n", name);
+            exit(EXIT_FAILURE);
+        }
+        player_reset(players[i]);
+    }
+
+    if (json)
+        printf("{\"players\":%d,\"rooms\":%d,\"large\":%d,\"sink\":\"%s\",\"seconds\":%.3f,"
+               "\"ops\":{", nplayers, nrooms, large, use_socketpair ? "socketpair" : "null", duration);
+    else
+        printf("engine_bench: %d players in each of %d %sroom(s), %s sink, %.1f s per point\n",
+               nplayers, nrooms, large ? "large " : "", use_socketpair ? "socketpair" : "/dev/null", duration);
+
+    int first = 1;
+    for (int op = 0; op < NOPS; op++) {
+        if (!run_op[op])
+            continue;
+        double base = 0;
+        if (json)
+            printf("%s\"%s\":[", first ? "" : ",", op_names[op]);
+        else
+            printf("\n%s\nTHREADS  OPS/S         SPEEDUP\n", op_names[op]);
+        first = 0;
+        for (int p = 0; p < npoints; p++) {
+            double rate = run_point(op, points[p]);
+            if (p == 0)
+                base = rate / points[0];
+            if (json)
+                printf("%s{\"threads\":%d,\"ops_per_sec\":%.1f,\"speedup\":%.3f}", p ? "," : "",
+                       points[p], rate, rate / base);
+            else
+                printf("%-8d %-13.1f %.2f\n", points[p], rate, rate / base);
+            fflush(stdout);
+        }
+        if (json)
+            printf("]");
+    }
+    if (json)
+        printf("}}\n");
+
+    for (int i = 0; i < ntotal; i++)
+        player_logout(players[i]);
+    if (use_socketpair) {
+        atomic_store(&draining, 0);
+        pthread_join(drain_tid, NULL);
+    }
+    for (int i = 0; i < ntotal; i++) {
+        if (use_socketpair) {
+            close(sink_fds[i][0]);
+            close(sink_fds[i][1]);
+        } else if (i == 0) {
+            close(sink_fds[i][0]);
+        }
+    }
+    free(players);
+    free(sink_fds);
+    player_fini();
+    maze_fini();
+    return 0;
+}
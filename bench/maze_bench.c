@@ -0,0 +1,464 @@
+/*
+ * maze_bench: micro-benchmarks for the maze primitives.
+ *
+ * Times maze_get_view(), maze_find_target() and maze_move() on generated
+ * mazes of several sizes.  Each maze has random interior walls and a
+ * clear row and column through its centre, where the benchmarks look and
+ * move, so that views reach their full depth and laser searches walk to
+ * the edge of the maze: a north or south walk steps from row to row of
+ * the maze, an east or west one along a row.  Views are timed at several
+ * depths up to VIEW_DEPTH and every case is run at each of a list of
+ * thread counts, all sharing the maze lock.
+ *
+ * Each case runs untimed for a warmup period and then for a number of
+ * timed repetitions, each giving nanoseconds per operation (wall time
+ * times threads, over operations).  The minimum, median, mean and
+ * standard deviation over the repetitions are reported, as a table and
+ * optionally as JSON with one case per line.
+ *
+ * Given the JSON of an earlier run as a baseline, each case's median is
+ * compared with the baseline's; a case is flagged as a regression if it
+ * is slower by more than the threshold and by more than three standard
+ * deviations of either run, and the exit status is then 1.
+ *
+ * Usage: maze_bench [-s <rows>x<cols>,...] [-t <threads,...>] [-r <reps>]
+ *            [-d <seconds per rep>] [-w <warmup seconds>] [-f <name filter>]
+ *            [-o <json file>] [-b <baseline json>] [-x <threshold %>]
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "maze.h"
+#include "log.h"
+
+#define MAX_SIZES 8
+#define MAX_POINTS 8
+#define MAX_THREADS 16
+#define MAX_REPS 100
+#define MAX_BASELINE 4096
+#define BATCH 64                        // operations between clock reads
+#define WALL_PERCENT 20
+
+enum op { OP_GET_VIEW, OP_FIND_TARGET, OP_MOVE };
+
+static const char *op_names[] = { "get_view", "find_target", "move" };
+static const char *dir_names[NUM_DIRECTIONS] = { "N", "W", "S", "E" };
+static const int depths[] = { 1, 4, 8, VIEW_DEPTH };
+
+struct bench_case {
+    enum op op;
+    DIRECTION dir;
+    int depth;
+    int threads;
+    char name[96];
+};
+
+struct result {
+    double min, median, mean, stddev;
+    unsigned long ops;
+};
+
+struct baseline {
+    char name[96];
+    double median, stddev;
+};
+
+struct runner {
+    pthread_t tid;
+    int index;
+    unsigned long ops;
+};
+
+static int sizes[MAX_SIZES][2] = { { 8, 30 }, { 64, 64 }, { 512, 512 }, { 2048, 2048 } };
+static int nsizes = 4;
+static int points[MAX_POINTS] = { 1, 4 };
+static int npoints = 2;
+static int reps = 5;
+static double rep_secs = 0.05;
+static double warmup_secs = 0.02;
+static const char *filter = NULL;
+static const char *json_path = NULL;
+static const char *baseline_path = NULL;
+static double threshold = 10.0;
+
+static struct baseline baselines[MAX_BASELINE];
+static int nbaselines = 0;
+
+static int rows, cols;
+static struct bench_case *current;
+static pthread_barrier_t start_barrier, end_barrier;
+static atomic_int stop = 0;
+static atomic_int done = 0;
+
+static unsigned long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static void sleep_secs(double secs) {
+    struct timespec ts = { (time_t)secs, (long)((secs - (time_t)secs) * 1e9) };
+    while (nanosleep(&ts, &ts) < 0)
+        ;
+}
+
+/*
+ * Build a maze with random walls, a clear row through the centre and a
+ * clear pair of columns beside it, for the movers.
+ */
+static void build_maze(int r, int c) {
+    char **template = malloc((r + 1) * sizeof(char *));
+    unsigned long x = 0x2545f4914f6cdd1dUL;
+
+    for (int i = 0; i < r; i++) {
+        template[i] = malloc(c + 1);
+        for (int j = 0; j < c; j++) {
+            x = x * 6364136223846793005UL + 1442695040888963407UL;
+            int border = i == 0 || j == 0 || i == r - 1 || j == c - 1;
+            template[i][j] = border ? '*' : (x >> 33) % 100 < WALL_PERCENT ? '#' : ' ';
+        }
+        template[i][c] = '\0';
+    }
+    for (int i = 1; i < r - 1; i++)
+        template[i][c / 2 - 1] = template[i][c / 2] = ' ';
+    for (int j = 1; j < c - 1; j++)
+        template[r / 2][j] = ' ';
+    template[r] = NULL;
+
+    rows = r;
+    cols = c;
+    maze_init(template);
+    for (int i = 0; i < r; i++)
+        free(template[i]);
+    free(template);
+}
+
+/*
+ * Where mover t stands, with an empty cell to its east: along the clear
+ * row, two cells apart, then down the clear pair of columns.
+ */
+static void mover_cell(int t, int *rowp, int *colp) {
+    int along = (cols - 3) / 2;
+    if (t < along) {
+        *rowp = rows / 2;
+        *colp = 1 + 2 * t;
+    } else {
+        t -= along;
+        *rowp = 1 + t + (1 + t >= rows / 2);
+        *colp = cols / 2 - 1;
+    }
+}
+
+static void *runner_thread(void *arg) {
+    struct runner *r = arg;
+    char view[VIEW_DEPTH][VIEW_WIDTH];
+    int row = rows / 2, col = cols / 2;
+    unsigned long ops = 0;
+
+    if (current->op == OP_MOVE)
+        mover_cell(r->index, &row, &col);
+    while (1) {
+        pthread_barrier_wait(&start_barrier);
+        if (atomic_load(&done))
+            break;
+        ops = 0;
+        while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+            for (int i = 0; i < BATCH; i++) {
+                switch (current->op) {
+                    case OP_GET_VIEW:
+                        maze_get_view((VIEW *)view, row, col, current->dir, current->depth);
+                        break;
+                    case OP_FIND_TARGET:
+                        maze_find_target(row, col, current->dir);
+                        break;
+                    case OP_MOVE:
+                        // There and back again: two operations.
+                        maze_move(row, col, EAST);
+                        maze_move(row, col + 1, WEST);
+                        i++;
+                        break;
+                }
+            }
+            ops += BATCH;
+        }
+        r->ops = ops;
+        pthread_barrier_wait(&end_barrier);
+    }
+    return NULL;
+}
+
+/*
+ * Run the threads for a period.  Returns nanoseconds per operation.
+ */
+static double run_period(struct runner *runners, int threads, double secs, unsigned long *opsp) {
+    atomic_store(&stop, 0);
+    pthread_barrier_wait(&start_barrier);
+    unsigned long start = now_ns();
+    sleep_secs(secs);
+    atomic_store(&stop, 1);
+    pthread_barrier_wait(&end_barrier);
+    unsigned long elapsed = now_ns() - start;
+
+    unsigned long ops = 0;
+    for (int t = 0; t < threads; t++)
+        ops += runners[t].ops;
+    *opsp = ops;
+    return (double)elapsed * threads / ops;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void run_case(struct bench_case *bc, struct result *res) {
+    struct runner runners[MAX_THREADS] = { 0 };
+    double samples[MAX_REPS];
+    unsigned long ops;
+
+    current = bc;
+    if (bc->op == OP_MOVE) {
+        for (int t = 0; t < bc->threads; t++) {
+            int r, c;
+            mover_cell(t, &r, &c);
+            maze_set_player('A' + t, r, c);
+        }
+    }
+    atomic_store(&done, 0);
+    pthread_barrier_init(&start_barrier, NULL, bc->threads + 1);
+    pthread_barrier_init(&end_barrier, NULL, bc->threads + 1);
+    for (int t = 0; t < bc->threads; t++) {
+        runners[t].index = t;
+        pthread_create(&runners[t].tid, NULL, runner_thread, &runners[t]);
+    }
+
+    run_period(runners, bc->threads, warmup_secs, &ops);
+    res->ops = 0;
+    for (int i = 0; i < reps; i++) {
+        samples[i] = run_period(runners, bc->threads, rep_secs, &ops);
+        res->ops += ops;
+    }
+
+    atomic_store(&done, 1);
+    pthread_barrier_wait(&start_barrier);
+    for (int t = 0; t < bc->threads; t++)
+        pthread_join(runners[t].tid, NULL);
+    pthread_barrier_destroy(&start_barrier);
+    pthread_barrier_destroy(&end_barrier);
+    if (bc->op == OP_MOVE) {
+        for (int t = 0; t < bc->threads; t++) {
+            int r, c;
+            mover_cell(t, &r, &c);
+            maze_remove_player('A' + t, r, c);
+            maze_remove_player('A' + t, r, c + 1);
+        }
+    }
+
+    double sum = 0, sq = 0;
+    for (int i = 0; i < reps; i++)
+        sum += samples[i];
+    res->mean = sum / reps;
+    for (int i = 0; i < reps; i++)
+        sq += (samples[i] - res->mean) * (samples[i] - res->mean);
+    res->stddev = reps > 1 ? sqrt(sq / (reps - 1)) : 0;
+    qsort(samples, reps, sizeof(double), compare_doubles);
+    res->min = samples[0];
+    res->median = reps % 2 ? samples[reps / 2] : (samples[reps / 2 - 1] + samples[reps / 2]) / 2;
+}
+
+/*
+ * Read the cases of a JSON file written by an earlier run; each is on a
+ * line of its own.
+ */
+static int load_baseline(const char *path) {
+    FILE *f = fopen(path, "r");
+    char line[1024];
+
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f) && nbaselines < MAX_BASELINE) {
+        struct baseline *b = &baselines[nbaselines];
+        char *median = strstr(line, "\"median_ns\":");
+        char *stddev = strstr(line, "\"stddev_ns\":");
+        if (sscanf(line, " {\"name\":\"%95[^\"]\"", b->name) == 1 && median && stddev) {
+            b->median = atof(median + strlen("\"median_ns\":"));
+            b->stddev = atof(stddev + strlen("\"stddev_ns\":"));
+            nbaselines++;
+        }
+    }
+    fclose(f);
+    return 0;
+}
+
+static struct baseline *find_baseline(const char *name) {
+    for (int i = 0; i < nbaselines; i++)
+        if (!strcmp(baselines[i].name, name))
+            return &baselines[i];
+    return NULL;
+}
+
+static int parse_list(char *spec, int *out, int max) {
+    int n = 0;
+    for (char *save = NULL, *tok = strtok_r(spec, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        if (n == max || atoi(tok) <= 0)
+            return -1;
+        out[n++] = atoi(tok);
+    }
+    return n ? n : -1;
+}
+
+static int parse_sizes(char *spec) {
+    nsizes = 0;
+    for (char *save = NULL, *tok = strtok_r(spec, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        int r, c;
+        if (nsizes == MAX_SIZES || sscanf(tok, "%dx%d", &r, &c) != 2 || r < 3 || c < 5)
+            return -1;
+        sizes[nsizes][0] = r;
+        sizes[nsizes][1] = c;
+        nsizes++;
+    }
+    return nsizes ? 0 : -1;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-s <rows>x<cols>,...] [-t <threads,...>] [-r <reps>] "
+            "[-d <seconds per rep>] [-w <warmup seconds>] [-f <name filter>] "
+            "[-o <json file>] [-b <baseline json>] [-x <threshold %%>]\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:t:r:d:w:f:o:b:x:")) != -1) {
+        switch (opt) {
+            case 's':
+                if (parse_sizes(optarg) < 0)
+                    usage(argv[0]);
+                break;
+            case 't':
+                if ((npoints = parse_list(optarg, points, MAX_POINTS)) < 0)
+                    usage(argv[0]);
+                break;
+            case 'r': reps = atoi(optarg); break;
+            case 'd': rep_secs = atof(optarg); break;
+            case 'w': warmup_secs = atof(optarg); break;
+            case 'f': filter = optarg; break;
+            case 'o': json_path = optarg; break;
+            case 'b': baseline_path = optarg; break;
+            case 'x': threshold = atof(optarg); break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (reps <= 0 || reps > MAX_REPS || rep_secs <= 0 || warmup_secs < 0 || threshold < 0)
+        usage(argv[0]);
+    for (int p = 0; p < npoints; p++) {
+        if (points[p] > MAX_THREADS) {
+            fprintf(stderr, "maze_bench: at most %d threads\n", MAX_THREADS);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (baseline_path && load_baseline(baseline_path) < 0)
+        exit(EXIT_FAILURE);
+
+    FILE *json = NULL;
+    if (json_path && !(json = fopen(json_path, "w"))) {
+        perror(json_path);
+        exit(EXIT_FAILURE);
+    }
+
+    log_init();
+    if (json)
+        fprintf(json, "{\"reps\":%d,\"rep_seconds\":%g,\"warmup_seconds\":%g,\"benchmarks\":[\n",
+                reps, rep_secs, warmup_secs);
+    printf("%-36s %-10s %-10s %-10s %-10s%s\n", "CASE", "MEDIAN_NS", "MIN_NS", "STDDEV_NS",
+           "MOPS", baseline_path ? " BASELINE" : "");
+
+    int first = 1, regressions = 0;
+    for (int s = 0; s < nsizes; s++) {
+        int r = sizes[s][0], c = sizes[s][1];
+        build_maze(r, c);
+
+        // Every view, then every laser search, then moves.
+        struct bench_case cases[NUM_DIRECTIONS * 4 + NUM_DIRECTIONS + 1];
+        int ncases = 0;
+        for (int d = 0; d < NUM_DIRECTIONS; d++)
+            for (int k = 0; k < sizeof(depths) / sizeof(depths[0]); k++)
+                cases[ncases++] = (struct bench_case){ OP_GET_VIEW, d, depths[k] };
+        for (int d = 0; d < NUM_DIRECTIONS; d++)
+            cases[ncases++] = (struct bench_case){ OP_FIND_TARGET, d, 0 };
+        cases[ncases++] = (struct bench_case){ OP_MOVE, EAST, 0 };
+
+        for (int i = 0; i < ncases; i++) {
+            for (int p = 0; p < npoints; p++) {
+                struct bench_case bc = cases[i];
+                struct result res;
+                bc.threads = points[p];
+                if (bc.op == OP_GET_VIEW)
+                    snprintf(bc.name, sizeof(bc.name), "%s/%dx%d/%s/d%d/t%d", op_names[bc.op],
+                             r, c, dir_names[bc.dir], bc.depth, bc.threads);
+                else if (bc.op == OP_FIND_TARGET)
+                    snprintf(bc.name, sizeof(bc.name), "%s/%dx%d/%s/t%d", op_names[bc.op],
+                             r, c, dir_names[bc.dir], bc.threads);
+                else
+                    snprintf(bc.name, sizeof(bc.name), "%s/%dx%d/t%d", op_names[bc.op],
+                             r, c, bc.threads);
+                if (filter && !strstr(bc.name, filter))
+                    continue;
+                if (bc.op == OP_MOVE && bc.threads > (c - 3) / 2 + r - 3) {
+                    fprintf(stderr, "maze_bench: %s skipped: maze too small\n", bc.name);
+                    continue;
+                }
+
+                run_case(&bc, &res);
+                printf("%-36s %-10.1f %-10.1f %-10.1f %-10.2f", bc.name, res.median, res.min,
+                       res.stddev, bc.threads * 1e3 / res.median);
+                struct baseline *b = baseline_path ? find_baseline(bc.name) : NULL;
+                if (b) {
+                    double change = (res.median - b->median) / b->median * 100;
+                    double noise = 3 * (res.stddev > b->stddev ? res.stddev : b->stddev);
+                    int regressed = change > threshold && res.median - b->median > noise;
+                    printf(" %+.1f%%%s", change, regressed ? " REGRESSION" :
+                           -change > threshold && b->median - res.median > noise ? " improved" : "");
+                    regressions += regressed;
+                } else if (baseline_path) {
+                    printf(" (new)");
+                }
+                printf("\n");
+                fflush(stdout);
+
+                if (json) {
+                    fprintf(json, "%s{\"name\":\"%s\",\"op\":\"%s\",\"rows\":%d,\"cols\":%d,"
+                            "\"gaze\":\"%s\",\"depth\":%d,\"threads\":%d,\"ops\":%lu,"
+                            "\"min_ns\":%.2f,\"median_ns\":%.2f,\"mean_ns\":%.2f,\"stddev_ns\":%.2f}",
+                            first ? "" : ",\n", bc.name, op_names[bc.op], r, c,
+                            dir_names[bc.dir], bc.depth, bc.threads, res.ops, res.min,
+                            res.median, res.mean, res.stddev);
+                    first = 0;
+                }
+            }
+        }
+        maze_fini();
+    }
+
+    if (json) {
+        fprintf(json, "\n]}\n");
+        fclose(json);
+    }
+    if (regressions) {
+        printf("%d regression%s against %s (threshold %.1f%%)\n", regressions,
+               regressions == 1 ? "" : "s", baseline_path, threshold);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,254 @@
+/*
+ * transport_bench: compare the per-packet cost of TCP and shared-memory
+ * clients of a running server.
+ *
+ * For each transport asked for, logs in a number of clients (one thread
+ * each) asking for compact views, and has each keep a window of TURN
+ * requests outstanding for a fixed time: every VIEW that comes back is
+ * answered with another TURN.  The report gives requests/s, and the CPU
+ * time per request spent by the clients and, given the server's pid, by
+ * the server, which includes everything it spends on a request and its
+ * reply: the system calls, the engine and the view.
+ *
+ * Start the server with both transports, e.g.
+ *     bin/mazewar -p 3333 -m /tmp/mazewar.shm
+ *
+ * Usage: transport_bench [-p <port>] [-m <shm socket>] [-P <server pid>]
+ *            [-n <clients>] [-W <window>] [-d <seconds>] [-j]
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+
+#include "protocol.h"
+#include "protocol_ext.h"
+#include "player_ext.h"
+#include "shm.h"
+
+enum transport { TCP, SHM, NTRANSPORTS };
+static const char *transport_names[] = { "tcp", "shm" };
+
+static int port = 0;
+static const char *shm_path = NULL;
+static int server_pid = 0;
+static int nclients = 4;
+static int window = 8;
+static double duration = 2.0;
+static int json = 0;
+
+static atomic_int stop;
+
+struct client {
+    pthread_t tid;
+    enum transport transport;
+    int avatar;
+    atomic_ulong requests;
+    int failed;
+};
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double cpu_sec(struct rusage *ru) {
+    return ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6 +
+        ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6;
+}
+
+/*
+ * CPU seconds used so far by a process, from /proc; zero if unknown.
+ */
+static double process_cpu_sec(int pid) {
+    char path[64], buf[1024];
+    unsigned long utime, stime;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return 0;
+    size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[n] = '\0';
+    // Fields 14 and 15, counted after the parenthesized command name.
+    char *p = strrchr(buf, ')');
+    if (!p || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+                     &utime, &stime) != 2)
+        return 0;
+    return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+static int open_tcp(void) {
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port) };
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+static int send_turn(int fd) {
+    MZW_PACKET turn = { .type = MZW_TURN_PKT, .param1 = 1 };
+    return proto_send_packet(fd, &turn, NULL);
+}
+
+static void *client_thread(void *arg) {
+    struct client *c = arg;
+    int fd = c->transport == SHM ? shm_connect(shm_path) : open_tcp();
+    MZW_PACKET pkt;
+    void *payload;
+    char name[16];
+
+    if (fd < 0) {
+        c->failed = 1;
+        return NULL;
+    }
+    snprintf(name, sizeof(name), "bench%d", c->avatar);
+    MZW_PACKET login = {
+        .type = MZW_LOGIN_PKT, .param1 = 'A' + c->avatar,
+        .param2 = MZW_LOGIN_COMPACT_VIEW, .size = strlen(name)
+    };
+    if (proto_send_packet(fd, &login, name) < 0)
+        goto fail;
+    do {
+        if (proto_recv_packet(fd, &pkt, &payload) < 0 || pkt.type == MZW_INUSE_PKT)
+            goto fail;
+        free(payload);
+    } while (pkt.type != MZW_READY_PKT);
+
+    for (int i = 0; i < window; i++)
+        if (send_turn(fd) < 0)
+            goto fail;
+    while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        if (proto_recv_packet(fd, &pkt, &payload) < 0)
+            goto fail;
+        free(payload);
+        if (pkt.type == MZW_VIEW_PKT) {
+            atomic_fetch_add_explicit(&c->requests, 1, memory_order_relaxed);
+            if (send_turn(fd) < 0)
+                goto fail;
+        }
+    }
+    shm_release(fd);
+    close(fd);
+    return NULL;
+
+fail:
+    c->failed = 1;
+    shm_release(fd);
+    close(fd);
+    return NULL;
+}
+
+/*
+ * Run one transport and print its line of the report.
+ */
+static int run(enum transport t, int first) {
+    struct client clients[MAX_PLAYERS];
+    struct rusage r0, r1;
+
+    atomic_store(&stop, 0);
+    for (int i = 0; i < nclients; i++) {
+        clients[i] = (struct client){ .transport = t, .avatar = i };
+        pthread_create(&clients[i].tid, NULL, client_thread, &clients[i]);
+    }
+    // Let the logins and first views settle before measuring.
+    usleep(200000);
+    unsigned long base = 0;
+    for (int i = 0; i < nclients; i++)
+        base += atomic_load(&clients[i].requests);
+    getrusage(RUSAGE_SELF, &r0);
+    double s0 = server_pid ? process_cpu_sec(server_pid) : 0, t0 = now_sec();
+
+    usleep(duration * 1e6);
+
+    unsigned long total = 0;
+    for (int i = 0; i < nclients; i++)
+        total += atomic_load(&clients[i].requests);
+    double elapsed = now_sec() - t0, s1 = server_pid ? process_cpu_sec(server_pid) : 0;
+    getrusage(RUSAGE_SELF, &r1);
+    atomic_store(&stop, 1);
+    int failed = 0;
+    for (int i = 0; i < nclients; i++) {
+        pthread_join(clients[i].tid, NULL);
+        failed += clients[i].failed;
+    }
+
+    total -= base;
+    double rate = total / elapsed;
+    double client_us = total ? (cpu_sec(&r1) - cpu_sec(&r0)) * 1e6 / total : 0;
+    double server_us = total && server_pid ? (s1 - s0) * 1e6 / total : 0;
+    if (json)
+        printf("%s\"%s\":{\"requests_per_sec\":%.1f,\"client_cpu_us\":%.3f,\"server_cpu_us\":%.3f,"
+               "\"failed\":%d}", first ? "" : ",", transport_names[t], rate, client_us, server_us,
+               failed);
+    else
+        printf("%-9s %-14.1f %-16.3f %-16.3f %d\n", transport_names[t], rate, client_us,
+               server_pid ? server_us : 0.0, failed);
+    return failed ? -1 : 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-p <port>] [-m <shm socket>] [-P <server pid>] [-n <clients>] "
+            "[-W <window>] [-d <seconds>] [-j]\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+
+    while ((opt = getopt(argc, argv, "p:m:P:n:W:d:j")) != -1) {
+        switch (opt) {
+            case 'p': port = atoi(optarg); break;
+            case 'm': shm_path = optarg; break;
+            case 'P': server_pid = atoi(optarg); break;
+            case 'n': nclients = atoi(optarg); break;
+            case 'W': window = atoi(optarg); break;
+            case 'd': duration = atof(optarg); break;
+            case 'j': json = 1; break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if ((port <= 0 && !shm_path) || nclients <= 0 || nclients > MAX_PLAYERS ||
+        window <= 0 || duration <= 0)
+        usage(argv[0]);
+
+    if (json)
+        printf("{\"clients\":%d,\"window\":%d,\"seconds\":%.3f,\"transports\":{",
+               nclients, window, duration);
+    else
+        printf("transport_bench: %d clients, window %d, %.1f s per transport\n\n"
+               "TRANSPORT REQUESTS/S     CLIENT CPU US    SERVER CPU US    FAILED\n",
+               nclients, window, duration);
+    int status = 0, first = 1;
+    if (port > 0) {
+        status |= run(TCP, first);
+        first = 0;
+        // The server logs the players out when it sees the connections go.
+        if (shm_path)
+            usleep(300000);
+    }
+    if (shm_path)
+        status |= run(SHM, first);
+    if (json)
+        printf("}}\n");
+    return status ? EXIT_FAILURE : EXIT_SUCCESS;
+}
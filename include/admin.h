@@ -0,0 +1,28 @@
+#ifndef ADMIN_H
+#define ADMIN_H
+
+/*
+ * Local administrative control socket.
+ *
+ * When enabled, the server listens on a Unix-domain stream socket for
+ * line-oriented commands that inspect live state (maze, players,
+ * connections) or adjust debug tracing at run time.  Commands are served
+ * by a single background thread, one connection at a time; type "help"
+ * for the list.  Nothing is dumped unless it is asked for.
+ */
+
+/*
+ * Start the admin thread listening on the given socket path.  Any stale
+ * socket file at that path is removed first.
+ *
+ * @param path  Filesystem path of the Unix-domain socket.
+ * @return  zero if the admin socket is listening, -1 otherwise.
+ */
+int admin_init(const char *path);
+
+/*
+ * Stop the admin thread and remove the socket file.
+ */
+void admin_fini(void);
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef CLIENT_REGISTRY_EXT_H
+#define CLIENT_REGISTRY_EXT_H
+
+#include <stdio.h>
+
+#include "client_registry.h"
+
+/*
+ * Additional client registry functions that are not part of the interface
+ * in client_registry.h.
+ */
+
+/*
+ * Get the number of currently registered clients.
+ *
+ * @param cr  The client registry.
+ * @return  The number of registered file descriptors.
+ */
+int creg_count(CLIENT_REGISTRY *cr);
+
+/*
+ * List the registered client file descriptors.
+ *
+ * @param cr  The client registry.
+ * @param fds  Array to receive the file descriptors, in ascending order.
+ * @param max  Number of elements in the array.
+ * @return  The number of file descriptors stored.
+ */
+int creg_list(CLIENT_REGISTRY *cr, int *fds, int max);
+
+/*
+ * Account for bytes transferred on a registered client connection.
+ * Unregistered descriptors are ignored.
+ *
+ * @param cr  The client registry.
+ * @param fd  The client file descriptor.
+ * @param in  Number of bytes received from the client.
+ * @param out  Number of bytes sent to the client.
+ */
+void creg_add_bytes(CLIENT_REGISTRY *cr, int fd, size_t in, size_t out);
+
+/*
+ * Print connection statistics on the specified stream.
+ *
+ * @param cr  The client registry.
+ * @param out  The stream on which the statistics are to be printed.
+ */
+void creg_show(CLIENT_REGISTRY *cr, FILE *out);
+
+/*
+ * Print one line per registered client on the specified stream, giving
+ * the file descriptor, connection age and bytes in/out.
+ *
+ * @param cr  The client registry.
+ * @param out  The stream on which the list is to be printed.
+ * @return  The number of clients listed.
+ */
+int creg_show_clients(CLIENT_REGISTRY *cr, FILE *out);
+
+#endif
@@ -0,0 +1,100 @@
+#ifndef CORO_H
+#define CORO_H
+
+#include <stdio.h>
+
+/*
+ * Stackful coroutines on per-core schedulers.
+ *
+ * Each scheduler is a thread with its own epoll instance and a run queue of
+ * coroutines.  A coroutine runs until it waits for a file descriptor or
+ * sleeps, at which point it switches back to its scheduler, which runs the
+ * next coroutine that is ready.  A coroutine stays on the scheduler it was
+ * started on, so thread-local state (errno, pthread_self()) is stable across
+ * a wait.
+ *
+ * Stacks are carved out of large reserved mappings and recycled through a
+ * per-scheduler free list; only the pages a coroutine actually touches are
+ * backed by memory.  Below each stack is a PROT_NONE guard page, so that an
+ * overflow faults at once instead of corrupting the next stack.  Each guard
+ * splits its mapping, so every stack costs two entries of the process's
+ * memory map, and vm.max_map_count (65530 by default) limits coroutines to
+ * about half that many; a coroutine that cannot get a stack is not started.
+ * As an earlier warning, the stack pointer is also checked every time a
+ * coroutine switches out, and the process is aborted if less than
+ * CORO_STACK_RED bytes are left, so code run in a coroutine must not keep
+ * large buffers on the stack.
+ *
+ * Only reads yield.  A write to a socket whose send buffer is full waits in
+ * place (writes are made with the receiving player's mutex held, which
+ * another coroutine on the thread could otherwise take), so a client that
+ * stops reading holds up every coroutine on its scheduler.  The wait is
+ * capped at CORO_SEND_WAIT_MS, after which that client is dropped, so each
+ * client can stall its scheduler at most once, and briefly.
+ *
+ * A coroutine must not wait while it holds a lock that another coroutine
+ * might take: both run on the same thread, so a recursive mutex would be
+ * granted to the second and a normal one would deadlock the scheduler.
+ */
+
+/* Maximum number of scheduler threads. */
+#define CORO_MAX_SCHEDULERS 256
+
+/* Size of each coroutine stack, in bytes. */
+#define CORO_STACK_SIZE (64 * 1024)
+
+/* Stack space that must remain free whenever a coroutine switches out. */
+#define CORO_STACK_RED (16 * 1024)
+
+/* Longest a coroutine waits for a client's send buffer before dropping it. */
+#define CORO_SEND_WAIT_MS 100
+
+/*
+ * Start the scheduler threads.  Scheduler i is pinned to CPU i modulo the
+ * number of online CPUs.
+ *
+ * @param nsched  Number of schedulers (at most CORO_MAX_SCHEDULERS).
+ * @return  zero if the schedulers were started, -1 otherwise.
+ */
+int coro_init(int nsched);
+
+/*
+ * Start a coroutine.  Coroutines are spread round-robin over the
+ * schedulers.  The coroutine ends when the function returns.
+ *
+ * @param fn  Function run by the coroutine.
+ * @param arg  Argument passed to the function.
+ * @return  zero if the coroutine was queued, -1 otherwise.
+ */
+int coro_spawn(void (*fn)(void *arg), void *arg);
+
+/*
+ * Is the caller running in a coroutine?
+ */
+int coro_running(void);
+
+/*
+ * Suspend the calling coroutine until a file descriptor is ready.
+ *
+ * @param fd  A non-blocking file descriptor.
+ * @param events  EPOLLIN and/or EPOLLOUT.
+ * @return  zero when the descriptor is ready (or has an error or hangup
+ * pending), -1 if it could not be watched or the caller is not a coroutine.
+ */
+int coro_wait(int fd, unsigned int events);
+
+/*
+ * Sleep for a number of milliseconds.  A coroutine yields to its scheduler
+ * for the duration; any other caller sleeps in place.
+ */
+void coro_sleep(unsigned int ms);
+
+/*
+ * Print per-scheduler statistics and the memory used by coroutine stacks,
+ * including the average per live coroutine.
+ *
+ * @param out  The stream on which the statistics are to be printed.
+ */
+void coro_show(FILE *out);
+
+#endif
@@ -0,0 +1,127 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <stdint.h>
+
+/*
+ * Zero-downtime restart.
+ *
+ * A running server started with a handoff socket (-H) waits there for a
+ * replacement process.  When one connects, the old process freezes: every
+ * participating thread (acceptors and client service threads) parks at a
+ * packet boundary, so no connection has a partially consumed packet, and
+ * the other threads that write to clients (the view flusher and the UDP
+ * thread) park as well.  It
+ * then sends the replacement a snapshot of the maze and of every logged-in
+ * player, together with the listening sockets and all client connections
+ * (as SCM_RIGHTS ancillary data), waits for an acknowledgement and exits
+ * without shutting any connection down.  The replacement (started with -R)
+ * rebuilds its state from the snapshot, acknowledges it, and only then
+ * resumes service on the inherited connections, so clients never reconnect
+ * and no connection is written by both processes.  UDP channels (udp.h)
+ * are not carried over: their clients get views over TCP afterwards, and
+ * must log in again for a new channel.
+ *
+ * If the replacement fails before acknowledging, the old process thaws and
+ * carries on as if nothing had happened.
+ */
+
+/* Maximum number of listening sockets carried across a handoff. */
+#define HANDOFF_MAX_LISTENERS 64
+
+#define HANDOFF_MAGIC   0x4d5a5748      // "MZWH"
+#define HANDOFF_VERSION 3
+
+/*
+ * The snapshot starts with this header, followed by the maze (rows x cols
+ * cells), the players and, as ancillary data, the listening sockets and
+ * client connections.  A replacement refuses a snapshot with another magic
+ * number or version, so that the old process thaws and carries on.
+ */
+struct handoff_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t freeze_ns;           // CLOCK_REALTIME when the freeze began
+    int32_t rows, cols;
+    int32_t nlisten;
+    int32_t nclients;
+    int32_t nplayers;
+};
+
+/*
+ * Open the handoff socket on a Unix-domain socket.  This must be done
+ * before any participating thread is started, since a thread that is
+ * already blocked waiting for input would never notice a freeze.
+ * Requests are not served until handoff_ready() is called.
+ *
+ * @param path  Filesystem path of the handoff socket.
+ * @return  zero if the socket is listening, -1 otherwise.
+ */
+int handoff_listen(const char *path);
+
+/*
+ * Start serving handoff requests, once the state and every listening
+ * socket are in place.
+ */
+void handoff_ready(void);
+
+/*
+ * Record a listening socket that is to be passed to a replacement process.
+ *
+ * @param fd  The listening socket.
+ */
+void handoff_add_listener(int fd);
+
+/*
+ * Take over from a running server.  On success the maze and players have
+ * been initialized from the old server's snapshot, each inherited client
+ * connection has been handed to the selected executor, and the inherited
+ * listening sockets are returned to the caller.
+ *
+ * @param path  Filesystem path of the old server's handoff socket.
+ * @param listen_fds  Array to receive the listening sockets.
+ * @param max  Number of elements in listen_fds.
+ * @return  The number of listening sockets received, or -1 on failure.
+ */
+int handoff_resume(const char *path, int *listen_fds, int max);
+
+/*
+ * Stop accepting handoff requests and remove the socket file.
+ */
+void handoff_fini(void);
+
+/*
+ * Is a handoff socket open?  Threads that wait for input themselves must
+ * use handoff_wait_readable() instead while it is.
+ */
+int handoff_enabled(void);
+
+/*
+ * Register a thread that must be parked before a handoff can proceed.
+ * A service thread's participation is taken by the thread that creates it,
+ * before it is created, and released by the service thread when it ends.
+ */
+void handoff_enter(void);
+void handoff_leave(void);
+
+/*
+ * Park the calling participant if a handoff is in progress.  For threads
+ * that wait for work on something other than a file descriptor, such as a
+ * condition variable; they must register a function that wakes them when
+ * a freeze begins.
+ */
+void handoff_checkpoint(void);
+int handoff_frozen(void);
+void handoff_on_freeze(void (*wake)(void));
+
+/*
+ * Wait until a file descriptor is readable.  If a handoff is in progress
+ * the calling thread parks here until it is abandoned (on success the
+ * process exits).  Without a handoff socket this returns at once.
+ *
+ * @param fd  The file descriptor to wait for.
+ * @return  zero when fd is readable, -1 on error.
+ */
+int handoff_wait_readable(int fd);
+
+#endif
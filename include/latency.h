@@ -0,0 +1,76 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdio.h>
+
+/*
+ * Per-packet service latency.
+ *
+ * For each packet a client sends, the time from the server having read it
+ * to the last packet it caused having been written (for a MOVE, the last
+ * SHOW of the new view; for a FIRE, the last score broadcast) is recorded
+ * in a histogram for the packet's type.  With the io_uring backend the
+ * replies are only queued when the clock stops.  A view held back by the
+ * -V rate limit is sent later by the view flusher, so the MOVE that caused
+ * it is timed without it.
+ *
+ * Histograms are log-linear, as in HdrHistogram: each power-of-two range
+ * of nanoseconds is split into 2^LATENCY_SUB_BITS equal buckets, so every
+ * reported value is within 1/2^LATENCY_SUB_BITS of the true one.  Counts
+ * are spread over a few shards to keep threads off each other's cache
+ * lines, and recording is two relaxed atomic adds.
+ */
+
+/* Sub-buckets per power of two, as a power of two. */
+#define LATENCY_SUB_BITS 3
+
+/* Latencies of 2^LATENCY_MAX_BITS ns (about 34 s) or more are clamped. */
+#define LATENCY_MAX_BITS 35
+
+#define LATENCY_BUCKETS ((LATENCY_MAX_BITS - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS)
+
+/* Packet types with their own histogram (client packet types are 1..6). */
+#define LATENCY_TYPES 8
+
+/*
+ * Record the service time of one packet.
+ *
+ * @param type  The type of the packet; types without their own histogram
+ * are recorded under type 0.
+ * @param ns  The time, in nanoseconds.
+ */
+void latency_record(int type, unsigned long ns);
+
+/*
+ * Get the histogram bucket a latency falls in.
+ *
+ * @param ns  The time, in nanoseconds.
+ * @return  The bucket, from 0 to LATENCY_BUCKETS - 1.
+ */
+int latency_bucket(unsigned long ns);
+
+/*
+ * Get the highest latency that falls in a bucket, which is the value
+ * reported for it.
+ *
+ * @param b  The bucket, from 0 to LATENCY_BUCKETS - 1.
+ * @return  The time, in nanoseconds.
+ */
+unsigned long latency_bucket_high(int b);
+
+/*
+ * Print, for each packet type seen, the count, mean, p50, p99, p999 and
+ * maximum.
+ *
+ * @param out  The stream on which the table is to be printed.
+ */
+void latency_show(FILE *out);
+
+/*
+ * Print the same quantiles as a Prometheus summary.
+ *
+ * @param out  The stream on which the metrics are to be printed.
+ */
+void latency_show_metrics(FILE *out);
+
+#endif
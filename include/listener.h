@@ -0,0 +1,60 @@
+#ifndef LISTENER_H
+#define LISTENER_H
+
+#include <stdio.h>
+
+/*
+ * Multi-acceptor listening sockets.
+ *
+ * The server listens on several TCP sockets bound to the same port with
+ * SO_REUSEPORT, so that the kernel spreads incoming connections across
+ * them.  Each socket has its own accept thread, pinned to its own CPU when
+ * possible, which drains the socket's accept queue with accept4() whenever
+ * it becomes readable and passes each new connection to a handler.
+ */
+
+/* Maximum number of listening sockets (and accept threads). */
+#define LISTENER_MAX 64
+
+/*
+ * Function that takes ownership of a newly accepted client connection.
+ */
+typedef void (*listener_handler)(int fd);
+
+/*
+ * Open listening sockets on a port.
+ *
+ * @param port  TCP port to listen on.
+ * @param count  Number of sockets to open (at most LISTENER_MAX).
+ * @param backlog  Accept queue length requested for each socket.
+ * @param fds  Array to receive the listening sockets.
+ * @return  The number of sockets opened, or -1 if none could be.
+ */
+int listener_open(int port, int count, int backlog, int *fds);
+
+/*
+ * Start one accept thread per listening socket.
+ *
+ * @param fds  The listening sockets.
+ * @param count  Number of listening sockets.
+ * @param accept_flags  Flags for accept4() (e.g. SOCK_NONBLOCK|SOCK_CLOEXEC).
+ * @param handler  Function to which each accepted connection is passed.
+ * @return  zero if every accept thread was started, -1 otherwise.
+ */
+int listener_start(int *fds, int count, int accept_flags, listener_handler handler);
+
+/*
+ * Stop accepting connections: the listening sockets are shut down, which
+ * makes the accept threads exit.
+ */
+void listener_fini(void);
+
+/*
+ * Print per-socket accept counts, accept rate, current accept queue depth
+ * and the kernel's listen-queue overflow counters.
+ *
+ * @param out  The stream on which the statistics are to be printed.
+ */
+void listener_show(FILE *out);
+
+#endif
@@ -0,0 +1,103 @@
+#ifndef LOCKPROF_H
+#define LOCKPROF_H
+
+#include <stdio.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "trace.h"
+
+/*
+ * Mutex contention profiler.
+ *
+ * The server's hot locks are taken through PROF_LOCK() and PROF_UNLOCK(),
+ * which name the class of the lock.  In a normal build these are plain
+ * pthread_mutex_lock() and pthread_mutex_unlock(), apart from a check for
+ * tracing (see trace.h), which records contended waits as spans.  In a build with LOCKPROF defined (make LOCKPROF=1) each
+ * acquisition is first tried without blocking; if that fails it is counted
+ * as contended and the wait is timed.  The time from the outermost
+ * acquisition of a lock to its release is recorded as the hold time.
+ * Wait and hold times go into power-of-two histograms per class, and
+ * counts and total times are also kept for each call site.
+ *
+ * A profiling build records from startup.  Recording can be switched off
+ * and on and the statistics reset with the admin command "locks".  The
+ * report is printed by that command, and to stderr when the server gets
+ * SIGUSR2.
+ */
+
+enum lockprof_class_id {
+    LOCK_MAZE,                          // maze_mutex
+    LOCK_PLAYERS,                       // players_mutex
+    LOCK_PLAYER,                        // every PLAYER's mutex, taken together
+    LOCK_CLASSES
+};
+
+/* Name of the trace span for a wait on a lock of a class. */
+#define LOCKPROF_WAIT_NAME(class_id)                                           \
+    ((class_id) == LOCK_MAZE ? "wait maze_mutex" :                             \
+     (class_id) == LOCK_PLAYERS ? "wait players_mutex" : "wait player->mutex")
+
+/* Histogram buckets: bucket i counts times in [2^(i-1), 2^i) ns. */
+#define LOCKPROF_BUCKETS 36
+
+/* Call sites listed per class in the report. */
+#define LOCKPROF_TOP_SITES 5
+
+#ifdef LOCKPROF
+
+/*
+ * Statistics of one PROF_LOCK() call site.  One is defined statically at
+ * each site by the macro.
+ */
+struct lockprof_site {
+    const char *file;
+    int line;
+    enum lockprof_class_id cls;
+    atomic_int registered;
+    struct lockprof_site *next;
+    atomic_ulong acquired;
+    atomic_ulong contended;
+    atomic_ulong wait_ns;
+    atomic_ulong hold_ns;
+};
+
+void lockprof_lock(pthread_mutex_t *m, struct lockprof_site *site);
+void lockprof_unlock(pthread_mutex_t *m);
+
+#define PROF_LOCK(m, class_id) do {                                            \
+        static struct lockprof_site lockprof_site_ = {                         \
+            .file = __FILE__, .line = __LINE__, .cls = (class_id) };           \
+        lockprof_lock((m), &lockprof_site_);                                   \
+    } while (0)
+#define PROF_UNLOCK(m, class_id) lockprof_unlock(m)
+
+#else
+
+#define PROF_LOCK(m, class_id) trace_mutex_lock((m), LOCKPROF_WAIT_NAME(class_id))
+#define PROF_UNLOCK(m, class_id) pthread_mutex_unlock(m)
+
+#endif
+
+/*
+ * Print, for each lock class, acquisition and contention counts, wait and
+ * hold time percentiles and histograms, and the call sites with the most
+ * wait time.  In a build without LOCKPROF this just says so.
+ *
+ * @param out  The stream on which the report is to be printed.
+ */
+void lockprof_show(FILE *out);
+
+/*
+ * Switch recording on or off.
+ *
+ * @return  zero, or -1 in a build without LOCKPROF.
+ */
+int lockprof_enable(int on);
+
+/*
+ * Clear all statistics.
+ */
+void lockprof_reset(void);
+
+#endif
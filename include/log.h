@@ -0,0 +1,91 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdatomic.h>
+
+#include "debug.h"
+
+/*
+ * Asynchronous logging for hot paths.
+ *
+ * A log call does not format anything: it copies the format pointer and
+ * its (integer) arguments into a binary record in a ring buffer owned by
+ * the calling thread.  A background writer thread drains all of the rings,
+ * formats the records and writes them to stderr.  When a ring is full the
+ * record is dropped and counted instead of blocking the caller.
+ *
+ * Because formatting is deferred, every argument is passed as a long and
+ * a %s argument must point to storage that outlives the record (in practice,
+ * a string literal).  Pointer arguments must be cast to long by the caller.
+ *
+ * Levels are gated twice: at compile time by LOG_COMPILE_LEVEL, which is
+ * derived from the same flags as the macros in debug.h, and at run time by
+ * log_level.  A call above the compile-time level generates no code.
+ */
+
+#define LOG_ERROR 1
+#define LOG_WARN  2
+#define LOG_INFO  3
+#define LOG_DEBUG 4
+#define LOG_TRACE 5
+
+#ifndef LOG_COMPILE_LEVEL
+#ifdef DEBUG
+#define LOG_COMPILE_LEVEL LOG_TRACE
+#else
+#define LOG_COMPILE_LEVEL LOG_DEBUG
+#endif
+#endif
+
+/* Maximum number of arguments a single log record can carry. */
+#define LOG_MAX_ARGS 8
+
+/*
+ * Current run-time log level.  Records above this level are discarded
+ * at the call site after a single relaxed load.
+ */
+extern atomic_int log_level;
+
+#define LOG_ENABLED(lvl)                                                       \
+  ((lvl) <= LOG_COMPILE_LEVEL &&                                               \
+   (lvl) <= atomic_load_explicit(&log_level, memory_order_relaxed))
+
+#define log_at(lvl, S, ...)                                                    \
+  do {                                                                         \
+    if (LOG_ENABLED(lvl)) {                                                    \
+      long _log_args[] = {0, ##__VA_ARGS__};                                   \
+      log_write((lvl), __FILE__, __extension__ __FUNCTION__, __LINE__, S,      \
+                (int)(sizeof(_log_args) / sizeof(long)) - 1, _log_args + 1);   \
+    }                                                                          \
+  } while (0)
+
+#define log_error(S, ...) log_at(LOG_ERROR, S, ##__VA_ARGS__)
+#define log_warn(S, ...)  log_at(LOG_WARN, S, ##__VA_ARGS__)
+#define log_info(S, ...)  log_at(LOG_INFO, S, ##__VA_ARGS__)
+#define log_debug(S, ...) log_at(LOG_DEBUG, S, ##__VA_ARGS__)
+#define log_trace(S, ...) log_at(LOG_TRACE, S, ##__VA_ARGS__)
+
+/*
+ * Start the background writer thread.  Until this has been called (and
+ * after log_fini), records are formatted and written synchronously.
+ */
+void log_init(void);
+
+/*
+ * Drain all pending records, report any drops and stop the writer thread.
+ */
+void log_fini(void);
+
+/*
+ * Append a record to the calling thread's ring.  Use the log_* macros
+ * rather than calling this directly.
+ */
+void log_write(int level, const char *file, const char *func, int line,
+               const char *fmt, int nargs, const long *args);
+
+/*
+ * Total number of records dropped because a ring was full.
+ */
+unsigned long log_dropped(void);
+
+#endif /* LOG_H */
@@ -0,0 +1,88 @@
+#ifndef MAZE_EXT_H
+#define MAZE_EXT_H
+
+#include <stdio.h>
+
+#include "maze.h"
+
+/*
+ * Additional maze functions that are not part of the interface in maze.h.
+ *
+ * Players are kept apart from the cells, by id (see room.h), each with the
+ * letter it is drawn as; the functions of maze.h know a player by its
+ * letter, which stands for the id of its position in the alphabet.
+ */
+
+/* Most ids maze_watchers() can find. */
+#define MAZE_WATCHERS_MAX (6 * (2 * VIEW_DEPTH - 1))
+
+/*
+ * Place a player in the maze, like maze_set_player().
+ *
+ * @param id  The player's id.
+ * @param avatar  The letter the player is drawn as.
+ * @return  zero, or -1 if the cell is not empty or the id out of range.
+ */
+int maze_place(int id, OBJECT avatar, int row, int col);
+
+/*
+ * Place a player at a random empty cell, like maze_set_player_random().
+ */
+int maze_place_random(int id, OBJECT avatar, int *rowp, int *colp);
+
+/*
+ * Remove a player from a cell, if it is there.
+ */
+void maze_remove(int id, int row, int col);
+
+/*
+ * Find the first player in a direction, like maze_find_target().
+ *
+ * @return  The player's id, or 0 if a wall or the edge comes first.
+ */
+int maze_find_target_id(int row, int col, DIRECTION dir);
+
+/*
+ * Find the players whose views could include a cell: those within
+ * VIEW_DEPTH - 1 cells of it along its row or column, or the rows or
+ * columns on either side.  Whether each looks its way is for the caller to
+ * check.  The cost depends on VIEW_DEPTH, not on the number of players.
+ *
+ * @param ids  Array to receive the ids, which may include a player at the
+ *   cell itself.
+ * @param max  Number of elements in the array; MAZE_WATCHERS_MAX is enough.
+ * @return  The number of ids stored.
+ */
+int maze_watchers(int row, int col, int *ids, int max);
+
+/*
+ * Make a template for maze_init() with a border of '*' and walls of '#'
+ * in about a fifth of the cells inside, at random.
+ *
+ * @return  The template, to be freed with maze_template_free(), or NULL.
+ */
+char **maze_generate(int rows, int cols);
+
+/*
+ * Free a template made by maze_generate().
+ */
+void maze_template_free(char **template);
+
+/*
+ * Print the current room's maze on the specified stream.  The maze is locked for the
+ * duration of the dump, so the output is a consistent snapshot.
+ *
+ * @param out  The stream on which the maze is to be printed.
+ */
+void maze_show(FILE *out);
+
+/*
+ * Copy the contents of the current room's maze, row by row, into a buffer.
+ *
+ * @param buf  Buffer to receive maze_get_rows() * maze_get_cols() bytes.
+ * @param size  Size of the buffer.
+ * @return  The number of bytes copied, or -1 if the buffer is too small.
+ */
+int maze_snapshot(char *buf, int size);
+
+#endif
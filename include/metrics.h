@@ -0,0 +1,112 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+/*
+ * Counters and gauges exported in the Prometheus text format.
+ *
+ * Every metric is a slot in a shard; each thread is given a shard the first
+ * time it records anything, and shards are spread round-robin over threads,
+ * so recording is one relaxed atomic add on a cache line that few (usually
+ * no) other threads write.  A scrape sums the slot over all shards.  A gauge
+ * is recorded as signed increments, so its shards may be negative but
+ * their sum is not.
+ *
+ * Metrics are always recorded.  They can be read over HTTP (GET /metrics on
+ * the port given to metrics_init(), bound to the loopback interface only)
+ * or with the admin command "metrics".
+ */
+
+/* Number of shards.  Threads beyond this share shards. */
+#define METRICS_SHARDS 64
+
+/* Packet types counted individually; larger types count as type 0. */
+#define METRICS_PKT_TYPES 16
+
+enum metric {
+    METRIC_PACKETS_IN,                                          // indexed by packet type
+    METRIC_PACKETS_OUT = METRIC_PACKETS_IN + METRICS_PKT_TYPES, // indexed by packet type
+    METRIC_BYTES_IN = METRIC_PACKETS_OUT + METRICS_PKT_TYPES,
+    METRIC_BYTES_OUT,
+    METRIC_VIEW_FULL,                   // view sent after it was invalidated
+    METRIC_VIEW_INCREMENTAL,            // view sent after a move or turn
+    METRIC_VIEW_DEFERRED,               // view update held back by a rate limit
+    METRIC_LASER_HITS,
+    METRIC_LOGINS,
+    METRIC_LOGINS_INUSE,                // logins refused with INUSE
+    METRIC_SEND_STALLS,                 // waits for a full socket buffer to drain
+    METRIC_SEND_STALL_NS,               // total time spent in those waits
+    METRIC_SEND_DROPS,                  // clients dropped after too long a wait
+    METRIC_PLAYERS,                     // gauge: players logged in
+    METRIC_COUNT
+};
+
+struct metrics_shard {
+    _Alignas(64) atomic_long value[METRIC_COUNT];
+};
+
+extern __thread struct metrics_shard *metrics_thread_shard;
+
+/*
+ * Assign the calling thread a shard.  Called by metrics_add() on a thread's
+ * first use; not for use elsewhere.
+ */
+struct metrics_shard *metrics_shard_assign(void);
+
+/*
+ * Add to a counter, or to (or, with a negative value, subtract from) a
+ * gauge.
+ */
+static inline void metrics_add(enum metric m, long n) {
+    struct metrics_shard *s = metrics_thread_shard;
+    if (!s)
+        s = metrics_shard_assign();
+    atomic_fetch_add_explicit(&s->value[m], n, memory_order_relaxed);
+}
+
+/*
+ * Count a packet received from a client.
+ *
+ * @param type  The packet type.
+ * @param bytes  Size of the packet including its payload.
+ */
+static inline void metrics_packet_in(int type, size_t bytes) {
+    metrics_add(METRIC_PACKETS_IN + ((unsigned)type < METRICS_PKT_TYPES ? type : 0), 1);
+    metrics_add(METRIC_BYTES_IN, bytes);
+}
+
+/*
+ * Count a packet sent to a client.
+ *
+ * @param type  The packet type.
+ * @param bytes  Size of the packet including its payload.
+ */
+static inline void metrics_packet_out(int type, size_t bytes) {
+    metrics_add(METRIC_PACKETS_OUT + ((unsigned)type < METRICS_PKT_TYPES ? type : 0), 1);
+    metrics_add(METRIC_BYTES_OUT, bytes);
+}
+
+/*
+ * Start a thread serving the metrics over HTTP on the loopback interface.
+ *
+ * @param port  TCP port to listen on.
+ * @return  zero if the port is listening, -1 otherwise.
+ */
+int metrics_init(int port);
+
+/*
+ * Stop the HTTP thread, if it was started.
+ */
+void metrics_fini(void);
+
+/*
+ * Print all metrics in the Prometheus text exposition format.
+ *
+ * @param out  The stream on which the metrics are to be printed.
+ */
+void metrics_show(FILE *out);
+
+#endif
@@ -0,0 +1,174 @@
+#ifndef PLAYER_EXT_H
+#define PLAYER_EXT_H
+
+#include <stdio.h>
+
+#include "player.h"
+
+/*
+ * Additional player functions that are not part of the interface in player.h.
+ */
+
+/* Players in a room that is not large (see room.h): one per letter A-Z. */
+#define MAX_PLAYERS 26
+
+/* Time a player who has been hit spends out of the maze. */
+#define PLAYER_PURGATORY_MS 3000
+
+/* Longest player name that is preserved across a state snapshot. */
+#define PLAYER_NAME_MAX 256
+
+/*
+ * Plain copy of the state of a logged-in player, used to carry players
+ * from one server process to another.
+ */
+struct player_state {
+    OBJECT avatar;
+    int fd;
+    int score;
+    int row, col;
+    int dir;
+    int view_flags;
+    int view_max_depth, view_max_rate;
+    char name[PLAYER_NAME_MAX + 1];
+};
+
+/*
+ * Get the player at a given index in the current room's players table,
+ * without taking a reference.
+ *
+ * @param idx  Index of the player (id - 1, or avatar - 'A' in a small room).
+ * @return  The player at that index, or NULL if the slot is empty.
+ */
+PLAYER *get_player_by_index(int idx);
+
+/*
+ * Accessors for fields of a PLAYER.
+ */
+const char *player_get_name(PLAYER *player);
+int player_get_score(PLAYER *player);
+char player_get_avatar(PLAYER *player);
+
+/*
+ * Print one line per logged-in player on the specified stream, giving the
+ * avatar, name, file descriptor, position, gaze direction, score and
+ * reference count.
+ *
+ * @param out  The stream on which the player list is to be printed.
+ * @return  The number of players listed.
+ */
+int player_show_all(FILE *out);
+
+/*
+ * Copy the state of every player logged in to the current room.
+ *
+ * @param states  Array to receive the player states.
+ * @param max  Number of elements in the array.
+ * @return  The number of player states stored.
+ */
+int player_snapshot(struct player_state *states, int max);
+
+/*
+ * Recreate a logged-in player from a saved state.  The player's avatar is
+ * assumed to be in the maze already, at the saved position.
+ *
+ * @param state  The saved player state.
+ * @return  The new player, with one reference held by the players table,
+ *   or NULL if the avatar is in use or memory could not be allocated.
+ */
+PLAYER *player_restore(const struct player_state *state);
+
+/*
+ * Choose how views are sent to a player.
+ *
+ * @param player  The player.
+ * @param flags  MZW_LOGIN_COMPACT_VIEW to send VIEW packets (see
+ * protocol_ext.h), or zero to send CLEAR and SHOW packets.
+ */
+void player_set_view_flags(PLAYER *player, int flags);
+
+/*
+ * Limit the views sent to a player (see protocol_ext.h).  Updates held
+ * back by the rate limit are sent by a background thread, started the
+ * first time a rate is set.
+ *
+ * @param player  The player.
+ * @param max_depth  The deepest view to compute and send, 1 to VIEW_DEPTH;
+ *   anything else means VIEW_DEPTH.
+ * @param max_rate  The most views to send per second, or zero for no limit.
+ */
+void player_set_view_limits(PLAYER *player, int max_depth, int max_rate);
+
+/*
+ * Make the calling thread the one that services a player, so that laser
+ * hits are signalled to it.
+ *
+ * @param player  The player to adopt.
+ */
+void player_adopt(PLAYER *player);
+
+/*
+ * The first half of player_check_for_laser_hit(), for executors that must
+ * not sleep through a player's purgatory: if the player has been hit,
+ * take it out of the maze and tell it so.
+ *
+ * @param player  The player.
+ * @return  1 if the player was hit, and is to be given to player_reset()
+ *   once PLAYER_PURGATORY_MS have passed; 0 otherwise.
+ */
+int player_take_laser_hit(PLAYER *player);
+
+/*
+ * Get the room a player is in (see room.h).
+ */
+int player_get_room(PLAYER *player);
+
+/*
+ * Get a player's id (see room.h).
+ */
+int player_get_id(PLAYER *player);
+
+/*
+ * Get a number for a player that is unique among those logged in to any
+ * room: room * room_capacity() + id - 1.
+ */
+int player_slot(PLAYER *player);
+
+/*
+ * Look a player up by id in the current room, like player_get().
+ *
+ * @return  The player, with a reference taken, or NULL if there is none.
+ */
+PLAYER *player_get_by_id(int id);
+
+/*
+ * Tell the players who should know (everyone in a small room, those
+ * nearby in a large one) of a player who has just logged in and been
+ * placed, with its score and name.
+ */
+void player_announce(PLAYER *player);
+
+/*
+ * Count the players logged in to a room.
+ */
+int player_room_count(int room);
+
+/*
+ * Check whether an avatar is taken in a room; never, in a large room.
+ */
+int player_room_has(int room, OBJECT avatar);
+
+/*
+ * Encode a view as runs of changes from the previous one, in the
+ * MZW_VIEW_DELTA format described in protocol_ext.h.
+ *
+ * @param old  The cells of the previous view.
+ * @param cur  The cells of the new view, of the same depth.
+ * @param n  The number of cells, at most VIEW_DEPTH * VIEW_WIDTH.
+ * @param out  Buffer of at least n bytes to receive the encoding.
+ * @return  The length of the encoding, or -1 if it would be no shorter
+ *   than the cells themselves.
+ */
+int player_view_delta(const char *old, const char *cur, int n, char *out);
+
+#endif
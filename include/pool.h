@@ -0,0 +1,60 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * Fixed-size worker thread pool with work stealing.
+ *
+ * Each worker owns a deque of tasks.  Tasks submitted from outside the
+ * pool are spread round-robin over the workers' deques; a worker takes
+ * tasks from the front of its own deque and, when that is empty, steals
+ * from the back of another worker's.  Workers with nothing to do sleep
+ * until a task is submitted.
+ *
+ * A task is run once per submission and must not be submitted again while
+ * it is still queued.  The client service code resubmits a connection's
+ * task only after its run function has returned, which keeps each
+ * connection's packets in order.
+ */
+
+/* Maximum number of worker threads. */
+#define POOL_MAX_WORKERS 256
+
+/*
+ * A unit of work.  Embed this in a larger structure and recover the
+ * structure in the run function.
+ */
+struct pool_task {
+    void (*run)(struct pool_task *task);
+    struct pool_task *next, *prev;      // links in a worker's deque
+    uint64_t queued_ns;                 // CLOCK_MONOTONIC at submission
+};
+
+/*
+ * Start the worker threads.
+ *
+ * @param nworkers  Number of worker threads (at most POOL_MAX_WORKERS).
+ * @param pin  If nonzero, worker i is pinned to CPU i modulo the number
+ * of online CPUs.
+ * @return  zero if the workers were started, -1 otherwise.
+ */
+int pool_init(int nworkers, int pin);
+
+/*
+ * Queue a task to be run by a worker.  If the caller is itself a worker,
+ * the task goes on the caller's own deque.
+ *
+ * @param task  The task, whose run field must be set.
+ */
+void pool_submit(struct pool_task *task);
+
+/*
+ * Print per-worker task counts, steal counts and queue latencies.
+ *
+ * @param out  The stream on which the statistics are to be printed.
+ */
+void pool_show(FILE *out);
+
+#endif
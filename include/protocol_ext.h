@@ -0,0 +1,101 @@
+#ifndef PROTOCOL_EXT_H
+#define PROTOCOL_EXT_H
+
+#include "protocol.h"
+
+/*
+ * Additional protocol definitions and functions that are not part of the
+ * interface in protocol.h.
+ */
+
+/*
+ * Compact views.  A client that sets MZW_LOGIN_COMPACT_VIEW in param2 of
+ * its LOGIN is sent each view as a single VIEW packet instead of a CLEAR
+ * and a SHOW per cell, and the server sets the same bit in param1 of the
+ * READY to say that it will.  Clients that do not ask are sent CLEAR and
+ * SHOW as before.
+ *
+ * A VIEW packet has the depth of the view in param2, and in param1 how its
+ * payload encodes the cells, which are taken depth by depth, each depth's
+ * left wall, corridor and right wall (the order of the SHOW packets):
+ *
+ *   MZW_VIEW_FULL   the payload is the 3 x depth cells.
+ *   MZW_VIEW_DELTA  the view has the same depth as the previous one, and
+ *                   the payload is a list of runs, each a byte counting
+ *                   cells that are unchanged, a byte n counting cells that
+ *                   changed, and the n new cells.  Cells after the last run
+ *                   are unchanged; an empty payload means nothing changed.
+ *
+ * A delta is only sent when it is shorter than the full view.
+ */
+#define MZW_VIEW_PKT (MZW_CHAT_PKT + 1)
+
+#define MZW_LOGIN_COMPACT_VIEW 0x01
+
+#define MZW_VIEW_FULL 0
+#define MZW_VIEW_DELTA 1
+
+/*
+ * View limits.  A client may give in the low bits of param3 of its LOGIN
+ * (MZW_LOGIN_DEPTH_MASK) the deepest view it wants, from 1 to VIEW_DEPTH
+ * (0 for VIEW_DEPTH), and in bits 1 to 6 of param2 the most view updates
+ * per second it wants, from 1 to 63 (0 for no limit).  Only that much of the view is computed and sent.  Updates that
+ * come sooner than the rate allows are coalesced: the view is sent once,
+ * as it then is, when the interval since the last one has passed.  The
+ * READY gives the depth granted in param2 and the rate in param3.
+ */
+#define MZW_LOGIN_RATE_SHIFT 1
+#define MZW_LOGIN_RATE_MASK 0x3f
+
+/*
+ * UDP views.  A client asking for compact views may also set
+ * MZW_LOGIN_UDP_VIEW in param2 of its LOGIN.  If the server has a UDP port
+ * (-U) it sets the bit in param1 of the READY, whose payload is then a
+ * token of UDP_TOKEN_SIZE bytes followed by the UDP port (16 bits, network
+ * byte order).  Once the client sends the token in a datagram to that
+ * port, its views and score changes come as datagrams from the port,
+ * as described in udp.h; views are then always full.
+ *
+ * A client applies a view only if its sequence number is greater than
+ * that of the last view applied, and a score only if it is greater than
+ * that of the last score applied for the avatar, and ignores scores for
+ * avatars not on its scoreboard (logins and logouts come over TCP).
+ */
+#define MZW_LOGIN_UDP_VIEW 0x80
+
+/*
+ * Wide player ids.  A client may set MZW_LOGIN_WIDE_ID in param3 of its
+ * LOGIN, above the depth (see MZW_LOGIN_DEPTH_MASK), to know players by
+ * their 16-bit ids, as it must to tell them apart in a large room (see
+ * room.h), where a player's letter is only how it is drawn.  The server
+ * sets the bit in param1 of the READY, whose payload then starts with the
+ * client's own id (16 bits, network byte order), before any UDP token.
+ * Such a client is sent a SCORE_ID packet wherever another would be sent
+ * a SCORE: param1 is the player's letter, param2 is -1 if the player is
+ * to be removed from the scoreboard and 0 otherwise, and the payload is
+ * the id and the score (16 bits each, network byte order) followed by the
+ * name, if any.  Views still show letters.  In a large room a LOGIN
+ * without the bit, or any other first packet, is answered with INUSE.
+ */
+#define MZW_SCORE_ID_PKT (MZW_VIEW_PKT + 1)
+
+#define MZW_LOGIN_WIDE_ID 0x40
+#define MZW_LOGIN_DEPTH_MASK 0x1f
+
+/*
+ * Receive a packet like proto_recv_packet(), but take any payload from the
+ * per-thread buffer caches instead of malloc().
+ *
+ * @return  zero in case of successful reception, nonzero otherwise.  A
+ * non-NULL payload must be freed with proto_free_payload().
+ */
+int proto_recv_packet_pooled(int fd, MZW_PACKET *pkt, void **datap);
+
+/*
+ * Free a payload returned by proto_recv_packet_pooled().
+ *
+ * @param payload  The payload, or NULL.
+ */
+void proto_free_payload(void *payload);
+
+#endif
@@ -0,0 +1,102 @@
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "protocol.h"
+
+/*
+ * Recording of client traffic, for replay by util/mzw_replay.
+ *
+ * When started with -r, the server appends every packet it receives, with
+ * the connection it came on and the time it was dispatched, to a binary
+ * log.  Records are copied into an in-memory buffer under a lock and
+ * written out by a background thread, so a client's thread never waits
+ * for the disk; if the writer falls a whole buffer behind, records are
+ * dropped and counted instead.
+ *
+ * The file starts with a struct record_file_header and continues with
+ * records, each a struct record_header followed, for a packet, by the
+ * packet header as it was on the wire (network byte order) and then its
+ * payload.  Integers in the file headers are in host byte order.
+ *
+ * Connections are numbered from 1 in the order of their first packet.  A
+ * connection inherited through a handoff is recorded from its next packet,
+ * without the LOGIN that came before.
+ */
+
+#define RECORD_MAGIC "MZWREC1"
+#define RECORD_VERSION 2
+
+/* Size of each of the two buffers records are collected in. */
+#define RECORD_BUFFER_SIZE (1 << 20)
+
+enum record_kind {
+    RECORD_PACKET = 1,          // a packet was received on the connection
+    RECORD_CLOSE = 2            // the connection was closed
+};
+
+struct record_file_header {
+    char magic[8];              // RECORD_MAGIC
+    uint32_t version;           // RECORD_VERSION
+    uint32_t reserved;
+    uint64_t start_realtime_ns; // CLOCK_REALTIME when recording started
+};
+
+struct record_header {
+    uint64_t time_ns;           // since recording started (CLOCK_MONOTONIC)
+    uint32_t conn;              // connection number
+    uint32_t kind;              // enum record_kind
+    uint32_t size;              // bytes following: 0, or the packet and payload
+};
+
+extern atomic_int record_enabled;
+
+/*
+ * Start recording.
+ *
+ * @param path  The file to record to; it is truncated.
+ * @return  zero, or -1 if the file cannot be opened or the writer started.
+ */
+int record_init(const char *path);
+
+/*
+ * Number a connection for recording.
+ *
+ * @return  a number not given to any other connection.
+ */
+unsigned int record_conn_id(void);
+
+/*
+ * Record a received packet.
+ *
+ * @param conn  The connection's number.
+ * @param pkt  The packet, with its header fields in host byte order.
+ * @param payload  Its payload, or NULL if it has none.
+ * @param ns  When it was received, from CLOCK_MONOTONIC.
+ */
+void record_packet(unsigned int conn, MZW_PACKET *pkt, void *payload, unsigned long ns);
+
+/*
+ * Record that a connection was closed.
+ *
+ * @param conn  The connection's number.
+ */
+void record_close(unsigned int conn);
+
+/*
+ * Write out everything recorded and stop.
+ */
+void record_fini(void);
+
+/*
+ * Print whether recording is on, and the records and bytes written and
+ * dropped.
+ *
+ * @param out  The stream on which the status is to be printed.
+ */
+void record_show(FILE *out);
+
+#endif
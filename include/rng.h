@@ -0,0 +1,51 @@
+#ifndef RNG_H
+#define RNG_H
+
+#include <stdint.h>
+
+/*
+ * Per-thread pseudo-random numbers.
+ *
+ * Each thread has its own xoshiro256** generator, so drawing a number takes
+ * no lock and touches no shared cache line (unlike rand(), which serializes
+ * every caller on a lock inside libc).  A thread's generator is seeded the
+ * first time it draws, from the process-wide master seed and the order in
+ * which threads first draw: given the same master seed and the same order,
+ * every thread sees the same sequence, which makes benchmark runs
+ * reproducible.  The master seed is taken from getrandom() unless one is
+ * set with rng_init().
+ *
+ * The generator is not suitable where unpredictability matters.
+ */
+
+/*
+ * Set the master seed.  This must be called before any thread draws a
+ * number, and may be omitted.
+ *
+ * @param seed  The master seed.
+ * @param fixed  Nonzero to use the seed given, zero to take one from
+ * getrandom().
+ */
+void rng_init(uint64_t seed, int fixed);
+
+/*
+ * Get the master seed in use, so that a run can be repeated.
+ *
+ * @param fixedp  If not NULL, set to nonzero if the seed was given to
+ * rng_init() and zero if it came from getrandom().
+ */
+uint64_t rng_seed(int *fixedp);
+
+/*
+ * Draw 64 random bits from the calling thread's generator.
+ */
+uint64_t rng_next(void);
+
+/*
+ * Draw a number uniformly distributed in [0, n).
+ *
+ * @param n  The bound, which must be positive.
+ */
+uint32_t rng_below(uint32_t n);
+
+#endif
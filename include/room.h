@@ -0,0 +1,92 @@
+#ifndef ROOM_H
+#define ROOM_H
+
+#include <stdio.h>
+
+#include "maze.h"
+
+/*
+ * Rooms: independent games served by one process.
+ *
+ * With -G <rooms> the server runs that many copies of the maze, each with
+ * its own players table and its own maze and players locks, so that play
+ * in one room never waits for another.  Connections, executors and the
+ * other services are shared.  A client is placed in a room by the lobby
+ * when it logs in, and stays there until it logs out; players only see,
+ * shoot and chat with others in the same room.
+ *
+ * With -X <players> the rooms are large: each holds up to that many
+ * players, numbered from 1 to ROOM_IDS_MAX, and any number of them may
+ * share an avatar letter, which only says how the player is drawn.  Anything
+ * a player does is then told only to the players who could see it (see
+ * maze_watchers()), so that the cost of an event does not grow with the
+ * number of players.  Otherwise a room holds MAX_PLAYERS players, one per
+ * letter, whose ids are the letters' positions in the alphabet.
+ *
+ * The functions of maze.h and player.h that take no player (maze_move(),
+ * player_login(), player_get() and so on) act on the calling thread's
+ * current room, which is room 0 until room_enter() is called.  Functions
+ * given a player act on that player's room, which they enter themselves.
+ */
+
+/* Most rooms a process can have. */
+#define ROOM_MAX 64
+
+/* Most players a large room can have: ids are 16 bits. */
+#define ROOM_IDS_MAX 65535
+
+/* The calling thread's current room. */
+extern __thread int room_current;
+
+/*
+ * Set the number and size of rooms.  Must be called, if at all, before
+ * maze_init().
+ *
+ * @param count  Number of rooms, from 1 to ROOM_MAX.
+ * @param large  Players in each large room, from 1 to ROOM_IDS_MAX, or zero
+ *   for rooms of one player per avatar letter.
+ * @return  zero, or -1 if either is out of range.
+ */
+int room_init(int count, int large);
+
+/*
+ * Get the number of rooms.
+ */
+int room_count(void);
+
+/*
+ * Get the most players a room can have; ids run from 1 to this.
+ */
+int room_capacity(void);
+
+/*
+ * Check whether the rooms are large.
+ */
+int room_large(void);
+
+/*
+ * Make a room the calling thread's current room.
+ */
+static inline void room_enter(int room) {
+    room_current = room;
+}
+
+/*
+ * Choose the room for a login: the one with the fewest players among those
+ * where the avatar is free, or else among those with any avatar free, so
+ * that a login falling back to another avatar can still succeed.
+ *
+ * @param avatar  The avatar asked for, or zero for any.
+ * @return  The room; room 0 if every room is full.
+ */
+int room_assign(OBJECT avatar);
+
+/*
+ * Print the number of players in each room, and the logins the lobby has
+ * sent there.
+ *
+ * @param out  The stream on which the rooms are to be printed.
+ */
+void room_show(FILE *out);
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef SERVER_EXT_H
+#define SERVER_EXT_H
+
+#include "server.h"
+#include "player.h"
+
+/*
+ * Additional server functions that are not part of the interface in server.h.
+ */
+
+/*
+ * Select how client connections are served.  With no workers (the
+ * default) each connection gets its own service thread.  Otherwise the
+ * connections are multiplexed over a pool of worker threads: a poller
+ * thread queues each connection that has input on the pool, and a worker
+ * processes one packet from it before it is watched again.  With
+ * coroutines, each connection's service loop runs as a coroutine on one of
+ * a set of per-core scheduler threads, and yields whenever it would block
+ * reading.  If the io_uring backend is requested, a single ring thread does
+ * all client I/O and packet processing instead; if io_uring is unavailable
+ * one of the other modes is used as if it had not been requested.
+ *
+ * @param nworkers  Number of worker threads, or 0 for thread per connection.
+ * @param pin  If nonzero, pin the workers to CPUs.
+ * @param uring  If nonzero, try the io_uring backend first.
+ * @param coroutines  Number of coroutine schedulers, or 0 for none.  Takes
+ * precedence over the worker pool.
+ * @return  zero on success, -1 if the pool or schedulers could not be started.
+ */
+int mzw_executor_init(int nworkers, int pin, int uring, int coroutines);
+
+/*
+ * Start serving a client connection with the selected executor.
+ *
+ * @param fd  The connection, which is registered by this function.
+ * @param player  The player already logged in on the connection, or NULL.
+ * Its reference is taken over as the connection's login reference.
+ * @return  zero on success, or -1 if the connection could not be served,
+ * in which case the player has been logged out and the connection closed.
+ */
+int mzw_client_start(int fd, PLAYER *player);
+
+#endif
@@ -0,0 +1,129 @@
+#ifndef SHM_H
+#define SHM_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+
+#include "protocol.h"
+
+/*
+ * Shared-memory transport for clients on the same host.
+ *
+ * With -m <path> the server also listens on a Unix-domain socket.  For each
+ * connection on it the server creates a memfd segment holding two
+ * single-producer single-consumer byte rings, one each way, and passes it
+ * to the client with SCM_RIGHTS.  Packets are written into the rings with
+ * the same framing as on a socket (header in network byte order, then the
+ * payload), so proto_send_packet() and proto_recv_packet() work on the
+ * connection's fd as they do on a socket's, and the server serves it like
+ * any other client.
+ *
+ * The socket itself carries no packets; it only wakes a reader that has
+ * gone to sleep, and shows when the other side has gone.  A reader that
+ * finds its ring empty sets its ring's waiting flag and polls the socket,
+ * and a writer sends one byte on the socket only if it finds the flag set.
+ * While both sides keep up, packets therefore cost no system calls at all.
+ * A writer that finds the ring full waits for the reader to make room,
+ * counting the time as a send stall.
+ *
+ * These connections are always served by a thread (or coroutine) of their
+ * own, since the io_uring backend and the worker pool only learn of input
+ * from the socket.  They cannot be handed off.
+ */
+
+#define SHM_MAGIC 0x4d5a5753            // "MZWS"
+#define SHM_VERSION 1
+
+/* Bytes in each ring; a power of two. */
+#define SHM_RING_SIZE (64 * 1024)
+
+/*
+ * A ring.  The positions count bytes ever written and read, and wrap
+ * around; tail - head bytes are waiting to be read.  Each is written only
+ * by its own side, on its own cache line.
+ */
+struct shm_ring {
+    _Alignas(64) atomic_uint head;      // written by the reader
+    atomic_int waiting;                 // the reader is asleep, or about to be
+    _Alignas(64) atomic_uint tail;      // written by the writer
+    _Alignas(64) char data[SHM_RING_SIZE];
+};
+
+struct shm_segment {
+    uint32_t magic;                     // SHM_MAGIC
+    uint32_t version;                   // SHM_VERSION
+    struct shm_ring up;                 // client to server
+    struct shm_ring down;               // server to client
+};
+
+/*
+ * Start accepting shared-memory clients.  Any stale socket file at the
+ * path is removed first.
+ *
+ * @param path  Filesystem path of the Unix-domain socket.
+ * @param start  Called with the fd of each new connection, which is to be
+ *   served like a newly accepted socket.
+ * @return  zero, or -1 if the socket cannot be bound or the thread started.
+ */
+int shm_init(const char *path, void (*start)(int fd));
+
+/*
+ * Stop accepting shared-memory clients and remove the socket file.
+ * Connections already open are closed by their service threads.
+ */
+void shm_fini(void);
+
+/*
+ * Connect to a server as a shared-memory client.
+ *
+ * @param path  The server's -m socket path.
+ * @return  an fd for proto_send_packet() and proto_recv_packet(), to be
+ *   given to shm_release() before it is closed, or -1 on failure.
+ */
+int shm_connect(const char *path);
+
+/*
+ * Check whether an fd is a shared-memory connection.
+ */
+int shm_owns(int fd);
+
+/*
+ * Unmap a shared-memory connection's segment.  Must be called before its
+ * fd is closed; does nothing for any other fd.  Another thread may be
+ * writing to the connection at the time: the segment stays mapped until
+ * that write is done, and a write waiting for room fails.
+ */
+void shm_release(int fd);
+
+/*
+ * Read up to count bytes from a connection's ring without blocking.
+ *
+ * @return  the number of bytes read; zero if the ring is empty and the
+ *   other side has gone; or -1 with errno EAGAIN if the ring is empty, in
+ *   which case the fd will become readable when there is more.
+ */
+ssize_t shm_read(int fd, void *buf, size_t count);
+
+/*
+ * Write one packet into a connection's ring, waiting for room if needed.
+ * Packets from concurrent callers are not interleaved.
+ *
+ * @param net_pkt  The header, in network byte order.
+ * @param data  The payload, or NULL.
+ * @param size  Bytes in the payload.
+ * @return  zero, or -1 if the packet can never fit or the other side has
+ *   gone.
+ */
+int shm_write_packet(int fd, const MZW_PACKET *net_pkt, const void *data, size_t size);
+
+/*
+ * Print the shared-memory connections, and the packets, wakeups and stalls
+ * counted on them.
+ *
+ * @param out  The stream on which the status is to be printed.
+ */
+void shm_show(FILE *out);
+
+#endif
@@ -0,0 +1,98 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+/*
+ * Per-thread caches of fixed-size objects.
+ *
+ * A slab cache hands out objects of one size.  Each thread keeps a short
+ * free list per cache, so that allocating and freeing are a pointer pop
+ * and push with no locking.  A thread whose list is empty takes a batch of
+ * objects from the cache's shared depot, and a thread whose list has grown
+ * too long gives a batch back.  The depot is refilled by carving a new
+ * slab of objects out of one allocation.  Objects are recycled and never
+ * returned to malloc, so a cache holds memory for its high-water mark of
+ * live objects.
+ *
+ * Slabs start on a cache line, so objects whose size is a multiple of 64
+ * bytes (such as structures with 64-byte aligned members) are aligned.
+ *
+ * An object may be freed by a thread other than the one that allocated
+ * it.  The objects cached by a thread go back to the depots when the
+ * thread exits.
+ */
+
+/* Maximum number of caches, including the buffer size classes. */
+#define SLAB_MAX_CACHES 32
+
+/* Largest buffer served by slab_buf_alloc() from a cache. */
+#define SLAB_BUF_MAX 4096
+
+struct slab_cache {
+    const char *name;
+    size_t size;                        // requested object size
+    atomic_int index;                   // slot in the per-thread lists, -1 until first use
+    pthread_mutex_t lock;               // protects the depot
+    void *depot;                        // free objects not held by any thread
+    unsigned long depot_count;
+    unsigned long slabs;                // slabs carved so far
+    struct slab_cache *next;            // all caches in use, for slab_show()
+
+    _Alignas(64) atomic_long live;      // objects allocated and not freed
+    atomic_long high_water;
+    atomic_ulong allocs;
+};
+
+/*
+ * Static initializer for a cache of objects of a given size.  The name must
+ * be a string literal.
+ */
+#define SLAB_CACHE_INITIALIZER(cname, osize) \
+    { .name = (cname), .size = (osize), .index = -1, .lock = PTHREAD_MUTEX_INITIALIZER }
+
+/*
+ * Allocate an object from a cache.  Its contents are undefined.
+ *
+ * @param cache  The cache.
+ * @return  The object, or NULL if memory is exhausted.
+ */
+void *slab_alloc(struct slab_cache *cache);
+
+/*
+ * Return an object to the cache it was allocated from.
+ *
+ * @param cache  The cache.
+ * @param obj  The object, or NULL.
+ */
+void slab_free(struct slab_cache *cache, void *obj);
+
+/*
+ * Allocate a buffer of any size.  Buffers of up to SLAB_BUF_MAX bytes come
+ * from power-of-two size-class caches, larger ones from malloc().
+ *
+ * @param size  Size of the buffer, in bytes.
+ * @return  The buffer, or NULL if memory is exhausted.  It must be freed
+ * with slab_buf_free(), not free().
+ */
+void *slab_buf_alloc(size_t size);
+
+/*
+ * Free a buffer allocated with slab_buf_alloc().
+ *
+ * @param buf  The buffer, or NULL.
+ */
+void slab_buf_free(void *buf);
+
+/*
+ * Print, for each cache in use, its object size, live objects, high-water
+ * mark, allocations, and the memory held in slabs and in the depot.
+ *
+ * @param out  The stream on which the statistics are to be printed.
+ */
+void slab_show(FILE *out);
+
+#endif
@@ -0,0 +1,131 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+/*
+ * Timeline tracing in the Chrome trace-event format.
+ *
+ * While tracing is on, spans (a static name, a start and an end time) are
+ * appended to a buffer owned by the thread that records them, without any
+ * locking.  The buffers are written out as one JSON file, which
+ * chrome://tracing and Perfetto load, when the server shuts down or when
+ * asked to through the admin command "trace".  Each thread of the server
+ * is a row of the timeline, so a lock convoy shows up as waits stacked
+ * across rows.
+ *
+ * Tracing is off unless it is started with -T.  When it is off a span
+ * costs one load and a branch.  Recording stops after TRACE_MAX_EVENTS
+ * spans; later ones are counted as dropped.
+ *
+ * Coroutines share their scheduler's row, and a span that is open when a
+ * coroutine waits overlaps those of the coroutines run meanwhile.
+ */
+
+/* Spans kept before recording stops. */
+#define TRACE_MAX_EVENTS (1 << 20)
+
+extern atomic_int trace_enabled;
+
+/*
+ * Current time on the trace clock (CLOCK_MONOTONIC), in nanoseconds.
+ */
+unsigned long trace_now(void);
+
+/*
+ * Record a span.
+ *
+ * @param name  Name of the span.  It must be a string literal or otherwise
+ * live as long as the process, and need no JSON escaping.
+ * @param start  Start time from trace_now().
+ * @param end  End time from trace_now().
+ */
+void trace_span(const char *name, unsigned long start, unsigned long end);
+
+/*
+ * Start timing a span: the current time if tracing is on, zero otherwise.
+ */
+static inline unsigned long trace_begin(void) {
+    return atomic_load_explicit(&trace_enabled, memory_order_relaxed) ? trace_now() : 0;
+}
+
+/*
+ * Finish a span started with trace_begin().
+ */
+static inline void trace_end(const char *name, unsigned long start) {
+    if (start)
+        trace_span(name, start, trace_now());
+}
+
+struct trace_scope {
+    const char *name;
+    unsigned long start;
+};
+
+static inline void trace_scope_end(struct trace_scope *s) {
+    trace_end(s->name, s->start);
+}
+
+/*
+ * Trace the rest of the enclosing block, however it is left.
+ */
+#define TRACE_SCOPE(span_name) \
+    struct trace_scope trace_scope_ __attribute__((cleanup(trace_scope_end))) = \
+        { (span_name), trace_begin() }
+
+/*
+ * Take a mutex, recording a span if tracing is on and the mutex is held by
+ * another thread.
+ *
+ * @param m  The mutex.
+ * @param name  Name of the span for the wait.
+ */
+static inline void trace_mutex_lock(pthread_mutex_t *m, const char *name) {
+    if (!atomic_load_explicit(&trace_enabled, memory_order_relaxed)) {
+        pthread_mutex_lock(m);
+    } else if (pthread_mutex_trylock(m) != 0) {
+        unsigned long start = trace_now();
+        pthread_mutex_lock(m);
+        trace_span(name, start, trace_now());
+    }
+}
+
+/*
+ * Turn tracing on.
+ *
+ * @param path  File the trace is written to by trace_dump(NULL) and
+ * trace_fini().
+ * @return  zero, or -1 if the path is too long.
+ */
+int trace_init(const char *path);
+
+/*
+ * Pause or resume recording.  Spans recorded so far are kept.
+ *
+ * @return  zero, or -1 if tracing was not started with trace_init().
+ */
+int trace_enable(int on);
+
+/*
+ * Write every span recorded so far as Chrome trace-event JSON.
+ *
+ * @param path  The file, or NULL for the one given to trace_init().
+ * @return  the number of spans written, or -1 on error.
+ */
+long trace_dump(const char *path);
+
+/*
+ * Write the trace, if tracing was started, and stop recording.
+ */
+void trace_fini(void);
+
+/*
+ * Print whether tracing is on, and the spans recorded and dropped.
+ *
+ * @param out  The stream on which the status is to be printed.
+ */
+void trace_show(FILE *out);
+
+#endif
@@ -0,0 +1,99 @@
+#ifndef UDP_H
+#define UDP_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "protocol.h"
+
+/*
+ * Unreliable channel for views and scores.
+ *
+ * Over TCP one lost segment holds up every packet behind it, although a
+ * view is a snapshot that the next one replaces.  With -U the server also
+ * listens on a UDP port, and a client that asks for it at login (see
+ * protocol_ext.h) is sent its full views, and score changes, as datagrams
+ * there once it has registered its address with the token from its READY.
+ * Everything else, and every packet until the client registers, stays on
+ * the TCP connection.  A channel lasts until its player logs out; it is
+ * not carried across a handoff, after which views come over TCP again and
+ * the old token is refused: the client must log in again for a channel.
+ *
+ * Each datagram sent holds a 32-bit sequence number in network byte order,
+ * counted per client, followed by one packet (header in network byte order,
+ * then the payload).  A datagram from a client holds just the token; it may
+ * be sent again at any time, for instance when the client's address
+ * changes, and is answered with a full view.
+ *
+ * For testing, -L makes the server drop, reorder and duplicate datagrams
+ * it sends with given percentages.
+ */
+
+/* Bytes in a channel's token. */
+#define UDP_TOKEN_SIZE 8
+
+extern atomic_int udp_enabled;
+
+/*
+ * Open the UDP socket and start the thread that takes registrations.
+ * Must be called after room_init().
+ *
+ * @param port  The UDP port to listen on.
+ * @param loss  Percentage of datagrams to drop.
+ * @param reorder  Percentage of datagrams to hold back until after the
+ *   next one to the same client.
+ * @param dup  Percentage of datagrams to send twice.
+ * @return  zero, or -1 if the socket cannot be bound or the thread started.
+ */
+int udp_init(int port, int loss, int reorder, int dup);
+
+/*
+ * Stop the registration thread and close the socket.
+ */
+void udp_fini(void);
+
+/*
+ * Offer a player a channel, replacing any it had.
+ *
+ * @param slot  The player's slot, from player_slot().
+ * @param token  Set to the token the client is to register with.
+ * @return  the UDP port, or -1 if there is no UDP socket.
+ */
+int udp_open(int slot, unsigned char token[UDP_TOKEN_SIZE]);
+
+/*
+ * Close a player's channel, if it has one.
+ *
+ * @param slot  The player's slot.
+ */
+void udp_close(int slot);
+
+/*
+ * Check whether a player's client has registered its address.
+ *
+ * @param slot  The player's slot.
+ */
+int udp_active(int slot);
+
+/*
+ * Send a packet to a player as a datagram, if it has a registered channel
+ * and the packet is one that goes over UDP: a full VIEW, or a SCORE without
+ * a name that is not a removal.
+ *
+ * @param slot  The player's slot.
+ * @param pkt  The packet, with its header fields in host byte order.
+ * @param data  Its payload, or NULL.
+ * @return  zero if the packet was sent (or dropped by -L), -1 if it must go
+ *   over TCP instead.
+ */
+int udp_send(int slot, MZW_PACKET *pkt, void *data);
+
+/*
+ * Print the UDP port, channels, and datagram counts.
+ *
+ * @param out  The stream on which the status is to be printed.
+ */
+void udp_show(FILE *out);
+
+#endif
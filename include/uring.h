@@ -0,0 +1,94 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stdio.h>
+
+#include "protocol.h"
+
+/*
+ * io_uring transport for client connections.
+ *
+ * A single ring thread owns an io_uring instance.  Each connection has a
+ * multishot recv outstanding that draws its buffers from a provided buffer
+ * ring, so an idle connection pins no memory of its own.  Complete packets
+ * are parsed out of the received data and handed to a callback on the ring
+ * thread.  Packets sent with proto_send_packet() on a connection owned by
+ * the ring are copied onto a per-connection queue; queued packets go out
+ * as a chain of linked sends, so they reach the socket in order, and all
+ * new submissions are made with one io_uring_enter() per pass of the ring
+ * thread's loop.  A client that lets more than a fixed number of bytes
+ * queue up without reading them is disconnected.
+ *
+ * Nothing on the ring thread may sleep, since every connection waits for
+ * it.  Instead, the packet function can pause a connection: its packets
+ * are held back for a time, without holding up any other connection.
+ *
+ * The transport needs multishot recv and provided buffer rings (Linux 6.0
+ * or later).  uring_init() checks for them and fails if they are missing,
+ * so the caller can fall back to the blocking transport.
+ */
+
+/*
+ * Function called on the ring thread for each complete packet.  The
+ * payload belongs to the transport and is only valid during the call.
+ * Returns zero if the packet was handled, -1 if the connection is to be
+ * closed, or a number of milliseconds to pause the connection for: the
+ * packet is then not handled, and is handed over again after the pause.
+ */
+typedef int (*uring_packet_fn)(void *conn, MZW_PACKET *pkt, void *payload);
+
+/*
+ * Function called on the ring thread when a connection's pause is over,
+ * before any more of its packets are handed over.
+ */
+typedef void (*uring_resume_fn)(void *conn);
+
+/*
+ * Function called on the ring thread when a connection is closing.  The
+ * file descriptor stays open until every outstanding operation on it has
+ * completed, and is then closed by the transport.
+ */
+typedef void (*uring_close_fn)(void *conn);
+
+/*
+ * Set up the ring and start the ring thread.
+ *
+ * @param packet  Function called for each packet received.
+ * @param closed  Function called when a connection closes.
+ * @param resumed  Function called when a connection's pause is over.
+ * @return  zero on success, or -1 if io_uring or a feature it needs is
+ * not available.
+ */
+int uring_init(uring_packet_fn packet, uring_close_fn closed, uring_resume_fn resumed);
+
+/*
+ * Start receiving on a connection.
+ *
+ * @param fd  The connection.
+ * @param conn  Value passed to the callbacks for this connection.
+ * @return  zero on success, -1 otherwise (the fd is left open).
+ */
+int uring_add(int fd, void *conn);
+
+/*
+ * Is a file descriptor a connection owned by the ring?
+ */
+int uring_owns(int fd);
+
+/*
+ * Queue a packet for sending on a connection owned by the ring.  The
+ * header and payload are copied, so they need not outlive the call.
+ *
+ * @return  zero if the packet was queued, -1 if the connection is closing
+ *   or the packet would overfill its queue, which closes it.
+ */
+int uring_send_packet(int fd, MZW_PACKET *pkt, void *data);
+
+/*
+ * Print submission, completion and buffer statistics.
+ *
+ * @param out  The stream on which the statistics are to be printed.
+ */
+void uring_show(FILE *out);
+
+#endif
@@ -0,0 +1,294 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "admin.h"
+#include "server.h"
+#include "client_registry_ext.h"
+#include "maze_ext.h"
+#include "player_ext.h"
+#include "debug.h"
+#include "log.h"
+#include "listener.h"
+#include "pool.h"
+#include "uring.h"
+#include "coro.h"
+#include "slab.h"
+#include "rng.h"
+#include "metrics.h"
+#include "lockprof.h"
+#include "latency.h"
+#include "trace.h"
+#include "record.h"
+#include "udp.h"
+#include "shm.h"
+#include "room.h"
+
+#define ADMIN_LINE_MAX 256
+#define ADMIN_TIMEOUT_SEC 60            // an idle session is dropped, freeing the thread
+
+static int admin_fd = -1;
+static int session_fd = -1;       // connection currently being served
+static pthread_mutex_t session_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t admin_tid;
+static char admin_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+
+static const char *level_names[] = {
+    "off", "error", "warn", "info", "debug", "trace"
+};
+
+static void admin_help(FILE *out) {
+    fprintf(out,
+            "commands:\n"
+            "  maze [ROOM]        dump the maze of room ROOM (default: every room)\n"
+            "  players            list players with position, score and refcount\n"
+            "  rooms              show players per room and lobby assignments (-G)\n"
+            "  stats              show connection and logging statistics\n"
+            "  conns              list connections with age and bytes in/out\n"
+            "  listeners          show accept counts, rates and queue depths\n"
+            "  pool               show worker pool steals and queue latency\n"
+            "  uring              show io_uring submission and buffer statistics\n"
+            "  coro               show coroutine schedulers and stack memory\n"
+            "  slab               show object cache live counts and high-water marks\n"
+            "  metrics            print the Prometheus metrics\n"
+            "  latency            show per-packet-type service latency percentiles\n"
+            "  trace [ARG]        show tracing; ARG on|off, or dump [FILE] to write it (-T)\n"
+            "  record             show packet recording status (-r)\n"
+            "  udp                show UDP view channels and datagram counts (-U)\n"
+            "  shm                show shared-memory connections and wakeups (-m)\n"
+            "  locks [ARG]        show lock contention; ARG on|off|reset (LOCKPROF builds)\n"
+            "  debug [LEVEL]      show or set the log level (off..trace)\n"
+            "  showmaze on|off    dump the maze to stderr after every packet\n"
+            "  quit               close this admin session\n");
+}
+
+static void admin_stats(FILE *out) {
+    creg_show(client_registry, out);
+    fprintf(out, "log: level=%s dropped=%lu\n",
+            level_names[atomic_load(&log_level)], log_dropped());
+    fprintf(out, "showmaze: %s\n", debug_show_maze ? "on" : "off");
+    int fixed;
+    uint64_t seed = rng_seed(&fixed);
+    fprintf(out, "rng: seed=%" PRIu64 " (%s)\n", seed, fixed ? "fixed" : "random");
+}
+
+static void admin_debug(FILE *out, const char *arg) {
+    if (arg) {
+        int level = -1;
+        if (!strcmp(arg, "on"))
+            level = LOG_DEBUG;
+        for (int i = 0; level < 0 && i <= LOG_TRACE; i++) {
+            if (!strcmp(arg, level_names[i]))
+                level = i;
+        }
+        if (level < 0) {
+            fprintf(out, "error: unknown level '%s'\n", arg);
+            return;
+        }
+        if (level > LOG_COMPILE_LEVEL)
+            fprintf(out, "warning: levels above %s are compiled out\n",
+                    level_names[LOG_COMPILE_LEVEL]);
+        atomic_store(&log_level, level);
+    }
+    fprintf(out, "log level: %s\n", level_names[atomic_load(&log_level)]);
+}
+
+static void admin_trace(FILE *out, const char *arg, const char *path) {
+    if (arg && !strcmp(arg, "dump")) {
+        long n = trace_dump(path);
+        if (n < 0)
+            fprintf(out, "error: trace not written (tracing not started with -T, or bad file)\n");
+        else
+            fprintf(out, "wrote %ld spans\n", n);
+    } else if (arg && trace_enable(!strcmp(arg, "on")) < 0) {
+        fprintf(out, "error: tracing not started with -T\n");
+    }
+    trace_show(out);
+}
+
+/*
+ * Execute one command line.  Returns nonzero if the session should end.
+ */
+static int admin_command(FILE *out, char *line) {
+    char *save = NULL;
+    char *cmd = strtok_r(line, " \t\r\n", &save);
+    char *arg = strtok_r(NULL, " \t\r\n", &save);
+
+    if (!cmd)
+        return 0;
+
+    if (!strcmp(cmd, "help")) {
+        admin_help(out);
+    } else if (!strcmp(cmd, "maze")) {
+        int room = arg ? atoi(arg) : -1;
+        if (arg && (room < 0 || room >= room_count())) {
+            fprintf(out, "error: no room %s\n", arg);
+        } else if (arg || room_count() == 1) {
+            room_enter(arg ? room : 0);
+            maze_show(out);
+        } else {
+            for (int r = 0; r < room_count(); r++) {
+                fprintf(out, "room %d:\n", r);
+                room_enter(r);
+                maze_show(out);
+            }
+        }
+    } else if (!strcmp(cmd, "players")) {
+        player_show_all(out);
+    } else if (!strcmp(cmd, "rooms")) {
+        room_show(out);
+    } else if (!strcmp(cmd, "stats")) {
+        admin_stats(out);
+    } else if (!strcmp(cmd, "conns")) {
+        creg_show_clients(client_registry, out);
+    } else if (!strcmp(cmd, "listeners")) {
+        listener_show(out);
+    } else if (!strcmp(cmd, "pool")) {
+        pool_show(out);
+    } else if (!strcmp(cmd, "uring")) {
+        uring_show(out);
+    } else if (!strcmp(cmd, "coro")) {
+        coro_show(out);
+    } else if (!strcmp(cmd, "slab")) {
+        slab_show(out);
+    } else if (!strcmp(cmd, "metrics")) {
+        metrics_show(out);
+    } else if (!strcmp(cmd, "latency")) {
+        latency_show(out);
+    } else if (!strcmp(cmd, "record")) {
+        record_show(out);
+    } else if (!strcmp(cmd, "udp")) {
+        udp_show(out);
+    } else if (!strcmp(cmd, "shm")) {
+        shm_show(out);
+    } else if (!strcmp(cmd, "trace")) {
+        admin_trace(out, arg, strtok_r(NULL, " \t\r\n", &save));
+    } else if (!strcmp(cmd, "locks")) {
+        if (arg && !strcmp(arg, "reset"))
+            lockprof_reset();
+        else if (arg && lockprof_enable(!strcmp(arg, "on")) < 0)
+            fprintf(out, "error: lock profiling not compiled in\n");
+        lockprof_show(out);
+    } else if (!strcmp(cmd, "debug")) {
+        admin_debug(out, arg);
+    } else if (!strcmp(cmd, "showmaze")) {
+        if (arg)
+            debug_show_maze = !strcmp(arg, "on");
+        fprintf(out, "showmaze: %s\n", debug_show_maze ? "on" : "off");
+    } else if (!strcmp(cmd, "quit")) {
+        return 1;
+    } else {
+        fprintf(out, "error: unknown command '%s' (try 'help')\n", cmd);
+    }
+    return 0;
+}
+
+static void admin_session(int fd) {
+    // Sessions are served one at a time, so one left open must not keep
+    // everyone else out.
+    struct timeval tv = { .tv_sec = ADMIN_TIMEOUT_SEC };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    int wfd = dup(fd);
+    FILE *in = fdopen(fd, "r");
+    FILE *out = wfd >= 0 ? fdopen(wfd, "w") : NULL;
+    if (!in || !out) {
+        if (in) fclose(in); else close(fd);
+        if (out) fclose(out); else if (wfd >= 0) close(wfd);
+        return;
+    }
+
+    char line[ADMIN_LINE_MAX];
+    while (fgets(line, sizeof(line), in) != NULL) {
+        int done = admin_command(out, line);
+        fflush(out);
+        if (done || ferror(out))
+            break;
+    }
+
+    fclose(out);
+    fclose(in);
+}
+
+static void *admin_thread(void *arg) {
+    while (1) {
+        int fd = accept(admin_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break;  // listening socket shut down by admin_fini()
+        }
+        pthread_mutex_lock(&session_mutex);
+        session_fd = fd;
+        pthread_mutex_unlock(&session_mutex);
+
+        admin_session(fd);
+
+        pthread_mutex_lock(&session_mutex);
+        session_fd = -1;
+        pthread_mutex_unlock(&session_mutex);
+    }
+    return NULL;
+}
+
+int admin_init(const char *path) {
+    struct sockaddr_un addr;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        error("Admin socket path too long: %s", path);
+        return -1;
+    }
+
+    if ((admin_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    strcpy(admin_path, path);
+    unlink(path);
+
+    if (bind(admin_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(admin_fd, 4) < 0) {
+        perror("admin socket");
+        close(admin_fd);
+        admin_fd = -1;
+        return -1;
+    }
+
+    if (pthread_create(&admin_tid, NULL, admin_thread, NULL) != 0) {
+        error("Failed to start admin thread");
+        close(admin_fd);
+        unlink(admin_path);
+        admin_fd = -1;
+        return -1;
+    }
+
+    info("Admin socket listening on %s", path);
+    return 0;
+}
+
+void admin_fini(void) {
+    if (admin_fd < 0)
+        return;
+
+    shutdown(admin_fd, SHUT_RDWR);
+    pthread_mutex_lock(&session_mutex);
+    if (session_fd >= 0)
+        shutdown(session_fd, SHUT_RD);
+    pthread_mutex_unlock(&session_mutex);
+    pthread_join(admin_tid, NULL);
+    close(admin_fd);
+    unlink(admin_path);
+    admin_fd = -1;
+}
@@ -5,43 +5,106 @@
 #include <string.h>
 #include <errno.h>
 #include <signal.h>
+#include <time.h>
+#include <stdatomic.h>
 #include <sys/socket.h>
 
 
 #include "client_registry.h"
+#include "client_registry_ext.h"
 #include "debug.h"
+#include "log.h"
 
-#define MAX_CLIENTS  FD_SETSIZE  // can safely track this many
+/*
+ * The registry is indexed directly by file descriptor.  Slots live in
+ * fixed-size chunks that are allocated on first use and never moved, so
+ * lookups need no lock and the table grows without copying.
+ */
+#define CHUNK_BITS   10
+#define CHUNK_SLOTS  (1 << CHUNK_BITS)          // slots per chunk
+#define MAX_CHUNKS   1024                       // up to 1M descriptors
+#define NUM_SHARDS   16                         // client count shards
+
+#define SHUTDOWN_BATCH    256                   // fds collected per shutdown batch
+#define SHUTDOWN_THREADS  4                     // helpers for large shutdowns
+#define SHUTDOWN_PARALLEL (2 * SHUTDOWN_BATCH)  // fd range that warrants helpers
+
+struct client_slot {
+    atomic_int in_use;
+    struct timespec connected;    // CLOCK_REALTIME at registration
+    atomic_ulong bytes_in;
+    atomic_ulong bytes_out;
+};
+
+struct count_shard {
+    atomic_long count;
+    char pad[64 - sizeof(atomic_long)];         // one shard per cache line
+};
 
 struct client_registry {
-    int clients[MAX_CLIENTS];     // file descriptors of connected clients
-    int count;                    // number of connected clients
-    pthread_mutex_t mutex;       // protects clients[] and count
-    pthread_cond_t empty;        // signaled when count reaches 0
+    struct client_slot *_Atomic chunks[MAX_CHUNKS];
+    struct count_shard shards[NUM_SHARDS];      // connected clients, by fd
+    atomic_ulong total;           // number of clients ever registered
+    atomic_int max_fd;            // highest fd ever registered
+    atomic_int waiters;           // threads in creg_wait_for_empty
+    pthread_mutex_t mutex;        // protects chunk allocation and wakeups
+    pthread_cond_t empty;         // signaled when count reaches 0
+};
+
+struct shutdown_range {
+    CLIENT_REGISTRY *cr;
+    int lo, hi;                   // fds in [lo, hi)
 };
 
 CLIENT_REGISTRY *client_registry = NULL;
 
+/*
+ * Find the slot for a file descriptor, allocating its chunk if asked to.
+ */
+static struct client_slot *slot_get(CLIENT_REGISTRY *cr, int fd, int create) {
+    if (fd < 0 || fd >= MAX_CHUNKS * CHUNK_SLOTS)
+        return NULL;
+
+    struct client_slot *chunk = atomic_load_explicit(&cr->chunks[fd >> CHUNK_BITS],
+                                                     memory_order_acquire);
+    if (!chunk && create) {
+        pthread_mutex_lock(&cr->mutex);
+        chunk = atomic_load(&cr->chunks[fd >> CHUNK_BITS]);
+        if (!chunk) {
+            chunk = calloc(CHUNK_SLOTS, sizeof(struct client_slot));
+            atomic_store_explicit(&cr->chunks[fd >> CHUNK_BITS], chunk,
+                                  memory_order_release);
+        }
+        pthread_mutex_unlock(&cr->mutex);
+    }
+
+    return chunk ? &chunk[fd & (CHUNK_SLOTS - 1)] : NULL;
+}
+
+static long count_all(CLIENT_REGISTRY *cr) {
+    long count = 0;
+    for (int i = 0; i < NUM_SHARDS; i++)
+        count += atomic_load(&cr->shards[i].count);
+    return count;
+}
+
 /*
  * Initialize the client registry.
  */
 CLIENT_REGISTRY *creg_init() {
-    printf("[DEBUG] Entering creg_init\n");
+    log_trace("Entering creg_init");
 
     CLIENT_REGISTRY *cr = calloc(1, sizeof(CLIENT_REGISTRY));
     if (!cr) {
-        printf("[DEBUG] Exiting creg_init with failure (calloc)\n");
+        log_trace("Exiting creg_init with failure (calloc)");
         return NULL;
     }
 
     pthread_mutex_init(&cr->mutex, NULL);
     pthread_cond_init(&cr->empty, NULL);
+    atomic_store(&cr->max_fd, -1);
 
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        cr->clients[i] = -1;
-    }
-
-    printf("[DEBUG] Exiting creg_init with success\n");
+    log_trace("Exiting creg_init with success");
     return cr;
 }
 
@@ -50,18 +113,20 @@ CLIENT_REGISTRY *creg_init() {
  * Finalize the client registry.
  */
 void creg_fini(CLIENT_REGISTRY *cr) {
-    printf("[DEBUG] Entering creg_fini\n");
+    log_trace("Entering creg_fini");
 
     if (!cr) {
-        printf("[DEBUG] Exiting creg_fini: NULL registry\n");
+        log_trace("Exiting creg_fini: NULL registry");
         return;
     }
 
+    for (int i = 0; i < MAX_CHUNKS; i++)
+        free(atomic_load(&cr->chunks[i]));
     pthread_mutex_destroy(&cr->mutex);
     pthread_cond_destroy(&cr->empty);
     free(cr);
 
-    printf("[DEBUG] Exiting creg_fini: registry finalized and memory freed\n");
+    log_trace("Exiting creg_fini: registry finalized and memory freed");
 }
 
 
@@ -69,24 +134,29 @@ void creg_fini(CLIENT_REGISTRY *cr) {
  * Register a new client file descriptor.
  */
 void creg_register(CLIENT_REGISTRY *cr, int fd) {
-    printf("[DEBUG] Entering creg_register with fd=%d\n", fd);
-
-    pthread_mutex_lock(&cr->mutex);
+    log_trace("Entering creg_register with fd=%d", fd);
 
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (cr->clients[i] == -1) {
-            cr->clients[i] = fd;
-            cr->count++;
-            debug("Registered client fd=%d (total=%d)", fd, cr->count);
-            pthread_mutex_unlock(&cr->mutex);
-            printf("[DEBUG] Exiting creg_register: fd=%d registered\n", fd);
-            return;
-        }
+    struct client_slot *slot = slot_get(cr, fd, 1);
+    int free_slot = 0;
+    if (!slot || !atomic_compare_exchange_strong(&slot->in_use, &free_slot, 1)) {
+        error("Cannot register client fd=%d.", fd);
+        log_trace("Exiting creg_register with error: fd=%d not registered", fd);
+        return;
     }
 
-    pthread_mutex_unlock(&cr->mutex);
-    error("Too many clients to register.");
-    printf("[DEBUG] Exiting creg_register with error: client limit reached\n");
+    clock_gettime(CLOCK_REALTIME, &slot->connected);
+    atomic_store_explicit(&slot->bytes_in, 0, memory_order_relaxed);
+    atomic_store_explicit(&slot->bytes_out, 0, memory_order_relaxed);
+
+    atomic_fetch_add(&cr->shards[fd % NUM_SHARDS].count, 1);
+    atomic_fetch_add_explicit(&cr->total, 1, memory_order_relaxed);
+
+    int max = atomic_load(&cr->max_fd);
+    while (fd > max && !atomic_compare_exchange_weak(&cr->max_fd, &max, fd))
+        ;
+
+    log_debug("Registered client fd=%d", fd);
+    log_trace("Exiting creg_register: fd=%d registered", fd);
 }
 
 
@@ -94,25 +164,27 @@ void creg_register(CLIENT_REGISTRY *cr, int fd) {
  * Unregister a client file descriptor.
  */
 void creg_unregister(CLIENT_REGISTRY *cr, int fd) {
-    printf("[DEBUG] Entering creg_unregister with fd=%d\n", fd);
-
-    pthread_mutex_lock(&cr->mutex);
+    log_trace("Entering creg_unregister with fd=%d", fd);
 
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (cr->clients[i] == fd) {
-            cr->clients[i] = -1;
-            cr->count--;
-            debug("Unregistered client fd=%d (remaining=%d)", fd, cr->count);
+    struct client_slot *slot = slot_get(cr, fd, 0);
+    int in_use = 1;
+    if (!slot || !atomic_compare_exchange_strong(&slot->in_use, &in_use, 0)) {
+        log_trace("Exiting creg_unregister: fd=%d was not registered", fd);
+        return;
+    }
 
-            if (cr->count == 0)
-                pthread_cond_signal(&cr->empty);
+    atomic_fetch_sub(&cr->shards[fd % NUM_SHARDS].count, 1);
+    log_debug("Unregistered client fd=%d", fd);
 
-            break;
-        }
+    // Only a thread waiting for the registry to empty needs the full count.
+    if (atomic_load(&cr->waiters) > 0) {
+        pthread_mutex_lock(&cr->mutex);
+        if (count_all(cr) == 0)
+            pthread_cond_broadcast(&cr->empty);
+        pthread_mutex_unlock(&cr->mutex);
     }
 
-    pthread_mutex_unlock(&cr->mutex);
-    printf("[DEBUG] Exiting creg_unregister for fd=%d\n", fd);
+    log_trace("Exiting creg_unregister for fd=%d", fd);
 }
 
 
@@ -120,35 +192,154 @@ void creg_unregister(CLIENT_REGISTRY *cr, int fd) {
  * Wait until all clients have disconnected.
  */
 void creg_wait_for_empty(CLIENT_REGISTRY *cr) {
-    printf("[DEBUG] Entering creg_wait_for_empty\n");
+    log_trace("Entering creg_wait_for_empty");
 
     pthread_mutex_lock(&cr->mutex);
+    atomic_fetch_add(&cr->waiters, 1);
 
-    while (cr->count > 0) {
-        printf("[DEBUG] Waiting: %d clients still connected\n", cr->count);
+    long count;
+    while ((count = count_all(cr)) > 0) {
+        log_debug("Waiting: %d clients still connected", count);
         pthread_cond_wait(&cr->empty, &cr->mutex);
     }
 
+    atomic_fetch_sub(&cr->waiters, 1);
     pthread_mutex_unlock(&cr->mutex);
-    printf("[DEBUG] Exiting creg_wait_for_empty: all clients disconnected\n");
+    log_trace("Exiting creg_wait_for_empty: all clients disconnected");
+}
+
+/*
+ * Shut down the registered clients whose fds lie in a range, collecting
+ * them in batches so the slot scan is kept apart from the syscalls.
+ */
+static void *shutdown_range(void *arg) {
+    struct shutdown_range *range = arg;
+    int batch[SHUTDOWN_BATCH];
+    int n = 0;
+
+    for (int fd = range->lo; fd < range->hi; fd++) {
+        struct client_slot *slot = slot_get(range->cr, fd, 0);
+        if (!slot) {
+            fd |= CHUNK_SLOTS - 1;      // skip the rest of an absent chunk
+            continue;
+        }
+        if (atomic_load(&slot->in_use))
+            batch[n++] = fd;
+        if (n == SHUTDOWN_BATCH) {
+            for (int i = 0; i < n; i++)
+                shutdown(batch[i], SHUT_RD);
+            n = 0;
+        }
+    }
+    for (int i = 0; i < n; i++)
+        shutdown(batch[i], SHUT_RD);
+
+    return NULL;
 }
 
 /*
  * Shut down all registered client connections.
  */
 void creg_shutdown_all(CLIENT_REGISTRY *cr) {
-    printf("[DEBUG] Entering creg_shutdown_all\n");
+    log_trace("Entering creg_shutdown_all");
+
+    int limit = atomic_load(&cr->max_fd) + 1;
+    int nthreads = limit >= SHUTDOWN_PARALLEL ? SHUTDOWN_THREADS : 1;
+    struct shutdown_range ranges[SHUTDOWN_THREADS];
+    pthread_t tids[SHUTDOWN_THREADS];
+    int started[SHUTDOWN_THREADS] = { 0 };
+
+    for (int i = 0; i < nthreads; i++) {
+        ranges[i].cr = cr;
+        ranges[i].lo = (long)limit * i / nthreads;
+        ranges[i].hi = (long)limit * (i + 1) / nthreads;
+        if (i > 0)
+            started[i] = pthread_create(&tids[i], NULL, shutdown_range, &ranges[i]) == 0;
+    }
 
-    pthread_mutex_lock(&cr->mutex);
+    // The calling thread takes the first range, and any range whose helper
+    // could not be started.
+    shutdown_range(&ranges[0]);
+    for (int i = 1; i < nthreads; i++) {
+        if (started[i])
+            pthread_join(tids[i], NULL);
+        else
+            shutdown_range(&ranges[i]);
+    }
+
+    log_trace("Exiting creg_shutdown_all");
+}
+
+/*
+ * Get the number of registered clients.
+ */
+int creg_count(CLIENT_REGISTRY *cr) {
+    return count_all(cr);
+}
 
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (cr->clients[i] != -1) {
-            shutdown(cr->clients[i], SHUT_RD);
-            debug("Shutdown client fd=%d", cr->clients[i]);
+/*
+ * List the registered client file descriptors.
+ */
+int creg_list(CLIENT_REGISTRY *cr, int *fds, int max) {
+    int n = 0;
+    int limit = atomic_load(&cr->max_fd) + 1;
+
+    for (int fd = 0; fd < limit && n < max; fd++) {
+        struct client_slot *slot = slot_get(cr, fd, 0);
+        if (!slot) {
+            fd |= CHUNK_SLOTS - 1;
+            continue;
         }
+        if (atomic_load(&slot->in_use))
+            fds[n++] = fd;
     }
+    return n;
+}
 
-    pthread_mutex_unlock(&cr->mutex);
-    printf("[DEBUG] Exiting creg_shutdown_all\n");
+/*
+ * Account for bytes transferred on a client connection.
+ */
+void creg_add_bytes(CLIENT_REGISTRY *cr, int fd, size_t in, size_t out) {
+    struct client_slot *slot = cr ? slot_get(cr, fd, 0) : NULL;
+    if (!slot)
+        return;
+    if (in)
+        atomic_fetch_add_explicit(&slot->bytes_in, in, memory_order_relaxed);
+    if (out)
+        atomic_fetch_add_explicit(&slot->bytes_out, out, memory_order_relaxed);
+}
+
+/*
+ * Print connection statistics.
+ */
+void creg_show(CLIENT_REGISTRY *cr, FILE *out) {
+    fprintf(out, "connections: %d open, %lu total since start\n",
+            creg_count(cr), atomic_load(&cr->total));
 }
 
+/*
+ * Print one line per registered client.
+ */
+int creg_show_clients(CLIENT_REGISTRY *cr, FILE *out) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    int n = 0;
+    int limit = atomic_load(&cr->max_fd) + 1;
+
+    fprintf(out, "FD     AGE(s)   BYTES_IN   BYTES_OUT\n");
+    for (int fd = 0; fd < limit; fd++) {
+        struct client_slot *slot = slot_get(cr, fd, 0);
+        if (!slot) {
+            fd |= CHUNK_SLOTS - 1;
+            continue;
+        }
+        if (!atomic_load(&slot->in_use))
+            continue;
+        fprintf(out, "%-6d %-8ld %-10lu %lu\n", fd,
+                (long)(now.tv_sec - slot->connected.tv_sec),
+                atomic_load_explicit(&slot->bytes_in, memory_order_relaxed),
+                atomic_load_explicit(&slot->bytes_out, memory_order_relaxed));
+        n++;
+    }
+    return n;
+}
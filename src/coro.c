@@ -0,0 +1,514 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "coro.h"
+#include "debug.h"
+#include "log.h"
+
+#define STACKS_PER_CHUNK 64             // stacks reserved by one mmap()
+#define POLL_BATCH       256            // readiness events taken per epoll_wait()
+
+// The context switch is hand-written for x86-64, where it only has to save
+// the callee-saved registers; elsewhere ucontext is used, at the cost of a
+// signal mask system call on every switch.  -DCORO_UCONTEXT forces ucontext.
+#if !defined(__x86_64__) && !defined(CORO_UCONTEXT)
+#define CORO_UCONTEXT
+#endif
+#ifdef CORO_UCONTEXT
+#include <ucontext.h>
+#endif
+
+struct coro {
+    struct coro *next;                  // run queue, inbox or sleep list
+#ifdef CORO_UCONTEXT
+    ucontext_t ctx;
+#else
+    void *sp;                           // saved stack pointer while switched out
+#endif
+    char *stack;                        // low end of the stack
+    void (*fn)(void *);
+    void *arg;
+    uint64_t wake_ns;                   // when sleeping: CLOCK_MONOTONIC to wake at
+    int done;
+};
+
+struct chunk {
+    struct chunk *next;
+    char *base;
+};
+
+struct sched {
+    _Alignas(64) pthread_mutex_t lock;  // protects the inbox and the stacks
+    struct coro *inbox_head, *inbox_tail;   // spawned, not yet run
+    char *free_stacks;                  // linked through each stack's top word
+    struct chunk *chunks;               // newest first
+    int bump;                           // stacks handed out from the newest chunk
+    unsigned long nchunks, nfree;
+
+    int epfd;
+    int wake_fd;                        // signalled when the inbox becomes non-empty
+    int index;
+    int cpu;                            // CPU the thread is pinned to, or -1
+    pthread_t tid;
+#ifdef CORO_UCONTEXT
+    ucontext_t ctx;
+#else
+    void *sp;
+#endif
+
+    // Used only by the scheduler thread.
+    struct coro *run_head, *run_tail;
+    struct coro *sleepers;
+
+    atomic_long live;                   // coroutines started and not finished
+    atomic_ulong spawned;
+    atomic_ulong switches;              // times a coroutine was resumed
+    atomic_ulong waits;                 // waits for a file descriptor
+    atomic_ulong polls, events;         // epoll_wait() calls, events returned
+    atomic_ulong max_stack;             // deepest stack use seen at a switch
+};
+
+static struct sched *scheds = NULL;
+static int nscheds = 0;
+static size_t guard_size;               // a page below each stack
+static size_t slot_size;                // a stack and its guard page
+static atomic_uint next_sched = 0;
+
+static __thread struct sched *self = NULL;
+static __thread struct coro *current = NULL;
+
+#ifndef CORO_UCONTEXT
+/*
+ * Save the callee-saved registers and stack pointer of the running context
+ * in *save, and resume the context whose stack pointer is load.
+ */
+void mzw_coro_switch(void **save, void *load);
+__asm__(
+    ".text\n"
+    ".globl mzw_coro_switch\n"
+    ".hidden mzw_coro_switch\n"
+    ".type mzw_coro_switch, @function\n"
+    "mzw_coro_switch:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq %rsi, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".size mzw_coro_switch, .-mzw_coro_switch\n");
+#endif
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Take a stack from a scheduler's free list, or carve a new one, with its
+ * guard page, out of its newest chunk.  Called with the scheduler's lock
+ * held.
+ */
+static char *stack_alloc(struct sched *s) {
+    if (s->free_stacks) {
+        char *stack = s->free_stacks;
+        s->free_stacks = *(char **)(stack + CORO_STACK_SIZE - sizeof(char *));
+        s->nfree--;
+        return stack;
+    }
+    if (!s->chunks || s->bump == STACKS_PER_CHUNK) {
+        struct chunk *ch = malloc(sizeof(*ch));
+        if (!ch)
+            return NULL;
+        ch->base = mmap(NULL, STACKS_PER_CHUNK * slot_size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+        if (ch->base == MAP_FAILED) {
+            free(ch);
+            return NULL;
+        }
+        ch->next = s->chunks;
+        s->chunks = ch;
+        s->bump = 0;
+        s->nchunks++;
+    }
+    char *slot = s->chunks->base + s->bump * slot_size;
+    // Fails once the process has vm.max_map_count mappings.
+    if (mprotect(slot, guard_size, PROT_NONE) < 0) {
+        warn("Cannot add a coroutine stack guard page (vm.max_map_count?)");
+        return NULL;
+    }
+    s->bump++;
+    return slot + guard_size;
+}
+
+/*
+ * Return a stack to the free list.  The link goes in the top word, which
+ * the previous owner has already touched, so a pooled stack costs no more
+ * memory than it did while in use.
+ */
+static void stack_free(struct sched *s, char *stack) {
+    pthread_mutex_lock(&s->lock);
+    *(char **)(stack + CORO_STACK_SIZE - sizeof(char *)) = s->free_stacks;
+    s->free_stacks = stack;
+    s->nfree++;
+    pthread_mutex_unlock(&s->lock);
+}
+
+static void coro_entry(void);
+
+static void context_init(struct coro *c) {
+#ifdef CORO_UCONTEXT
+    getcontext(&c->ctx);
+    c->ctx.uc_stack.ss_sp = c->stack;
+    c->ctx.uc_stack.ss_size = CORO_STACK_SIZE;
+    c->ctx.uc_link = NULL;
+    makecontext(&c->ctx, coro_entry, 0);
+#else
+    // The first switch pops six zero registers and "returns" into
+    // coro_entry with the stack aligned as if it had been called.
+    uintptr_t *sp = (uintptr_t *)(c->stack + CORO_STACK_SIZE);
+    *--sp = 0;
+    *--sp = (uintptr_t)coro_entry;
+    for (int i = 0; i < 6; i++)
+        *--sp = 0;
+    c->sp = sp;
+#endif
+}
+
+/*
+ * Switch from the running coroutine back to its scheduler.
+ */
+static void switch_out(struct coro *c) {
+    char here;
+    unsigned long used = (unsigned long)(c->stack + CORO_STACK_SIZE - &here);
+
+    if (used > atomic_load_explicit(&self->max_stack, memory_order_relaxed))
+        atomic_store_explicit(&self->max_stack, used, memory_order_relaxed);
+    if (used > CORO_STACK_SIZE - CORO_STACK_RED) {
+        fprintf(stderr, "coroutine stack nearly exhausted (%lu of %d bytes used)\n",
+                used, CORO_STACK_SIZE);
+        abort();
+    }
+#ifdef CORO_UCONTEXT
+    swapcontext(&c->ctx, &self->ctx);
+#else
+    mzw_coro_switch(&c->sp, self->sp);
+#endif
+}
+
+static void coro_entry(void) {
+    struct coro *c = current;
+    c->fn(c->arg);
+    c->done = 1;
+    switch_out(c);
+    abort();                            // a finished coroutine is never resumed
+}
+
+static void run_push(struct sched *s, struct coro *c) {
+    c->next = NULL;
+    if (s->run_tail)
+        s->run_tail->next = c;
+    else
+        s->run_head = c;
+    s->run_tail = c;
+}
+
+/*
+ * Resume a coroutine until it next waits, sleeps or finishes.
+ */
+static void resume(struct sched *s, struct coro *c) {
+    current = c;
+    atomic_fetch_add_explicit(&s->switches, 1, memory_order_relaxed);
+#ifdef CORO_UCONTEXT
+    swapcontext(&s->ctx, &c->ctx);
+#else
+    mzw_coro_switch(&s->sp, c->sp);
+#endif
+    current = NULL;
+
+    if (c->done) {
+        stack_free(s, c->stack);
+        free(c);
+        atomic_fetch_sub_explicit(&s->live, 1, memory_order_relaxed);
+    }
+}
+
+/*
+ * Move sleepers whose time has come to the run queue, and return the
+ * epoll_wait() timeout until the next one is due.
+ */
+static int wake_sleepers(struct sched *s) {
+    struct coro **pp = &s->sleepers;
+    uint64_t now = now_ns(), next = UINT64_MAX;
+
+    while (*pp) {
+        struct coro *c = *pp;
+        if (c->wake_ns <= now) {
+            *pp = c->next;
+            run_push(s, c);
+        } else {
+            if (c->wake_ns < next)
+                next = c->wake_ns;
+            pp = &c->next;
+        }
+    }
+    if (s->run_head)
+        return 0;
+    return next == UINT64_MAX ? -1 : (int)((next - now + 999999) / 1000000);
+}
+
+static void *sched_thread(void *arg) {
+    struct sched *s = arg;
+    struct epoll_event events[POLL_BATCH];
+    uint64_t count;
+
+    self = s;
+    if (s->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(s->cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+
+    while (1) {
+        while (s->run_head) {
+            struct coro *c = s->run_head;
+            s->run_head = c->next;
+            if (!s->run_head)
+                s->run_tail = NULL;
+            resume(s, c);
+        }
+
+        int n = epoll_wait(s->epfd, events, POLL_BATCH, wake_sleepers(s));
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            error("epoll_wait failed in scheduler %d", s->index);
+            break;
+        }
+        atomic_fetch_add_explicit(&s->polls, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&s->events, n, memory_order_relaxed);
+
+        for (int i = 0; i < n; i++) {
+            struct coro *c = events[i].data.ptr;
+            if (c) {
+                run_push(s, c);
+                continue;
+            }
+            if (read(s->wake_fd, &count, sizeof(count)) < 0)
+                log_debug("wake_fd already drained");
+            pthread_mutex_lock(&s->lock);
+            struct coro *head = s->inbox_head;
+            s->inbox_head = s->inbox_tail = NULL;
+            pthread_mutex_unlock(&s->lock);
+            while (head) {
+                struct coro *next = head->next;
+                run_push(s, head);
+                head = next;
+            }
+        }
+    }
+    return NULL;
+}
+
+int coro_init(int n) {
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (n <= 0 || n > CORO_MAX_SCHEDULERS)
+        return -1;
+    guard_size = sysconf(_SC_PAGESIZE);
+    slot_size = CORO_STACK_SIZE + guard_size;
+    scheds = calloc(n, sizeof(struct sched));
+    if (!scheds)
+        return -1;
+
+    for (int i = 0; i < n; i++) {
+        struct sched *s = &scheds[i];
+        pthread_mutex_init(&s->lock, NULL);
+        s->index = i;
+        s->cpu = ncpu > 1 ? (int)(i % ncpu) : -1;
+        if ((s->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+            (s->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0) {
+            perror("epoll/eventfd");
+            return -1;
+        }
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+        if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, s->wake_fd, &ev) < 0) {
+            perror("epoll_ctl");
+            return -1;
+        }
+    }
+
+    for (int i = 0; i < n; i++) {
+        if (pthread_create(&scheds[i].tid, NULL, sched_thread, &scheds[i]) != 0) {
+            error("Failed to start scheduler thread %d", i);
+            return -1;
+        }
+        pthread_detach(scheds[i].tid);
+        // Coroutines are only spread over schedulers that are running.
+        nscheds = i + 1;
+    }
+
+    log_info("Coroutine schedulers started: %d threads, %d KiB stacks", n,
+             CORO_STACK_SIZE / 1024);
+    return 0;
+}
+
+int coro_spawn(void (*fn)(void *arg), void *arg) {
+    if (!nscheds)
+        return -1;
+
+    struct sched *s = &scheds[atomic_fetch_add_explicit(&next_sched, 1, memory_order_relaxed) % nscheds];
+    struct coro *c = calloc(1, sizeof(*c));
+    if (!c)
+        return -1;
+    c->fn = fn;
+    c->arg = arg;
+
+    pthread_mutex_lock(&s->lock);
+    c->stack = stack_alloc(s);
+    if (!c->stack) {
+        pthread_mutex_unlock(&s->lock);
+        free(c);
+        return -1;
+    }
+    context_init(c);
+    int was_empty = s->inbox_head == NULL;
+    if (s->inbox_tail)
+        s->inbox_tail->next = c;
+    else
+        s->inbox_head = c;
+    s->inbox_tail = c;
+    pthread_mutex_unlock(&s->lock);
+
+    atomic_fetch_add_explicit(&s->live, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&s->spawned, 1, memory_order_relaxed);
+    if (was_empty) {
+        uint64_t one = 1;
+        if (write(s->wake_fd, &one, sizeof(one)) < 0)
+            warn("Failed to wake scheduler %d", s->index);
+    }
+    return 0;
+}
+
+int coro_running(void) {
+    return current != NULL;
+}
+
+int coro_wait(int fd, unsigned int events) {
+    struct coro *c = current;
+
+    if (!c) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // The registration is one-shot, so the coroutine is queued at most once
+    // per wait; it is re-armed with MOD, and added on a descriptor's first wait.
+    struct epoll_event ev = { .events = events | EPOLLONESHOT, .data.ptr = c };
+    if (epoll_ctl(self->epfd, EPOLL_CTL_MOD, fd, &ev) < 0 &&
+        (errno != ENOENT || epoll_ctl(self->epfd, EPOLL_CTL_ADD, fd, &ev) < 0))
+        return -1;
+
+    atomic_fetch_add_explicit(&self->waits, 1, memory_order_relaxed);
+    switch_out(c);
+    return 0;
+}
+
+void coro_sleep(unsigned int ms) {
+    struct coro *c = current;
+
+    if (!c) {
+        // Like sleep(), this returns early if a signal arrives.
+        struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+        nanosleep(&ts, NULL);
+        return;
+    }
+
+    c->wake_ns = now_ns() + (uint64_t)ms * 1000000;
+    c->next = self->sleepers;
+    self->sleepers = c;
+    switch_out(c);
+}
+
+/*
+ * Count the resident bytes in a scheduler's stack chunks.  Called with the
+ * scheduler's lock held.
+ */
+static unsigned long stacks_resident(struct sched *s, unsigned char *vec, long page) {
+    size_t len = STACKS_PER_CHUNK * slot_size;
+    unsigned long bytes = 0;
+
+    for (struct chunk *ch = s->chunks; ch; ch = ch->next) {
+        if (mincore(ch->base, len, vec) < 0)
+            continue;
+        for (size_t i = 0; i < len / page; i++)
+            if (vec[i] & 1)
+                bytes += page;
+    }
+    return bytes;
+}
+
+void coro_show(FILE *out) {
+    long page = sysconf(_SC_PAGESIZE);
+    unsigned char *vec;
+    long live = 0;
+    unsigned long chunks = 0, pooled = 0, resident = 0, deepest = 0;
+
+    if (!nscheds) {
+        fprintf(out, "coroutines: off\n");
+        return;
+    }
+    if (!(vec = malloc(STACKS_PER_CHUNK * slot_size / page)))
+        return;
+
+    fprintf(out, "SCHED CPU LIVE     SPAWNED    SWITCHES   WAITS      POLLS      EVENTS/POLL\n");
+    for (int i = 0; i < nscheds; i++) {
+        struct sched *s = &scheds[i];
+        long l = atomic_load(&s->live);
+        unsigned long polls = atomic_load(&s->polls);
+
+        pthread_mutex_lock(&s->lock);
+        chunks += s->nchunks;
+        pooled += s->nfree;
+        resident += stacks_resident(s, vec, page);
+        pthread_mutex_unlock(&s->lock);
+
+        fprintf(out, "%-5d %-3d %-8ld %-10lu %-10lu %-10lu %-10lu %.1f\n", i, s->cpu, l,
+                atomic_load(&s->spawned), atomic_load(&s->switches), atomic_load(&s->waits),
+                polls, polls ? (double)atomic_load(&s->events) / polls : 0.0);
+        live += l;
+        if (atomic_load(&s->max_stack) > deepest)
+            deepest = atomic_load(&s->max_stack);
+    }
+    free(vec);
+
+    fprintf(out, "stacks: %lu reserved (%lu MiB virtual), %lu pooled, %lu KiB resident; "
+            "deepest use at a switch %lu of %d bytes\n",
+            chunks * STACKS_PER_CHUNK, chunks * STACKS_PER_CHUNK * (CORO_STACK_SIZE / 1024) / 1024,
+            pooled, resident / 1024, deepest, CORO_STACK_SIZE);
+    if (live > 0)
+        fprintf(out, "memory per connection: %lu bytes (%lu stack, %zu control)\n",
+                resident / live + sizeof(struct coro), resident / live, sizeof(struct coro));
+}
@@ -0,0 +1,509 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "handoff.h"
+#include "server_ext.h"
+#include "client_registry_ext.h"
+#include "maze_ext.h"
+#include "player_ext.h"
+#include "debug.h"
+#include "log.h"
+#include "record.h"
+
+#define HANDOFF_MAX_FDS_PER_MSG 250     // below the kernel's SCM_MAX_FD
+#define HANDOFF_PARK_TIMEOUT_MS 5000    // give up if threads do not park
+#define HANDOFF_ACK_TIMEOUT_S   10      // give up if the successor is silent
+#define HANDOFF_MAX_WAKERS      8
+
+/*
+ * Players are sent with the index of their connection in the list of
+ * client fds, since descriptor numbers change across processes.
+ */
+struct handoff_player {
+    int32_t client;
+    struct player_state state;
+};
+
+static int handoff_fd = -1;
+static pthread_t handoff_tid;
+static char handoff_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+
+static int listeners[HANDOFF_MAX_LISTENERS];
+static int nlisteners = 0;
+
+/*
+ * Freeze state.  The pipe becomes readable while frozen, waking any
+ * participant blocked in poll().
+ */
+static pthread_mutex_t state_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t state_cond = PTHREAD_COND_INITIALIZER;
+static atomic_int frozen = 0;
+static int participants = 0;
+static int parked = 0;
+static int freeze_pipe[2] = { -1, -1 };
+static int ready = 0;                    // set by handoff_ready()
+static void (*wakers[HANDOFF_MAX_WAKERS])(void);
+static int nwakers = 0;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int write_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t w = write(fd, p, len);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return -1;
+        p += w;
+        len -= w;
+    }
+    return 0;
+}
+
+static int read_all(int fd, void *buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t r = read(fd, p, len);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return -1;
+        p += r;
+        len -= r;
+    }
+    return 0;
+}
+
+static int send_fds(int sock, const int *fds, int n) {
+    for (int sent = 0; sent < n; ) {
+        int batch = n - sent < HANDOFF_MAX_FDS_PER_MSG ? n - sent : HANDOFF_MAX_FDS_PER_MSG;
+        char ctrl[CMSG_SPACE(HANDOFF_MAX_FDS_PER_MSG * sizeof(int))];
+        int32_t count = batch;
+        struct iovec iov = { &count, sizeof(count) };
+        struct msghdr msg = {
+            .msg_iov = &iov, .msg_iovlen = 1,
+            .msg_control = ctrl, .msg_controllen = CMSG_SPACE(batch * sizeof(int))
+        };
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(batch * sizeof(int));
+        memcpy(CMSG_DATA(cm), fds + sent, batch * sizeof(int));
+
+        if (sendmsg(sock, &msg, 0) != sizeof(count))
+            return -1;
+        sent += batch;
+    }
+    return 0;
+}
+
+static int recv_fds(int sock, int *fds, int n) {
+    for (int got = 0; got < n; ) {
+        char ctrl[CMSG_SPACE(HANDOFF_MAX_FDS_PER_MSG * sizeof(int))];
+        int32_t count;
+        struct iovec iov = { &count, sizeof(count) };
+        struct msghdr msg = {
+            .msg_iov = &iov, .msg_iovlen = 1,
+            .msg_control = ctrl, .msg_controllen = sizeof(ctrl)
+        };
+
+        if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != sizeof(count))
+            return -1;
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+        if (!cm || cm->cmsg_type != SCM_RIGHTS || count <= 0 || got + count > n ||
+            cm->cmsg_len != CMSG_LEN(count * sizeof(int)))
+            return -1;
+        memcpy(fds + got, CMSG_DATA(cm), count * sizeof(int));
+        got += count;
+    }
+    return 0;
+}
+
+int handoff_enabled(void) {
+    return handoff_fd >= 0;
+}
+
+void handoff_enter(void) {
+    pthread_mutex_lock(&state_mutex);
+    participants++;
+    pthread_mutex_unlock(&state_mutex);
+}
+
+void handoff_leave(void) {
+    pthread_mutex_lock(&state_mutex);
+    participants--;
+    pthread_cond_broadcast(&state_cond);
+    pthread_mutex_unlock(&state_mutex);
+}
+
+static void park(void) {
+    pthread_mutex_lock(&state_mutex);
+    parked++;
+    pthread_cond_broadcast(&state_cond);
+    while (atomic_load(&frozen))
+        pthread_cond_wait(&state_cond, &state_mutex);
+    parked--;
+    pthread_mutex_unlock(&state_mutex);
+}
+
+int handoff_frozen(void) {
+    return atomic_load(&frozen);
+}
+
+void handoff_checkpoint(void) {
+    if (atomic_load(&frozen))
+        park();
+}
+
+void handoff_on_freeze(void (*wake)(void)) {
+    if (nwakers < HANDOFF_MAX_WAKERS)
+        wakers[nwakers++] = wake;
+}
+
+int handoff_wait_readable(int fd) {
+    if (handoff_fd < 0)
+        return 0;
+
+    struct pollfd pfd[2] = {
+        { .fd = fd, .events = POLLIN },
+        { .fd = freeze_pipe[0], .events = POLLIN }
+    };
+    while (1) {
+        if (atomic_load(&frozen)) {
+            park();
+            continue;
+        }
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (pfd[0].revents)
+            return 0;
+    }
+}
+
+static void freeze(void) {
+    char c = 0;
+    atomic_store(&frozen, 1);
+    if (write(freeze_pipe[1], &c, 1) < 0)
+        warn("handoff: failed to wake participants");
+    for (int i = 0; i < nwakers; i++)
+        wakers[i]();
+}
+
+static void thaw(void) {
+    char c;
+    pthread_mutex_lock(&state_mutex);
+    atomic_store(&frozen, 0);
+    while (read(freeze_pipe[0], &c, 1) == 1)
+        ;
+    pthread_cond_broadcast(&state_cond);
+    pthread_mutex_unlock(&state_mutex);
+}
+
+/*
+ * Wait until every participant has parked.  Returns -1 on timeout.
+ */
+static int wait_parked(void) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += HANDOFF_PARK_TIMEOUT_MS / 1000;
+
+    int ret = 0;
+    pthread_mutex_lock(&state_mutex);
+    while (parked < participants && ret == 0)
+        ret = pthread_cond_timedwait(&state_cond, &state_mutex, &deadline);
+    int ok = parked >= participants;
+    pthread_mutex_unlock(&state_mutex);
+    return ok ? 0 : -1;
+}
+
+/*
+ * Send the snapshot and descriptors to a successor.  All participants are
+ * parked, so the maze, players and registry are quiescent.
+ */
+static int send_snapshot(int sock, uint64_t freeze_ns) {
+    int rows = maze_get_rows(), cols = maze_get_cols();
+    int maxfd = sysconf(_SC_OPEN_MAX) > 0 ? sysconf(_SC_OPEN_MAX) : 1024;
+    char *maze = malloc(rows * cols);
+    int *fds = malloc((HANDOFF_MAX_LISTENERS + maxfd) * sizeof(int));
+    struct player_state *states = malloc(MAX_PLAYERS * sizeof(*states));
+    struct handoff_player *hps = malloc(MAX_PLAYERS * sizeof(*hps));
+    int ret = -1;
+
+    if (!maze || !fds || !states || !hps || maze_snapshot(maze, rows * cols) < 0)
+        goto out;
+
+    memcpy(fds, listeners, nlisteners * sizeof(int));
+    int nclients = creg_list(client_registry, fds + nlisteners, maxfd);
+    int nplayers = player_snapshot(states, MAX_PLAYERS);
+    int np = 0;
+
+    for (int i = 0; i < nplayers; i++) {
+        for (int c = 0; c < nclients; c++) {
+            if (fds[nlisteners + c] == states[i].fd) {
+                hps[np].client = c;
+                hps[np++].state = states[i];
+                break;
+            }
+        }
+    }
+
+    struct handoff_header hdr = {
+        .magic = HANDOFF_MAGIC, .version = HANDOFF_VERSION,
+        .freeze_ns = freeze_ns, .rows = rows, .cols = cols,
+        .nlisten = nlisteners, .nclients = nclients, .nplayers = np
+    };
+
+    if (write_all(sock, &hdr, sizeof(hdr)) < 0 ||
+        write_all(sock, maze, rows * cols) < 0 ||
+        write_all(sock, hps, np * sizeof(*hps)) < 0 ||
+        send_fds(sock, fds, nlisteners + nclients) < 0)
+        goto out;
+
+    log_info("handoff: sent %d listener(s), %d client(s), %d player(s)",
+             nlisteners, nclients, np);
+    ret = 0;
+
+out:
+    free(maze);
+    free(fds);
+    free(states);
+    free(hps);
+    return ret;
+}
+
+/*
+ * Serve one handoff request.  Returns zero if the successor has taken over.
+ */
+static int handoff_serve(int sock) {
+    uint64_t t0 = now_ns();
+    freeze();
+
+    if (wait_parked() < 0) {
+        warn("handoff: threads did not park, abandoning handoff");
+        thaw();
+        return -1;
+    }
+    uint64_t t1 = now_ns();
+
+    struct timeval tv = { HANDOFF_ACK_TIMEOUT_S, 0 };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    char ack;
+    if (send_snapshot(sock, t0) < 0 || read_all(sock, &ack, 1) < 0) {
+        warn("handoff: successor failed, resuming service");
+        thaw();
+        return -1;
+    }
+    uint64_t t2 = now_ns();
+
+    log_info("handoff: park %lu us, transfer+resume %lu us, total %lu us",
+             (t1 - t0) / 1000, (t2 - t1) / 1000, (t2 - t0) / 1000);
+    return 0;
+}
+
+static void *handoff_thread(void *arg) {
+    pthread_mutex_lock(&state_mutex);
+    while (!ready)
+        pthread_cond_wait(&state_cond, &state_mutex);
+    pthread_mutex_unlock(&state_mutex);
+
+    while (1) {
+        int sock = accept(handoff_fd, NULL, NULL);
+        if (sock < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break;  // listening socket shut down by handoff_fini()
+        }
+        if (handoff_serve(sock) == 0) {
+            // The successor owns every connection now: leave without the
+            // usual shutdown, which would disconnect the clients.
+            unlink(handoff_path);
+            record_fini();
+            log_fini();
+            _exit(EXIT_SUCCESS);
+        }
+        close(sock);
+    }
+    return NULL;
+}
+
+void handoff_add_listener(int fd) {
+    if (nlisteners < HANDOFF_MAX_LISTENERS)
+        listeners[nlisteners++] = fd;
+}
+
+void handoff_ready(void) {
+    pthread_mutex_lock(&state_mutex);
+    ready = 1;
+    pthread_cond_broadcast(&state_cond);
+    pthread_mutex_unlock(&state_mutex);
+}
+
+int handoff_listen(const char *path) {
+    struct sockaddr_un addr;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        error("Handoff socket path too long: %s", path);
+        return -1;
+    }
+    if (pipe(freeze_pipe) < 0) {
+        perror("pipe");
+        return -1;
+    }
+    for (int i = 0; i < 2; i++) {
+        fcntl(freeze_pipe[i], F_SETFD, FD_CLOEXEC);
+        fcntl(freeze_pipe[i], F_SETFL, O_NONBLOCK);
+    }
+
+    if ((handoff_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    strcpy(handoff_path, path);
+    unlink(path);
+
+    if (bind(handoff_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(handoff_fd, 1) < 0 ||
+        pthread_create(&handoff_tid, NULL, handoff_thread, NULL) != 0) {
+        perror("handoff socket");
+        close(handoff_fd);
+        unlink(handoff_path);
+        handoff_fd = -1;
+        return -1;
+    }
+
+    info("Handoff socket listening on %s", path);
+    return 0;
+}
+
+void handoff_fini(void) {
+    if (handoff_fd < 0)
+        return;
+
+    shutdown(handoff_fd, SHUT_RDWR);
+    handoff_ready();                    // let the thread see the shutdown
+    pthread_join(handoff_tid, NULL);
+    close(handoff_fd);
+    unlink(handoff_path);
+    handoff_fd = -1;
+}
+
+int handoff_resume(const char *path, int *listen_fds, int max) {
+    struct sockaddr_un addr;
+    struct handoff_header hdr;
+    uint64_t t0 = now_ns();
+    int ret = -1;
+    char *maze = NULL;
+    char **rows = NULL;
+    struct handoff_player *hps = NULL;
+    int *fds = NULL;
+    PLAYER **owners = NULL;
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        perror("socket");
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("connect to handoff socket");
+        goto out;
+    }
+
+    if (read_all(sock, &hdr, sizeof(hdr)) < 0 || hdr.magic != HANDOFF_MAGIC ||
+        hdr.version != HANDOFF_VERSION || hdr.rows <= 0 || hdr.cols <= 0 ||
+        hdr.nlisten < 0 || hdr.nlisten > max || hdr.nclients < 0 ||
+        hdr.nplayers < 0 || hdr.nplayers > MAX_PLAYERS) {
+        error("handoff: bad snapshot header");
+        goto out;
+    }
+
+    maze = malloc(hdr.rows * hdr.cols);
+    rows = calloc(hdr.rows + 1, sizeof(char *));
+    hps = malloc((hdr.nplayers + 1) * sizeof(*hps));
+    fds = malloc((hdr.nlisten + hdr.nclients + 1) * sizeof(int));
+    owners = calloc(hdr.nclients + 1, sizeof(PLAYER *));
+    if (!maze || !rows || !hps || !fds || !owners)
+        goto out;
+
+    if (read_all(sock, maze, hdr.rows * hdr.cols) < 0 ||
+        read_all(sock, hps, hdr.nplayers * sizeof(*hps)) < 0 ||
+        recv_fds(sock, fds, hdr.nlisten + hdr.nclients) < 0) {
+        error("handoff: failed to receive snapshot");
+        goto out;
+    }
+
+    // maze_init() takes NUL-terminated rows.
+    for (int r = 0; r < hdr.rows; r++) {
+        rows[r] = strndup(maze + r * hdr.cols, hdr.cols);
+        if (!rows[r])
+            goto out;
+    }
+    maze_init(rows);
+    player_init();
+
+    int *clients = fds + hdr.nlisten;
+    for (int i = 0; i < hdr.nplayers; i++) {
+        int c = hps[i].client;
+        if (c < 0 || c >= hdr.nclients)
+            continue;
+        hps[i].state.fd = clients[c];
+        hps[i].state.name[PLAYER_NAME_MAX] = '\0';
+        owners[c] = player_restore(&hps[i].state);
+    }
+
+    // Until the old process has the acknowledgement it may still thaw and
+    // serve these connections itself, so nothing is sent on them before.
+    char ack = 1;
+    if (write_all(sock, &ack, 1) < 0) {
+        error("handoff: failed to acknowledge snapshot");
+        for (int i = 0; i < hdr.nlisten + hdr.nclients; i++)
+            close(fds[i]);
+        goto out;
+    }
+
+    for (int c = 0; c < hdr.nclients; c++)
+        mzw_client_start(clients[c], owners[c]);
+
+    memcpy(listen_fds, fds, hdr.nlisten * sizeof(int));
+    ret = hdr.nlisten;
+
+    uint64_t t1 = now_ns();
+    log_info("handoff: resumed %d client(s), %d player(s) in %lu us; "
+             "client-visible pause %lu us",
+             hdr.nclients, hdr.nplayers, (t1 - t0) / 1000,
+             (t1 - hdr.freeze_ns) / 1000);
+
+out:
+    if (rows) {
+        for (int r = 0; r < hdr.rows && rows[r]; r++)
+            free(rows[r]);
+        free(rows);
+    }
+    free(maze);
+    free(hps);
+    free(fds);
+    free(owners);
+    close(sock);
+    return ret;
+}
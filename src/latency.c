@@ -0,0 +1,119 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include "latency.h"
+#include "debug.h"
+#include "log.h"
+
+#define LATENCY_SHARDS 8
+#define SUB_COUNT (1UL << LATENCY_SUB_BITS)
+
+struct latency_shard {
+    _Alignas(64) atomic_ulong count[LATENCY_TYPES][LATENCY_BUCKETS];
+    atomic_ulong sum_ns[LATENCY_TYPES];
+};
+
+static struct latency_shard shards[LATENCY_SHARDS];
+static atomic_uint next_shard = 0;
+static __thread struct latency_shard *thread_shard = NULL;
+
+static const char *type_names[LATENCY_TYPES] = {
+    "other", "login", "move", "turn", "fire", "refresh", "send", "ready"
+};
+
+int latency_bucket(unsigned long ns) {
+    if (ns < SUB_COUNT)
+        return ns;
+    if (ns >= 1UL << LATENCY_MAX_BITS)
+        ns = (1UL << LATENCY_MAX_BITS) - 1;
+    int k = 63 - __builtin_clzl(ns);
+    return ((k - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS) +
+           (int)((ns >> (k - LATENCY_SUB_BITS)) - SUB_COUNT);
+}
+
+unsigned long latency_bucket_high(int b) {
+    if (b < (int)SUB_COUNT)
+        return b;
+    int k = (b >> LATENCY_SUB_BITS) + LATENCY_SUB_BITS - 1;
+    unsigned long sub = b & (SUB_COUNT - 1);
+    return ((SUB_COUNT + sub + 1) << (k - LATENCY_SUB_BITS)) - 1;
+}
+
+void latency_record(int type, unsigned long ns) {
+    struct latency_shard *s = thread_shard;
+    if (!s) {
+        unsigned int i = atomic_fetch_add_explicit(&next_shard, 1, memory_order_relaxed);
+        s = thread_shard = &shards[i % LATENCY_SHARDS];
+    }
+    if ((unsigned)type >= LATENCY_TYPES)
+        type = 0;
+    atomic_fetch_add_explicit(&s->count[type][latency_bucket(ns)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&s->sum_ns[type], ns, memory_order_relaxed);
+}
+
+/*
+ * Merge the shards' histograms for one type.  Returns the number of
+ * samples.
+ */
+static unsigned long merge(int type, unsigned long *hist, unsigned long *sum) {
+    unsigned long n = 0;
+    memset(hist, 0, LATENCY_BUCKETS * sizeof(*hist));
+    *sum = 0;
+    for (int i = 0; i < LATENCY_SHARDS; i++) {
+        for (int b = 0; b < LATENCY_BUCKETS; b++) {
+            unsigned long c = atomic_load_explicit(&shards[i].count[type][b], memory_order_relaxed);
+            hist[b] += c;
+            n += c;
+        }
+        *sum += atomic_load_explicit(&shards[i].sum_ns[type], memory_order_relaxed);
+    }
+    return n;
+}
+
+static unsigned long quantile(unsigned long *hist, unsigned long n, double q) {
+    unsigned long seen = 0, want = (unsigned long)(q * n);
+    for (int b = 0; b < LATENCY_BUCKETS; b++) {
+        seen += hist[b];
+        if (seen > want)
+            return latency_bucket_high(b);
+    }
+    return latency_bucket_high(LATENCY_BUCKETS - 1);
+}
+
+void latency_show(FILE *out) {
+    unsigned long hist[LATENCY_BUCKETS], sum;
+
+    fprintf(out, "TYPE     COUNT      MEAN_US    P50_US     P99_US     P999_US    MAX_US\n");
+    for (int t = 0; t < LATENCY_TYPES; t++) {
+        unsigned long n = merge(t, hist, &sum);
+        if (!n)
+            continue;
+        int max = LATENCY_BUCKETS - 1;
+        while (max > 0 && !hist[max])
+            max--;
+        fprintf(out, "%-8s %-10lu %-10.1f %-10.1f %-10.1f %-10.1f %.1f\n", type_names[t], n,
+                sum / 1e3 / n, quantile(hist, n, 0.5) / 1e3, quantile(hist, n, 0.99) / 1e3,
+                quantile(hist, n, 0.999) / 1e3, latency_bucket_high(max) / 1e3);
+    }
+}
+
+void latency_show_metrics(FILE *out) {
+    static const double quantiles[] = { 0.5, 0.99, 0.999 };
+    unsigned long hist[LATENCY_BUCKETS], sum;
+    const char *name = "mazewar_packet_latency_seconds";
+
+    fprintf(out, "# HELP %s Time from reading a client packet to writing the last packet it caused.\n"
+            "# TYPE %s summary\n", name, name);
+    for (int t = 0; t < LATENCY_TYPES; t++) {
+        unsigned long n = merge(t, hist, &sum);
+        if (!n)
+            continue;
+        for (int i = 0; i < 3; i++)
+            fprintf(out, "%s{type=\"%s\",quantile=\"%g\"} %.9f\n", name, type_names[t],
+                    quantiles[i], quantile(hist, n, quantiles[i]) / 1e9);
+        fprintf(out, "%s_sum{type=\"%s\"} %.9f\n", name, type_names[t], sum / 1e9);
+        fprintf(out, "%s_count{type=\"%s\"} %lu\n", name, type_names[t], n);
+    }
+}
@@ -0,0 +1,259 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "listener.h"
+#include "handoff.h"
+#include "debug.h"
+#include "log.h"
+
+#define ACCEPT_RETRY_NS 10000000        // back-off after EMFILE/ENFILE/ENOBUFS
+
+struct acceptor {
+    int fd;
+    int cpu;                            // CPU the thread is pinned to, or -1
+    pthread_t tid;
+    atomic_ulong accepted;              // connections accepted
+    atomic_ulong wakeups;               // times the socket became readable
+    atomic_ulong errors;                // accept4() failures other than EAGAIN
+    atomic_uint max_queue;              // deepest accept queue drained at once
+};
+
+static struct acceptor acceptors[LISTENER_MAX];
+static int nacceptors = 0;
+static int accept_flags = SOCK_CLOEXEC;
+static listener_handler handler = NULL;
+
+static struct timespec start_time;
+static struct timespec last_show;       // for the rate since the last report
+static unsigned long last_accepted;
+
+static double seconds_since(const struct timespec *t) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - t->tv_sec) + (now.tv_nsec - t->tv_nsec) / 1e9;
+}
+
+/*
+ * Wait until the socket has connections to accept.  While a handoff socket
+ * is open the wait goes through the handoff module, so that this thread
+ * can be parked for a handoff.
+ */
+static int wait_for_connections(int fd) {
+    if (handoff_enabled())
+        return handoff_wait_readable(fd);
+
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    while (poll(&pfd, 1, -1) < 0) {
+        if (errno != EINTR)
+            return -1;
+    }
+    return (pfd.revents & (POLLERR | POLLHUP | POLLNVAL)) ? -1 : 0;
+}
+
+static void *acceptor_thread(void *arg) {
+    struct acceptor *a = arg;
+    struct timespec retry = { 0, ACCEPT_RETRY_NS };
+
+    if (a->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(a->cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+
+    while (wait_for_connections(a->fd) == 0) {
+        atomic_fetch_add_explicit(&a->wakeups, 1, memory_order_relaxed);
+
+        // Drain everything that is queued: during a login storm one wakeup
+        // then covers many connections.
+        unsigned int drained = 0;
+        while (1) {
+            int fd = accept4(a->fd, NULL, NULL, accept_flags);
+            if (fd >= 0) {
+                drained++;
+                handler(fd);
+                continue;
+            }
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            atomic_fetch_add_explicit(&a->errors, 1, memory_order_relaxed);
+            if (errno == EINVAL || errno == EBADF)
+                goto done;              // socket shut down by listener_fini()
+            log_warn("accept4 on listener fd=%d failed (errno=%d)", a->fd, errno);
+            nanosleep(&retry, NULL);
+            break;
+        }
+
+        atomic_fetch_add_explicit(&a->accepted, drained, memory_order_relaxed);
+        unsigned int max = atomic_load_explicit(&a->max_queue, memory_order_relaxed);
+        if (drained > max)
+            atomic_store_explicit(&a->max_queue, drained, memory_order_relaxed);
+    }
+
+done:
+    handoff_leave();
+    return NULL;
+}
+
+int listener_open(int port, int count, int backlog, int *fds) {
+    struct sockaddr_in addr;
+    int n = 0;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+
+    if (count > LISTENER_MAX)
+        count = LISTENER_MAX;
+
+    for (int i = 0; i < count; i++) {
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            perror("socket");
+            break;
+        }
+
+        int optval = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) < 0 && i > 0) {
+            perror("setsockopt(SO_REUSEPORT)");
+            close(fd);
+            break;
+        }
+
+        if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+            listen(fd, backlog) < 0) {
+            perror("bind/listen");
+            close(fd);
+            break;
+        }
+        fds[n++] = fd;
+    }
+
+    return n > 0 ? n : -1;
+}
+
+int listener_start(int *fds, int count, int flags, listener_handler h) {
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int ret = 0;
+
+    accept_flags = flags;
+    handler = h;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    last_show = start_time;
+
+    for (int i = 0; i < count && nacceptors < LISTENER_MAX; i++) {
+        struct acceptor *a = &acceptors[nacceptors];
+        memset(a, 0, sizeof(*a));
+        a->fd = fds[i];
+        a->cpu = ncpu > 1 ? (int)(nacceptors % ncpu) : -1;
+
+        // The drain loop needs a non-blocking socket, and one inherited
+        // through a handoff from an older server may not be.
+        fcntl(a->fd, F_SETFL, fcntl(a->fd, F_GETFL) | O_NONBLOCK);
+        handoff_add_listener(a->fd);
+
+        handoff_enter();
+        if (pthread_create(&a->tid, NULL, acceptor_thread, a) != 0) {
+            error("Failed to start accept thread for fd=%d", a->fd);
+            handoff_leave();
+            ret = -1;
+            continue;
+        }
+        nacceptors++;
+    }
+
+    return ret;
+}
+
+void listener_fini(void) {
+    for (int i = 0; i < nacceptors; i++)
+        shutdown(acceptors[i].fd, SHUT_RDWR);
+    for (int i = 0; i < nacceptors; i++) {
+        pthread_join(acceptors[i].tid, NULL);
+        close(acceptors[i].fd);
+    }
+    nacceptors = 0;
+}
+
+/*
+ * Read the system-wide listen queue overflow and drop counters.
+ */
+static int read_listen_drops(unsigned long *overflows, unsigned long *drops) {
+    FILE *f = fopen("/proc/net/netstat", "r");
+    char names[4096], values[4096];
+    int found = 0;
+
+    if (!f)
+        return -1;
+    while (!found && fgets(names, sizeof(names), f) && fgets(values, sizeof(values), f)) {
+        if (strncmp(names, "TcpExt:", 7) != 0)
+            continue;
+        char *ns = NULL, *vs = NULL;
+        char *n = strtok_r(names, " \n", &ns);
+        char *v = strtok_r(values, " \n", &vs);
+        while (n && v) {
+            if (!strcmp(n, "ListenOverflows"))
+                *overflows = strtoul(v, NULL, 10), found++;
+            else if (!strcmp(n, "ListenDrops"))
+                *drops = strtoul(v, NULL, 10), found++;
+            n = strtok_r(NULL, " \n", &ns);
+            v = strtok_r(NULL, " \n", &vs);
+        }
+    }
+    fclose(f);
+    return found ? 0 : -1;
+}
+
+void listener_show(FILE *out) {
+    unsigned long total = 0;
+
+    fprintf(out, "LISTENER CPU ACCEPTED  WAKEUPS  ERRORS MAXBATCH QUEUE/BACKLOG\n");
+    for (int i = 0; i < nacceptors; i++) {
+        struct acceptor *a = &acceptors[i];
+        unsigned long accepted = atomic_load(&a->accepted);
+        struct tcp_info ti;
+        socklen_t len = sizeof(ti);
+        char queue[32] = "?";
+
+        // For a listening socket, tcpi_unacked is the current accept queue
+        // length and tcpi_sacked the backlog it is capped at.
+        if (getsockopt(a->fd, IPPROTO_TCP, TCP_INFO, &ti, &len) == 0)
+            snprintf(queue, sizeof(queue), "%u/%u", ti.tcpi_unacked, ti.tcpi_sacked);
+
+        fprintf(out, "%-8d %-3d %-8lu %-8lu %-6lu %-8u %s\n",
+                a->fd, a->cpu, accepted, atomic_load(&a->wakeups),
+                atomic_load(&a->errors), atomic_load(&a->max_queue), queue);
+        total += accepted;
+    }
+
+    double elapsed = seconds_since(&start_time);
+    double interval = seconds_since(&last_show);
+    fprintf(out, "accepted: %lu total, %.1f/s average, %.1f/s since last report\n",
+            total, elapsed > 0 ? total / elapsed : 0.0,
+            interval > 0 ? (total - last_accepted) / interval : 0.0);
+    clock_gettime(CLOCK_MONOTONIC, &last_show);
+    last_accepted = total;
+
+    unsigned long overflows = 0, drops = 0;
+    if (read_listen_drops(&overflows, &drops) == 0)
+        fprintf(out, "kernel listen queue: %lu overflows, %lu drops (system-wide)\n",
+                overflows, drops);
+}
@@ -0,0 +1,284 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "lockprof.h"
+#include "debug.h"
+#include "log.h"
+
+#ifdef LOCKPROF
+
+#define HELD_MAX  16                    // locks one thread can hold and be timed
+#define SITES_MAX 256                   // call sites sorted for a report
+
+struct lockprof_class {
+    const char *name;
+    atomic_ulong acquired;
+    atomic_ulong contended;
+    atomic_ulong wait_ns;
+    atomic_ulong hold_ns;
+    atomic_ulong wait_hist[LOCKPROF_BUCKETS];
+    atomic_ulong hold_hist[LOCKPROF_BUCKETS];
+};
+
+/*
+ * A lock held by the calling thread.  A recursive mutex taken again by its
+ * owner only raises the depth; the hold is timed from the outermost
+ * acquisition.
+ */
+struct held_lock {
+    pthread_mutex_t *mutex;
+    struct lockprof_site *site;
+    unsigned long since;
+    int depth;
+};
+
+static struct lockprof_class classes[LOCK_CLASSES] = {
+    [LOCK_MAZE] = { .name = "maze_mutex" },
+    [LOCK_PLAYERS] = { .name = "players_mutex" },
+    [LOCK_PLAYER] = { .name = "player->mutex" },
+};
+
+static atomic_int enabled = 1;
+
+static pthread_mutex_t sites_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct lockprof_site *sites = NULL;
+
+static __thread struct held_lock held[HELD_MAX];
+static __thread int nheld = 0;
+
+static unsigned long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static int bucket(unsigned long ns) {
+    int b = ns ? 64 - __builtin_clzl(ns) : 0;
+    return b < LOCKPROF_BUCKETS ? b : LOCKPROF_BUCKETS - 1;
+}
+
+static void register_site(struct lockprof_site *site) {
+    pthread_mutex_lock(&sites_lock);
+    if (!atomic_load(&site->registered)) {
+        site->next = sites;
+        sites = site;
+        atomic_store(&site->registered, 1);
+    }
+    pthread_mutex_unlock(&sites_lock);
+}
+
+static void add(atomic_ulong *counter, unsigned long n) {
+    atomic_fetch_add_explicit(counter, n, memory_order_relaxed);
+}
+
+void lockprof_lock(pthread_mutex_t *m, struct lockprof_site *site) {
+    if (!atomic_load_explicit(&enabled, memory_order_relaxed)) {
+        pthread_mutex_lock(m);
+        return;
+    }
+
+    for (int i = nheld - 1; i >= 0; i--) {
+        if (held[i].mutex == m) {
+            pthread_mutex_lock(m);
+            held[i].depth++;
+            return;
+        }
+    }
+
+    if (!atomic_load_explicit(&site->registered, memory_order_acquire))
+        register_site(site);
+
+    struct lockprof_class *c = &classes[site->cls];
+    unsigned long wait = 0, since;
+    if (pthread_mutex_trylock(m) == 0) {
+        since = now_ns();
+    } else {
+        unsigned long start = now_ns();
+        pthread_mutex_lock(m);
+        since = now_ns();
+        wait = since - start;
+        add(&site->contended, 1);
+        add(&site->wait_ns, wait);
+        add(&c->contended, 1);
+        add(&c->wait_ns, wait);
+        if (atomic_load_explicit(&trace_enabled, memory_order_relaxed))
+            trace_span(LOCKPROF_WAIT_NAME(site->cls), start, since);
+    }
+    add(&site->acquired, 1);
+    add(&c->acquired, 1);
+    add(&c->wait_hist[bucket(wait)], 1);
+
+    if (nheld < HELD_MAX)
+        held[nheld++] = (struct held_lock){ m, site, since, 1 };
+}
+
+void lockprof_unlock(pthread_mutex_t *m) {
+    for (int i = nheld - 1; i >= 0; i--) {
+        if (held[i].mutex != m)
+            continue;
+        if (--held[i].depth == 0) {
+            unsigned long hold = now_ns() - held[i].since;
+            struct lockprof_site *site = held[i].site;
+            add(&site->hold_ns, hold);
+            add(&classes[site->cls].hold_ns, hold);
+            add(&classes[site->cls].hold_hist[bucket(hold)], 1);
+            // Locks are not always released in the reverse order.
+            memmove(&held[i], &held[i + 1], (nheld - i - 1) * sizeof(held[0]));
+            nheld--;
+        }
+        break;
+    }
+    pthread_mutex_unlock(m);
+}
+
+int lockprof_enable(int on) {
+    atomic_store(&enabled, on);
+    return 0;
+}
+
+void lockprof_reset(void) {
+    for (int i = 0; i < LOCK_CLASSES; i++) {
+        struct lockprof_class *c = &classes[i];
+        atomic_store(&c->acquired, 0);
+        atomic_store(&c->contended, 0);
+        atomic_store(&c->wait_ns, 0);
+        atomic_store(&c->hold_ns, 0);
+        for (int b = 0; b < LOCKPROF_BUCKETS; b++) {
+            atomic_store(&c->wait_hist[b], 0);
+            atomic_store(&c->hold_hist[b], 0);
+        }
+    }
+    pthread_mutex_lock(&sites_lock);
+    for (struct lockprof_site *s = sites; s; s = s->next) {
+        atomic_store(&s->acquired, 0);
+        atomic_store(&s->contended, 0);
+        atomic_store(&s->wait_ns, 0);
+        atomic_store(&s->hold_ns, 0);
+    }
+    pthread_mutex_unlock(&sites_lock);
+}
+
+static const char *fmt_ns(char *buf, size_t size, double ns) {
+    if (ns < 1e3)
+        snprintf(buf, size, "%.0fns", ns);
+    else if (ns < 1e6)
+        snprintf(buf, size, "%.1fus", ns / 1e3);
+    else if (ns < 1e9)
+        snprintf(buf, size, "%.1fms", ns / 1e6);
+    else
+        snprintf(buf, size, "%.2fs", ns / 1e9);
+    return buf;
+}
+
+/*
+ * Upper bound of the bucket holding the given fraction of the samples.
+ */
+static double percentile(unsigned long *hist, unsigned long total, double q) {
+    unsigned long seen = 0, want = (unsigned long)(q * total);
+    for (int b = 0; b < LOCKPROF_BUCKETS; b++) {
+        seen += hist[b];
+        if (seen > want)
+            return b ? (double)(1UL << b) : 0;
+    }
+    return (double)(1UL << (LOCKPROF_BUCKETS - 1));
+}
+
+/*
+ * Format a bucket bound: "0" for the bucket of zero times, "<N" otherwise.
+ */
+static const char *fmt_bound(char *buf, size_t size, double ns) {
+    if (ns == 0) {
+        snprintf(buf, size, "0");
+    } else {
+        buf[0] = '<';
+        fmt_ns(buf + 1, size - 1, ns);
+    }
+    return buf;
+}
+
+static void show_times(FILE *out, const char *what, atomic_ulong *counts,
+                       unsigned long total_ns) {
+    unsigned long hist[LOCKPROF_BUCKETS], n = 0;
+    char a[16], b[16], c[16], d[16];
+
+    for (int i = 0; i < LOCKPROF_BUCKETS; i++)
+        n += hist[i] = atomic_load(&counts[i]);
+    fprintf(out, "  %s: total %s, p50 %s, p99 %s, p999 %s\n    ", what,
+            fmt_ns(a, sizeof(a), total_ns), fmt_bound(b, sizeof(b), percentile(hist, n, 0.5)),
+            fmt_bound(c, sizeof(c), percentile(hist, n, 0.99)),
+            fmt_bound(d, sizeof(d), percentile(hist, n, 0.999)));
+    for (int i = 0; i < LOCKPROF_BUCKETS; i++) {
+        if (hist[i])
+            fprintf(out, " %s:%lu", fmt_bound(a, sizeof(a), i ? (double)(1UL << i) : 0), hist[i]);
+    }
+    fprintf(out, "\n");
+}
+
+static int by_wait(const void *x, const void *y) {
+    const struct lockprof_site *a = *(struct lockprof_site *const *)x;
+    const struct lockprof_site *b = *(struct lockprof_site *const *)y;
+    unsigned long wa = atomic_load(&a->wait_ns), wb = atomic_load(&b->wait_ns);
+    if (wa != wb)
+        return wa < wb ? 1 : -1;
+    unsigned long aa = atomic_load(&a->acquired), ab = atomic_load(&b->acquired);
+    return aa < ab ? 1 : aa > ab ? -1 : 0;
+}
+
+void lockprof_show(FILE *out) {
+    struct lockprof_site *list[SITES_MAX];
+    char a[16], b[16];
+
+    fprintf(out, "lock profiling: %s\n", atomic_load(&enabled) ? "on" : "off");
+    for (int i = 0; i < LOCK_CLASSES; i++) {
+        struct lockprof_class *c = &classes[i];
+        unsigned long acquired = atomic_load(&c->acquired);
+        unsigned long contended = atomic_load(&c->contended);
+
+        fprintf(out, "%s: %lu acquired, %lu contended (%.2f%%)\n", c->name, acquired,
+                contended, acquired ? 100.0 * contended / acquired : 0.0);
+        if (!acquired)
+            continue;
+        show_times(out, "wait", c->wait_hist, atomic_load(&c->wait_ns));
+        show_times(out, "hold", c->hold_hist, atomic_load(&c->hold_ns));
+
+        int n = 0;
+        pthread_mutex_lock(&sites_lock);
+        for (struct lockprof_site *s = sites; s && n < SITES_MAX; s = s->next) {
+            if (s->cls == i && atomic_load(&s->acquired))
+                list[n++] = s;
+        }
+        pthread_mutex_unlock(&sites_lock);
+        qsort(list, n, sizeof(list[0]), by_wait);
+
+        fprintf(out, "  top sites:          ACQUIRED   CONTENDED  WAIT       HOLD\n");
+        for (int j = 0; j < n && j < LOCKPROF_TOP_SITES; j++) {
+            struct lockprof_site *s = list[j];
+            char where[64];
+            const char *file = strrchr(s->file, '/');
+            snprintf(where, sizeof(where), "%s:%d", file ? file + 1 : s->file, s->line);
+            fprintf(out, "    %-16s %-10lu %-10lu %-10s %s\n", where,
+                    atomic_load(&s->acquired), atomic_load(&s->contended),
+                    fmt_ns(a, sizeof(a), atomic_load(&s->wait_ns)),
+                    fmt_ns(b, sizeof(b), atomic_load(&s->hold_ns)));
+        }
+    }
+}
+
+#else
+
+void lockprof_show(FILE *out) {
+    fprintf(out, "lock profiling not compiled in (build with make LOCKPROF=1)\n");
+}
+
+int lockprof_enable(int on) {
+    return -1;
+}
+
+void lockprof_reset(void) {
+}
+
+#endif
@@ -0,0 +1,324 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "log.h"
+
+#define LOG_RING_SIZE 1024             // records per thread; power of two
+#define LOG_RING_MASK (LOG_RING_SIZE - 1)
+#define LOG_OUTBUF_SIZE 65536          // writer's formatting buffer
+#define LOG_IDLE_NS 1000000            // writer sleep when all rings are empty
+
+struct log_record {
+    uint64_t ns;                       // CLOCK_REALTIME at the call site
+    const char *fmt;
+    const char *file;
+    const char *func;
+    int line;
+    unsigned char level;
+    unsigned char nargs;
+    long args[LOG_MAX_ARGS];
+};
+
+/*
+ * Single-producer/single-consumer ring.  The owning thread advances head,
+ * the writer thread advances tail.  A ring whose thread has exited is
+ * marked orphaned and is handed to the next thread that needs one once
+ * the writer has drained it.
+ */
+struct log_ring {
+    _Atomic uint64_t head;
+    _Atomic uint64_t tail;
+    atomic_ulong dropped;
+    atomic_int orphaned;
+    struct log_ring *next;
+    struct log_record records[LOG_RING_SIZE];
+};
+
+#ifdef DEBUG
+atomic_int log_level = LOG_DEBUG;
+#else
+atomic_int log_level = LOG_INFO;
+#endif
+
+static struct log_ring *_Atomic rings = NULL;
+static __thread struct log_ring *my_ring = NULL;
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+static pthread_t writer_tid;
+static atomic_int writer_running = 0;
+static unsigned long drops_reported = 0;
+static pthread_mutex_t sync_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *level_names[] = {
+    "", KRED "ERROR", KYEL "WARN", KBLU "INFO", KMAG "DEBUG", KCYN "TRACE"
+};
+
+static void ring_release(void *arg) {
+    struct log_ring *r = arg;
+    atomic_store_explicit(&r->orphaned, 1, memory_order_release);
+}
+
+static void ring_key_create(void) {
+    pthread_key_create(&ring_key, ring_release);
+}
+
+/*
+ * Find the calling thread's ring, adopting a drained orphan or allocating
+ * a new one on first use.
+ */
+static struct log_ring *ring_get(void) {
+    if (my_ring)
+        return my_ring;
+
+    pthread_once(&ring_key_once, ring_key_create);
+
+    struct log_ring *r;
+    for (r = atomic_load(&rings); r != NULL; r = r->next) {
+        int one = 1;
+        if (atomic_load(&r->head) == atomic_load(&r->tail) &&
+            atomic_compare_exchange_strong(&r->orphaned, &one, 0))
+            break;
+    }
+
+    if (!r) {
+        r = calloc(1, sizeof(*r));
+        if (!r)
+            return NULL;
+        r->next = atomic_load(&rings);
+        while (!atomic_compare_exchange_weak(&rings, &r->next, r))
+            ;
+    }
+
+    pthread_setspecific(ring_key, r);
+    my_ring = r;
+    return r;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ * Expand a deferred format.  Every argument was captured as a long, so each
+ * conversion is re-issued to snprintf with the argument cast back to the
+ * type the conversion expects.  Length modifiers in the original format are
+ * ignored and '*' widths are not supported.
+ */
+static size_t format_args(char *out, size_t cap, const char *fmt,
+                          int nargs, const long *args) {
+    size_t n = 0;
+    int ai = 0;
+
+    while (*fmt && n + 1 < cap) {
+        if (*fmt != '%') {
+            out[n++] = *fmt++;
+            continue;
+        }
+        if (fmt[1] == '%') {
+            out[n++] = '%';
+            fmt += 2;
+            continue;
+        }
+
+        char spec[32];
+        size_t sl = 0;
+        spec[sl++] = *fmt++;
+        while (*fmt && strchr("-+ #0123456789.", *fmt) && sl < sizeof(spec) - 4)
+            spec[sl++] = *fmt++;
+        while (*fmt && strchr("hlzjt", *fmt))
+            fmt++;
+        char conv = *fmt ? *fmt++ : '\0';
+        long arg = ai < nargs ? args[ai++] : 0;
+        int w;
+
+        switch (conv) {
+            case 'd': case 'i':
+                spec[sl++] = 'l'; spec[sl++] = conv; spec[sl] = '\0';
+                w = snprintf(out + n, cap - n, spec, arg);
+                break;
+            case 'u': case 'x': case 'X': case 'o':
+                spec[sl++] = 'l'; spec[sl++] = conv; spec[sl] = '\0';
+                w = snprintf(out + n, cap - n, spec, (unsigned long)arg);
+                break;
+            case 'c':
+                spec[sl++] = 'c'; spec[sl] = '\0';
+                w = snprintf(out + n, cap - n, spec, (int)arg);
+                break;
+            case 's':
+                spec[sl++] = 's'; spec[sl] = '\0';
+                w = snprintf(out + n, cap - n, spec,
+                             arg ? (const char *)arg : "(null)");
+                break;
+            case 'p':
+                w = snprintf(out + n, cap - n, "%p", (void *)arg);
+                break;
+            default:
+                w = 0;
+                break;
+        }
+        if (w > 0)
+            n += ((size_t)w < cap - n) ? (size_t)w : cap - n - 1;
+    }
+
+    out[n] = '\0';
+    return n;
+}
+
+static size_t format_record(char *out, size_t cap, const struct log_record *rec) {
+    int w = snprintf(out, cap, "%s: %lu.%06lu %s:%s:%d " KNRM,
+                     level_names[rec->level],
+                     (unsigned long)(rec->ns / 1000000000ull),
+                     (unsigned long)(rec->ns % 1000000000ull / 1000),
+                     rec->file, rec->func, rec->line);
+    if (w < 0 || (size_t)w >= cap)
+        return 0;
+    size_t n = w;
+    n += format_args(out + n, cap - n - 1, rec->fmt, rec->nargs, rec->args);
+    out[n++] = '\n';
+    return n;
+}
+
+static void write_out(const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t w = write(STDERR_FILENO, buf, len);
+        if (w <= 0)
+            return;
+        buf += w;
+        len -= w;
+    }
+}
+
+/*
+ * Drain every ring once.  Returns the number of records written.
+ */
+static size_t drain_all(char *buf, size_t cap) {
+    size_t total = 0, used = 0;
+
+    for (struct log_ring *r = atomic_load(&rings); r != NULL; r = r->next) {
+        uint64_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        uint64_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+
+        while (tail != head) {
+            if (cap - used < 1024) {
+                write_out(buf, used);
+                used = 0;
+            }
+            used += format_record(buf + used, cap - used,
+                                  &r->records[tail & LOG_RING_MASK]);
+            tail++;
+            total++;
+        }
+        atomic_store_explicit(&r->tail, tail, memory_order_release);
+    }
+
+    unsigned long dropped = log_dropped();
+    if (dropped != drops_reported) {
+        if (cap - used < 1024) {
+            write_out(buf, used);
+            used = 0;
+        }
+        int w = snprintf(buf + used, cap - used,
+                         "%s: " KNRM "log: %lu records dropped (ring full)\n",
+                         level_names[LOG_WARN], dropped - drops_reported);
+        if (w > 0)
+            used += (size_t)w < cap - used ? (size_t)w : cap - used - 1;
+        drops_reported = dropped;
+    }
+
+    if (used > 0)
+        write_out(buf, used);
+    return total;
+}
+
+static void *writer_thread(void *arg) {
+    char *buf = malloc(LOG_OUTBUF_SIZE);
+    if (!buf)
+        return NULL;
+
+    struct timespec idle = { 0, LOG_IDLE_NS };
+    while (atomic_load(&writer_running)) {
+        if (drain_all(buf, LOG_OUTBUF_SIZE) == 0)
+            nanosleep(&idle, NULL);
+    }
+    drain_all(buf, LOG_OUTBUF_SIZE);
+
+    free(buf);
+    return NULL;
+}
+
+void log_write(int level, const char *file, const char *func, int line,
+               const char *fmt, int nargs, const long *args) {
+    if (nargs > LOG_MAX_ARGS)
+        nargs = LOG_MAX_ARGS;
+
+    if (!atomic_load_explicit(&writer_running, memory_order_relaxed)) {
+        struct log_record rec = {
+            .ns = now_ns(), .fmt = fmt, .file = file, .func = func, .line = line,
+            .level = level, .nargs = nargs
+        };
+        memcpy(rec.args, args, nargs * sizeof(long));
+        char buf[1024];
+        size_t len = format_record(buf, sizeof(buf), &rec);
+        pthread_mutex_lock(&sync_mutex);
+        write_out(buf, len);
+        pthread_mutex_unlock(&sync_mutex);
+        return;
+    }
+
+    struct log_ring *r = ring_get();
+    if (!r)
+        return;
+
+    uint64_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    if (head - tail >= LOG_RING_SIZE) {
+        atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    struct log_record *rec = &r->records[head & LOG_RING_MASK];
+    rec->ns = now_ns();
+    rec->fmt = fmt;
+    rec->file = file;
+    rec->func = func;
+    rec->line = line;
+    rec->level = level;
+    rec->nargs = nargs;
+    memcpy(rec->args, args, nargs * sizeof(long));
+
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
+
+unsigned long log_dropped(void) {
+    unsigned long total = 0;
+    for (struct log_ring *r = atomic_load(&rings); r != NULL; r = r->next)
+        total += atomic_load_explicit(&r->dropped, memory_order_relaxed);
+    return total;
+}
+
+void log_init(void) {
+    if (atomic_load(&writer_running))
+        return;
+    atomic_store(&writer_running, 1);
+    if (pthread_create(&writer_tid, NULL, writer_thread, NULL) != 0) {
+        atomic_store(&writer_running, 0);
+        error("Failed to start log writer thread");
+    }
+}
+
+void log_fini(void) {
+    if (!atomic_load(&writer_running))
+        return;
+    atomic_store(&writer_running, 0);
+    pthread_join(writer_tid, NULL);
+    // Rings are left allocated: exiting threads may still mark theirs orphaned.
+}
@@ -5,15 +5,29 @@
 #include <signal.h>
 #include <errno.h>
 #include <pthread.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
 #include <sys/socket.h>
 
 #include "client_registry.h"
 #include "maze.h"
 #include "player.h"
 #include "debug.h"
+#include "log.h"
 #include "server.h"
+#include "server_ext.h"
+#include "admin.h"
+#include "handoff.h"
+#include "room.h"
+#include "maze_ext.h"
+#include "listener.h"
+#include "pool.h"
+#include "coro.h"
+#include "rng.h"
+#include "metrics.h"
+#include "lockprof.h"
+#include "trace.h"
+#include "record.h"
+#include "udp.h"
+#include "shm.h"
 
 //int debug_show_maze = 0;
 
@@ -32,40 +46,223 @@ static char *default_maze[] = {
     NULL
 };
 
+static volatile sig_atomic_t dump_locks = 0;
+
+// SIGUSR2 handler: the lock report is printed by the main loop.
+static void handle_sigusr2(int sig) {
+    (void)sig;
+    dump_locks = 1;
+}
+
 // SIGHUP handler
 void handle_sighup(int sig) {
-    printf("[DEBUG] Entering handle_sighup with signal %d\n", sig);
+    log_trace("Entering handle_sighup with signal %d", sig);
     (void)sig;
     terminate(EXIT_SUCCESS);
     // No exit needed: terminate will call it
 }
 
+/*
+ * Serve a newly accepted client connection.
+ */
+static void start_client(int fd) {
+    mzw_client_start(fd, NULL);
+}
+
 int main(int argc, char *argv[]) {
-    printf("[DEBUG] Entering main\n");
+    log_trace("Entering main");
 
     int opt;
     int port = 0;
+    char *admin_path = NULL;
+    char *handoff_path = NULL;
+    char *resume_path = NULL;
+    int nlisteners = sysconf(_SC_NPROCESSORS_ONLN);
+    int backlog = SOMAXCONN;
+    int nworkers = 0;
+    int pin_workers = 0;
+    int use_uring = 0;
+    int nscheds = 0;
+    unsigned long long seed = 0;
+    int fixed_seed = 0;
+    int metrics_port = 0;
+    char *trace_file = NULL;
+    char *record_path = NULL;
+    int udp_port = 0;
+    int loss = 0, reorder = 0, dup = 0;
+    char *shm_path = NULL;
+    int nrooms = 1;
+    int large = 0;
+    int maze_rows = 0, maze_cols = 0;
 
-    while ((opt = getopt(argc, argv, "p:")) != -1) {
+    while ((opt = getopt(argc, argv, "p:a:H:R:n:b:w:Puc:S:M:T:r:U:L:m:G:X:z:")) != -1) {
         switch (opt) {
             case 'p':
                 port = atoi(optarg);
                 break;
+            case 'a':
+                admin_path = optarg;
+                break;
+            case 'H':
+                handoff_path = optarg;
+                break;
+            case 'R':
+                resume_path = optarg;
+                break;
+            case 'n':
+                nlisteners = atoi(optarg);
+                break;
+            case 'b':
+                backlog = atoi(optarg);
+                break;
+            case 'w':
+                nworkers = atoi(optarg);
+                break;
+            case 'P':
+                pin_workers = 1;
+                break;
+            case 'u':
+                use_uring = 1;
+                break;
+            case 'c':
+                // Zero or less means one scheduler per online CPU.
+                nscheds = atoi(optarg);
+                if (nscheds <= 0)
+                    nscheds = sysconf(_SC_NPROCESSORS_ONLN);
+                break;
+            case 'S':
+                seed = strtoull(optarg, NULL, 0);
+                fixed_seed = 1;
+                break;
+            case 'M':
+                metrics_port = atoi(optarg);
+                break;
+            case 'T':
+                trace_file = optarg;
+                break;
+            case 'r':
+                record_path = optarg;
+                break;
+            case 'U':
+                udp_port = atoi(optarg);
+                break;
+            case 'm':
+                shm_path = optarg;
+                break;
+            case 'G':
+                nrooms = atoi(optarg);
+                break;
+            case 'X':
+                large = atoi(optarg);
+                break;
+            case 'z':
+                // A random maze of <rows>x<cols>.
+                if (sscanf(optarg, "%dx%d", &maze_rows, &maze_cols) != 2)
+                    maze_rows = maze_cols = -1;
+                break;
+            case 'L':
+                // Percentages lost[,reordered[,duplicated]]; anything else
+                // is left for the check below to reject.
+                {
+                    int *pct[] = { &loss, &reorder, &dup };
+                    char *s = optarg, *end;
+                    for (int i = 0; i < 3; i++) {
+                        errno = 0;
+                        long v = strtol(s, &end, 10);
+                        if (end == s || errno || v < 0 || v > 100) {
+                            loss = -1;
+                            break;
+                        }
+                        *pct[i] = v;
+                        if (*end == '\0')
+                            break;
+                        if (*end != ',' || i == 2) {
+                            loss = -1;
+                            break;
+                        }
+                        s = end + 1;
+                    }
+                }
+                break;
             default:
-                fprintf(stderr, "Usage: %s -p <port>\n", argv[0]);
+                fprintf(stderr, "Usage: %s -p <port> [-n <listeners>] [-b <backlog>] "
+                        "[-w <workers> [-P]] [-c <schedulers>] [-u] [-S <seed>] [-M <metrics port>] [-T <trace file>] [-r <record file>] [-U <udp port> [-L <loss>[,<reorder>[,<dup>]]]] [-m <shm socket>] [-G <rooms>] [-X <players per room>] [-z <rows>x<cols>] [-a <admin socket>] [-H <handoff socket>] "
+                        "[-R <handoff socket to take over>]\n", argv[0]);
                 exit(EXIT_FAILURE);
         }
     }
 
-    if (port <= 0) {
+    if (port <= 0 && !resume_path) {
         fprintf(stderr, "Error: Port number required via -p <port>\n");
         exit(EXIT_FAILURE);
     }
+    if (nlisteners <= 0 || nlisteners > LISTENER_MAX)
+        nlisteners = nlisteners <= 0 ? 1 : LISTENER_MAX;
+    if (backlog <= 0)
+        backlog = SOMAXCONN;
+    if (nworkers < 0 || nworkers > POOL_MAX_WORKERS)
+        nworkers = nworkers < 0 ? 0 : POOL_MAX_WORKERS;
+    if (nscheds > CORO_MAX_SCHEDULERS)
+        nscheds = CORO_MAX_SCHEDULERS;
+    if (handoff_path && use_uring) {
+        // Received bytes of a partial packet live in the backend's buffers,
+        // so a handoff could not pass them on.
+        fprintf(stderr, "Error: -H is not supported with the io_uring backend\n");
+        exit(EXIT_FAILURE);
+    }
+    if (handoff_path && nscheds) {
+        // A coroutine can be suspended half way through reading a packet.
+        fprintf(stderr, "Error: -H is not supported with coroutines\n");
+        exit(EXIT_FAILURE);
+    }
+    if (loss < 0 || loss > 100 || reorder < 0 || reorder > 100 || dup < 0 || dup > 100) {
+        fprintf(stderr, "Error: -L takes <loss>[,<reorder>[,<dup>]], each a percentage from 0 to 100\n");
+        exit(EXIT_FAILURE);
+    }
+    if (handoff_path && shm_path) {
+        // The rings are mapped in this process only.
+        fprintf(stderr, "Error: -H is not supported with shared-memory clients\n");
+        exit(EXIT_FAILURE);
+    }
+    if (nrooms < 1 || nrooms > ROOM_MAX) {
+        fprintf(stderr, "Error: -G must be from 1 to %d\n", ROOM_MAX);
+        exit(EXIT_FAILURE);
+    }
+    if (large < 0 || large > ROOM_IDS_MAX) {
+        fprintf(stderr, "Error: -X must be from 0 (off) to %d\n", ROOM_IDS_MAX);
+        exit(EXIT_FAILURE);
+    }
+    if (maze_rows < 0 || (maze_rows && (maze_rows < 3 || maze_cols < 3))) {
+        fprintf(stderr, "Error: -z takes <rows>x<cols>, each at least 3\n");
+        exit(EXIT_FAILURE);
+    }
+    if ((handoff_path || resume_path) && (nrooms > 1 || large)) {
+        // The handoff carries one maze and one players table, and players
+        // in the maze snapshot by their letters.
+        fprintf(stderr, "Error: -H and -R are not supported with more than one room or with -X\n");
+        exit(EXIT_FAILURE);
+    }
+    if (handoff_path && resume_path && !strcmp(handoff_path, resume_path)) {
+        fprintf(stderr, "Error: -H and -R must name different sockets\n");
+        exit(EXIT_FAILURE);
+    }
 
+    // SIGHUP and SIGUSR2 are only taken by the main thread, which waits
+    // for them below; every other thread inherits this mask.
+    sigset_t hup;
+    sigemptyset(&hup);
+    sigaddset(&hup, SIGHUP);
+    sigaddset(&hup, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &hup, NULL);
+
+    log_init();
+    rng_init(seed, fixed_seed);
+    if (trace_file && trace_init(trace_file) < 0)
+        exit(EXIT_FAILURE);
+    if (record_path && record_init(record_path) < 0)
+        exit(EXIT_FAILURE);
     client_registry = creg_init();
-    maze_init(default_maze);
-    player_init();
-    debug_show_maze = 1;
+    room_init(nrooms, large);
 
     struct sigaction sa;
     sa.sa_handler = handle_sighup;
@@ -76,59 +273,73 @@ int main(int argc, char *argv[]) {
         terminate(EXIT_FAILURE);
     }
 
-    int server_fd;
-    struct sockaddr_in server_addr;
-
-    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        perror("socket");
+    sa.sa_handler = handle_sigusr2;
+    if (sigaction(SIGUSR2, &sa, NULL) < 0) {
+        perror("sigaction");
         terminate(EXIT_FAILURE);
     }
 
-    int optval = 1;
-    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+    // Writes to a client that has gone away must fail with EPIPE, not kill us.
+    sa.sa_handler = SIG_IGN;
+    if (sigaction(SIGPIPE, &sa, NULL) < 0) {
+        perror("sigaction");
+        terminate(EXIT_FAILURE);
+    }
 
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    server_addr.sin_port = htons(port);
+    int listen_fds[LISTENER_MAX];
+    int nlisten;
 
-    if (bind(server_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        perror("bind");
-        close(server_fd);
+    // Enable handoff before any thread that could block waiting for input
+    // is started, so that every such thread can be parked.
+    if (handoff_path && handoff_listen(handoff_path) < 0)
         terminate(EXIT_FAILURE);
+    if (mzw_executor_init(nworkers, pin_workers, use_uring, nscheds) < 0)
+        terminate(EXIT_FAILURE);
+
+    // Inherited clients are served as soon as the state is restored, so
+    // signal dispositions must already be in place.
+    if (resume_path) {
+        if ((nlisten = handoff_resume(resume_path, listen_fds, LISTENER_MAX)) <= 0)
+            terminate(EXIT_FAILURE);
+    } else {
+        if (maze_rows) {
+            char **template = maze_generate(maze_rows, maze_cols);
+            if (!template)
+                terminate(EXIT_FAILURE);
+            maze_init(template);
+            maze_template_free(template);
+        } else {
+            maze_init(default_maze);
+        }
+        player_init();
+        if ((nlisten = listener_open(port, nlisteners, backlog, listen_fds)) < 0)
+            terminate(EXIT_FAILURE);
+        info("MazeWar server listening on port %d (%d sockets)", port, nlisten);
     }
 
-    if (listen(server_fd, 5) < 0) {
-        perror("listen");
-        close(server_fd);
+    if (udp_port > 0 && udp_init(udp_port, loss, reorder, dup) < 0)
+        terminate(EXIT_FAILURE);
+    if (admin_path && admin_init(admin_path) < 0)
+        terminate(EXIT_FAILURE);
+    if (metrics_port > 0 && metrics_init(metrics_port) < 0)
         terminate(EXIT_FAILURE);
-    }
 
-    info("MazeWar server listening on port %d", port);
+    if (listener_start(listen_fds, nlisten, SOCK_CLOEXEC, start_client) < 0)
+        terminate(EXIT_FAILURE);
+    if (shm_path && shm_init(shm_path, start_client) < 0)
+        terminate(EXIT_FAILURE);
+    handoff_ready();
 
+    // The accept threads do the rest; this thread just waits for SIGHUP,
+    // and prints the lock report on SIGUSR2.
+    sigset_t none;
+    sigemptyset(&none);
     while (1) {
-        int *client_fd = malloc(sizeof(int));
-        if (!client_fd) {
-            error("malloc failed");
-            continue;
-        }
-
-        *client_fd = accept(server_fd, NULL, NULL);
-        if (*client_fd < 0) {
-            free(client_fd);
-            if (errno == EINTR) continue;
-            perror("accept");
-            continue;
-        }
-
-        pthread_t tid;
-        if (pthread_create(&tid, NULL, mzw_client_service, client_fd) != 0) {
-            error("pthread_create failed");
-            close(*client_fd);
-            free(client_fd);
-            continue;
+        sigsuspend(&none);
+        if (dump_locks) {
+            dump_locks = 0;
+            lockprof_show(stderr);
         }
-        pthread_detach(tid);
     }
 
     terminate(EXIT_SUCCESS);
@@ -140,20 +351,29 @@ int main(int argc, char *argv[]) {
  * Function called to cleanly shut down the server.
  */
 void terminate(int status) {
-    printf("[DEBUG] Entering terminate with status=%d\n", status);
+    log_trace("Entering terminate with status=%d", status);
 
+    listener_fini();
+    shm_fini();
+    handoff_fini();
+    admin_fini();
+    metrics_fini();
     creg_shutdown_all(client_registry);
     debug("Waiting for service threads to terminate...");
     creg_wait_for_empty(client_registry);
     debug("All service threads terminated.");
 
     creg_fini(client_registry);
+    udp_fini();
+    record_fini();
     player_fini();
     maze_fini();
+    trace_fini();
 
     debug("MazeWar server terminating");
+    log_fini();
 
-    printf("[DEBUG] Exiting terminate with status=%d\n", status);
+    log_trace("Exiting terminate with status=%d", status);
     exit(status);
 }
 
@@ -1,37 +1,109 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <pthread.h>
 #include "maze.h"
+#include "maze_ext.h"
+#include "room.h"
+#include "rng.h"
+#include "lockprof.h"
+#include "trace.h"
 #include "debug.h"
+#include "log.h"
 
-static OBJECT **maze = NULL;
+/*
+ * Every room has its own copy of the maze and its own lock, on a cache
+ * line of its own; all copies have the same size.  The cells hold only
+ * walls and empty space.  Where the players are is kept apart, by id, so
+ * that ids are not limited to what fits in a cell, together with the
+ * letter each player is drawn as.
+ */
+struct maze_room {
+    _Alignas(64) pthread_mutex_t mutex;
+    OBJECT **cells;
+    uint16_t *occupant;             // rows * cols player ids, 0 for none
+    OBJECT *hint;                   // letter of each id, by id
+};
+
+static struct maze_room mazes[ROOM_MAX] = {
+    [0 ... ROOM_MAX - 1] = { .mutex = PTHREAD_MUTEX_INITIALIZER }
+};
 static int rows = 0;
 static int cols = 0;
-static pthread_mutex_t maze_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static const int dr[] = { -1, 0, 1, 0 };
+static const int dc[] = { 0, -1, 0, 1 };
+
+static inline struct maze_room *current(void) {
+    return &mazes[room_current];
+}
+
+/*
+ * The id of the player with a letter, for the interface of maze.h, in
+ * which players are known by their letters.
+ */
+static inline int letter_id(OBJECT avatar) {
+    return avatar - 'A' + 1;
+}
+
+static inline int in_maze(int row, int col) {
+    return row >= 0 && row < rows && col >= 0 && col < cols;
+}
+
+/*
+ * What a cell shows: its player's letter, or the cell itself.  Called with
+ * the maze locked.
+ */
+static inline OBJECT cell_at(struct maze_room *m, int row, int col) {
+    int id = m->occupant[row * cols + col];
+    return id ? m->hint[id] : m->cells[row][col];
+}
 
 void maze_init(char **template) {
-    printf("[DEBUG] Entering maze_init\n");
+    log_trace("Entering maze_init");
     rows = 0;
     while (template[rows] != NULL) rows++;
     cols = strlen(template[0]);
 
-    maze = malloc(rows * sizeof(OBJECT *));
-    for (int r = 0; r < rows; r++) {
-        maze[r] = malloc(cols * sizeof(OBJECT));
-        memcpy(maze[r], template[r], cols);
+    for (int i = 0; i < room_count(); i++) {
+        struct maze_room *m = &mazes[i];
+        m->cells = malloc(rows * sizeof(OBJECT *));
+        m->occupant = calloc(rows * cols, sizeof(*m->occupant));
+        m->hint = calloc(room_capacity() + 1, sizeof(*m->hint));
+        for (int r = 0; r < rows; r++) {
+            m->cells[r] = malloc(cols * sizeof(OBJECT));
+            memcpy(m->cells[r], template[r], cols);
+            // Letters in the template (as in a handoff's snapshot) are
+            // players already placed.
+            for (int c = 0; c < cols; c++) {
+                OBJECT obj = m->cells[r][c];
+                if (IS_AVATAR(obj) && letter_id(obj) <= room_capacity()) {
+                    m->occupant[r * cols + c] = letter_id(obj);
+                    m->hint[letter_id(obj)] = obj;
+                    m->cells[r][c] = EMPTY;
+                }
+            }
+        }
     }
-    printf("[DEBUG] Maze initialized with %d rows and %d cols\n", rows, cols);
+    log_debug("Maze initialized with %d rows and %d cols", rows, cols);
 }
 
 void maze_fini() {
-    printf("[DEBUG] Entering maze_fini\n");
-    if (!maze) return;
-    for (int r = 0; r < rows; r++)
-        free(maze[r]);
-    free(maze);
-    maze = NULL;
-    printf("[DEBUG] Maze finalized\n");
+    log_trace("Entering maze_fini");
+    for (int i = 0; i < ROOM_MAX; i++) {
+        struct maze_room *m = &mazes[i];
+        if (!m->cells) continue;
+        for (int r = 0; r < rows; r++)
+            free(m->cells[r]);
+        free(m->cells);
+        free(m->occupant);
+        free(m->hint);
+        m->cells = NULL;
+        m->occupant = NULL;
+        m->hint = NULL;
+    }
+    log_debug("Maze finalized");
 }
 
 int maze_get_rows() {
@@ -42,146 +114,261 @@ int maze_get_cols() {
     return cols;
 }
 
-int maze_set_player(OBJECT avatar, int row, int col) {
-    printf("[DEBUG] Entering maze_set_player: avatar=%c, row=%d, col=%d\n", avatar, row, col);
-    pthread_mutex_lock(&maze_mutex);
-    if (row < 0 || row >= rows || col < 0 || col >= cols || !IS_EMPTY(maze[row][col])) {
-        pthread_mutex_unlock(&maze_mutex);
+int maze_place(int id, OBJECT avatar, int row, int col) {
+    TRACE_SCOPE("maze_place");
+    log_trace("Entering maze_place: id=%d, avatar=%c, row=%d, col=%d", id, avatar, row, col);
+    struct maze_room *m = current();
+    PROF_LOCK(&m->mutex, LOCK_MAZE);
+    if (id < 1 || id > room_capacity() || !in_maze(row, col) ||
+        !IS_EMPTY(m->cells[row][col]) || m->occupant[row * cols + col]) {
+        PROF_UNLOCK(&m->mutex, LOCK_MAZE);
         return -1;
     }
-    maze[row][col] = avatar;
-    pthread_mutex_unlock(&maze_mutex);
-    printf("[DEBUG] Player %c placed at (%d, %d)\n", avatar, row, col);
+    m->occupant[row * cols + col] = id;
+    m->hint[id] = avatar;
+    PROF_UNLOCK(&m->mutex, LOCK_MAZE);
+    log_debug("Player %d (%c) placed at (%d, %d)", id, avatar, row, col);
     return 0;
 }
 
-int maze_set_player_random(OBJECT avatar, int *rowp, int *colp) {
-    printf("[DEBUG] Entering maze_set_player_random for avatar %c\n", avatar);
+int maze_set_player(OBJECT avatar, int row, int col) {
+    return maze_place(letter_id(avatar), avatar, row, col);
+}
+
+int maze_place_random(int id, OBJECT avatar, int *rowp, int *colp) {
+    TRACE_SCOPE("maze_place_random");
+    log_trace("Entering maze_place_random for player %d", id);
     const int MAX_ATTEMPTS = 1000;
     for (int attempts = 0; attempts < MAX_ATTEMPTS; attempts++) {
-        int r = rand() % rows;
-        int c = rand() % cols;
-        if (maze_set_player(avatar, r, c) == 0) {
+        int r = rng_below(rows);
+        int c = rng_below(cols);
+        if (maze_place(id, avatar, r, c) == 0) {
             if (rowp) *rowp = r;
             if (colp) *colp = c;
-            printf("[DEBUG] Successfully placed avatar %c at random (%d, %d)\n", avatar, r, c);
+            log_debug("Successfully placed player %d at random (%d, %d)", id, r, c);
             return 0;
         }
     }
-    printf("[DEBUG] Failed to place avatar %c randomly after %d attempts\n", avatar, MAX_ATTEMPTS);
+    log_debug("Failed to place player %d randomly after %d attempts", id, MAX_ATTEMPTS);
     return -1;
 }
 
-void maze_remove_player(OBJECT avatar, int row, int col) {
-    printf("[DEBUG] Entering maze_remove_player: avatar=%c, row=%d, col=%d\n", avatar, row, col);
-    pthread_mutex_lock(&maze_mutex);
-    if (row >= 0 && row < rows && col >= 0 && col < cols && maze[row][col] == avatar) {
-        maze[row][col] = EMPTY;
-        printf("[DEBUG] Removed avatar %c from (%d, %d)\n", avatar, row, col);
+int maze_set_player_random(OBJECT avatar, int *rowp, int *colp) {
+    return maze_place_random(letter_id(avatar), avatar, rowp, colp);
+}
+
+void maze_remove(int id, int row, int col) {
+    TRACE_SCOPE("maze_remove");
+    log_trace("Entering maze_remove: id=%d, row=%d, col=%d", id, row, col);
+    struct maze_room *m = current();
+    PROF_LOCK(&m->mutex, LOCK_MAZE);
+    if (in_maze(row, col) && m->occupant[row * cols + col] == id) {
+        m->occupant[row * cols + col] = 0;
+        log_debug("Removed player %d from (%d, %d)", id, row, col);
     }
-    pthread_mutex_unlock(&maze_mutex);
+    PROF_UNLOCK(&m->mutex, LOCK_MAZE);
+}
+
+void maze_remove_player(OBJECT avatar, int row, int col) {
+    maze_remove(letter_id(avatar), row, col);
 }
 
 int maze_move(int row, int col, int dir) {
-    printf("[DEBUG] Entering maze_move from (%d, %d) in dir=%d\n", row, col, dir);
-    int dr[] = { -1, 0, 1, 0 };
-    int dc[] = { 0, -1, 0, 1 };
+    TRACE_SCOPE("maze_move");
+    log_trace("Entering maze_move from (%d, %d) in dir=%d", row, col, dir);
+    struct maze_room *m = current();
 
-    pthread_mutex_lock(&maze_mutex);
-    if (row < 0 || row >= rows || col < 0 || col >= cols || IS_EMPTY(maze[row][col]) || !IS_AVATAR(maze[row][col])) {
-        pthread_mutex_unlock(&maze_mutex);
+    PROF_LOCK(&m->mutex, LOCK_MAZE);
+    if (!in_maze(row, col) || !m->occupant[row * cols + col]) {
+        PROF_UNLOCK(&m->mutex, LOCK_MAZE);
         return -1;
     }
 
     int new_row = row + dr[dir];
     int new_col = col + dc[dir];
 
-    if (new_row < 0 || new_row >= rows || new_col < 0 || new_col >= cols || !IS_EMPTY(maze[new_row][new_col])) {
-        pthread_mutex_unlock(&maze_mutex);
+    if (!in_maze(new_row, new_col) || !IS_EMPTY(m->cells[new_row][new_col]) ||
+        m->occupant[new_row * cols + new_col]) {
+        PROF_UNLOCK(&m->mutex, LOCK_MAZE);
         return -1;
     }
 
-    maze[new_row][new_col] = maze[row][col];
-    maze[row][col] = EMPTY;
-    pthread_mutex_unlock(&maze_mutex);
-    printf("[DEBUG] Moved player to (%d, %d)\n", new_row, new_col);
+    m->occupant[new_row * cols + new_col] = m->occupant[row * cols + col];
+    m->occupant[row * cols + col] = 0;
+    PROF_UNLOCK(&m->mutex, LOCK_MAZE);
+    log_debug("Moved player to (%d, %d)", new_row, new_col);
     return 0;
 }
 
-OBJECT maze_find_target(int row, int col, DIRECTION dir) {
-    printf("[DEBUG] Entering maze_find_target from (%d, %d) dir=%d\n", row, col, dir);
-    int dr[] = { -1, 0, 1, 0 };
-    int dc[] = { 0, -1, 0, 1 };
-
-    pthread_mutex_lock(&maze_mutex);
+/*
+ * The id of the first player in a direction, or 0 if a wall or the edge
+ * comes first.  Called with the maze locked.
+ */
+static int find_target(struct maze_room *m, int row, int col, DIRECTION dir) {
     while (1) {
         row += dr[dir];
         col += dc[dir];
 
-        if (row < 0 || row >= rows || col < 0 || col >= cols) {
-            pthread_mutex_unlock(&maze_mutex);
-            return EMPTY;
-        }
-        if (!IS_EMPTY(maze[row][col])) {
-            OBJECT found = maze[row][col];
-            pthread_mutex_unlock(&maze_mutex);
-            printf("[DEBUG] Found object '%c' at (%d, %d)\n", found, row, col);
-            return IS_AVATAR(found) ? found : EMPTY;
+        if (!in_maze(row, col))
+            return 0;
+        if (m->occupant[row * cols + col]) {
+            log_debug("Found player %d at (%d, %d)", m->occupant[row * cols + col], row, col);
+            return m->occupant[row * cols + col];
         }
+        if (!IS_EMPTY(m->cells[row][col]))
+            return 0;
     }
 }
 
+int maze_find_target_id(int row, int col, DIRECTION dir) {
+    TRACE_SCOPE("maze_find_target");
+    log_trace("Entering maze_find_target_id from (%d, %d) dir=%d", row, col, dir);
+    struct maze_room *m = current();
+
+    PROF_LOCK(&m->mutex, LOCK_MAZE);
+    int id = find_target(m, row, col, dir);
+    PROF_UNLOCK(&m->mutex, LOCK_MAZE);
+    return id;
+}
+
+OBJECT maze_find_target(int row, int col, DIRECTION dir) {
+    TRACE_SCOPE("maze_find_target");
+    log_trace("Entering maze_find_target from (%d, %d) dir=%d", row, col, dir);
+    struct maze_room *m = current();
+
+    PROF_LOCK(&m->mutex, LOCK_MAZE);
+    int id = find_target(m, row, col, dir);
+    OBJECT found = id ? m->hint[id] : EMPTY;
+    PROF_UNLOCK(&m->mutex, LOCK_MAZE);
+    return found;
+}
+
 int maze_get_view(VIEW *view, int row, int col, DIRECTION gaze, int depth) {
-    printf("[DEBUG] Entering maze_get_view at (%d, %d) gaze=%d depth=%d\n", row, col, gaze, depth);
-    int dr[] = { -1, 0, 1, 0 };
-    int dc[] = { 0, -1, 0, 1 };
+    TRACE_SCOPE("maze_get_view");
+    log_trace("Entering maze_get_view at (%d, %d) gaze=%d depth=%d", row, col, gaze, depth);
+    struct maze_room *m = current();
+    DIRECTION left = TURN_LEFT(gaze);
+    DIRECTION right = TURN_RIGHT(gaze);
 
-    pthread_mutex_lock(&maze_mutex);
+    PROF_LOCK(&m->mutex, LOCK_MAZE);
 
     int actual_depth = 0;
     for (int d = 0; d < depth; d++) {
         int pos_row = row + dr[gaze] * d;
         int pos_col = col + dc[gaze] * d;
 
-        if (pos_row < 0 || pos_row >= rows || pos_col < 0 || pos_col >= cols) {
+        if (!in_maze(pos_row, pos_col)) {
             break;
         }
 
-        (*view)[d][CORRIDOR] = maze[pos_row][pos_col];
+        (*view)[d][CORRIDOR] = cell_at(m, pos_row, pos_col);
 
-        DIRECTION left = TURN_LEFT(gaze);
         int lw_row = pos_row + dr[left];
         int lw_col = pos_col + dc[left];
-        (*view)[d][LEFT_WALL] = (lw_row >= 0 && lw_row < rows && lw_col >= 0 && lw_col < cols) ? maze[lw_row][lw_col] : '*';
+        (*view)[d][LEFT_WALL] = in_maze(lw_row, lw_col) ? cell_at(m, lw_row, lw_col) : '*';
 
-        DIRECTION right = TURN_RIGHT(gaze);
         int rw_row = pos_row + dr[right];
         int rw_col = pos_col + dc[right];
-        (*view)[d][RIGHT_WALL] = (rw_row >= 0 && rw_row < rows && rw_col >= 0 && rw_col < cols) ? maze[rw_row][rw_col] : '*';
+        (*view)[d][RIGHT_WALL] = in_maze(rw_row, rw_col) ? cell_at(m, rw_row, rw_col) : '*';
 
         actual_depth++;
     }
 
-    pthread_mutex_unlock(&maze_mutex);
-    printf("[DEBUG] Completed maze_get_view with depth=%d\n", actual_depth);
+    PROF_UNLOCK(&m->mutex, LOCK_MAZE);
+    log_debug("Completed maze_get_view with depth=%d", actual_depth);
     return actual_depth;
 }
 
+int maze_watchers(int row, int col, int *ids, int max) {
+    TRACE_SCOPE("maze_watchers");
+    struct maze_room *m = current();
+    const int reach = VIEW_DEPTH - 1;
+    int n = 0;
+
+    // A view is a strip three cells wide, so the cell is seen from within
+    // reach along its row or column, or along the rows or columns beside.
+    PROF_LOCK(&m->mutex, LOCK_MAZE);
+    for (int r = row - 1; r <= row + 1; r++) {
+        for (int c = col - reach; c <= col + reach && n < max; c++) {
+            if (in_maze(r, c) && m->occupant[r * cols + c])
+                ids[n++] = m->occupant[r * cols + c];
+        }
+    }
+    for (int c = col - 1; c <= col + 1; c++) {
+        for (int r = row - reach; r <= row + reach && n < max; r++) {
+            if (r >= row - 1 && r <= row + 1)
+                continue;
+            if (in_maze(r, c) && m->occupant[r * cols + c])
+                ids[n++] = m->occupant[r * cols + c];
+        }
+    }
+    PROF_UNLOCK(&m->mutex, LOCK_MAZE);
+    return n;
+}
+
+char **maze_generate(int nrows, int ncols) {
+    char **template = malloc((nrows + 1) * sizeof(char *));
+
+    if (!template)
+        return NULL;
+    for (int r = 0; r < nrows; r++) {
+        template[r] = malloc(ncols + 1);
+        if (!template[r]) {
+            while (r-- > 0)
+                free(template[r]);
+            free(template);
+            return NULL;
+        }
+        for (int c = 0; c < ncols; c++) {
+            int border = r == 0 || c == 0 || r == nrows - 1 || c == ncols - 1;
+            template[r][c] = border ? '*' : rng_below(100) < 20 ? '#' : ' ';
+        }
+        template[r][ncols] = '\0';
+    }
+    template[nrows] = NULL;
+    return template;
+}
+
+void maze_template_free(char **template) {
+    for (int r = 0; template[r]; r++)
+        free(template[r]);
+    free(template);
+}
+
 void show_view(VIEW *view, int depth) {
-    printf("[DEBUG] Showing view with depth=%d\n", depth);
+    log_debug("Showing view with depth=%d", depth);
     for (int d = 0; d < depth; d++) {
         fprintf(stderr, "%c %c %c\n", (*view)[d][LEFT_WALL], (*view)[d][CORRIDOR], (*view)[d][RIGHT_WALL]);
     }
 }
 
 void show_maze() {
-    printf("[DEBUG] Showing entire maze\n");
-    pthread_mutex_lock(&maze_mutex);
+    log_debug("Showing entire maze");
+    maze_show(stderr);
+}
+
+void maze_show(FILE *out) {
+    struct maze_room *m = current();
+    PROF_LOCK(&m->mutex, LOCK_MAZE);
     for (int r = 0; r < rows; r++) {
-        for (int c = 0; c < cols; c++) {
-            fputc(maze[r][c], stderr);
-        }
-        fputc('\n', stderr);
+        for (int c = 0; c < cols; c++)
+            fputc(cell_at(m, r, c), out);
+        fputc('\n', out);
     }
-    pthread_mutex_unlock(&maze_mutex);
+    PROF_UNLOCK(&m->mutex, LOCK_MAZE);
+}
+
+int maze_snapshot(char *buf, int size) {
+    struct maze_room *m = current();
+    PROF_LOCK(&m->mutex, LOCK_MAZE);
+    if (size < rows * cols) {
+        PROF_UNLOCK(&m->mutex, LOCK_MAZE);
+        return -1;
+    }
+    for (int r = 0; r < rows; r++)
+        for (int c = 0; c < cols; c++)
+            buf[r * cols + c] = cell_at(m, r, c);
+    int n = rows * cols;
+    PROF_UNLOCK(&m->mutex, LOCK_MAZE);
+    return n;
 }
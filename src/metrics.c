@@ -0,0 +1,226 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "metrics.h"
+#include "client_registry.h"
+#include "client_registry_ext.h"
+#include "latency.h"
+#include "debug.h"
+#include "log.h"
+
+#define HTTP_REQUEST_MAX 2048
+#define HTTP_TIMEOUT_SEC 2              // a scraper that stalls is dropped
+
+extern CLIENT_REGISTRY *client_registry;
+
+__thread struct metrics_shard *metrics_thread_shard = NULL;
+
+static struct metrics_shard shards[METRICS_SHARDS];
+static atomic_uint next_shard = 0;
+
+static int http_fd = -1;
+static pthread_t http_tid;
+
+static const char *packet_names[METRICS_PKT_TYPES] = {
+    "other", "login", "move", "turn", "fire", "refresh", "send",
+    "ready", "inuse", "clear", "show", "alert", "score", "chat", "view",
+    "score_id"
+};
+
+struct metrics_shard *metrics_shard_assign(void) {
+    unsigned int i = atomic_fetch_add_explicit(&next_shard, 1, memory_order_relaxed);
+    return metrics_thread_shard = &shards[i % METRICS_SHARDS];
+}
+
+static long metric_sum(enum metric m) {
+    long sum = 0;
+    for (int i = 0; i < METRICS_SHARDS; i++)
+        sum += atomic_load_explicit(&shards[i].value[m], memory_order_relaxed);
+    return sum;
+}
+
+static void show_header(FILE *out, const char *name, const char *type, const char *help) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void show_metric(FILE *out, const char *name, const char *type, const char *help,
+                        enum metric m) {
+    show_header(out, name, type, help);
+    fprintf(out, "%s %ld\n", name, metric_sum(m));
+}
+
+static void show_packets(FILE *out, const char *name, const char *help, enum metric base) {
+    show_header(out, name, "counter", help);
+    for (int t = 0; t < METRICS_PKT_TYPES; t++) {
+        long n = metric_sum(base + t);
+        if (packet_names[t] && (t > 0 || n > 0))
+            fprintf(out, "%s{type=\"%s\"} %ld\n", name, packet_names[t], n);
+    }
+}
+
+void metrics_show(FILE *out) {
+    show_packets(out, "mazewar_packets_received_total", "Packets received from clients.",
+                 METRIC_PACKETS_IN);
+    show_packets(out, "mazewar_packets_sent_total", "Packets sent to clients.",
+                 METRIC_PACKETS_OUT);
+    show_metric(out, "mazewar_received_bytes_total", "counter",
+                "Bytes received from clients, headers included.", METRIC_BYTES_IN);
+    show_metric(out, "mazewar_sent_bytes_total", "counter",
+                "Bytes sent to clients, headers included.", METRIC_BYTES_OUT);
+
+    show_header(out, "mazewar_view_refreshes_total", "counter",
+                "Views sent, full after an invalidation or incremental after a move.");
+    fprintf(out, "mazewar_view_refreshes_total{kind=\"full\"} %ld\n",
+            metric_sum(METRIC_VIEW_FULL));
+    fprintf(out, "mazewar_view_refreshes_total{kind=\"incremental\"} %ld\n",
+            metric_sum(METRIC_VIEW_INCREMENTAL));
+    show_metric(out, "mazewar_view_updates_deferred_total", "counter",
+                "View updates held back by a client's rate limit and coalesced into a later view.",
+                METRIC_VIEW_DEFERRED);
+
+    show_metric(out, "mazewar_laser_hits_total", "counter",
+                "Laser shots that hit a player.", METRIC_LASER_HITS);
+    show_metric(out, "mazewar_logins_total", "counter",
+                "Successful logins.", METRIC_LOGINS);
+    show_metric(out, "mazewar_logins_inuse_total", "counter",
+                "Logins refused because the avatar was in use.", METRIC_LOGINS_INUSE);
+    show_metric(out, "mazewar_send_stalls_total", "counter",
+                "Waits for a full socket send buffer to drain.", METRIC_SEND_STALLS);
+
+    show_header(out, "mazewar_send_stall_seconds_total", "counter",
+                "Time spent waiting for full socket send buffers to drain.");
+    fprintf(out, "mazewar_send_stall_seconds_total %.9f\n",
+            metric_sum(METRIC_SEND_STALL_NS) / 1e9);
+    show_metric(out, "mazewar_send_drops_total", "counter",
+                "Clients dropped because their send buffer stayed full.", METRIC_SEND_DROPS);
+
+    show_metric(out, "mazewar_players", "gauge", "Players logged in.", METRIC_PLAYERS);
+    show_header(out, "mazewar_connections", "gauge", "Registered client connections.");
+    fprintf(out, "mazewar_connections %d\n", client_registry ? creg_count(client_registry) : 0);
+    latency_show_metrics(out);
+}
+
+/*
+ * Serve one HTTP request.  Only GET /metrics is answered; the connection is
+ * closed after the response.
+ */
+static void http_session(int fd) {
+    struct timeval tv = { .tv_sec = HTTP_TIMEOUT_SEC };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    char req[HTTP_REQUEST_MAX + 1];
+    size_t len = 0;
+    while (len < HTTP_REQUEST_MAX) {
+        ssize_t n = read(fd, req + len, HTTP_REQUEST_MAX - len);
+        if (n <= 0)
+            return;
+        len += n;
+        req[len] = '\0';
+        if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n"))
+            break;
+    }
+
+    char *body = NULL;
+    size_t body_len = 0;
+    FILE *out = open_memstream(&body, &body_len);
+    if (!out)
+        return;
+    const char *status = "200 OK";
+    if (!strncmp(req, "GET /metrics ", 13) || !strncmp(req, "GET /metrics?", 13)) {
+        metrics_show(out);
+    } else {
+        status = "404 Not Found";
+        fprintf(out, "not found; try /metrics\n");
+    }
+    fclose(out);
+
+    char header[256];
+    int hlen = snprintf(header, sizeof(header),
+                        "HTTP/1.0 %s\r\n"
+                        "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+                        "Content-Length: %zu\r\n"
+                        "Connection: close\r\n\r\n", status, body_len);
+    if (write(fd, header, hlen) == hlen) {
+        size_t sent = 0;
+        while (sent < body_len) {
+            ssize_t n = write(fd, body + sent, body_len - sent);
+            if (n <= 0)
+                break;
+            sent += n;
+        }
+    }
+    free(body);
+}
+
+static void *http_thread(void *arg) {
+    while (1) {
+        int fd = accept4(http_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break;  // listening socket shut down by metrics_fini()
+        }
+        http_session(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+int metrics_init(int port) {
+    struct sockaddr_in addr;
+
+    if ((http_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    // SO_REUSEPORT lets a server taking over through a handoff bind the
+    // port while the old one is still answering on it.
+    int optval = 1;
+    setsockopt(http_fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+    setsockopt(http_fd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+
+    if (bind(http_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(http_fd, 16) < 0) {
+        perror("metrics socket");
+        close(http_fd);
+        http_fd = -1;
+        return -1;
+    }
+
+    if (pthread_create(&http_tid, NULL, http_thread, NULL) != 0) {
+        error("Failed to start metrics thread");
+        close(http_fd);
+        http_fd = -1;
+        return -1;
+    }
+
+    info("Metrics served on http://127.0.0.1:%d/metrics", port);
+    return 0;
+}
+
+void metrics_fini(void) {
+    if (http_fd < 0)
+        return;
+
+    shutdown(http_fd, SHUT_RDWR);
+    pthread_join(http_tid, NULL);
+    close(http_fd);
+    http_fd = -1;
+}
@@ -3,33 +3,251 @@
 #include <string.h>
 #include <pthread.h>
 #include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
 #include "player.h"
+#include "player_ext.h"
+#include "client_registry_ext.h"
 #include "protocol.h"
+#include "protocol_ext.h"
 #include "maze.h"
+#include "maze_ext.h"
 #include "debug.h"
-#include <unistd.h>  // for sleep()
-
-const char *player_get_name(PLAYER *player);
-#define MAX_PLAYERS 26  // one avatar per letter A-Z
-
+#include "log.h"
+#include "coro.h"
+#include "slab.h"
+#include "metrics.h"
+#include "lockprof.h"
+#include "trace.h"
+#include "udp.h"
+#include "room.h"
+#include "handoff.h"
+#include <unistd.h>
+
+/*
+ * Fields are grouped by which threads write them, one group per cache line,
+ * so that writes from other threads do not invalidate the line the owner
+ * reads on every packet.
+ */
 struct player {
-    OBJECT avatar;
-    char *name;
+    // Taken by every thread that sends to this player, together with the
+    // fields read on every packet.  The shooter's thread writes hit_flag,
+    // but only on a hit.
+    _Alignas(64) pthread_mutex_t mutex;  // must be recursive
     int fd;
-    int score;
     int row, col;
     DIRECTION dir;
-    char (*view)[VIEW_WIDTH];  // pointer to 2D array
-    pthread_mutex_t mutex;  // must be recursive
-    int ref_count;
+    OBJECT avatar;
     volatile sig_atomic_t hit_flag;  // set by SIGUSR1
+
+    // Changed by every thread that looks the player up.
+    _Alignas(64) atomic_int ref_count;
+
+    // Rewritten by every view update.
+    _Alignas(64) char view[VIEW_DEPTH][VIEW_WIDTH];
+    int view_depth;                 // of the view last sent
+    int view_flags;                 // MZW_LOGIN_COMPACT_VIEW
+    int view_max_depth;             // 0 for VIEW_DEPTH
+    int view_max_rate;              // views per second, 0 for no limit
+    int view_pending;               // an update is held back by the rate limit
+    uint64_t view_sent_ns;          // when the last view was sent
+
+    // Cold: set at login, or changed only on a hit.
+    _Alignas(64) char *name;
+    int score;
+    int room;
+    int id;                         // 1 to room_capacity()
+    int list_pos;                   // in the room's list, under its mutex
     pthread_t thread_id;  // NEW: store the thread handling this player
+};
 
+_Static_assert(offsetof(struct player, hit_flag) + sizeof(sig_atomic_t) <= 64,
+               "hot player fields must fit in the mutex's cache line");
+
+
+/*
+ * Each room has its own players table and lock.  The table is indexed by
+ * id, and the list holds the same players densely, for broadcasts.  The
+ * arrays are read on every lookup, the lock only written, so they are kept
+ * on separate lines.
+ */
+struct player_room {
+    _Alignas(64) PLAYER **players;  // by id - 1
+    PLAYER **list;                  // count of them
+    int *free_ids;                  // large rooms: unused ids, lowest last
+    _Alignas(64) pthread_mutex_t mutex;
+    int count;                      // players logged in, under the mutex
+    int nfree;
 };
 
+/* Most players audience() can gather. */
+#define AUDIENCE_MAX (MAZE_WATCHERS_MAX + 1)
+
+_Static_assert(AUDIENCE_MAX >= MAX_PLAYERS, "a small room's audience is all of it");
+
+static const int dir_rows[] = { -1, 0, 1, 0 };
+static const int dir_cols[] = { 0, -1, 0, 1 };
+
+static struct player_room rooms[ROOM_MAX] = {
+    [0 ... ROOM_MAX - 1] = { .mutex = PTHREAD_MUTEX_INITIALIZER }
+};
+
+static struct slab_cache player_cache = SLAB_CACHE_INITIALIZER("player", sizeof(PLAYER));
+
+/*
+ * Views held back by a rate limit are sent by the flusher thread, which
+ * sleeps until the earliest of them is due or it is kicked by a player
+ * with a newly pending view.
+ */
+static pthread_once_t flusher_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t flusher_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flusher_cond;
+static pthread_t flusher_tid;
+static int flusher_started = 0, flusher_kicked = 0, flusher_stopping = 0;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Copy a name into a buffer from the slab buffer caches.
+ */
+static char *name_dup(const char *name) {
+    size_t len = strlen(name) + 1;
+    char *copy = slab_buf_alloc(len);
+    if (copy)
+        memcpy(copy, name, len);
+    return copy;
+}
+
+/*
+ * Look a player up by id in a room, taking a reference.
+ */
+static PLAYER *lookup(struct player_room *room, int id) {
+    PLAYER *p = NULL;
+
+    PROF_LOCK(&room->mutex, LOCK_PLAYERS);
+    if (id >= 1 && id <= room_capacity() && room->players[id - 1])
+        p = player_ref(room->players[id - 1], "lookup");
+    PROF_UNLOCK(&room->mutex, LOCK_PLAYERS);
+    return p;
+}
+
+/*
+ * Gather, with a reference each, the players to be told of something a
+ * player did at a cell: in a large room the player and those who could
+ * see the cell, otherwise everyone in the room.  The room must be the
+ * current one.
+ *
+ * @param out  Array of AUDIENCE_MAX elements to receive the players.
+ * @return  The number of players stored.
+ */
+static int audience(PLAYER *player, int row, int col, PLAYER **out) {
+    struct player_room *room = &rooms[player->room];
+    int ids[MAZE_WATCHERS_MAX];
+    int n = 0, nids = 0;
+
+    if (room_large())
+        nids = maze_watchers(row, col, ids, MAZE_WATCHERS_MAX);
+    PROF_LOCK(&room->mutex, LOCK_PLAYERS);
+    if (!room_large()) {
+        for (int i = 0; i < room->count; i++)
+            out[n++] = player_ref(room->list[i], "audience");
+    } else {
+        out[n++] = player_ref(player, "audience");
+        for (int i = 0; i < nids; i++) {
+            PLAYER *p = room->players[ids[i] - 1];
+            if (p && p != player)
+                out[n++] = player_ref(p, "audience");
+        }
+    }
+    PROF_UNLOCK(&room->mutex, LOCK_PLAYERS);
+    return n;
+}
+
+/*
+ * Check whether a cell is in a player's view: ahead of it, within its
+ * depth, and no more than one cell to either side.
+ */
+static int sees(PLAYER *viewer, int row, int col) {
+    PROF_LOCK(&viewer->mutex, LOCK_PLAYER);
+    int d = viewer->dir;
+    int ahead = (row - viewer->row) * dir_rows[d] + (col - viewer->col) * dir_cols[d];
+    int side = dir_rows[d] ? col - viewer->col : row - viewer->row;
+    int depth = viewer->view_max_depth ? viewer->view_max_depth : VIEW_DEPTH;
+    PROF_UNLOCK(&viewer->mutex, LOCK_PLAYER);
+    return ahead >= 0 && ahead < depth && side >= -1 && side <= 1;
+}
+
+/*
+ * Recompute and send the views of the players other than the given one
+ * that a change to a cell may have altered: everyone's, in a small room.
+ */
+static void refresh_watchers(PLAYER *player, int row, int col) {
+    PLAYER *to[AUDIENCE_MAX];
+    int n = audience(player, row, col, to);
+
+    for (int i = 0; i < n; i++) {
+        if (to[i] != player && (!room_large() || sees(to[i], row, col))) {
+            player_invalidate_view(to[i]);
+            player_update_view(to[i]);
+        }
+        player_unref(to[i], "refresh");
+    }
+}
+
+/*
+ * Send one player's score, or its removal if score is negative, to
+ * another, as a SCORE_ID packet if the recipient knows players by id and
+ * as a SCORE packet otherwise.
+ */
+static void send_score(PLAYER *to, PLAYER *subject, int score, const char *name) {
+    size_t len = name ? strlen(name) : 0;
+
+    if (to->view_flags & MZW_LOGIN_WIDE_ID) {
+        char payload[4 + PLAYER_NAME_MAX];
+        if (len > PLAYER_NAME_MAX)
+            len = PLAYER_NAME_MAX;
+        int value = score < 0 ? 0 : score;
+        payload[0] = subject->id >> 8;
+        payload[1] = subject->id & 0xff;
+        payload[2] = (value >> 8) & 0xff;
+        payload[3] = value & 0xff;
+        memcpy(payload + 4, name, len);
+        MZW_PACKET pkt = {
+            .type = MZW_SCORE_ID_PKT,
+            .param1 = subject->avatar,
+            .param2 = score < 0 ? -1 : 0,
+            .size = 4 + len
+        };
+        player_send_packet(to, &pkt, payload);
+    } else {
+        MZW_PACKET pkt = {
+            .type = MZW_SCORE_PKT,
+            .param1 = subject->avatar,
+            .param2 = score,
+            .size = len
+        };
+        player_send_packet(to, &pkt, len ? (void *)name : NULL);
+    }
+}
 
-static PLAYER *players[MAX_PLAYERS];
-static pthread_mutex_t players_mutex = PTHREAD_MUTEX_INITIALIZER;
+/*
+ * Send a player's score, and its name if given, to its audience.
+ */
+static void tell_score(PLAYER *player, int row, int col, int score, const char *name) {
+    PLAYER *to[AUDIENCE_MAX];
+    int n = audience(player, row, col, to);
+
+    for (int i = 0; i < n; i++) {
+        send_score(to[i], player, score, name);
+        player_unref(to[i], "score");
+    }
+}
 
 static void player_broadcast_name(PLAYER *player) {
     // if (!player || !player->name) return;
@@ -52,70 +270,95 @@ static void player_broadcast_name(PLAYER *player) {
 
 
 void player_init(void) {
-    printf("[DEBUG] Entering player_init\n");
-
-    for (int i = 0; i < MAX_PLAYERS; i++) {
-        players[i] = NULL;
+    log_trace("Entering player_init");
+
+    int capacity = room_capacity();
+    for (int r = 0; r < room_count(); r++) {
+        struct player_room *room = &rooms[r];
+        room->players = calloc(capacity, sizeof(*room->players));
+        room->list = calloc(capacity, sizeof(*room->list));
+        room->count = 0;
+        room->nfree = 0;
+        if (room_large()) {
+            room->free_ids = malloc(capacity * sizeof(*room->free_ids));
+            while (room->nfree < capacity) {
+                room->free_ids[room->nfree] = capacity - room->nfree;
+                room->nfree++;
+            }
+        }
     }
 
-    printf("[DEBUG] Exiting player_init\n");
+    log_trace("Exiting player_init");
 }
 
 void player_fini(void) {
-    printf("[DEBUG] Entering player_fini\n");
+    log_trace("Entering player_fini");
+
+    if (flusher_started) {
+        pthread_mutex_lock(&flusher_mutex);
+        flusher_stopping = 1;
+        pthread_cond_signal(&flusher_cond);
+        pthread_mutex_unlock(&flusher_mutex);
+        pthread_join(flusher_tid, NULL);
+        flusher_started = 0;
+    }
 
-    for (int i = 0; i < MAX_PLAYERS; i++) {
-        if (players[i]) {
-            player_unref(players[i], "player_fini cleanup");
-        }
+    for (int r = 0; r < ROOM_MAX; r++) {
+        struct player_room *room = &rooms[r];
+        if (!room->players) continue;
+        for (int i = 0; i < room->count; i++)
+            player_unref(room->list[i], "player_fini cleanup");
+        free(room->players);
+        free(room->list);
+        free(room->free_ids);
+        room->players = room->list = NULL;
+        room->free_ids = NULL;
+        room->count = room->nfree = 0;
     }
 
-    printf("[DEBUG] Exiting player_fini\n");
+    log_trace("Exiting player_fini");
 }
 
 PLAYER *get_player_by_index(int idx) {
-    if (idx < 0 || idx >= 26) return NULL;
-    return players[idx];  // players[] must be declared static or global in this file
+    if (idx < 0 || idx >= room_capacity()) return NULL;
+    return rooms[room_current].players[idx];
 }
 
 
 PLAYER *player_login(int clientfd, OBJECT avatar, char *name) {
-    printf("[DEBUG] Entering player_login\n");
-
-    pthread_mutex_lock(&players_mutex);
-    int idx = avatar - 'A';
-    printf("[DEBUG] Attempting login: fd=%d, avatar=%c, idx=%d\n", clientfd, avatar, idx);
-    if (idx < 0 || idx >= MAX_PLAYERS || players[idx]) {
-        pthread_mutex_unlock(&players_mutex);
-        printf("[DEBUG] Login failed: avatar already in use or invalid index\n");
-        printf("[DEBUG] Exiting player_login with failure\n");
+    log_trace("Entering player_login");
+
+    struct player_room *room = &rooms[room_current];
+    PROF_LOCK(&room->mutex, LOCK_PLAYERS);
+    // In a large room the letter is only drawn, and the id is any free one.
+    int id = room_large() ? (room->nfree ? room->free_ids[room->nfree - 1] : 0) : avatar - 'A' + 1;
+    log_debug("Attempting login: fd=%d, avatar=%c, id=%d", clientfd, avatar, id);
+    if (avatar < 'A' || avatar > 'Z' || id < 1 || room->players[id - 1]) {
+        PROF_UNLOCK(&room->mutex, LOCK_PLAYERS);
+        log_debug("Login failed: avatar already in use, invalid or room full");
+        log_trace("Exiting player_login with failure");
         return NULL;
     }
 
-    PLAYER *p = calloc(1, sizeof(PLAYER));
+    PLAYER *p = slab_alloc(&player_cache);
     if (!p) {
-        pthread_mutex_unlock(&players_mutex);
-        printf("[DEBUG] Login failed: calloc for PLAYER failed\n");
-        printf("[DEBUG] Exiting player_login with failure\n");
+        PROF_UNLOCK(&room->mutex, LOCK_PLAYERS);
+        log_debug("Login failed: allocation of PLAYER failed");
+        log_trace("Exiting player_login with failure");
         return NULL;
     }
 
-    p->view = calloc(VIEW_DEPTH, sizeof(*p->view));
-    if (!p->view) {
-        free(p);
-        pthread_mutex_unlock(&players_mutex);
-        printf("[DEBUG] Login failed: calloc for view failed\n");
-        printf("[DEBUG] Exiting player_login with failure\n");
-        return NULL;
-    }
+    memset(p, 0, sizeof(*p));
 
     p->avatar = avatar;
     p->fd = clientfd;
     p->score = 0;
     p->dir = NORTH;
-    p->ref_count = 1;
+    p->room = room_current;
+    p->id = id;
+    atomic_init(&p->ref_count, 1);
     p->hit_flag = 0;
-    p->name = (name && strlen(name) > 0) ? strdup(name) : strdup("anonymous");
+    p->name = name_dup((name && strlen(name) > 0) ? name : "anonymous");
     p->thread_id = pthread_self();  // ⬅️ store the current thread ID
 
 
@@ -125,304 +368,490 @@ PLAYER *player_login(int clientfd, OBJECT avatar, char *name) {
     pthread_mutex_init(&p->mutex, &attr);
     pthread_mutexattr_destroy(&attr);
 
-    players[idx] = p;
-    printf("[DEBUG] Player %c logged in successfully\n", avatar);
-    pthread_mutex_unlock(&players_mutex);
+    if (room_large())
+        room->nfree--;
+    room->players[id - 1] = p;
+    p->list_pos = room->count;
+    room->list[room->count++] = p;
+    metrics_add(METRIC_PLAYERS, 1);
+    log_debug("Player %c logged in successfully", avatar);
+    PROF_UNLOCK(&room->mutex, LOCK_PLAYERS);
 
-    printf("[DEBUG] Exiting player_login with success\n");
+    log_trace("Exiting player_login with success");
     return p;
 }
 
 void player_logout(PLAYER *player) {
-    printf("[DEBUG] Entering player_logout for %c\n", player->avatar);
-
-    pthread_mutex_lock(&players_mutex);
-    int idx = player->avatar - 'A';
-    players[idx] = NULL;
-    pthread_mutex_unlock(&players_mutex);
-
-    maze_remove_player(player->avatar, player->row, player->col);
-
-    MZW_PACKET pkt = {
-        .type = MZW_SCORE_PKT,
-        .param1 = player->avatar,
-        .param2 = -1,
-        .size = 0
-    };
-    player_send_packet(player, &pkt, NULL);
-
-    printf("[DEBUG] Player %c logged out\n", player->avatar);
+    log_trace("Entering player_logout for %c", player->avatar);
+
+    // The channel is closed while the slot is still taken, so that it
+    // cannot be the one offered to the next player in the slot.
+    struct player_room *room = &rooms[player->room];
+    room_enter(player->room);
+    udp_close(player_slot(player));
+    PROF_LOCK(&room->mutex, LOCK_PLAYERS);
+    room->players[player->id - 1] = NULL;
+    PLAYER *last = room->list[--room->count];
+    room->list[player->list_pos] = last;
+    last->list_pos = player->list_pos;
+    if (room_large())
+        room->free_ids[room->nfree++] = player->id;
+    metrics_add(METRIC_PLAYERS, -1);
+    PROF_UNLOCK(&room->mutex, LOCK_PLAYERS);
+
+    maze_remove(player->id, player->row, player->col);
+    send_score(player, player, -1, NULL);
+
+    log_debug("Player %c logged out", player->avatar);
     player_unref(player, "logout");
 
-    printf("[DEBUG] Exiting player_logout for %c\n", player->avatar);
+    log_trace("Exiting player_logout for %c", player->avatar);
 }
 
 
 void player_reset(PLAYER *player) {
-    printf("[DEBUG] Entering player_reset for %c\n", player->avatar);
+    TRACE_SCOPE("player_reset");
+    log_trace("Entering player_reset for %c", player->avatar);
 
-    pthread_mutex_lock(&player->mutex);
-    printf("[DEBUG] Acquired player mutex for %c\n", player->avatar);
+    room_enter(player->room);
+    PROF_LOCK(&player->mutex, LOCK_PLAYER);
+    log_debug("Acquired player mutex for %c", player->avatar);
 
-    maze_remove_player(player->avatar, player->row, player->col);
-    printf("[DEBUG] Called maze_remove_player for %c\n", player->avatar);
+    maze_remove(player->id, player->row, player->col);
+    log_debug("Called maze_remove for %c", player->avatar);
 
-    if (maze_set_player_random(player->avatar, &player->row, &player->col) != 0) {
-        printf("[DEBUG] Failed to set player %c randomly\n", player->avatar);
+    if (maze_place_random(player->id, player->avatar, &player->row, &player->col) != 0) {
+        log_debug("Failed to set player %c randomly", player->avatar);
         warn("Could not place player %c in maze. Skipping reset.", player->avatar);
-        pthread_mutex_unlock(&player->mutex);
-        printf("[DEBUG] Exiting player_reset early due to placement failure for %c\n", player->avatar);
+        PROF_UNLOCK(&player->mutex, LOCK_PLAYER);
+        log_trace("Exiting player_reset early due to placement failure for %c", player->avatar);
         return;
     }
 
-    printf("[DEBUG] Calling player_update_view for %c\n", player->avatar);
+    log_debug("Calling player_update_view for %c", player->avatar);
     player_update_view(player);
-    printf("[DEBUG] player_update_view done for %c\n", player->avatar);
+    log_debug("player_update_view done for %c", player->avatar);
+    int row = player->row, col = player->col, score = player->score;
 
-    // Notify other players to update their views
-    for (int i = 0; i < MAX_PLAYERS; i++) {
-        if (players[i] && players[i] != player) {
-            player_invalidate_view(players[i]);
-            player_update_view(players[i]);
-        }
-    }
+    // Other players' mutexes are taken below, so this one must be released
+    // first: two players resetting at once would otherwise deadlock.
+    PROF_UNLOCK(&player->mutex, LOCK_PLAYER);
 
-    // Re-add the player's score to the scoreboard
-    MZW_PACKET pkt = {
-        .type = MZW_SCORE_PKT,
-        .param1 = player->avatar,
-        .param2 = player->score,
-        .size = 0
-    };
-
-    for (int i = 0; i < MAX_PLAYERS; i++) {
-        if (players[i]) {
-            player_send_packet(players[i], &pkt, NULL);
-        }
-    }
+    // Notify other players to update their views, and re-add the player's
+    // score to the scoreboard.  Each is looked up with a reference, since
+    // it may log out concurrently.
+    refresh_watchers(player, row, col);
+    tell_score(player, row, col, score, NULL);
 
     // 🔁 Re-broadcast name to ensure gclient links avatar to name
     player_broadcast_name(player);
 
-    pthread_mutex_unlock(&player->mutex);
-    printf("[DEBUG] Exiting player_reset for %c\n", player->avatar);
+    log_trace("Exiting player_reset for %c", player->avatar);
 }
 
 
 PLAYER *player_get(unsigned char avatar) {
-    printf("[DEBUG] Entering player_get for avatar %c\n", avatar);
-
-    pthread_mutex_lock(&players_mutex);
-    int idx = avatar - 'A';
-
-    if (idx < 0 || idx >= MAX_PLAYERS || !players[idx]) {
-        pthread_mutex_unlock(&players_mutex);
-        printf("[DEBUG] Exiting player_get: avatar %c not found\n", avatar);
-        return NULL;
-    }
+    log_trace("Entering player_get for avatar %c", avatar);
 
-    PLAYER *p = player_ref(players[idx], "player_get");
-    pthread_mutex_unlock(&players_mutex);
+    PLAYER *p = lookup(&rooms[room_current], avatar - 'A' + 1);
 
-    printf("[DEBUG] Exiting player_get with player %c\n", avatar);
+    log_trace("Exiting player_get for avatar %c", avatar);
     return p;
 }
 
+PLAYER *player_get_by_id(int id) {
+    return lookup(&rooms[room_current], id);
+}
+
 PLAYER *player_ref(PLAYER *player, char *why) {
-    printf("[DEBUG] Entering player_ref for %c (%s)\n", player->avatar, why);
+    log_trace("Entering player_ref for %c (%s)", player->avatar, (long)why);
 
-    pthread_mutex_lock(&player->mutex);
-    player->ref_count++;
-    printf("[DEBUG] player_ref: %c ref_count=%d (%s)\n", player->avatar, player->ref_count, why);
-    pthread_mutex_unlock(&player->mutex);
+    // The count has its own cache line and needs no mutex.
+    int count = atomic_fetch_add(&player->ref_count, 1) + 1;
+    log_debug("player_ref: %c ref_count=%d (%s)", player->avatar, count, (long)why);
 
-    printf("[DEBUG] Exiting player_ref for %c\n", player->avatar);
+    log_trace("Exiting player_ref for %c", player->avatar);
     return player;
 }
 
 
 void player_unref(PLAYER *player, char *why) {
-    printf("[DEBUG] Entering player_unref for %c (%s)\n", player->avatar, why);
+    log_trace("Entering player_unref for %c (%s)", player->avatar, (long)why);
 
-    pthread_mutex_lock(&player->mutex);
-    player->ref_count--;
-    printf("[DEBUG] player_unref: %c ref_count=%d (%s)\n", player->avatar, player->ref_count, why);
+    int count = atomic_fetch_sub(&player->ref_count, 1) - 1;
+    log_debug("player_unref: %c ref_count=%d (%s)", player->avatar, count, (long)why);
 
-    if (player->ref_count == 0) {
-        pthread_mutex_unlock(&player->mutex);
+    // The last reference has gone, so no other thread can hold the mutex.
+    if (count == 0) {
         pthread_mutex_destroy(&player->mutex);
-        free(player->name);
-        free(player->view);
-        printf("[DEBUG] Freed player %c\n", player->avatar);
-        printf("[DEBUG] Exiting player_unref for %c — object destroyed\n", player->avatar);
-        free(player);
+        slab_buf_free(player->name);
+        log_debug("Freed player %c", player->avatar);
+        log_trace("Exiting player_unref for %c — object destroyed", player->avatar);
+        slab_free(&player_cache, player);
     } else {
-        pthread_mutex_unlock(&player->mutex);
-        printf("[DEBUG] Exiting player_unref for %c — object retained\n", player->avatar);
+        log_trace("Exiting player_unref for %c — object retained", player->avatar);
     }
 }
 
 
 int player_send_packet(PLAYER *player, MZW_PACKET *pkt, void *data) {
-    printf("[DEBUG] Entering player_send_packet: sending type %d to %c (fd=%d)\n",
+    log_trace("Entering player_send_packet: sending type %d to %c (fd=%d)",
            pkt->type, player->avatar, player->fd);
 
-    pthread_mutex_lock(&player->mutex);
-    int ret = proto_send_packet(player->fd, pkt, data);
-    pthread_mutex_unlock(&player->mutex);
+    PROF_LOCK(&player->mutex, LOCK_PLAYER);
+    int ret;
+    if (atomic_load_explicit(&udp_enabled, memory_order_relaxed) &&
+        udp_send(player_slot(player), pkt, data) == 0)
+        ret = 0;
+    else
+        ret = proto_send_packet(player->fd, pkt, data);
+    if (ret == 0) {
+        creg_add_bytes(client_registry, player->fd, 0, sizeof(*pkt) + (data ? pkt->size : 0));
+        metrics_packet_out(pkt->type, sizeof(*pkt) + (data ? pkt->size : 0));
+    }
+    PROF_UNLOCK(&player->mutex, LOCK_PLAYER);
 
     if (ret < 0) {
-        printf("[DEBUG] proto_send_packet failed for %c\n", player->avatar);
+        log_debug("proto_send_packet failed for %c", player->avatar);
     }
 
-    printf("[DEBUG] Exiting player_send_packet for %c\n", player->avatar);
+    log_trace("Exiting player_send_packet for %c", player->avatar);
     return ret;
 }
 
 
 
 int player_get_location(PLAYER *player, int *rowp, int *colp, int *dirp) {
-    printf("[DEBUG] Entering player_get_location for %c\n", player->avatar);
+    log_trace("Entering player_get_location for %c", player->avatar);
 
-    pthread_mutex_lock(&player->mutex);
+    PROF_LOCK(&player->mutex, LOCK_PLAYER);
     if (rowp) *rowp = player->row;
     if (colp) *colp = player->col;
     if (dirp) *dirp = player->dir;
-    pthread_mutex_unlock(&player->mutex);
+    PROF_UNLOCK(&player->mutex, LOCK_PLAYER);
 
-    printf("[DEBUG] Exiting player_get_location for %c with row=%d, col=%d, dir=%d\n",
+    log_trace("Exiting player_get_location for %c with row=%d, col=%d, dir=%d",
            player->avatar, player->row, player->col, player->dir);
     return 0;
 }
 
 
 int player_move(PLAYER *player, int sign) {
-    printf("[DEBUG] Entering player_move for %c with sign=%d\n", player->avatar, sign);
+    log_trace("Entering player_move for %c with sign=%d", player->avatar, sign);
 
-    pthread_mutex_lock(&player->mutex);
+    room_enter(player->room);
+    PROF_LOCK(&player->mutex, LOCK_PLAYER);
     int dir = (sign == 1) ? player->dir : REVERSE(player->dir);
 
     if (maze_move(player->row, player->col, dir) == 0) {
         player->row += (dir == NORTH) ? -1 : (dir == SOUTH) ? 1 : 0;
         player->col += (dir == WEST) ? -1 : (dir == EAST) ? 1 : 0;
-        printf("[DEBUG] Player %c moved to (%d, %d)\n", player->avatar, player->row, player->col);
-        player_update_view(player);
-        pthread_mutex_unlock(&player->mutex);
-        printf("[DEBUG] Exiting player_move for %c: move successful\n", player->avatar);
+        log_debug("Player %c moved to (%d, %d)", player->avatar, player->row, player->col);
+        PROF_UNLOCK(&player->mutex, LOCK_PLAYER);
+        log_trace("Exiting player_move for %c: move successful", player->avatar);
         return 0;
     }
 
-    pthread_mutex_unlock(&player->mutex);
-    printf("[DEBUG] Exiting player_move for %c: move failed\n", player->avatar);
+    PROF_UNLOCK(&player->mutex, LOCK_PLAYER);
+    log_trace("Exiting player_move for %c: move failed", player->avatar);
     return -1;
 }
 
 
 void player_rotate(PLAYER *player, int dir) {
-    printf("[DEBUG] Entering player_rotate for %c with dir=%d\n", player->avatar, dir);
+    log_trace("Entering player_rotate for %c with dir=%d", player->avatar, dir);
 
-    pthread_mutex_lock(&player->mutex);
+    PROF_LOCK(&player->mutex, LOCK_PLAYER);
     player->dir = (dir == 1) ? TURN_LEFT(player->dir) : TURN_RIGHT(player->dir);
-    printf("[DEBUG] Player %c rotated to direction %d\n", player->avatar, player->dir);
+    log_debug("Player %c rotated to direction %d", player->avatar, player->dir);
     player_invalidate_view(player);
-    pthread_mutex_unlock(&player->mutex);
+    PROF_UNLOCK(&player->mutex, LOCK_PLAYER);
 
-    printf("[DEBUG] Exiting player_rotate for %c\n", player->avatar);
+    log_trace("Exiting player_rotate for %c", player->avatar);
 }
 
 
 void player_fire_laser(PLAYER *player) {
-    printf("[DEBUG] Entering player_fire_laser for %c\n", player->avatar);
-    printf("[DEBUG] I detected the Escape key — shot fired by %c\n", player->avatar);
+    log_trace("Entering player_fire_laser for %c", player->avatar);
+    log_debug("I detected the Escape key — shot fired by %c", player->avatar);
 
-    pthread_mutex_lock(&player->mutex);
-    OBJECT target = maze_find_target(player->row, player->col, player->dir);
+    room_enter(player->room);
+    PROF_LOCK(&player->mutex, LOCK_PLAYER);
+    int target = maze_find_target_id(player->row, player->col, player->dir);
+    PROF_UNLOCK(&player->mutex, LOCK_PLAYER);
 
-    if (IS_AVATAR(target)) {
-        PLAYER *victim = player_get(target);
+    if (target) {
+        // The victim's mutex is taken here, so the shooter's is not held.
+        PLAYER *victim = lookup(&rooms[player->room], target);
         if (victim) {
             victim->hit_flag = 1;
+            metrics_add(METRIC_LASER_HITS, 1);
             pthread_kill(victim->thread_id, SIGUSR1);  // <-- this triggers the immediate respawn
-            printf("[DEBUG] Player %c hit player %c with laser (hit_flag set and signal sent)\n", player->avatar, target);
+            log_debug("Player %c hit player %c with laser (hit_flag set and signal sent)", player->avatar, victim->avatar);
             player_unref(victim, "fired hit");
         }
 
+        PROF_LOCK(&player->mutex, LOCK_PLAYER);
         player->score++;
-        printf("[DEBUG] Player %c score incremented to %d\n", player->avatar, player->score);
+        log_debug("Player %c score incremented to %d", player->avatar, player->score);
+        int row = player->row, col = player->col, score = player->score;
+        PROF_UNLOCK(&player->mutex, LOCK_PLAYER);
 
         // Broadcast updated score
-        for (int i = 0; i < MAX_PLAYERS; i++) {
-            if (players[i]) {
-                MZW_PACKET pkt = {
-                    .type = MZW_SCORE_PKT,
-                    .param1 = player->avatar,
-                    .param2 = player->score,
-                    .size = 0
-                };
-                player_send_packet(players[i], &pkt, NULL);
-            }
-        }
+        tell_score(player, row, col, score, NULL);
 
         player_broadcast_name(player);
     } else {
-        printf("[DEBUG] Player %c fired but hit nothing\n", player->avatar);
+        log_debug("Player %c fired but hit nothing", player->avatar);
     }
 
-    pthread_mutex_unlock(&player->mutex);
-    printf("[DEBUG] Exiting player_fire_laser for %c\n", player->avatar);
+    log_trace("Exiting player_fire_laser for %c", player->avatar);
 }
 
 
 void player_invalidate_view(PLAYER *player) {
-    printf("[DEBUG] Entering player_invalidate_view for %c\n", player->avatar);
+    log_trace("Entering player_invalidate_view for %c", player->avatar);
 
-    pthread_mutex_lock(&player->mutex);
+    PROF_LOCK(&player->mutex, LOCK_PLAYER);
     memset(player->view, 0, VIEW_DEPTH * sizeof(*player->view));
-    printf("[DEBUG] Player %c view invalidated\n", player->avatar);
-    pthread_mutex_unlock(&player->mutex);
+    log_debug("Player %c view invalidated", player->avatar);
+    PROF_UNLOCK(&player->mutex, LOCK_PLAYER);
 
-    printf("[DEBUG] Exiting player_invalidate_view for %c\n", player->avatar);
+    log_trace("Exiting player_invalidate_view for %c", player->avatar);
 }
 
 
-void player_update_view(PLAYER *player) {
-    printf("[DEBUG] Entered player_update_view for %c\n", player->avatar);
+int player_view_delta(const char *old, const char *cur, int n, char *out) {
+    int len = 0, i = 0;
+
+    // n is at most VIEW_DEPTH * VIEW_WIDTH, so the counts fit in a byte.
+    while (i < n) {
+        int keep = 0, change = 0;
+        while (i < n && old[i] == cur[i])
+            keep++, i++;
+        if (i == n)
+            break;
+        int start = i;
+        while (i < n && old[i] != cur[i])
+            change++, i++;
+        if (len + 2 + change >= n)
+            return -1;
+        out[len++] = keep;
+        out[len++] = change;
+        memcpy(out + len, cur + start, change);
+        len += change;
+    }
+    return len;
+}
 
-    pthread_mutex_lock(&player->mutex);
-    printf("[DEBUG] Acquired mutex in player_update_view for %c\n", player->avatar);
+/*
+ * Send a view as a VIEW packet: a delta from the old view if there is one
+ * and that is shorter, the whole view otherwise.  Called with the player's
+ * mutex held.
+ */
+static void player_send_compact_view(PLAYER *player, char (*old)[VIEW_WIDTH], int depth) {
+    char payload[VIEW_DEPTH * VIEW_WIDTH];
+    int n = depth * VIEW_WIDTH, len = -1;
+    MZW_PACKET pkt = { .type = MZW_VIEW_PKT, .param1 = MZW_VIEW_DELTA, .param2 = depth };
+
+    if (old)
+        len = player_view_delta((char *)old, (char *)player->view, n, payload);
+    if (len < 0) {
+        pkt.param1 = MZW_VIEW_FULL;
+        memcpy(payload, player->view, n);
+        len = n;
+    }
+    pkt.size = len;
+    player_send_packet(player, &pkt, len ? payload : NULL);
+}
 
-    if (!player->view) {
-        printf("[DEBUG] player->view is NULL. Aborting update_view for %c\n", player->avatar);
-        pthread_mutex_unlock(&player->mutex);
-        printf("[DEBUG] Released mutex and exiting player_update_view early for %c\n", player->avatar);
-        return;
+void player_set_view_flags(PLAYER *player, int flags) {
+    PROF_LOCK(&player->mutex, LOCK_PLAYER);
+    player->view_flags = flags;
+    PROF_UNLOCK(&player->mutex, LOCK_PLAYER);
+}
+
+/*
+ * Views held back by the rate limit are sent from here.  The players due
+ * are picked out of each room under their own mutexes, and their views are
+ * sent after those are dropped: player_update_view() enters the room
+ * before locking the player, so it must not be called with the player
+ * already locked.  The list is kept from pass to pass.
+ */
+static void *view_flusher(void *arg) {
+    PLAYER **due_list = NULL;
+    int due_max = 0;
+
+    pthread_mutex_lock(&flusher_mutex);
+    while (!flusher_stopping) {
+        flusher_kicked = 0;
+        pthread_mutex_unlock(&flusher_mutex);
+        // Views go to client sockets, which a handoff is passing on.
+        handoff_checkpoint();
+
+        // Send the views that are due, and find when the next one is.
+        uint64_t now = now_ns(), next = UINT64_MAX;
+        for (int r = 0; r < room_count(); r++) {
+            struct player_room *room = &rooms[r];
+            PROF_LOCK(&room->mutex, LOCK_PLAYERS);
+            int n = room->count;
+            if (n > due_max) {
+                PLAYER **list = realloc(due_list, n * sizeof(*list));
+                if (!list) {
+                    PROF_UNLOCK(&room->mutex, LOCK_PLAYERS);
+                    continue;
+                }
+                due_list = list;
+                due_max = n;
+            }
+            for (int i = 0; i < n; i++)
+                due_list[i] = player_ref(room->list[i], "view flusher");
+            PROF_UNLOCK(&room->mutex, LOCK_PLAYERS);
+
+            int ndue = 0;
+            for (int i = 0; i < n; i++) {
+                PLAYER *p = due_list[i];
+                int send = 0;
+                PROF_LOCK(&p->mutex, LOCK_PLAYER);
+                if (p->view_pending) {
+                    uint64_t due = p->view_sent_ns + 1000000000 / p->view_max_rate;
+                    if (due <= now)
+                        send = 1;
+                    else if (due < next)
+                        next = due;
+                }
+                PROF_UNLOCK(&p->mutex, LOCK_PLAYER);
+                if (send)
+                    due_list[ndue++] = p;
+                else
+                    player_unref(p, "view flusher");
+            }
+            for (int i = 0; i < ndue; i++) {
+                player_update_view(due_list[i]);
+                player_unref(due_list[i], "view flusher");
+            }
+        }
+
+        pthread_mutex_lock(&flusher_mutex);
+        if (flusher_kicked || flusher_stopping)
+            continue;
+        if (next == UINT64_MAX) {
+            pthread_cond_wait(&flusher_cond, &flusher_mutex);
+        } else {
+            struct timespec ts = { .tv_sec = next / 1000000000, .tv_nsec = next % 1000000000 };
+            pthread_cond_timedwait(&flusher_cond, &flusher_mutex, &ts);
+        }
     }
+    pthread_mutex_unlock(&flusher_mutex);
+    free(due_list);
+    handoff_leave();
+    return NULL;
+}
 
-    int depth = maze_get_view((VIEW *)player->view, player->row, player->col, player->dir, VIEW_DEPTH);
-    printf("[DEBUG] maze_get_view completed. Depth = %d for %c\n", depth, player->avatar);
+static void view_flusher_wake(void) {
+    pthread_mutex_lock(&flusher_mutex);
+    flusher_kicked = 1;
+    pthread_cond_signal(&flusher_cond);
+    pthread_mutex_unlock(&flusher_mutex);
+}
+
+static void view_flusher_start(void) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&flusher_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    handoff_on_freeze(view_flusher_wake);
+    handoff_enter();
+    if (pthread_create(&flusher_tid, NULL, view_flusher, NULL) == 0) {
+        flusher_started = 1;
+    } else {
+        handoff_leave();
+        error("Cannot start the view flusher; rate-limited views will be late");
+    }
+}
+
+void player_set_view_limits(PLAYER *player, int max_depth, int max_rate) {
+    if (max_rate > 0)
+        pthread_once(&flusher_once, view_flusher_start);
+
+    PROF_LOCK(&player->mutex, LOCK_PLAYER);
+    player->view_max_depth = max_depth > 0 && max_depth <= VIEW_DEPTH ? max_depth : 0;
+    player->view_max_rate = max_rate > 0 ? max_rate : 0;
+    PROF_UNLOCK(&player->mutex, LOCK_PLAYER);
+}
+
+void player_update_view(PLAYER *player) {
+    TRACE_SCOPE("player_update_view");
+    log_trace("Entered player_update_view for %c", player->avatar);
+
+    room_enter(player->room);
+    PROF_LOCK(&player->mutex, LOCK_PLAYER);
+    log_debug("Acquired mutex in player_update_view for %c", player->avatar);
+
+    // An update that comes before the rate limit allows is left to the
+    // flusher, which sends the view as it is then; player->view still holds
+    // the view last sent (or zeroes, if invalidated since), so the updates
+    // in between coalesce.
+    if (player->view_max_rate) {
+        uint64_t now = now_ns();
+        if (now - player->view_sent_ns < 1000000000 / player->view_max_rate) {
+            metrics_add(METRIC_VIEW_DEFERRED, 1);
+            if (!player->view_pending) {
+                player->view_pending = 1;
+                pthread_mutex_lock(&flusher_mutex);
+                flusher_kicked = 1;
+                pthread_cond_signal(&flusher_cond);
+                pthread_mutex_unlock(&flusher_mutex);
+            }
+            PROF_UNLOCK(&player->mutex, LOCK_PLAYER);
+            return;
+        }
+        player->view_sent_ns = now;
+        player->view_pending = 0;
+    }
+
+    // An invalidated view is all zeroes; maze_get_view() never yields one.
+    int full = player->view[0][0] == 0;
+    char old[VIEW_DEPTH][VIEW_WIDTH];
+    if (player->view_flags && !full)
+        memcpy(old, player->view, sizeof(old));
+    int depth = maze_get_view((VIEW *)player->view, player->row, player->col, player->dir,
+                              player->view_max_depth ? player->view_max_depth : VIEW_DEPTH);
+    log_debug("maze_get_view completed. Depth = %d for %c", depth, player->avatar);
 
     if (depth <= 0 || depth > VIEW_DEPTH) {
-        printf("[DEBUG] Invalid view depth (%d). Exiting player_update_view for %c\n", depth, player->avatar);
-        pthread_mutex_unlock(&player->mutex);
-        printf("[DEBUG] Released mutex and exiting player_update_view early for %c\n", player->avatar);
+        log_debug("Invalid view depth (%d). Exiting player_update_view for %c", depth, player->avatar);
+        PROF_UNLOCK(&player->mutex, LOCK_PLAYER);
+        log_debug("Released mutex and exiting player_update_view early for %c", player->avatar);
         return;
     }
 
-    printf("[DEBUG] Sending CLEAR packet to %c\n", player->avatar);
+    metrics_add(full ? METRIC_VIEW_FULL : METRIC_VIEW_INCREMENTAL, 1);
+    if (player->view_flags & MZW_LOGIN_COMPACT_VIEW) {
+        // A view over UDP may be lost, so a delta could not be applied.
+        int fresh = full || depth != player->view_depth || udp_active(player_slot(player));
+        player_send_compact_view(player, fresh ? NULL : old, depth);
+        player->view_depth = depth;
+        PROF_UNLOCK(&player->mutex, LOCK_PLAYER);
+        return;
+    }
+    log_debug("Sending CLEAR packet to %c", player->avatar);
     MZW_PACKET clear_pkt = { .type = MZW_CLEAR_PKT, .size = 0 };
 
     if (player_send_packet(player, &clear_pkt, NULL) < 0) {
-        printf("[DEBUG] Failed to send CLEAR packet for %c\n", player->avatar);
+        log_debug("Failed to send CLEAR packet for %c", player->avatar);
     } else {
-        printf("[DEBUG] Sent CLEAR packet to %c\n", player->avatar);
+        log_debug("Sent CLEAR packet to %c", player->avatar);
     }
 
     for (int d = 0; d < depth; d++) {
-        printf("[DEBUG] Entering depth loop d=%d for %c\n", d, player->avatar);
+        log_trace("Entering depth loop d=%d for %c", d, player->avatar);
         for (int side = 0; side < VIEW_WIDTH; side++) {
-            printf("[DEBUG] Accessing player->view[%d][%d] for %c\n", d, side, player->avatar);
+            log_trace("Accessing player->view[%d][%d] for %c", d, side, player->avatar);
             char cell = player->view[d][side];
-            printf("[DEBUG] Got view cell = '%c' at [%d][%d] for %c\n", cell, d, side, player->avatar);
+            log_trace("Got view cell = '%c' at [%d][%d] for %c", cell, d, side, player->avatar);
 
             MZW_PACKET show_pkt = {
                 .type = MZW_SHOW_PKT,
@@ -431,85 +860,88 @@ void player_update_view(PLAYER *player) {
                 .param3 = d,
                 .size = 0
             };
-            printf("[DEBUG] Prepared SHOW packet for cell '%c' at side=%d depth=%d\n", cell, side, d);
+            log_trace("Prepared SHOW packet for cell '%c' at side=%d depth=%d", cell, side, d);
 
             if (player_send_packet(player, &show_pkt, NULL) < 0) {
-                printf("[DEBUG] Failed to send SHOW packet for %c (depth=%d, side=%d)\n", player->avatar, d, side);
+                log_debug("Failed to send SHOW packet for %c (depth=%d, side=%d)", player->avatar, d, side);
             } else {
-                printf("[DEBUG] Sent SHOW packet for %c: cell=%c, depth=%d, side=%d\n", player->avatar, cell, d, side);
+                log_trace("Sent SHOW packet for %c: cell=%c, depth=%d, side=%d", player->avatar, cell, d, side);
             }
         }
     }
 
-    pthread_mutex_unlock(&player->mutex);
-    printf("[DEBUG] Released mutex and exiting player_update_view for %c\n", player->avatar);
+    PROF_UNLOCK(&player->mutex, LOCK_PLAYER);
+    log_debug("Released mutex and exiting player_update_view for %c", player->avatar);
 }
 
 
 
-void player_check_for_laser_hit(PLAYER *player) {
-    if (!player) return;
+int player_take_laser_hit(PLAYER *player) {
+    if (!player) return 0;
 
-    printf("[DEBUG] Entering player_check_for_laser_hit for %c\n", player->avatar);
+    log_trace("Entering player_take_laser_hit for %c", player->avatar);
 
-    pthread_mutex_lock(&player->mutex);
+    room_enter(player->room);
+    PROF_LOCK(&player->mutex, LOCK_PLAYER);
 
-    if (player->hit_flag) {
-        printf("[DEBUG] Player %c was hit by laser (hit_flag=1), processing respawn\n", player->avatar);
-        player->hit_flag = 0;
+    if (!player->hit_flag) {
+        log_debug("No laser hit detected for %c (hit_flag=0)", player->avatar);
+        PROF_UNLOCK(&player->mutex, LOCK_PLAYER);
+        log_trace("Exiting player_take_laser_hit for %c", player->avatar);
+        return 0;
+    }
 
-        // Remove from maze
-        maze_remove_player(player->avatar, player->row, player->col);
+    log_debug("Player %c was hit by laser (hit_flag=1), processing respawn", player->avatar);
+    player->hit_flag = 0;
 
-        // Remove score from scoreboard
-        MZW_PACKET pkt = {
-            .type = MZW_SCORE_PKT,
-            .param1 = player->avatar,
-            .param2 = -1,
-            .size = 0
-        };
-        player_send_packet(player, &pkt, NULL);
+    // Remove from maze
+    maze_remove(player->id, player->row, player->col);
+    int row = player->row, col = player->col;
 
-        // 🔁 Re-announce name so gclient keeps it on scoreboard
-        player_broadcast_name(player);
+    // Remove score from scoreboard
+    send_score(player, player, -1, NULL);
 
-        // Send alert
-        MZW_PACKET alert = {
-            .type = MZW_ALERT_PKT,
-            .size = 0
-        };
-        player_send_packet(player, &alert, NULL);
+    // 🔁 Re-announce name so gclient keeps it on scoreboard
+    player_broadcast_name(player);
 
-        // ⬇️ Invalidate views for all other players
-        for (int i = 0; i < MAX_PLAYERS; i++) {
-            if (players[i] && players[i] != player) {
-                player_invalidate_view(players[i]);
-                player_update_view(players[i]);
-            }
-        }
+    // Send alert
+    MZW_PACKET alert = {
+        .type = MZW_ALERT_PKT,
+        .size = 0
+    };
+    player_send_packet(player, &alert, NULL);
+
+    PROF_UNLOCK(&player->mutex, LOCK_PLAYER);
 
-        pthread_mutex_unlock(&player->mutex);
-        printf("[DEBUG] Player %c entering purgatory...\n", player->avatar);
-        sleep(3);  // purgatory time
-        printf("[DEBUG] Player %c exiting purgatory\n", player->avatar);
+    // ⬇️ Invalidate views for all other players who could see it
+    refresh_watchers(player, row, col);
+
+    log_debug("Player %c entering purgatory...", player->avatar);
+    log_trace("Exiting player_take_laser_hit for %c", player->avatar);
+    return 1;
+}
+
+void player_check_for_laser_hit(PLAYER *player) {
+    log_trace("Entering player_check_for_laser_hit");
+
+    if (player_take_laser_hit(player)) {
+        coro_sleep(PLAYER_PURGATORY_MS);  // a coroutine yields meanwhile
+        log_debug("Player %c exiting purgatory", player->avatar);
 
         // Respawn player
         player_reset(player);
-    } else {
-        printf("[DEBUG] No laser hit detected for %c (hit_flag=0)\n", player->avatar);
-        pthread_mutex_unlock(&player->mutex);
     }
 
-    printf("[DEBUG] Exiting player_check_for_laser_hit for %c\n", player->avatar);
+    log_trace("Exiting player_check_for_laser_hit");
 }
 
 
 
 void player_send_chat(PLAYER *player, char *msg, size_t len) {
-    printf("[DEBUG] Entering player_send_chat for %c\n", player->avatar);
+    log_trace("Entering player_send_chat for %c", player->avatar);
 
     if (msg == NULL || len == 0) {
-        printf("[DEBUG] Exiting player_send_chat early: empty message\n");
+        log_trace("Exiting player_send_chat early: empty message");
         return;
     }
 
@@ -517,7 +949,7 @@ void player_send_chat(PLAYER *player, char *msg, size_t len) {
     const char *name = player_get_name(player);  // safely returns "anonymous" if NULL
     int prefix_len = snprintf(full_msg, sizeof(full_msg), "%s[%c] ", name, player->avatar);
     if (prefix_len < 0 || prefix_len >= (int)sizeof(full_msg)) {
-        printf("[DEBUG] Exiting player_send_chat early: snprintf failed\n");
+        log_trace("Exiting player_send_chat early: snprintf failed");
         return;
     }
 
@@ -532,17 +964,19 @@ void player_send_chat(PLAYER *player, char *msg, size_t len) {
         .size = strlen(full_msg)
     };
 
-    printf("[DEBUG] Player %c sending chat: %s\n", player->avatar, full_msg);
+    log_debug("Player %c sending chat (%d bytes)", player->avatar, pkt.size);
 
-    for (int i = 0; i < MAX_PLAYERS; i++) {
-        PLAYER *recipient = player_get('A' + i);
-        if (recipient) {
-            player_send_packet(recipient, &pkt, full_msg);
-            player_unref(recipient, "chat");
-        }
+    room_enter(player->room);
+    int row, col;
+    player_get_location(player, &row, &col, NULL);
+    PLAYER *to[AUDIENCE_MAX];
+    int n = audience(player, row, col, to);
+    for (int i = 0; i < n; i++) {
+        player_send_packet(to[i], &pkt, full_msg);
+        player_unref(to[i], "chat");
     }
 
-    printf("[DEBUG] Exiting player_send_chat for %c\n", player->avatar);
+    log_trace("Exiting player_send_chat for %c", player->avatar);
 }
 
 const char *player_get_name(PLAYER *player) {
@@ -560,3 +994,124 @@ char player_get_avatar(PLAYER *player) {
     return player->avatar;
 }
 
+int player_show_all(FILE *out) {
+    static const char dir_names[] = "NWSE";
+    int n = 0;
+
+    // Ids only say more than the letters in large rooms.
+    fprintf(out, "%sAV NAME             FD   ROW COL DIR SCORE REFS\n", room_large() ? "ID    " : "");
+    for (int r = 0; r < room_count(); r++) {
+        struct player_room *room = &rooms[r];
+        PROF_LOCK(&room->mutex, LOCK_PLAYERS);
+        if (room_count() > 1)
+            fprintf(out, "room %d:\n", r);
+        for (int i = 0; i < room_capacity(); i++) {
+            PLAYER *p = room->players[i];
+            if (!p) continue;
+
+            PROF_LOCK(&p->mutex, LOCK_PLAYER);
+            if (room_large())
+                fprintf(out, "%-5d ", p->id);
+            fprintf(out, "%c  %-16.16s %-4d %-3d %-3d %-3c %-5d %d\n",
+                    p->avatar, player_get_name(p), p->fd, p->row, p->col,
+                    dir_names[p->dir], p->score, atomic_load(&p->ref_count));
+            PROF_UNLOCK(&p->mutex, LOCK_PLAYER);
+            n++;
+        }
+        PROF_UNLOCK(&room->mutex, LOCK_PLAYERS);
+    }
+
+    fprintf(out, "%d player(s) logged in\n", n);
+    return n;
+}
+
+
+int player_snapshot(struct player_state *states, int max) {
+    struct player_room *room = &rooms[room_current];
+    int n = 0;
+
+    PROF_LOCK(&room->mutex, LOCK_PLAYERS);
+    for (int i = 0; i < room_capacity() && n < max; i++) {
+        PLAYER *p = room->players[i];
+        if (!p) continue;
+
+        PROF_LOCK(&p->mutex, LOCK_PLAYER);
+        struct player_state *st = &states[n++];
+        st->avatar = p->avatar;
+        st->fd = p->fd;
+        st->score = p->score;
+        st->row = p->row;
+        st->col = p->col;
+        st->dir = p->dir;
+        st->view_flags = p->view_flags;
+        st->view_max_depth = p->view_max_depth;
+        st->view_max_rate = p->view_max_rate;
+        snprintf(st->name, sizeof(st->name), "%s", player_get_name(p));
+        PROF_UNLOCK(&p->mutex, LOCK_PLAYER);
+    }
+    PROF_UNLOCK(&room->mutex, LOCK_PLAYERS);
+
+    return n;
+}
+
+PLAYER *player_restore(const struct player_state *state) {
+    PLAYER *p = player_login(state->fd, state->avatar, (char *)state->name);
+    if (!p)
+        return NULL;
+
+    PROF_LOCK(&p->mutex, LOCK_PLAYER);
+    p->score = state->score;
+    p->row = state->row;
+    p->col = state->col;
+    p->dir = state->dir;
+    p->view_flags = state->view_flags;
+    PROF_UNLOCK(&p->mutex, LOCK_PLAYER);
+    player_set_view_limits(p, state->view_max_depth, state->view_max_rate);
+
+    log_debug("Player %c restored at (%d, %d)", p->avatar, p->row, p->col);
+    return p;
+}
+
+void player_adopt(PLAYER *player) {
+    PROF_LOCK(&player->mutex, LOCK_PLAYER);
+    player->thread_id = pthread_self();
+    PROF_UNLOCK(&player->mutex, LOCK_PLAYER);
+}
+
+int player_get_room(PLAYER *player) {
+    return player->room;
+}
+
+int player_slot(PLAYER *player) {
+    return player->room * room_capacity() + player->id - 1;
+}
+
+int player_room_count(int room) {
+    PROF_LOCK(&rooms[room].mutex, LOCK_PLAYERS);
+    int n = rooms[room].count;
+    PROF_UNLOCK(&rooms[room].mutex, LOCK_PLAYERS);
+    return n;
+}
+
+int player_room_has(int room, OBJECT avatar) {
+    int idx = avatar - 'A';
+    // Letters are shared in large rooms.
+    if (room_large() || idx < 0 || idx >= MAX_PLAYERS)
+        return 0;
+    PROF_LOCK(&rooms[room].mutex, LOCK_PLAYERS);
+    int taken = rooms[room].players[idx] != NULL;
+    PROF_UNLOCK(&rooms[room].mutex, LOCK_PLAYERS);
+    return taken;
+}
+
+int player_get_id(PLAYER *player) {
+    return player->id;
+}
+
+void player_announce(PLAYER *player) {
+    int row, col;
+
+    room_enter(player->room);
+    player_get_location(player, &row, &col, NULL);
+    tell_score(player, row, col, player_get_score(player), player_get_name(player));
+}
@@ -0,0 +1,266 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "pool.h"
+#include "handoff.h"
+#include "debug.h"
+#include "log.h"
+
+#define LATENCY_BUCKETS 40              // power-of-two buckets of nanoseconds
+
+struct worker {
+    _Alignas(64) pthread_mutex_t lock;  // protects the deque
+    struct pool_task *head, *tail;      // owner takes the head, thieves the tail
+    atomic_int queued;                  // tasks in the deque, for idle thieves
+    int index;
+    int cpu;                            // CPU the worker is pinned to, or -1
+    pthread_t tid;
+
+    // Written only by the owning worker.
+    atomic_ulong tasks;                 // tasks run
+    atomic_ulong steals;                // tasks taken from other workers
+    atomic_ulong latency_sum;           // total queue latency, ns
+    atomic_ulong latency_max;           // largest queue latency, ns
+    atomic_ulong latency[LATENCY_BUCKETS];
+};
+
+static struct worker *workers = NULL;
+static int nworkers = 0;
+static atomic_uint next_worker = 0;     // round-robin target for submissions
+
+static pthread_mutex_t idle_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+static atomic_int idle = 0;             // workers waiting for tasks
+static atomic_long pending = 0;         // tasks queued on all deques
+
+static __thread struct worker *self = NULL;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void push_tail(struct worker *w, struct pool_task *task) {
+    pthread_mutex_lock(&w->lock);
+    task->next = NULL;
+    task->prev = w->tail;
+    if (w->tail)
+        w->tail->next = task;
+    else
+        w->head = task;
+    w->tail = task;
+    atomic_fetch_add_explicit(&w->queued, 1, memory_order_relaxed);
+    pthread_mutex_unlock(&w->lock);
+}
+
+static struct pool_task *pop_head(struct worker *w) {
+    pthread_mutex_lock(&w->lock);
+    struct pool_task *task = w->head;
+    if (task) {
+        w->head = task->next;
+        if (w->head)
+            w->head->prev = NULL;
+        else
+            w->tail = NULL;
+        atomic_fetch_sub_explicit(&w->queued, 1, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return task;
+}
+
+static struct pool_task *pop_tail(struct worker *w) {
+    // Checked without the lock so that idle thieves do not contend on
+    // empty deques; a task missed here is found on the next pass.
+    if (atomic_load_explicit(&w->queued, memory_order_relaxed) == 0)
+        return NULL;
+
+    pthread_mutex_lock(&w->lock);
+    struct pool_task *task = w->tail;
+    if (task) {
+        w->tail = task->prev;
+        if (w->tail)
+            w->tail->next = NULL;
+        else
+            w->head = NULL;
+        atomic_fetch_sub_explicit(&w->queued, 1, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return task;
+}
+
+/*
+ * Find a task for a worker: its own oldest task, or else the newest task
+ * of the first other worker that has any.
+ */
+static struct pool_task *take(struct worker *w) {
+    if (atomic_load(&pending) == 0)
+        return NULL;
+
+    struct pool_task *task = pop_head(w);
+    for (int i = 1; !task && i < nworkers; i++) {
+        task = pop_tail(&workers[(w->index + i) % nworkers]);
+        if (task)
+            atomic_fetch_add_explicit(&w->steals, 1, memory_order_relaxed);
+    }
+    if (task)
+        atomic_fetch_sub(&pending, 1);
+    return task;
+}
+
+static void record_latency(struct worker *w, uint64_t ns) {
+    int b = 0;
+    while (b < LATENCY_BUCKETS - 1 && (ns >> (b + 1)))
+        b++;
+    atomic_fetch_add_explicit(&w->latency[b], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&w->latency_sum, ns, memory_order_relaxed);
+    if (ns > atomic_load_explicit(&w->latency_max, memory_order_relaxed))
+        atomic_store_explicit(&w->latency_max, ns, memory_order_relaxed);
+}
+
+/*
+ * Wake every idle worker, so that they notice a handoff freeze.
+ */
+static void wake_all(void) {
+    pthread_mutex_lock(&idle_mutex);
+    pthread_cond_broadcast(&idle_cond);
+    pthread_mutex_unlock(&idle_mutex);
+}
+
+static void *worker_thread(void *arg) {
+    struct worker *w = arg;
+    self = w;
+
+    if (w->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(w->cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+
+    while (1) {
+        // Between tasks no connection has a partially consumed packet.
+        handoff_checkpoint();
+
+        struct pool_task *task = take(w);
+        if (!task) {
+            pthread_mutex_lock(&idle_mutex);
+            atomic_fetch_add(&idle, 1);
+            while (atomic_load(&pending) == 0 && !handoff_frozen())
+                pthread_cond_wait(&idle_cond, &idle_mutex);
+            atomic_fetch_sub(&idle, 1);
+            pthread_mutex_unlock(&idle_mutex);
+            continue;
+        }
+
+        record_latency(w, now_ns() - task->queued_ns);
+        task->run(task);
+        atomic_fetch_add_explicit(&w->tasks, 1, memory_order_relaxed);
+    }
+    return NULL;
+}
+
+int pool_init(int n, int pin) {
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (n <= 0 || n > POOL_MAX_WORKERS)
+        return -1;
+    workers = calloc(n, sizeof(struct worker));
+    if (!workers)
+        return -1;
+
+    handoff_on_freeze(wake_all);
+    for (int i = 0; i < n; i++) {
+        struct worker *w = &workers[i];
+        pthread_mutex_init(&w->lock, NULL);
+        w->index = i;
+        w->cpu = pin && ncpu > 0 ? (int)(i % ncpu) : -1;
+    }
+    // Workers index the whole array when stealing, so it must be complete
+    // before the first one starts.
+    nworkers = n;
+
+    for (int i = 0; i < n; i++) {
+        handoff_enter();
+        if (pthread_create(&workers[i].tid, NULL, worker_thread, &workers[i]) != 0) {
+            error("Failed to start worker thread %d", i);
+            handoff_leave();
+            return -1;
+        }
+        pthread_detach(workers[i].tid);
+    }
+
+    log_info("Worker pool started: %d threads%s", n, (long)(pin ? ", pinned" : ""));
+    return 0;
+}
+
+void pool_submit(struct pool_task *task) {
+    struct worker *w = self;
+    if (!w)
+        w = &workers[atomic_fetch_add_explicit(&next_worker, 1, memory_order_relaxed) % nworkers];
+
+    task->queued_ns = now_ns();
+    push_tail(w, task);
+    atomic_fetch_add(&pending, 1);
+
+    if (atomic_load(&idle) > 0) {
+        pthread_mutex_lock(&idle_mutex);
+        pthread_cond_signal(&idle_cond);
+        pthread_mutex_unlock(&idle_mutex);
+    }
+}
+
+/*
+ * Upper bound, in microseconds, of the latency below which the given
+ * fraction of all recorded queue latencies fall.
+ */
+static unsigned long percentile_us(const unsigned long *hist, unsigned long total, double q) {
+    unsigned long want = (unsigned long)(total * q), seen = 0;
+    for (int b = 0; b < LATENCY_BUCKETS; b++) {
+        seen += hist[b];
+        if (seen > want)
+            return ((2UL << b) + 999) / 1000;
+    }
+    return 0;
+}
+
+void pool_show(FILE *out) {
+    unsigned long hist[LATENCY_BUCKETS] = { 0 };
+    unsigned long tasks = 0, steals = 0, sum = 0, max = 0;
+
+    if (!nworkers) {
+        fprintf(out, "worker pool: off (one thread per connection)\n");
+        return;
+    }
+
+    fprintf(out, "WORKER CPU TASKS      STEALS     QUEUED  AVG_LAT(us) MAX_LAT(us)\n");
+    for (int i = 0; i < nworkers; i++) {
+        struct worker *w = &workers[i];
+        unsigned long t = atomic_load(&w->tasks), s = atomic_load(&w->steals);
+        unsigned long ls = atomic_load(&w->latency_sum), lm = atomic_load(&w->latency_max);
+        int queued = atomic_load(&w->queued);
+
+        fprintf(out, "%-6d %-3d %-10lu %-10lu %-7d %-11lu %lu\n", i, w->cpu, t, s, queued,
+                t ? ls / t / 1000 : 0, lm / 1000);
+        for (int b = 0; b < LATENCY_BUCKETS; b++)
+            hist[b] += atomic_load(&w->latency[b]);
+        tasks += t;
+        steals += s;
+        sum += ls;
+        if (lm > max)
+            max = lm;
+    }
+
+    fprintf(out, "total: %lu tasks, %lu steals (%.1f%%), %d idle workers\n",
+            tasks, steals, tasks ? 100.0 * steals / tasks : 0.0, atomic_load(&idle));
+    fprintf(out, "queue latency: avg %lu us, p50 <%lu us, p99 <%lu us, max %lu us\n",
+            tasks ? sum / tasks / 1000 : 0, percentile_us(hist, tasks, 0.5),
+            percentile_us(hist, tasks, 0.99), max / 1000);
+}
@@ -3,59 +3,135 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/epoll.h>
 #include <arpa/inet.h>
+#include <sys/socket.h>
 
 #include "protocol.h"
+#include "protocol_ext.h"
+#include "slab.h"
 #include "debug.h"
+#include "log.h"
+#include "uring.h"
+#include "coro.h"
+#include "metrics.h"
+#include "trace.h"
+#include "shm.h"
 
 #define HEADER_SIZE sizeof(MZW_PACKET)
 
+/*
+ * Wait until a non-blocking fd is ready.  A coroutine reading its own
+ * connection yields to its scheduler.  Writes always wait in place: they are
+ * made with the receiving player's mutex held, and another coroutine on the
+ * same thread could otherwise take that (recursive) mutex.  Since such a
+ * wait holds up every coroutine on the scheduler, a coroutine waits at most
+ * CORO_SEND_WAIT_MS for a send buffer to drain; the client is then dropped,
+ * as the io_uring backend drops one whose send queue overflows.
+ */
+static int wait_ready(int fd, short events) {
+    if (events == POLLIN && coro_running())
+        return coro_wait(fd, EPOLLIN);
+
+    int timeout = coro_running() ? CORO_SEND_WAIT_MS : -1;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    struct pollfd pfd = { .fd = fd, .events = events };
+    int ret;
+    while ((ret = poll(&pfd, 1, timeout)) < 0) {
+        if (errno != EINTR)
+            return -1;
+        if (timeout >= 0) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            long ms = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+            timeout = ms < CORO_SEND_WAIT_MS ? CORO_SEND_WAIT_MS - ms : 0;
+        }
+    }
+    if (ret == 0) {
+        // Shutting the socket down fails this and every later write, and
+        // ends the client's own read, so its service loop logs it out.
+        shutdown(fd, SHUT_RDWR);
+        metrics_add(METRIC_SEND_DROPS, 1);
+        log_warn("Dropping client fd=%d: send buffer full for %d ms", fd, CORO_SEND_WAIT_MS);
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Wait until a full send buffer has room, counting the time as a send stall.
+ */
+static int wait_writable(int fd) {
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    int ret = wait_ready(fd, POLLOUT);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    metrics_add(METRIC_SEND_STALLS, 1);
+    metrics_add(METRIC_SEND_STALL_NS, (t1.tv_sec - t0.tv_sec) * 1000000000L + (t1.tv_nsec - t0.tv_nsec));
+    return ret;
+}
+
 /*
  * Helper to write `count` bytes to fd.
- * Handles partial writes and EINTR.
+ * Handles partial writes, EINTR and EAGAIN.  Sockets are written without
+ * blocking even in blocking mode, so that a full send buffer is seen and
+ * the wait for it can be timed.
  */
 static ssize_t write_all(int fd, const void *buf, size_t count) {
-    printf("[DEBUG] Entering write_all\n");
+    log_trace("Entering write_all");
 
     size_t written = 0;
     const char *ptr = buf;
+    int flags = MSG_DONTWAIT;
     while (written < count) {
-        ssize_t w = write(fd, ptr + written, count - written);
+        ssize_t w = flags ? send(fd, ptr + written, count - written, flags)
+                          : write(fd, ptr + written, count - written);
         if (w < 0) {
             if (errno == EINTR) continue;
-            printf("[DEBUG] Exiting write_all with error\n");
+            if (errno == ENOTSOCK && flags) { flags = 0; continue; }
+            if (errno == EAGAIN && wait_writable(fd) == 0) continue;
+            log_trace("Exiting write_all with error");
             return -1;
         }
         if (w == 0) break;
         written += w;
     }
 
-    printf("[DEBUG] Exiting write_all\n");
+    log_trace("Exiting write_all");
     return written == count ? 0 : -1;
 }
 
 
 /*
- * Helper to read `count` bytes from fd.
- * Handles partial reads and EINTR.
+ * Helper to read `count` bytes from fd, or from its ring if it is a
+ * shared-memory connection.
+ * Handles partial reads, EINTR and (for non-blocking fds) EAGAIN.
  */
 static ssize_t read_all(int fd, void *buf, size_t count) {
-    printf("[DEBUG] Entering read_all\n");
+    log_trace("Entering read_all");
 
     size_t read_bytes = 0;
     char *ptr = buf;
+    int shm = shm_owns(fd);
     while (read_bytes < count) {
-        ssize_t r = read(fd, ptr + read_bytes, count - read_bytes);
+        ssize_t r = shm ? shm_read(fd, ptr + read_bytes, count - read_bytes)
+                        : read(fd, ptr + read_bytes, count - read_bytes);
         if (r < 0) {
             if (errno == EINTR) continue;
-            printf("[DEBUG] Exiting read_all with error\n");
+            if (errno == EAGAIN && wait_ready(fd, POLLIN) == 0) continue;
+            log_trace("Exiting read_all with error");
             return -1;
         }
         if (r == 0) break;  // EOF
         read_bytes += r;
     }
 
-    printf("[DEBUG] Exiting read_all\n");
+    log_trace("Exiting read_all");
     return read_bytes == count ? 0 : -1;
 }
 
@@ -64,48 +140,68 @@ static ssize_t read_all(int fd, void *buf, size_t count) {
  * Send a packet with optional payload.
  */
 int proto_send_packet(int fd, MZW_PACKET *pkt, void *data) {
-    printf("[DEBUG] Entering proto_send_packet\n");
+    TRACE_SCOPE("send");
+    log_trace("Entering proto_send_packet");
 
     if (!pkt || fd < 0) {
         errno = EINVAL;
-        printf("[DEBUG] Exiting proto_send_packet with error: invalid arguments\n");
+        log_trace("Exiting proto_send_packet with error: invalid arguments");
         return -1;
     }
 
+    // Stamp the packet with the time it is sent, unless the caller has.
+    // The caller's packet may be broadcast, so a copy is stamped.
+    MZW_PACKET stamped = *pkt;
+    if (stamped.timestamp_sec == 0 && stamped.timestamp_nsec == 0) {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        stamped.timestamp_sec = now.tv_sec;
+        stamped.timestamp_nsec = now.tv_nsec;
+    }
+
+    // Connections served by the io_uring backend are written asynchronously.
+    if (uring_owns(fd))
+        return uring_send_packet(fd, &stamped, data);
+
     // Convert fields to network byte order (copy so we don't modify original)
-    MZW_PACKET net_pkt = *pkt;
+    MZW_PACKET net_pkt = stamped;
     net_pkt.size = htons(pkt->size);
-    net_pkt.timestamp_sec = htonl(pkt->timestamp_sec);
-    net_pkt.timestamp_nsec = htonl(pkt->timestamp_nsec);
+    net_pkt.timestamp_sec = htonl(stamped.timestamp_sec);
+    net_pkt.timestamp_nsec = htonl(stamped.timestamp_nsec);
+
+    // A shared-memory connection takes the whole packet at once.
+    if (shm_owns(fd))
+        return shm_write_packet(fd, &net_pkt, data, pkt->size > 0 && data ? pkt->size : 0);
 
     // Send packet header
     if (write_all(fd, &net_pkt, HEADER_SIZE) < 0) {
-        printf("[DEBUG] Exiting proto_send_packet with error: failed to write header\n");
+        log_trace("Exiting proto_send_packet with error: failed to write header");
         return -1;
     }
 
     // Send optional payload
     if (pkt->size > 0 && data != NULL) {
         if (write_all(fd, data, pkt->size) < 0) {
-            printf("[DEBUG] Exiting proto_send_packet with error: failed to write payload\n");
+            log_trace("Exiting proto_send_packet with error: failed to write payload");
             return -1;
         }
     }
 
-    printf("[DEBUG] Exiting proto_send_packet successfully\n");
+    log_trace("Exiting proto_send_packet successfully");
     return 0;
 }
 
 
 /*
- * Receive a packet, and optional payload (malloc'd if present).
+ * Receive a packet, and optional payload obtained from the given allocator.
  */
-int proto_recv_packet(int fd, MZW_PACKET *pkt, void **datap) {
-    printf("[DEBUG] Entering proto_recv_packet\n");
+static int recv_packet(int fd, MZW_PACKET *pkt, void **datap,
+                       void *(*alloc)(size_t), void (*release)(void *)) {
+    log_trace("Entering proto_recv_packet");
 
     if (!pkt || fd < 0 || !datap) {
         errno = EINVAL;
-        printf("[DEBUG] Exiting proto_recv_packet with error: invalid arguments\n");
+        log_trace("Exiting proto_recv_packet with error: invalid arguments");
         return -1;
     }
 
@@ -114,10 +210,13 @@ int proto_recv_packet(int fd, MZW_PACKET *pkt, void **datap) {
     // Read packet header
     MZW_PACKET net_pkt;
     if (read_all(fd, &net_pkt, HEADER_SIZE) < 0) {
-        printf("[DEBUG] Exiting proto_recv_packet with error: failed to read header\n");
+        log_trace("Exiting proto_recv_packet with error: failed to read header");
         return -1;
     }
 
+    // Only the time after the header has arrived is decoding.
+    unsigned long decode = trace_begin();
+
     // Convert fields back to host byte order
     pkt->type = net_pkt.type;
     pkt->param1 = net_pkt.param1;
@@ -129,21 +228,37 @@ int proto_recv_packet(int fd, MZW_PACKET *pkt, void **datap) {
 
     // If there is a payload, read it
     if (pkt->size > 0) {
-        void *payload = malloc(pkt->size);
+        void *payload = alloc(pkt->size);
         if (!payload) {
-            printf("[DEBUG] Exiting proto_recv_packet with error: malloc failed\n");
+            log_trace("Exiting proto_recv_packet with error: malloc failed");
             return -1;
         }
 
         if (read_all(fd, payload, pkt->size) < 0) {
-            free(payload);
-            printf("[DEBUG] Exiting proto_recv_packet with error: failed to read payload\n");
+            release(payload);
+            log_trace("Exiting proto_recv_packet with error: failed to read payload");
             return -1;
         }
 
         *datap = payload;
     }
+    trace_end("decode", decode);
 
-    printf("[DEBUG] Exiting proto_recv_packet successfully\n");
+    log_trace("Exiting proto_recv_packet successfully");
     return 0;
 }
+
+/*
+ * Receive a packet, and optional payload (malloc'd if present).
+ */
+int proto_recv_packet(int fd, MZW_PACKET *pkt, void **datap) {
+    return recv_packet(fd, pkt, datap, malloc, free);
+}
+
+int proto_recv_packet_pooled(int fd, MZW_PACKET *pkt, void **datap) {
+    return recv_packet(fd, pkt, datap, slab_buf_alloc, slab_buf_free);
+}
+
+void proto_free_payload(void *payload) {
+    slab_buf_free(payload);
+}
@@ -0,0 +1,201 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include "record.h"
+#include "debug.h"
+#include "log.h"
+
+#define FLUSH_INTERVAL_MS 200           // a part-filled buffer is written after this
+
+atomic_int record_enabled = 0;
+
+static FILE *record_file = NULL;
+static unsigned long record_start;
+static atomic_uint next_conn = 1;
+static pthread_t writer_tid;
+
+/*
+ * Records are appended to buffers[current].  When it is full it is handed
+ * to the writer thread as buffers[pending], and appending carries on in
+ * the other one.
+ */
+static pthread_mutex_t buffer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t buffer_cond = PTHREAD_COND_INITIALIZER;
+static char *buffers[2];
+static int current = 0;
+static size_t fill = 0;
+static int pending = -1;
+static size_t pending_len = 0;
+static int stopping = 0;
+
+static unsigned long records = 0, dropped = 0, bytes_written = 0;
+static int write_failed = 0;
+
+static unsigned long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/*
+ * Hand the current buffer to the writer.  Called with the lock held, and
+ * only when the writer has no buffer pending.
+ */
+static void swap_buffers(void) {
+    pending = current;
+    pending_len = fill;
+    current ^= 1;
+    fill = 0;
+    pthread_cond_signal(&buffer_cond);
+}
+
+static void *writer_thread(void *arg) {
+    pthread_mutex_lock(&buffer_lock);
+    while (1) {
+        while (pending < 0 && !stopping) {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += FLUSH_INTERVAL_MS * 1000000L;
+            if (ts.tv_nsec >= 1000000000L) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000L;
+            }
+            if (pthread_cond_timedwait(&buffer_cond, &buffer_lock, &ts) == ETIMEDOUT &&
+                pending < 0 && fill > 0)
+                swap_buffers();
+        }
+        if (pending < 0)
+            break;
+
+        int b = pending;
+        size_t len = pending_len;
+        pthread_mutex_unlock(&buffer_lock);
+        if (fwrite(buffers[b], 1, len, record_file) != len || fflush(record_file) != 0)
+            write_failed = 1;
+        pthread_mutex_lock(&buffer_lock);
+        bytes_written += len;
+        pending = -1;
+    }
+    pthread_mutex_unlock(&buffer_lock);
+    return NULL;
+}
+
+/*
+ * Append one record, dropping it if both buffers are full.
+ */
+static void append(struct record_header *h, MZW_PACKET *pkt, void *payload, size_t payload_len) {
+    size_t need = sizeof(*h) + (pkt ? sizeof(*pkt) : 0) + payload_len;
+
+    pthread_mutex_lock(&buffer_lock);
+    if (fill + need > RECORD_BUFFER_SIZE) {
+        if (pending >= 0) {
+            dropped++;
+            pthread_mutex_unlock(&buffer_lock);
+            return;
+        }
+        swap_buffers();
+    }
+    char *p = buffers[current] + fill;
+    memcpy(p, h, sizeof(*h));
+    if (pkt)
+        memcpy(p + sizeof(*h), pkt, sizeof(*pkt));
+    if (payload_len)
+        memcpy(p + sizeof(*h) + sizeof(*pkt), payload, payload_len);
+    fill += need;
+    records++;
+    pthread_mutex_unlock(&buffer_lock);
+}
+
+int record_init(const char *path) {
+    struct record_file_header fh = { .magic = RECORD_MAGIC, .version = RECORD_VERSION };
+    struct timespec ts;
+
+    if (!(record_file = fopen(path, "w"))) {
+        error("Cannot open record file %s: %s", path, strerror(errno));
+        return -1;
+    }
+    clock_gettime(CLOCK_REALTIME, &ts);
+    fh.start_realtime_ns = ts.tv_sec * 1000000000UL + ts.tv_nsec;
+    record_start = now_ns();
+    buffers[0] = malloc(RECORD_BUFFER_SIZE);
+    buffers[1] = malloc(RECORD_BUFFER_SIZE);
+    if (!buffers[0] || !buffers[1] || fwrite(&fh, sizeof(fh), 1, record_file) != 1 ||
+        pthread_create(&writer_tid, NULL, writer_thread, NULL) != 0) {
+        error("Cannot start recording to %s", path);
+        fclose(record_file);
+        record_file = NULL;
+        return -1;
+    }
+    bytes_written = sizeof(fh);
+    atomic_store(&record_enabled, 1);
+    info("Recording client packets to %s", path);
+    return 0;
+}
+
+unsigned int record_conn_id(void) {
+    return atomic_fetch_add_explicit(&next_conn, 1, memory_order_relaxed);
+}
+
+void record_packet(unsigned int conn, MZW_PACKET *pkt, void *payload, unsigned long ns) {
+    struct record_header h = {
+        .time_ns = ns > record_start ? ns - record_start : 0,
+        .conn = conn,
+        .kind = RECORD_PACKET,
+        .size = sizeof(*pkt) + (payload ? pkt->size : 0)
+    };
+    MZW_PACKET wire = *pkt;
+
+    wire.size = htons(pkt->size);
+    wire.timestamp_sec = htonl(pkt->timestamp_sec);
+    wire.timestamp_nsec = htonl(pkt->timestamp_nsec);
+    append(&h, &wire, payload, payload ? pkt->size : 0);
+}
+
+void record_close(unsigned int conn) {
+    struct record_header h = {
+        .time_ns = now_ns() - record_start,
+        .conn = conn,
+        .kind = RECORD_CLOSE,
+        .size = 0
+    };
+    append(&h, NULL, NULL, 0);
+}
+
+void record_fini(void) {
+    if (!record_file)
+        return;
+    atomic_store(&record_enabled, 0);
+
+    pthread_mutex_lock(&buffer_lock);
+    stopping = 1;
+    pthread_cond_signal(&buffer_cond);
+    pthread_mutex_unlock(&buffer_lock);
+    pthread_join(writer_tid, NULL);
+
+    // The writer has gone, so what is left can be written from here.
+    if (fill && fwrite(buffers[current], 1, fill, record_file) != fill)
+        write_failed = 1;
+    bytes_written += fill;
+    fill = 0;
+    if (fclose(record_file) != 0 || write_failed)
+        error("Failed to write all of the recorded packets");
+    else
+        log_info("Recorded %lu packets and closes (%lu dropped)", records, dropped);
+    record_file = NULL;
+    free(buffers[0]);
+    free(buffers[1]);
+}
+
+void record_show(FILE *out) {
+    pthread_mutex_lock(&buffer_lock);
+    fprintf(out, "record: %s, %lu records, %lu bytes written, %zu buffered, %lu dropped%s\n",
+            atomic_load(&record_enabled) ? "on" : "off", records, bytes_written,
+            fill + (pending >= 0 ? pending_len : 0), dropped,
+            write_failed ? ", write error" : "");
+    pthread_mutex_unlock(&buffer_lock);
+}
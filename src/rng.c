@@ -0,0 +1,102 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/random.h>
+
+#include "rng.h"
+#include "debug.h"
+#include "log.h"
+
+static uint64_t master_seed;
+static int master_fixed = 0;
+static pthread_once_t master_once = PTHREAD_ONCE_INIT;
+static atomic_ulong streams = 0;        // threads seeded so far
+
+static __thread uint64_t state[4];
+static __thread int seeded = 0;
+
+static uint64_t splitmix64(uint64_t *x) {
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static inline uint64_t rotl(uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+}
+
+static void random_master(void) {
+    if (master_fixed)
+        return;
+    if (getrandom(&master_seed, sizeof(master_seed), 0) != sizeof(master_seed)) {
+        // Only fails on kernels without getrandom(); this is not for secrets.
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        master_seed = ((uint64_t)ts.tv_sec << 32) ^ ts.tv_nsec ^ ((uint64_t)getpid() << 16);
+    }
+}
+
+void rng_init(uint64_t seed, int fixed) {
+    if (fixed) {
+        master_seed = seed;
+        master_fixed = 1;
+    }
+    pthread_once(&master_once, random_master);
+    log_info("PRNG master seed %lu (%s)", (long)master_seed,
+             (long)(master_fixed ? "fixed" : "random"));
+}
+
+uint64_t rng_seed(int *fixedp) {
+    pthread_once(&master_once, random_master);
+    if (fixedp)
+        *fixedp = master_fixed;
+    return master_seed;
+}
+
+/*
+ * Seed the calling thread's generator.  Each thread gets a distinct stream
+ * number, which is mixed into the master seed before it is expanded with
+ * splitmix64 (as recommended for xoshiro), so the states of different
+ * threads are unrelated.
+ */
+static void seed_thread(void) {
+    pthread_once(&master_once, random_master);
+    uint64_t stream = atomic_fetch_add_explicit(&streams, 1, memory_order_relaxed);
+    uint64_t x = master_seed ^ (stream * 0xd1b54a32d192ed03ULL);
+    for (int i = 0; i < 4; i++)
+        state[i] = splitmix64(&x);
+    seeded = 1;
+}
+
+uint64_t rng_next(void) {
+    if (!seeded)
+        seed_thread();
+
+    // xoshiro256** by Blackman and Vigna.
+    uint64_t *s = state;
+    uint64_t result = rotl(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 45);
+    return result;
+}
+
+uint32_t rng_below(uint32_t n) {
+    // Lemire's multiply-and-reject: no division in the common case, and no
+    // modulo bias.
+    uint64_t m = (uint64_t)(uint32_t)(rng_next() >> 32) * n;
+    if ((uint32_t)m < n) {
+        uint32_t threshold = -n % n;
+        while ((uint32_t)m < threshold)
+            m = (uint64_t)(uint32_t)(rng_next() >> 32) * n;
+    }
+    return m >> 32;
+}
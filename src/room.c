@@ -0,0 +1,71 @@
+#include <stdio.h>
+#include <stdatomic.h>
+
+#include "room.h"
+#include "player_ext.h"
+#include "debug.h"
+
+__thread int room_current = 0;
+
+static int nrooms = 1;
+static int capacity = MAX_PLAYERS;
+static int large = 0;
+static atomic_ulong assigned[ROOM_MAX];
+
+int room_init(int count, int players) {
+    if (count < 1 || count > ROOM_MAX || players < 0 || players > ROOM_IDS_MAX)
+        return -1;
+    nrooms = count;
+    large = players > 0;
+    capacity = large ? players : MAX_PLAYERS;
+    if (count > 1 || large)
+        info("Serving %d room(s) of up to %d players", count, capacity);
+    return 0;
+}
+
+int room_count(void) {
+    return nrooms;
+}
+
+int room_capacity(void) {
+    return capacity;
+}
+
+int room_large(void) {
+    return large;
+}
+
+int room_assign(OBJECT avatar) {
+    int best = -1, best_load = capacity, any = -1, any_load = capacity;
+
+    if (nrooms == 1)
+        return 0;
+    // The counts are only a hint: a login may still find its avatar taken
+    // by the time it gets there, as it could with one room.
+    for (int r = 0; r < nrooms; r++) {
+        int load = player_room_count(r);
+        if (load < any_load) {
+            any = r;
+            any_load = load;
+        }
+        if (avatar && load < best_load && !player_room_has(r, avatar)) {
+            best = r;
+            best_load = load;
+        }
+    }
+    int room = best >= 0 ? best : any >= 0 ? any : 0;
+    atomic_fetch_add_explicit(&assigned[room], 1, memory_order_relaxed);
+    return room;
+}
+
+void room_show(FILE *out) {
+    int total = 0;
+
+    fprintf(out, "ROOM PLAYERS ASSIGNED\n");
+    for (int r = 0; r < nrooms; r++) {
+        int load = player_room_count(r);
+        total += load;
+        fprintf(out, "%-4d %-7d %lu\n", r, load, atomic_load(&assigned[r]));
+    }
+    fprintf(out, "%d room(s), %d player(s)\n", nrooms, total);
+}
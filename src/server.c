@@ -4,21 +4,37 @@
 #include <signal.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
 
 #include "server.h"
+#include "server_ext.h"
+#include "handoff.h"
+#include "pool.h"
+#include "uring.h"
+#include "coro.h"
 #include "client_registry.h"
+#include "client_registry_ext.h"
 #include "protocol.h"
+#include "protocol_ext.h"
+#include "slab.h"
+#include "metrics.h"
+#include "latency.h"
+#include "trace.h"
+#include "record.h"
+#include "udp.h"
+#include "room.h"
+#include "shm.h"
 #include "player.h"
+#include "player_ext.h"
 #include "maze.h"
 #include "debug.h"
-
-#define MAX_PLAYERS 26             // if not already defined
-typedef struct player PLAYER;     // forward declaration of opaque struct
-PLAYER *get_player_by_index(int idx); // forward declare the function
-// Accessor functions from player.c
-const char *player_get_name(PLAYER *player);
-int player_get_score(PLAYER *player);
-char player_get_avatar(PLAYER *player);
+#include "log.h"
 
 volatile sig_atomic_t got_hit = 0;
 
@@ -31,289 +47,826 @@ void sigusr1_handler(int sig) {
 
 int debug_show_maze = 0;
 
+#define POLLER_BATCH 256        // readiness events taken per epoll_wait()
+
 extern CLIENT_REGISTRY *client_registry;
 
-void *mzw_client_service(void *arg) {
-    printf("[DEBUG] Entered mzw_client_service\n");
+/*
+ * Send a packet directly on a client connection.
+ */
+static int send_direct(int fd, MZW_PACKET *pkt, void *data) {
+    size_t bytes = sizeof(*pkt) + (data ? pkt->size : 0);
+    creg_add_bytes(client_registry, fd, 0, bytes);
+    metrics_packet_out(pkt->type, bytes);
+    return proto_send_packet(fd, pkt, data);
+}
 
-    int fd = *((int *)arg);
-    free(arg);  // Clean up the dynamically allocated fd wrapper
+/*
+ * Send a reply with no payload directly on a client connection.
+ */
+static int send_reply(int fd, MZW_PACKET_TYPE type, int param1, int param2, int param3) {
+    MZW_PACKET reply = {
+        .type = type,
+        .param1 = param1,
+        .param2 = param2,
+        .param3 = param3,
+        .size = 0
+    };
+    return send_direct(fd, &reply, NULL);
+}
 
+static void install_sigusr1_handler(void) {
     struct sigaction sa;
     sa.sa_handler = sigusr1_handler;
     sigemptyset(&sa.sa_mask);
     sa.sa_flags = 0;
     sigaction(SIGUSR1, &sa, NULL);
+}
 
+/*
+ * State of one client connection.  In pool mode the task is queued on the
+ * worker pool whenever the connection has input.
+ */
+struct client_conn {
+    struct pool_task task;      // must be first
+    int fd;
+    PLAYER *player;             // NULL until logged in
+    unsigned int rec_id;        // number in the packet recording, 0 until its first packet
+    uint32_t events;            // pool mode: readiness last reported by the poller
+    int lowat;                  // pool mode: the socket's SO_RCVLOWAT
+    uint64_t respawn_ns;        // pool mode: when the player's purgatory ends
+    struct client_conn *next_respawn;
+};
+
+/*
+ * A connection, and the player (if any) already logged in on it, passed to
+ * the thread or coroutine that is to serve it.
+ */
+struct client_start {
+    int fd;
+    PLAYER *player;
+};
+
+static struct slab_cache conn_cache = SLAB_CACHE_INITIALIZER("client_conn", sizeof(struct client_conn));
+static struct slab_cache start_cache = SLAB_CACHE_INITIALIZER("client_start", sizeof(struct client_start));
+
+static int epoll_fd = -1;       // pool mode: connections waiting for input
+static int wake_fd = -1;        // pool mode: wakes the poller for a freeze or a respawn
+static int use_uring = 0;       // connections are served by the io_uring backend
+static int use_coro = 0;        // each connection's service loop is a coroutine
+
+/*
+ * Pool mode: connections whose players are in purgatory, in the order
+ * their purgatories end (they all last the same time).  The poller
+ * respawns them, so that no worker sleeps through one.
+ */
+static pthread_mutex_t respawn_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct client_conn *respawn_head, *respawn_tail;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
+/*
+ * Handle one packet from a client.  The payload remains owned by the
+ * caller.  Returns -1 if the connection is to be closed.
+ */
+static int client_dispatch(struct client_conn *c, MZW_PACKET *pkt, void *payload) {
+    int fd = c->fd;
+    PLAYER *player = c->player;
+
+    metrics_packet_in(pkt->type, sizeof(*pkt) + pkt->size);
+
+    if (!player && pkt->type != MZW_LOGIN_PKT) {
+        log_debug("No LOGIN received. Auto-logging in as A Anonymous");
+
+        // A client that has not logged in cannot have asked for ids, which
+        // it needs in a large room (see below).
+        if (room_large()) {
+            metrics_add(METRIC_LOGINS_INUSE, 1);
+            send_reply(fd, MZW_INUSE_PKT, 0, 0, 0);
+            return -1;
+        }
 
-    printf("[DEBUG] Detached thread and registering client (fd=%d)\n", fd);
-    pthread_detach(pthread_self());
-    creg_register(client_registry, fd);
-
-    PLAYER *player = NULL;
-    int logged_in = 0;
+        char default_name[] = "Anonymous";
+        unsigned char avatar = 0;
 
-    MZW_PACKET pkt;
-    void *payload = NULL;
+        room_enter(room_assign(0));
 
-    while (1) {
-        if (player != NULL) {
-            printf("[DEBUG] Checking for laser hit\n");
-            if (got_hit && player) {
-                got_hit = 0;
-                player_check_for_laser_hit(player);
+        // Scan for first available avatar from 'A' to 'Z'
+        for (int i = 0; i < 26; i++) {
+            PLAYER *existing = get_player_by_index(i); // You must have this in player.c
+            if (existing == NULL) {
+                avatar = 'A' + i;
+                break;
             }
+        }
 
+        if (avatar == 0) {
+            log_debug("Auto-login failed: no available avatars");
+            return -1;
         }
 
-        printf("[DEBUG] Waiting to receive packet on fd=%d\n", fd);
-        if (proto_recv_packet(fd, &pkt, &payload) < 0) {
-            printf("[DEBUG] proto_recv_packet failed or client disconnected on fd=%d\n", fd);
-            break;
+        log_debug("Auto-picked avatar '%c' for Anonymous", avatar);
+        player = player_login(fd, avatar, default_name);
+
+        if (!player) {
+            log_debug("Auto-login failed: avatar A already in use");
+            metrics_add(METRIC_LOGINS_INUSE, 1);
+            send_reply(fd, MZW_INUSE_PKT, 0, 0, 0);
+            return -1;
         }
 
-        if (!logged_in && pkt.type != MZW_LOGIN_PKT) {
-            printf("[DEBUG] No LOGIN received. Auto-logging in as A Anonymous\n");
+        c->player = player;
+        log_debug("Auto-login successful");
+        metrics_add(METRIC_LOGINS, 1);
 
-            char *default_name = strdup("Anonymous");
-            unsigned char avatar = 0;
+        send_reply(fd, MZW_READY_PKT, 0, VIEW_DEPTH, 0);
 
-            // Scan for first available avatar from 'A' to 'Z'
-            for (int i = 0; i < 26; i++) {
-                PLAYER *existing = get_player_by_index(i); // You must have this in player.c
-                if (existing == NULL) {
-                    avatar = 'A' + i;
-                    break;
-                }
-            }
+        log_debug("Resetting player view after auto-login");
+        player_reset(player);
+        return 0;
+    }
+
+    switch (pkt->type) {
+        case MZW_LOGIN_PKT: {
+            log_debug("Received LOGIN packet");
 
-            if (avatar == 0) {
-                printf("[DEBUG] Auto-login failed: no available avatars\n");
-                free(default_name);
+            if (player) break;
+
+            if (pkt->size > PLAYER_NAME_MAX) {
+                log_debug("Refusing a login with a %d-byte name", pkt->size);
+                metrics_add(METRIC_LOGINS_INUSE, 1);
+                send_reply(fd, MZW_INUSE_PKT, 0, 0, 0);
                 break;
             }
 
-            printf("[DEBUG] Auto-picked avatar '%c' for Anonymous\n", avatar);
-            player = player_login(fd, avatar, default_name);
+            // player_login() copies the name, so it only needs terminating.
+            unsigned char avatar = pkt->param1;
+            char name_buf[PLAYER_NAME_MAX + 1];
+            char *name = NULL;
+            if (payload) {
+                memcpy(name_buf, payload, pkt->size);
+                name_buf[pkt->size] = '\0';
+                name = name_buf;
+            }
 
-            free(default_name);
+            // Debug print of parsed name
+            if (name) {
+                log_debug("Received login name (length=%d)", pkt->size);
+            } else {
+                log_debug("No login name received (name is NULL)");
+            }
 
-            if (!player) {
-                printf("[DEBUG] Auto-login failed: avatar A already in use\n");
-                MZW_PACKET reply = {
-                    .type = MZW_INUSE_PKT,
-                    .size = 0
-                };
-                proto_send_packet(fd, &reply, NULL);
-                if (payload) {
-                    free(payload);
-                    payload = NULL;
-                }
+            // Letters are shared in a large room, so a client that cannot
+            // tell players apart by id would keep a garbled scoreboard.
+            if (room_large() && !(pkt->param3 & MZW_LOGIN_WIDE_ID)) {
+                log_debug("Refusing a login without wide ids in a large room");
+                metrics_add(METRIC_LOGINS_INUSE, 1);
+                send_reply(fd, MZW_INUSE_PKT, 0, 0, 0);
                 break;
             }
 
-            logged_in = 1;
-            printf("[DEBUG] Auto-login successful\n");
+            // The lobby picks the room; everything below happens there.
+            room_enter(room_assign(avatar));
+            log_debug("Attempting login with avatar '%c'", avatar);
+            player = player_login(fd, avatar, name);
+
+            if (!player) {
+                log_debug("Login failed for avatar '%c'. Trying fallback...", avatar);
+
+                if (name && strcmp(name, "Anonymous") == 0) {
+                    for (int i = 0; i < 26; i++) {
+                        unsigned char try_avatar = 'A' + i;
+                        if (get_player_by_index(i) == NULL) {
+                            log_debug("Trying fallback avatar '%c'", try_avatar);
+                            player = player_login(fd, try_avatar, name);
+                            if (player) {
+                                avatar = try_avatar;
+                                break;
+                            }
+                        }
+                    }
+                }
+
+                if (!player) {
+                    log_debug("All avatars in use or fallback failed");
+                    metrics_add(METRIC_LOGINS_INUSE, 1);
+                    send_reply(fd, MZW_INUSE_PKT, 0, 0, 0);
+                    break;
+                }
+            }
 
-            MZW_PACKET reply = {
+            c->player = player;
+            log_debug("Login successful");
+            metrics_add(METRIC_LOGINS, 1);
+
+            // Acknowledge the protocol extensions asked for that are known.
+            int view_flags = (pkt->param2 & MZW_LOGIN_COMPACT_VIEW) |
+                (pkt->param3 & MZW_LOGIN_WIDE_ID);
+            int max_depth = pkt->param3 & MZW_LOGIN_DEPTH_MASK;
+            if (max_depth <= 0 || max_depth > VIEW_DEPTH)
+                max_depth = VIEW_DEPTH;
+            int max_rate = (pkt->param2 >> MZW_LOGIN_RATE_SHIFT) & MZW_LOGIN_RATE_MASK;
+            player_set_view_flags(player, view_flags);
+            player_set_view_limits(player, max_depth, max_rate);
+
+            // The READY carries the player's id if asked for, then a UDP
+            // channel's token and port if one is offered.
+            unsigned char ready_data[2 + UDP_TOKEN_SIZE + 2];
+            int len = 0, udp_port = -1;
+            if (view_flags & MZW_LOGIN_WIDE_ID) {
+                ready_data[len++] = player_get_id(player) >> 8;
+                ready_data[len++] = player_get_id(player) & 0xff;
+            }
+            if ((pkt->param2 & MZW_LOGIN_UDP_VIEW) && (view_flags & MZW_LOGIN_COMPACT_VIEW) &&
+                (udp_port = udp_open(player_slot(player), ready_data + len)) > 0) {
+                view_flags |= MZW_LOGIN_UDP_VIEW;
+                len += UDP_TOKEN_SIZE;
+                ready_data[len++] = udp_port >> 8;
+                ready_data[len++] = udp_port & 0xff;
+            }
+            MZW_PACKET ready = {
                 .type = MZW_READY_PKT,
-                .size = 0
+                .param1 = view_flags,
+                .param2 = max_depth,
+                .param3 = max_rate,
+                .size = len
             };
-            proto_send_packet(fd, &reply, NULL);
+            send_direct(fd, &ready, len ? ready_data : NULL);
 
-            printf("[DEBUG] Resetting player view after auto-login\n");
+            log_debug("Resetting player view");
             player_reset(player);
+            log_debug("Broadcasting initial score for %c", player_get_avatar(player));
+            player_announce(player);
 
-            if (payload) {
-                free(payload);
-                payload = NULL;
+            break;
+        }
+
+
+       case MZW_MOVE_PKT: {
+            log_debug("MOVE packet received");
+            int sign = pkt->param1;
+
+            if (player_move(player, sign) == 0) {
+                log_debug("Movement succeeded for %c, updating view", player_get_avatar(player));
+                player_update_view(player);
+            } else {
+                log_debug("Movement failed for %c, no view update", player_get_avatar(player));
             }
 
-            continue;  // Go back to top of loop
+            break;
         }
 
+        case MZW_TURN_PKT: {
+            log_debug("TURN packet received");
+            int dir = pkt->param1;
+            player_rotate(player, dir);
+            player_update_view(player);
+            break;
+        }
 
-        switch (pkt.type) {
-            case MZW_LOGIN_PKT: {
-                printf("[DEBUG] Received LOGIN packet\n");
 
-                if (logged_in) break;
+        case MZW_FIRE_PKT: {
+            log_debug("FIRE packet received");
+            player_fire_laser(player);
+            break;
+        }
 
-                if (pkt.size > 256) {
-                    warn("LOGIN payload too large");
-                    free(payload);
-                    break;
-                }
 
-                unsigned char avatar = pkt.param1;
-                char *name = payload ? strndup(payload, pkt.size) : NULL;
+        case MZW_REFRESH_PKT: {
+            log_debug("REFRESH packet received");
+            player_invalidate_view(player);
+            player_update_view(player);
+            break;
+        }
 
-                // Dump raw payload bytes
-                if (payload && pkt.size > 0) {
-                    printf("[DEBUG] Raw payload bytes (length=%d): ", pkt.size);
-                    for (int i = 0; i < pkt.size; i++) {
-                        printf("%02x ", ((unsigned char *)payload)[i]);
-                    }
-                    printf("\n");
-                }
 
-                // Debug print of parsed name
-                if (name) {
-                    printf("[DEBUG] Received login name: '%.*s' (length=%d)\n", pkt.size, name, pkt.size);
-                } else {
-                    printf("[DEBUG] No login name received (name is NULL)\n");
-                }
+        case MZW_SEND_PKT: {
+            log_debug("SEND (chat) packet received");
+            if (payload && pkt->size > 0)
+                player_send_chat(player, payload, pkt->size);
+            break;
+        }
 
-                free(payload);
-                payload = NULL;
 
-                printf("[DEBUG] Attempting login with avatar '%c'\n", avatar);
-                player = player_login(fd, avatar, name);
+        default:
+            log_warn("Unhandled packet type %d", pkt->type);
+            break;
+    }
 
-                if (!player) {
-                    printf("[DEBUG] Login failed for avatar '%c'. Trying fallback...\n", avatar);
-
-                    if (name && strcmp(name, "Anonymous") == 0) {
-                        for (int i = 0; i < 26; i++) {
-                            unsigned char try_avatar = 'A' + i;
-                            if (get_player_by_index(i) == NULL) {
-                                printf("[DEBUG] Trying fallback avatar '%c'\n", try_avatar);
-                                player = player_login(fd, try_avatar, name);
-                                if (player) {
-                                    avatar = try_avatar;
-                                    break;
-                                }
-                            }
-                        }
-                    }
+    if (debug_show_maze)
+        show_maze();
+    return 0;
+}
 
-                    if (!player) {
-                        printf("[DEBUG] All avatars in use or fallback failed\n");
-                        MZW_PACKET reply = {
-                            .type = MZW_INUSE_PKT,
-                            .size = 0
-                        };
-                        proto_send_packet(fd, &reply, NULL);
-                        free(name);  // free only after done using it
-                        break;
-                    }
-                }
+static const char *dispatch_names[] = {
+    "dispatch", "dispatch LOGIN", "dispatch MOVE", "dispatch TURN", "dispatch FIRE",
+    "dispatch REFRESH", "dispatch SEND"
+};
+
+/*
+ * Handle one packet from a client, recording the packet if recording is
+ * on and the time taken to write everything it caused.
+ */
+static int client_packet(struct client_conn *c, MZW_PACKET *pkt, void *payload) {
+    struct timespec t0, t1;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (atomic_load_explicit(&record_enabled, memory_order_relaxed)) {
+        if (!c->rec_id)
+            c->rec_id = record_conn_id();
+        record_packet(c->rec_id, pkt, payload, t0.tv_sec * 1000000000UL + t0.tv_nsec);
+    }
+    // Another connection served by this thread may have left it in
+    // another room.
+    if (c->player)
+        room_enter(player_get_room(c->player));
+    int ret = client_dispatch(c, pkt, payload);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    latency_record(pkt->type, (t1.tv_sec - t0.tv_sec) * 1000000000L + (t1.tv_nsec - t0.tv_nsec));
+    if (atomic_load_explicit(&trace_enabled, memory_order_relaxed)) {
+        int type = pkt->type < sizeof(dispatch_names) / sizeof(dispatch_names[0]) ? pkt->type : 0;
+        trace_span(dispatch_names[type], t0.tv_sec * 1000000000UL + t0.tv_nsec,
+                   t1.tv_sec * 1000000000UL + t1.tv_nsec);
+    }
+    return ret;
+}
 
-                free(name);  // move here
-
-                logged_in = 1;
-                printf("[DEBUG] Login successful\n");
-
-                MZW_PACKET reply = {
-                    .type = MZW_READY_PKT,
-                    .size = 0
-                };
-                proto_send_packet(fd, &reply, NULL);
-
-                printf("[DEBUG] Resetting player view\n");
-                player_reset(player);
-                printf("[DEBUG] Broadcasting initial score for %c (%s)\n",
-                    player_get_avatar(player),
-                    player_get_name(player) ? player_get_name(player) : "null");
-
-                MZW_PACKET score_pkt = {
-                    .type = MZW_SCORE_PKT,
-                    .param1 = player_get_avatar(player),
-                    .param2 = player_get_score(player),
-                    .size = player_get_name(player) ? strlen(player_get_name(player)) : 0
-                };
-
-                for (int i = 0; i < MAX_PLAYERS; i++) {
-                    PLAYER *p = get_player_by_index(i);
-                    if (p) {
-                        player_send_packet(p, &score_pkt, (void *)player_get_name(player));
-                    }
-                }
+/*
+ * Log out, unregister and close a client connection.
+ */
+static void client_close(struct client_conn *c) {
+    log_debug("Cleaning up after client on fd=%d", c->fd);
+
+    if (c->player != NULL)
+        player_logout(c->player);
+    if (c->rec_id && atomic_load(&record_enabled))
+        record_close(c->rec_id);
+
+    // Unregister before closing, so a new connection that is handed the same
+    // fd number can never be unregistered by this thread.
+    creg_unregister(client_registry, c->fd);
+    shm_release(c->fd);
+    close(c->fd);
+}
 
+/*
+ * Service loop for a registered client connection, in thread-per-connection
+ * mode.  On return the player has been logged out, the connection
+ * unregistered and closed, and the handoff participation taken by the
+ * creator of this thread released.
+ */
+static void client_service(int fd, PLAYER *player) {
+    struct client_conn conn = { .fd = fd, .player = player };
+    MZW_PACKET pkt;
+    void *payload = NULL;
 
-                break;
+    while (1) {
+        if (conn.player != NULL) {
+            log_debug("Checking for laser hit");
+            // A coroutine shares its thread, and so the shooter's SIGUSR1,
+            // with other connections, so it cannot rely on got_hit.
+            if (got_hit || use_coro) {
+                got_hit = 0;
+                player_check_for_laser_hit(conn.player);
             }
+        }
+
+        log_debug("Waiting to receive packet on fd=%d", fd);
+        if (handoff_wait_readable(fd) < 0 ||
+            proto_recv_packet_pooled(fd, &pkt, &payload) < 0) {
+            log_debug("proto_recv_packet failed or client disconnected on fd=%d", fd);
+            break;
+        }
+        creg_add_bytes(client_registry, fd, sizeof(pkt) + pkt.size, 0);
 
+        int ret = client_packet(&conn, &pkt, payload);
+        proto_free_payload(payload);
+        payload = NULL;
+        if (ret < 0)
+            break;
+    }
 
-           case MZW_MOVE_PKT: {
-                printf("[DEBUG] MOVE packet received\n");
-                int sign = pkt.param1;
+    client_close(&conn);
+    handoff_leave();
+}
 
-                if (player_move(player, sign) == 0) {
-                    printf("[DEBUG] Movement succeeded for %c, updating view\n", player_get_avatar(player));
-                    player_update_view(player);
-                } else {
-                    printf("[DEBUG] Movement failed for %c, no view update\n", player_get_avatar(player));
-                }
+void *mzw_client_service(void *arg) {
+    log_trace("Entered mzw_client_service");
 
-                break;
-            }
+    int fd = *((int *)arg);
+    free(arg);  // Clean up the dynamically allocated fd wrapper
 
-            case MZW_TURN_PKT: {
-                printf("[DEBUG] TURN packet received\n");
-                int dir = pkt.param1;
-                player_rotate(player, dir);
-                player_update_view(player);
+    install_sigusr1_handler();
 
-                if (debug_show_maze)
-                    show_maze();
-                break;
-            }
+    log_debug("Detached thread and registering client (fd=%d)", fd);
+    pthread_detach(pthread_self());
+    creg_register(client_registry, fd);
 
+    client_service(fd, NULL);
 
-            case MZW_FIRE_PKT: {
-                printf("[DEBUG] FIRE packet received\n");
-                player_fire_laser(player);
+    log_trace("Exiting mzw_client_service");
+    return NULL;
+}
 
-                if (debug_show_maze)
-                    show_maze();
-                break;
-            }
+/*
+ * Thread per connection: the service thread for a connection started by
+ * mzw_client_start().
+ */
+static void *client_thread(void *arg) {
+    struct client_start start = *(struct client_start *)arg;
+    slab_free(&start_cache, arg);
 
+    install_sigusr1_handler();
+    pthread_detach(pthread_self());
+    creg_register(client_registry, start.fd);
+    if (start.player)
+        player_adopt(start.player);
 
-            case MZW_REFRESH_PKT: {
-                printf("[DEBUG] REFRESH packet received\n");
-                player_invalidate_view(player);
-                player_update_view(player);
+    client_service(start.fd, start.player);
+    return NULL;
+}
 
-                if (debug_show_maze)
-                    show_maze();
-                break;
-            }
+/*
+ * Coroutine mode: the service loop for a connection, run as a coroutine on
+ * a scheduler thread.  Its reads yield to the scheduler when no input is
+ * available.
+ */
+static void client_coro(void *arg) {
+    struct client_start start = *(struct client_start *)arg;
+    slab_free(&start_cache, arg);
+
+    // Registered here, so that the player's thread is the scheduler's.
+    creg_register(client_registry, start.fd);
+    if (start.player)
+        player_adopt(start.player);
+    client_service(start.fd, start.player);
+}
 
+static void wake_poller(void);
 
-            case MZW_SEND_PKT: {
-                printf("[DEBUG] SEND (chat) packet received\n");
-                if (payload && pkt.size > 0)
-                    player_send_chat(player, payload, pkt.size);
-                break;
+/*
+ * Pool mode: set a socket's receive low-water mark, the least input for
+ * which the poller will report it ready.
+ */
+static void set_lowat(struct client_conn *c, int bytes) {
+    if (c->lowat != bytes && setsockopt(c->fd, SOL_SOCKET, SO_RCVLOWAT, &bytes, sizeof(bytes)) == 0)
+        c->lowat = bytes;
+}
+
+/*
+ * Pool mode: check whether a whole packet has arrived, so that reading it
+ * cannot block a worker.  If it has not, the low-water mark is raised to
+ * what the packet needs, and the connection is not reported ready again
+ * until it has all arrived.  The bytes stay in the socket meanwhile, so a
+ * handoff still finds every connection at a packet boundary.
+ *
+ * @return  1 if a packet can be read, 0 if not yet, -1 if it never will.
+ */
+static int client_has_packet(struct client_conn *c) {
+    MZW_PACKET hdr;
+    int avail = 0;
+
+    if (ioctl(c->fd, FIONREAD, &avail) < 0)
+        return -1;
+    int need = sizeof(hdr);
+    if (avail >= need && recv(c->fd, &hdr, sizeof(hdr), MSG_PEEK | MSG_DONTWAIT) == sizeof(hdr))
+        need += ntohs(hdr.size);
+    if (avail >= need) {
+        // No packet is shorter than a header.
+        set_lowat(c, sizeof(hdr));
+        return 1;
+    }
+    if (c->events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+        return -1;
+    set_lowat(c, need);
+    // If the mark could not be set the poller would report the connection
+    // at once again, so the rest is waited for in the read instead.
+    return c->lowat == need ? 0 : 1;
+}
+
+/*
+ * Pool mode: hand a connection whose player has been hit to the poller,
+ * which respawns the player when its purgatory is over and only then
+ * re-arms the connection.  A handoff waits for the respawn, as it would
+ * for a thread sleeping through the purgatory.
+ */
+static void defer_respawn(struct client_conn *c) {
+    handoff_enter();
+    c->respawn_ns = now_ns() + PLAYER_PURGATORY_MS * 1000000ULL;
+    c->next_respawn = NULL;
+    pthread_mutex_lock(&respawn_mutex);
+    if (respawn_tail)
+        respawn_tail->next_respawn = c;
+    else
+        respawn_head = c;
+    respawn_tail = c;
+    pthread_mutex_unlock(&respawn_mutex);
+    wake_poller();
+}
+
+/*
+ * Pool mode: let the poller report a connection's next input.  Its epoll
+ * registration is one-shot, so it cannot be queued again until it is
+ * re-armed here, and a client's packets are never processed concurrently
+ * or out of order.
+ */
+static int client_rearm(struct client_conn *c) {
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT, .data.ptr = c };
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &ev) == 0)
+        return 0;
+    error("epoll_ctl failed for fd=%d", c->fd);
+    return -1;
+}
+
+static void client_task_close(struct client_conn *c) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    client_close(c);
+    slab_free(&conn_cache, c);
+}
+
+/*
+ * Pool mode: run one packet for a connection that has input, then re-arm
+ * the connection.
+ */
+static void client_task(struct pool_task *task) {
+    struct client_conn *c = (struct client_conn *)task;
+    MZW_PACKET pkt;
+    void *payload = NULL;
+
+    // The shooter's SIGUSR1 went to whichever worker last ran this player,
+    // so the hit flag is checked here rather than relying on got_hit.
+    if (c->player != NULL && player_take_laser_hit(c->player)) {
+        defer_respawn(c);
+        return;
+    }
+
+    int ready = client_has_packet(c);
+    if (ready < 0)
+        goto close;
+    if (ready > 0) {
+        if (proto_recv_packet_pooled(c->fd, &pkt, &payload) < 0) {
+            log_debug("proto_recv_packet failed or client disconnected on fd=%d", c->fd);
+            goto close;
+        }
+        creg_add_bytes(client_registry, c->fd, sizeof(pkt) + pkt.size, 0);
+
+        int ret = client_packet(c, &pkt, payload);
+        proto_free_payload(payload);
+        if (ret < 0)
+            goto close;
+    }
+    if (client_rearm(c) == 0)
+        return;
+
+close:
+    client_task_close(c);
+}
+
+/*
+ * Pool mode: milliseconds until the next purgatory ends, or -1 if there
+ * is none.
+ */
+static int respawn_timeout(void) {
+    int ms = -1;
+    pthread_mutex_lock(&respawn_mutex);
+    if (respawn_head) {
+        uint64_t now = now_ns();
+        ms = respawn_head->respawn_ns > now ? (respawn_head->respawn_ns - now + 999999) / 1000000 : 0;
+    }
+    pthread_mutex_unlock(&respawn_mutex);
+    return ms;
+}
+
+/*
+ * Pool mode: respawn the players whose purgatories are over.  Their
+ * connections are disarmed, so no worker is serving them.
+ */
+static void run_respawns(void) {
+    uint64_t now = now_ns();
+
+    while (1) {
+        pthread_mutex_lock(&respawn_mutex);
+        struct client_conn *c = respawn_head;
+        if (c && c->respawn_ns <= now) {
+            respawn_head = c->next_respawn;
+            if (!respawn_head)
+                respawn_tail = NULL;
+        } else {
+            c = NULL;
+        }
+        pthread_mutex_unlock(&respawn_mutex);
+        if (!c)
+            break;
+
+        log_debug("Player %c exiting purgatory", player_get_avatar(c->player));
+        player_reset(c->player);
+        if (client_rearm(c) < 0)
+            client_task_close(c);
+        handoff_leave();
+    }
+}
+
+/*
+ * Pool mode: wait for connections with input and queue them on the pool,
+ * and respawn players.
+ */
+static void *poller_thread(void *arg) {
+    struct epoll_event events[POLLER_BATCH];
+    uint64_t count;
+
+    while (1) {
+        int n = epoll_wait(epoll_fd, events, POLLER_BATCH, respawn_timeout());
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            error("epoll_wait failed");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            struct client_conn *c = events[i].data.ptr;
+            if (c == NULL) {
+                if (read(wake_fd, &count, sizeof(count)) < 0)
+                    log_debug("wake_fd already drained");
+                continue;
             }
+            c->events = events[i].events;
+            pool_submit(&c->task);
+        }
+        run_respawns();
+        // A freeze waits for players in purgatory to be respawned.
+        if (respawn_timeout() < 0)
+            handoff_checkpoint();
+    }
+
+    handoff_leave();
+    return NULL;
+}
+
+static void wake_poller(void) {
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) < 0)
+        warn("Failed to wake poller");
+}
 
+/*
+ * io_uring mode: handle one packet on the ring thread.
+ */
+static int uring_packet(void *arg, MZW_PACKET *pkt, void *payload) {
+    struct client_conn *c = arg;
+
+    // The ring thread cannot sleep through the purgatory, so the
+    // connection is paused instead, and the packet handled after it.
+    if (c->player != NULL && player_take_laser_hit(c->player))
+        return PLAYER_PURGATORY_MS;
+    creg_add_bytes(client_registry, c->fd, sizeof(*pkt) + pkt->size, 0);
+    return client_packet(c, pkt, payload);
+}
 
-            default:
-                warn("[DEBUG] Unhandled packet type %d", pkt.type);
-                break;
+/*
+ * io_uring mode: a hit player's purgatory is over.
+ */
+static void uring_resumed(void *arg) {
+    struct client_conn *c = arg;
+
+    log_debug("Player %c exiting purgatory", player_get_avatar(c->player));
+    player_reset(c->player);
+}
+
+/*
+ * io_uring mode: a connection is closing.  The backend closes the fd once
+ * its last operation has completed, so it is only unregistered here.
+ */
+static void uring_closed(void *arg) {
+    struct client_conn *c = arg;
+
+    log_debug("Cleaning up after client on fd=%d", c->fd);
+    if (c->player != NULL)
+        player_logout(c->player);
+    if (c->rec_id && atomic_load(&record_enabled))
+        record_close(c->rec_id);
+    creg_unregister(client_registry, c->fd);
+    slab_free(&conn_cache, c);
+}
+
+int mzw_executor_init(int nworkers, int pin, int uring, int coroutines) {
+    if (uring) {
+        install_sigusr1_handler();
+        if (uring_init(uring_packet, uring_closed, uring_resumed) == 0) {
+            use_uring = 1;
+            return 0;
         }
+        log_warn("Falling back from io_uring to %s",
+                 (long)(coroutines > 0 ? "coroutines" :
+                        nworkers > 0 ? "the worker pool" : "thread per connection"));
+    }
+    if (coroutines > 0) {
+        install_sigusr1_handler();
+        if (coro_init(coroutines) < 0)
+            return -1;
+        use_coro = 1;
+        return 0;
+    }
+    if (nworkers <= 0)
+        return 0;
+
+    install_sigusr1_handler();
+    if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+        (wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0) {
+        perror("epoll/eventfd");
+        return -1;
+    }
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev) < 0 ||
+        pool_init(nworkers, pin) < 0)
+        return -1;
+
+    pthread_t tid;
+    handoff_on_freeze(wake_poller);
+    handoff_enter();
+    if (pthread_create(&tid, NULL, poller_thread, NULL) != 0) {
+        handoff_leave();
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
 
-        if (payload) {
-            free(payload);
-            payload = NULL;
+int mzw_client_start(int fd, PLAYER *player) {
+    pthread_t tid;
+    // Input on a shared-memory connection only shows on the fd when its
+    // reader is waiting, so it needs a service loop of its own.
+    int shm = shm_owns(fd);
+
+    if (use_uring && !shm) {
+        struct client_conn *c = slab_alloc(&conn_cache);
+        if (!c)
+            goto fail;
+        memset(c, 0, sizeof(*c));
+        c->fd = fd;
+        c->player = player;
+
+        creg_register(client_registry, fd);
+        if (player)
+            player_adopt(player);
+        if (uring_add(fd, c) < 0) {
+            error("Cannot add client fd=%d to io_uring", fd);
+            client_close(c);
+            slab_free(&conn_cache, c);
+            return -1;
         }
+        return 0;
+    }
 
-        if (debug_show_maze)
-            show_maze();
+    if (epoll_fd >= 0 && !shm) {
+        struct client_conn *c = slab_alloc(&conn_cache);
+        if (!c)
+            goto fail;
+        memset(c, 0, sizeof(*c));
+        c->task.run = client_task;
+        c->fd = fd;
+        c->player = player;
+
+        creg_register(client_registry, fd);
+        if (player)
+            player_adopt(player);
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT, .data.ptr = c };
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            error("epoll_ctl failed for fd=%d", fd);
+            client_close(c);
+            slab_free(&conn_cache, c);
+            return -1;
+        }
+        return 0;
     }
 
-    printf("[DEBUG] Cleaning up after client on fd=%d\n", fd);
-    if (payload) free(payload);
+    // Thread or coroutine per connection.
+    struct client_start *start = slab_alloc(&start_cache);
+    if (!start)
+        goto fail;
+    start->fd = fd;
+    start->player = player;
+
+    handoff_enter();
+    if (use_coro) {
+        // Reads on the connection must not block the scheduler.
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        if (coro_spawn(client_coro, start) == 0)
+            return 0;
+    } else if (pthread_create(&tid, NULL, client_thread, start) == 0) {
+        return 0;
+    }
+    handoff_leave();
+    slab_free(&start_cache, start);
 
-    if (logged_in && player != NULL)
+fail:
+    error("Failed to start service for client fd=%d", fd);
+    if (player)
         player_logout(player);
-
+    shm_release(fd);
     close(fd);
-    creg_unregister(client_registry, fd);
-
-    printf("[DEBUG] Exiting mzw_client_service\n");
-    return NULL;
+    return -1;
 }
@@ -0,0 +1,436 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+
+#include "shm.h"
+#include "metrics.h"
+#include "debug.h"
+#include "log.h"
+
+#define SHM_MAX_FDS 65536               // highest fd + 1 that can be a connection
+#define STALL_SLEEP_NS 50000            // between checks of a full ring
+#define TABLE_LOCKS 64                  // stripes of the lock over the table
+
+/*
+ * This process's side of a connection.  The lock serializes writers, which
+ * may be any thread that sends to the player.  The table holds a reference,
+ * and so does each caller between get_conn() and put_conn(); the segment
+ * is unmapped when the last goes, so a sender racing shm_release() writes
+ * to a ring nobody reads rather than to freed memory.
+ */
+struct shm_conn {
+    struct shm_segment *seg;
+    struct shm_ring *rx, *tx;
+    pthread_mutex_t tx_lock;
+    atomic_int refs;
+    atomic_int released;                // shm_release() has been called
+};
+
+static pthread_once_t table_once = PTHREAD_ONCE_INIT;
+static _Atomic(struct shm_conn *) *conns = NULL;
+static int max_fds = 0;
+static pthread_mutex_t table_locks[TABLE_LOCKS];
+
+static int listen_fd = -1;
+static char listen_path[108];
+static pthread_t accept_tid;
+static void (*start_fn)(int fd);
+
+static atomic_ulong accepted, active, packets, doorbells, sleeps, stalls;
+
+static void table_init(void) {
+    struct rlimit rl;
+
+    max_fds = SHM_MAX_FDS;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < (rlim_t)max_fds)
+        max_fds = rl.rlim_cur;
+    conns = calloc(max_fds, sizeof(*conns));
+    for (int i = 0; i < TABLE_LOCKS; i++)
+        pthread_mutex_init(&table_locks[i], NULL);
+}
+
+static struct shm_conn *lookup(int fd) {
+    if (!conns || fd < 0 || fd >= max_fds)
+        return NULL;
+    return atomic_load_explicit(&conns[fd], memory_order_acquire);
+}
+
+/*
+ * Look up a connection and take a reference to it, to be dropped with
+ * put_conn().
+ */
+static struct shm_conn *get_conn(int fd) {
+    if (!conns || fd < 0 || fd >= max_fds)
+        return NULL;
+    pthread_mutex_t *lock = &table_locks[fd % TABLE_LOCKS];
+    pthread_mutex_lock(lock);
+    struct shm_conn *c = atomic_load_explicit(&conns[fd], memory_order_relaxed);
+    if (c)
+        atomic_fetch_add_explicit(&c->refs, 1, memory_order_relaxed);
+    pthread_mutex_unlock(lock);
+    return c;
+}
+
+static void put_conn(struct shm_conn *c) {
+    if (atomic_fetch_sub(&c->refs, 1) != 1)
+        return;
+    munmap(c->seg, sizeof(*c->seg));
+    pthread_mutex_destroy(&c->tx_lock);
+    free(c);
+}
+
+/*
+ * Map a segment and enter the connection in the table.  The server reads
+ * the up ring, and a client the down ring.
+ */
+static int attach(int fd, int memfd, int server) {
+    pthread_once(&table_once, table_init);
+    if (!conns || fd >= max_fds)
+        return -1;
+
+    struct shm_segment *seg = mmap(NULL, sizeof(*seg), PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (seg == MAP_FAILED)
+        return -1;
+    struct shm_conn *c = malloc(sizeof(*c));
+    if (!c) {
+        munmap(seg, sizeof(*seg));
+        return -1;
+    }
+    c->seg = seg;
+    c->rx = server ? &seg->up : &seg->down;
+    c->tx = server ? &seg->down : &seg->up;
+    pthread_mutex_init(&c->tx_lock, NULL);
+    atomic_init(&c->refs, 1);
+    atomic_init(&c->released, 0);
+    atomic_store_explicit(&conns[fd], c, memory_order_release);
+    atomic_fetch_add(&active, 1);
+    return 0;
+}
+
+/*
+ * Serve one connection: create its segment, pass it over, and start it.
+ */
+static void accept_one(int fd) {
+    int memfd = memfd_create("mazewar-shm", MFD_CLOEXEC);
+    if (memfd < 0 || ftruncate(memfd, sizeof(struct shm_segment)) < 0) {
+        error("Cannot create a shared-memory segment: %s", strerror(errno));
+        goto fail;
+    }
+
+    struct shm_segment *seg = mmap(NULL, sizeof(*seg), PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (seg == MAP_FAILED)
+        goto fail;
+    seg->magic = SHM_MAGIC;
+    seg->version = SHM_VERSION;
+    munmap(seg, sizeof(*seg));
+
+    char byte = 0;
+    struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg = {
+        .msg_iov = &iov, .msg_iovlen = 1,
+        .msg_control = control.buf, .msg_controllen = sizeof(control.buf)
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &memfd, sizeof(int));
+
+    if (sendmsg(fd, &msg, MSG_NOSIGNAL) != 1 || attach(fd, memfd, 1) < 0)
+        goto fail;
+    close(memfd);
+    atomic_fetch_add(&accepted, 1);
+    start_fn(fd);
+    return;
+
+fail:
+    if (memfd >= 0)
+        close(memfd);
+    close(fd);
+}
+
+static void *accept_thread(void *arg) {
+    while (1) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break;
+        }
+        accept_one(fd);
+    }
+    return NULL;
+}
+
+int shm_init(const char *path, void (*start)(int fd)) {
+    struct sockaddr_un addr;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        error("Shared-memory socket path too long: %s", path);
+        return -1;
+    }
+    pthread_once(&table_once, table_init);
+    if (!conns)
+        return -1;
+
+    if ((listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+        perror("socket");
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    strcpy(listen_path, path);
+    unlink(path);
+
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(listen_fd, SOMAXCONN) < 0) {
+        perror("shared-memory socket");
+        close(listen_fd);
+        listen_fd = -1;
+        return -1;
+    }
+
+    start_fn = start;
+    if (pthread_create(&accept_tid, NULL, accept_thread, NULL) != 0) {
+        error("Failed to start shared-memory accept thread");
+        close(listen_fd);
+        unlink(listen_path);
+        listen_fd = -1;
+        return -1;
+    }
+
+    info("Shared-memory clients accepted on %s", path);
+    return 0;
+}
+
+void shm_fini(void) {
+    if (listen_fd < 0)
+        return;
+
+    shutdown(listen_fd, SHUT_RDWR);
+    pthread_join(accept_tid, NULL);
+    close(listen_fd);
+    unlink(listen_path);
+    listen_fd = -1;
+}
+
+int shm_connect(const char *path) {
+    struct sockaddr_un addr;
+    int fd, memfd = -1;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+        return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        goto fail;
+
+    char byte;
+    struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg = {
+        .msg_iov = &iov, .msg_iovlen = 1,
+        .msg_control = control.buf, .msg_controllen = sizeof(control.buf)
+    };
+    if (recvmsg(fd, &msg, MSG_CMSG_CLOEXEC) != 1)
+        goto fail;
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+        goto fail;
+    memcpy(&memfd, CMSG_DATA(cmsg), sizeof(int));
+
+    if (attach(fd, memfd, 0) < 0)
+        goto fail;
+    close(memfd);
+    struct shm_conn *c = lookup(fd);
+    if (c->seg->magic != SHM_MAGIC || c->seg->version != SHM_VERSION) {
+        shm_release(fd);
+        errno = EPROTO;
+        close(fd);
+        return -1;
+    }
+    return fd;
+
+fail:
+    if (memfd >= 0)
+        close(memfd);
+    close(fd);
+    return -1;
+}
+
+int shm_owns(int fd) {
+    return lookup(fd) != NULL;
+}
+
+void shm_release(int fd) {
+    if (!conns || fd < 0 || fd >= max_fds)
+        return;
+    pthread_mutex_t *lock = &table_locks[fd % TABLE_LOCKS];
+    pthread_mutex_lock(lock);
+    struct shm_conn *c = atomic_load_explicit(&conns[fd], memory_order_relaxed);
+    atomic_store(&conns[fd], NULL);
+    pthread_mutex_unlock(lock);
+    if (!c)
+        return;
+
+    // A writer waiting for room gives up; the fd is about to be closed, so
+    // it could no longer tell that the reader has gone.
+    atomic_store(&c->released, 1);
+    put_conn(c);
+    atomic_fetch_sub(&active, 1);
+}
+
+/*
+ * Read from a connection's receive ring; see shm_read().
+ */
+static ssize_t ring_read(int fd, struct shm_ring *r, void *buf, size_t count) {
+    unsigned int head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    unsigned int avail = atomic_load_explicit(&r->tail, memory_order_acquire) - head;
+
+    if (!avail) {
+        // Drain the wakeups, then say that one is wanted.  The tail is
+        // looked at again afterwards, so that a write in between, which
+        // may not have seen the flag, is not missed.
+        char bytes[64];
+        ssize_t n;
+        while ((n = recv(fd, bytes, sizeof(bytes), MSG_DONTWAIT)) > 0)
+            ;
+        int gone = n == 0;
+        atomic_store(&r->waiting, 1);
+        avail = atomic_load(&r->tail) - head;
+        if (!avail) {
+            if (gone)
+                return 0;
+            atomic_fetch_add_explicit(&sleeps, 1, memory_order_relaxed);
+            errno = EAGAIN;
+            return -1;
+        }
+        atomic_store_explicit(&r->waiting, 0, memory_order_relaxed);
+    }
+
+    size_t n = avail < count ? avail : count;
+    size_t off = head & (SHM_RING_SIZE - 1), first = SHM_RING_SIZE - off;
+    if (first >= n) {
+        memcpy(buf, r->data + off, n);
+    } else {
+        memcpy(buf, r->data + off, first);
+        memcpy((char *)buf + first, r->data, n - first);
+    }
+    atomic_store_explicit(&r->head, head + n, memory_order_release);
+    return n;
+}
+
+ssize_t shm_read(int fd, void *buf, size_t count) {
+    struct shm_conn *c = get_conn(fd);
+    if (!c) {
+        errno = EBADF;
+        return -1;
+    }
+    ssize_t n = ring_read(fd, c->rx, buf, count);
+    put_conn(c);
+    return n;
+}
+
+static void ring_put(struct shm_ring *r, unsigned int pos, const void *src, size_t n) {
+    size_t off = pos & (SHM_RING_SIZE - 1), first = SHM_RING_SIZE - off;
+    if (first >= n) {
+        memcpy(r->data + off, src, n);
+    } else {
+        memcpy(r->data + off, src, first);
+        memcpy(r->data, (const char *)src + first, n - first);
+    }
+}
+
+/*
+ * Check whether the other side has gone, or this side has shut down.
+ */
+static int hung_up(int fd) {
+    struct pollfd pfd = { .fd = fd, .events = POLLRDHUP };
+    return poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLRDHUP | POLLHUP | POLLERR));
+}
+
+int shm_write_packet(int fd, const MZW_PACKET *net_pkt, const void *data, size_t size) {
+    size_t len = sizeof(*net_pkt) + size;
+    if (len > SHM_RING_SIZE) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    struct shm_conn *c = get_conn(fd);
+    if (!c) {
+        errno = EBADF;
+        return -1;
+    }
+    struct shm_ring *r = c->tx;
+
+    pthread_mutex_lock(&c->tx_lock);
+    unsigned int tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    if (SHM_RING_SIZE - (tail - atomic_load_explicit(&r->head, memory_order_acquire)) < len) {
+        struct timespec t0, t1, pause = { 0, STALL_SLEEP_NS };
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        while (SHM_RING_SIZE - (tail - atomic_load_explicit(&r->head, memory_order_acquire)) < len) {
+            if (atomic_load(&c->released) || hung_up(fd)) {
+                pthread_mutex_unlock(&c->tx_lock);
+                put_conn(c);
+                errno = EPIPE;
+                return -1;
+            }
+            nanosleep(&pause, NULL);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        atomic_fetch_add_explicit(&stalls, 1, memory_order_relaxed);
+        metrics_add(METRIC_SEND_STALLS, 1);
+        metrics_add(METRIC_SEND_STALL_NS, (t1.tv_sec - t0.tv_sec) * 1000000000L + (t1.tv_nsec - t0.tv_nsec));
+    }
+
+    ring_put(r, tail, net_pkt, sizeof(*net_pkt));
+    if (size)
+        ring_put(r, tail + sizeof(*net_pkt), data, size);
+    atomic_store(&r->tail, tail + len);
+
+    // Wake the reader if it is waiting, once.  A released fd may already
+    // be closed, and its number taken by another connection.
+    if (!atomic_load(&c->released) && atomic_load(&r->waiting) && atomic_exchange(&r->waiting, 0)) {
+        char byte = 0;
+        send(fd, &byte, 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+        atomic_fetch_add_explicit(&doorbells, 1, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&c->tx_lock);
+    put_conn(c);
+    atomic_fetch_add_explicit(&packets, 1, memory_order_relaxed);
+    return 0;
+}
+
+void shm_show(FILE *out) {
+    if (listen_fd < 0) {
+        fprintf(out, "shm: off\n");
+        return;
+    }
+    unsigned long p = atomic_load(&packets), d = atomic_load(&doorbells);
+    fprintf(out, "shm: %s, %lu connections (%lu open), %lu packets written, %lu wakeups sent "
+            "(%.3f per packet), %lu reader sleeps, %lu full-ring stalls\n",
+            listen_path, atomic_load(&accepted), atomic_load(&active), p, d,
+            p ? (double)d / p : 0.0, atomic_load(&sleeps), atomic_load(&stalls));
+}
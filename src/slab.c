@@ -0,0 +1,239 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "slab.h"
+#include "debug.h"
+#include "log.h"
+
+#define SLAB_BYTES       16384          // memory carved into objects at a time
+#define SLAB_MIN_OBJECTS 8
+#define SLAB_BATCH       16             // objects moved between a thread and the depot
+#define SLAB_ALIGN       16
+#define SLAB_LINE        64             // slabs start on a cache line
+
+// Buffers carry a header giving their size class, so that slab_buf_free()
+// needs no size.  It is SLAB_ALIGN bytes long to keep the buffer aligned.
+#define BUF_HEADER  SLAB_ALIGN
+#define BUF_CLASSES 9                   // 16 .. 4096 bytes
+#define BUF_LARGE   0xff                // class of a buffer from malloc()
+
+struct thread_list {
+    void *head;
+    unsigned int count;
+};
+
+static __thread struct thread_list lists[SLAB_MAX_CACHES];
+static __thread int thread_registered = 0;
+
+static pthread_key_t exit_key;
+static pthread_once_t exit_once = PTHREAD_ONCE_INIT;
+
+static pthread_mutex_t caches_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct slab_cache *caches = NULL;
+static int ncaches = 0;
+static struct slab_cache *caches_by_index[SLAB_MAX_CACHES];
+
+static struct slab_cache buf_caches[BUF_CLASSES] = {
+    SLAB_CACHE_INITIALIZER("buf16", BUF_HEADER + 16),
+    SLAB_CACHE_INITIALIZER("buf32", BUF_HEADER + 32),
+    SLAB_CACHE_INITIALIZER("buf64", BUF_HEADER + 64),
+    SLAB_CACHE_INITIALIZER("buf128", BUF_HEADER + 128),
+    SLAB_CACHE_INITIALIZER("buf256", BUF_HEADER + 256),
+    SLAB_CACHE_INITIALIZER("buf512", BUF_HEADER + 512),
+    SLAB_CACHE_INITIALIZER("buf1024", BUF_HEADER + 1024),
+    SLAB_CACHE_INITIALIZER("buf2048", BUF_HEADER + 2048),
+    SLAB_CACHE_INITIALIZER("buf4096", BUF_HEADER + 4096),
+};
+static atomic_long large_live = 0;     // buffers too big for the size classes
+
+static size_t object_size(struct slab_cache *c) {
+    size_t size = c->size < sizeof(void *) ? sizeof(void *) : c->size;
+    return (size + SLAB_ALIGN - 1) & ~(size_t)(SLAB_ALIGN - 1);
+}
+
+static size_t objects_per_slab(struct slab_cache *c) {
+    size_t n = SLAB_BYTES / object_size(c);
+    return n < SLAB_MIN_OBJECTS ? SLAB_MIN_OBJECTS : n;
+}
+
+/*
+ * Give a batch of a thread's objects back to the depot.
+ */
+static void give_back(struct slab_cache *c, struct thread_list *l, unsigned int n) {
+    pthread_mutex_lock(&c->lock);
+    while (n-- > 0 && l->head) {
+        void *obj = l->head;
+        l->head = *(void **)obj;
+        l->count--;
+        *(void **)obj = c->depot;
+        c->depot = obj;
+        c->depot_count++;
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+/*
+ * Return everything cached by an exiting thread to the depots.
+ */
+static void thread_exit(void *arg) {
+    for (int i = 0; i < SLAB_MAX_CACHES; i++) {
+        if (lists[i].head)
+            give_back(caches_by_index[i], &lists[i], lists[i].count);
+    }
+}
+
+static void make_exit_key(void) {
+    pthread_key_create(&exit_key, thread_exit);
+}
+
+static void register_thread(void) {
+    pthread_once(&exit_once, make_exit_key);
+    // The value only has to be non-NULL for the destructor to run.
+    pthread_setspecific(exit_key, &thread_registered);
+    thread_registered = 1;
+}
+
+static int register_cache(struct slab_cache *c) {
+    pthread_mutex_lock(&caches_lock);
+    int i = atomic_load(&c->index);
+    if (i < 0 && ncaches < SLAB_MAX_CACHES) {
+        i = ncaches++;
+        caches_by_index[i] = c;
+        c->next = caches;
+        caches = c;
+        atomic_store(&c->index, i);
+    }
+    pthread_mutex_unlock(&caches_lock);
+    if (i < 0)
+        error("Too many slab caches: %s not registered", c->name);
+    return i;
+}
+
+/*
+ * Move a batch of objects from the depot to a thread's list, carving a new
+ * slab first if the depot is empty.
+ */
+static int refill(struct slab_cache *c, struct thread_list *l) {
+    pthread_mutex_lock(&c->lock);
+    if (!c->depot) {
+        size_t size = object_size(c), n = objects_per_slab(c);
+        char *slab = aligned_alloc(SLAB_LINE, (size * n + SLAB_LINE - 1) & ~(size_t)(SLAB_LINE - 1));
+        if (!slab) {
+            pthread_mutex_unlock(&c->lock);
+            return -1;
+        }
+        for (size_t i = n; i-- > 0; ) {
+            *(void **)(slab + i * size) = c->depot;
+            c->depot = slab + i * size;
+        }
+        c->depot_count += n;
+        c->slabs++;
+    }
+    for (int i = 0; i < SLAB_BATCH && c->depot; i++) {
+        void *obj = c->depot;
+        c->depot = *(void **)obj;
+        c->depot_count--;
+        *(void **)obj = l->head;
+        l->head = obj;
+        l->count++;
+    }
+    pthread_mutex_unlock(&c->lock);
+    return 0;
+}
+
+void *slab_alloc(struct slab_cache *c) {
+    int i = atomic_load_explicit(&c->index, memory_order_acquire);
+    if (i < 0 && (i = register_cache(c)) < 0)
+        return NULL;
+
+    struct thread_list *l = &lists[i];
+    if (!l->head) {
+        if (!thread_registered)
+            register_thread();
+        if (refill(c, l) < 0)
+            return NULL;
+    }
+    void *obj = l->head;
+    l->head = *(void **)obj;
+    l->count--;
+
+    long live = atomic_fetch_add_explicit(&c->live, 1, memory_order_relaxed) + 1;
+    long high = atomic_load_explicit(&c->high_water, memory_order_relaxed);
+    while (live > high &&
+           !atomic_compare_exchange_weak_explicit(&c->high_water, &high, live,
+                                                  memory_order_relaxed, memory_order_relaxed))
+        ;
+    atomic_fetch_add_explicit(&c->allocs, 1, memory_order_relaxed);
+    return obj;
+}
+
+void slab_free(struct slab_cache *c, void *obj) {
+    if (!obj)
+        return;
+
+    // An object can only have come from a registered cache.
+    struct thread_list *l = &lists[atomic_load_explicit(&c->index, memory_order_relaxed)];
+    if (!thread_registered)
+        register_thread();
+    *(void **)obj = l->head;
+    l->head = obj;
+    l->count++;
+    atomic_fetch_sub_explicit(&c->live, 1, memory_order_relaxed);
+
+    if (l->count >= 2 * SLAB_BATCH)
+        give_back(c, l, SLAB_BATCH);
+}
+
+void *slab_buf_alloc(size_t size) {
+    int cls = 0;
+    while (cls < BUF_CLASSES && (16UL << cls) < size)
+        cls++;
+
+    unsigned char *buf;
+    if (cls < BUF_CLASSES) {
+        buf = slab_alloc(&buf_caches[cls]);
+    } else {
+        buf = malloc(BUF_HEADER + size);
+        if (buf)
+            atomic_fetch_add_explicit(&large_live, 1, memory_order_relaxed);
+        cls = BUF_LARGE;
+    }
+    if (!buf)
+        return NULL;
+    buf[0] = cls;
+    return buf + BUF_HEADER;
+}
+
+void slab_buf_free(void *p) {
+    if (!p)
+        return;
+
+    unsigned char *buf = (unsigned char *)p - BUF_HEADER;
+    if (buf[0] == BUF_LARGE) {
+        atomic_fetch_sub_explicit(&large_live, 1, memory_order_relaxed);
+        free(buf);
+    } else {
+        slab_free(&buf_caches[buf[0]], buf);
+    }
+}
+
+void slab_show(FILE *out) {
+    fprintf(out, "CACHE        SIZE  LIVE     HIGH     ALLOCS       SLAB_KB  DEPOT\n");
+    pthread_mutex_lock(&caches_lock);
+    for (struct slab_cache *c = caches; c; c = c->next) {
+        pthread_mutex_lock(&c->lock);
+        unsigned long slabs = c->slabs, depot = c->depot_count;
+        pthread_mutex_unlock(&c->lock);
+
+        fprintf(out, "%-12s %-5zu %-8ld %-8ld %-12lu %-8zu %lu\n", c->name, c->size,
+                atomic_load(&c->live), atomic_load(&c->high_water), atomic_load(&c->allocs),
+                slabs * objects_per_slab(c) * object_size(c) / 1024, depot);
+    }
+    pthread_mutex_unlock(&caches_lock);
+    fprintf(out, "buffers over %d bytes (malloc): %ld live\n", SLAB_BUF_MAX,
+            atomic_load(&large_live));
+}
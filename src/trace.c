@@ -0,0 +1,189 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/syscall.h>
+
+#include "trace.h"
+#include "debug.h"
+#include "log.h"
+
+#define CHUNK_EVENTS 4096               // spans per buffer allocation
+#define TRACE_PATH_MAX 256
+
+struct trace_event {
+    const char *name;
+    unsigned long start;
+    unsigned long end;
+};
+
+/*
+ * Spans are appended by the owning thread only.  The count is published
+ * with a release store after the span is written, and a new chunk is
+ * linked in the same way, so a dump can read a buffer while it grows.
+ */
+struct trace_chunk {
+    _Atomic(struct trace_chunk *) next;
+    atomic_uint count;
+    struct trace_event events[CHUNK_EVENTS];
+};
+
+struct trace_buffer {
+    struct trace_buffer *next;
+    long tid;
+    struct trace_chunk *head;
+};
+
+atomic_int trace_enabled = 0;
+
+static int started = 0;
+static char trace_path[TRACE_PATH_MAX];
+static unsigned long trace_start;
+static atomic_long allocated = 0;      // spans of buffer space handed out
+static atomic_ulong dropped = 0;
+
+static pthread_mutex_t buffers_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct trace_buffer *buffers = NULL;
+static int nbuffers = 0;
+
+static __thread struct trace_chunk *current = NULL;
+static __thread int out_of_space = 0;
+
+unsigned long trace_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static struct trace_chunk *new_chunk(void) {
+    if (atomic_fetch_add(&allocated, CHUNK_EVENTS) >= TRACE_MAX_EVENTS) {
+        out_of_space = 1;
+        return NULL;
+    }
+    struct trace_chunk *c = malloc(sizeof(*c));
+    if (c) {
+        atomic_init(&c->next, NULL);
+        atomic_init(&c->count, 0);
+    }
+    return c;
+}
+
+/*
+ * Give the calling thread its buffer and first chunk.
+ */
+static struct trace_chunk *new_buffer(void) {
+    struct trace_buffer *b = malloc(sizeof(*b));
+    struct trace_chunk *c = b ? new_chunk() : NULL;
+    if (!c) {
+        free(b);
+        return NULL;
+    }
+    b->tid = syscall(SYS_gettid);
+    b->head = c;
+
+    pthread_mutex_lock(&buffers_lock);
+    b->next = buffers;
+    buffers = b;
+    nbuffers++;
+    pthread_mutex_unlock(&buffers_lock);
+    return c;
+}
+
+void trace_span(const char *name, unsigned long start, unsigned long end) {
+    struct trace_chunk *c = current;
+    if (!c || atomic_load_explicit(&c->count, memory_order_relaxed) == CHUNK_EVENTS) {
+        struct trace_chunk *next = out_of_space ? NULL : c ? new_chunk() : new_buffer();
+        if (!next) {
+            atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+            return;
+        }
+        if (c)
+            atomic_store_explicit(&c->next, next, memory_order_release);
+        current = c = next;
+    }
+
+    unsigned int n = atomic_load_explicit(&c->count, memory_order_relaxed);
+    c->events[n] = (struct trace_event){ name, start, end };
+    atomic_store_explicit(&c->count, n + 1, memory_order_release);
+}
+
+int trace_init(const char *path) {
+    if (strlen(path) >= sizeof(trace_path)) {
+        error("Trace file path too long: %s", path);
+        return -1;
+    }
+    strcpy(trace_path, path);
+    trace_start = trace_now();
+    started = 1;
+    atomic_store(&trace_enabled, 1);
+    info("Tracing to %s", path);
+    return 0;
+}
+
+int trace_enable(int on) {
+    if (!started)
+        return -1;
+    atomic_store(&trace_enabled, on);
+    return 0;
+}
+
+long trace_dump(const char *path) {
+    if (!path) {
+        if (!started)
+            return -1;
+        path = trace_path;
+    }
+    FILE *f = fopen(path, "w");
+    if (!f)
+        return -1;
+
+    long n = 0;
+    int pid = getpid(), first = 1;
+    fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    pthread_mutex_lock(&buffers_lock);
+    for (struct trace_buffer *b = buffers; b; b = b->next) {
+        fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%ld,"
+                "\"args\":{\"name\":\"thread %ld\"}}", first ? "" : ",\n", pid, b->tid, b->tid);
+        first = 0;
+        for (struct trace_chunk *c = b->head; c;
+             c = atomic_load_explicit(&c->next, memory_order_acquire)) {
+            unsigned int count = atomic_load_explicit(&c->count, memory_order_acquire);
+            for (unsigned int i = 0; i < count; i++) {
+                struct trace_event *e = &c->events[i];
+                fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%ld,"
+                        "\"ts\":%.3f,\"dur\":%.3f}", e->name, pid, b->tid,
+                        (e->start - trace_start) / 1e3, (e->end - e->start) / 1e3);
+                n++;
+            }
+        }
+    }
+    pthread_mutex_unlock(&buffers_lock);
+    fprintf(f, "\n]}\n");
+    if (fclose(f) != 0)
+        return -1;
+    return n;
+}
+
+void trace_fini(void) {
+    if (!started)
+        return;
+    atomic_store(&trace_enabled, 0);
+    long n = trace_dump(NULL);
+    if (n < 0)
+        error("Failed to write trace to %s", trace_path);
+    else
+        log_info("Wrote %ld trace events to %s", n, (long)trace_path);
+}
+
+void trace_show(FILE *out) {
+    long used = atomic_load(&allocated);
+    fprintf(out, "trace: %s%s%s, %d threads, %ld of %d spans allocated, %lu dropped\n",
+            !started ? "off" : atomic_load(&trace_enabled) ? "on" : "paused",
+            started ? " -> " : "", started ? trace_path : "", nbuffers,
+            used < TRACE_MAX_EVENTS ? used : TRACE_MAX_EVENTS, TRACE_MAX_EVENTS,
+            atomic_load(&dropped));
+}
@@ -0,0 +1,348 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/random.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "udp.h"
+#include "player.h"
+#include "player_ext.h"
+#include "protocol_ext.h"
+#include "maze.h"
+#include "rng.h"
+#include "room.h"
+#include "handoff.h"
+#include "debug.h"
+#include "log.h"
+
+/* Largest datagram: the sequence number, a header and a full view. */
+#define UDP_DATAGRAM_MAX (4 + sizeof(MZW_PACKET) + VIEW_DEPTH * VIEW_WIDTH)
+
+/*
+ * One player's channel.  The lock keeps datagrams in sequence order, and
+ * is never held while a player's mutex is taken.  The token and the hash
+ * chain are under token_lock instead.
+ */
+struct udp_peer {
+    pthread_mutex_t lock;
+    int open;                           // a token has been issued
+    atomic_int active;                  // the client has registered
+    unsigned char token[UDP_TOKEN_SIZE];
+    int hashed;                         // the token is in the table
+    int next;                           // next peer in the bucket, or -1
+    struct sockaddr_in addr;
+    uint32_t seq;                       // of the last datagram sent
+    char held[UDP_DATAGRAM_MAX];        // a datagram held back by -L
+    size_t held_len;
+};
+
+atomic_int udp_enabled = 0;
+
+static int udp_fd = -1;
+static int udp_port = 0;
+static pthread_t udp_tid;
+static int loss_pct, reorder_pct, dup_pct;
+static struct udp_peer *peers;         // one per player slot in every room
+static int npeers;
+
+/*
+ * Open tokens, hashed on their first bytes; tokens are random, so buckets
+ * hold one or two each.
+ */
+static pthread_mutex_t token_lock = PTHREAD_MUTEX_INITIALIZER;
+static int *buckets;                    // first peer in each bucket, or -1
+static unsigned int bucket_mask;
+
+static atomic_ulong datagrams_sent, bytes_sent, registrations, bad_tokens;
+static atomic_ulong sim_dropped, sim_reordered, sim_duplicated;
+
+static void transmit(struct udp_peer *p, const char *buf, size_t len) {
+    if (sendto(udp_fd, buf, len, MSG_DONTWAIT, (struct sockaddr *)&p->addr, sizeof(p->addr)) == (ssize_t)len) {
+        atomic_fetch_add_explicit(&datagrams_sent, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&bytes_sent, len, memory_order_relaxed);
+    }
+}
+
+static unsigned int token_bucket(const unsigned char *token) {
+    uint32_t h;
+    memcpy(&h, token, sizeof(h));
+    return h & bucket_mask;
+}
+
+/* Called with token_lock held. */
+static void unhash_token(int slot) {
+    struct udp_peer *p = &peers[slot];
+    if (!p->hashed)
+        return;
+    int *link = &buckets[token_bucket(p->token)];
+    while (*link != slot)
+        link = &peers[*link].next;
+    *link = p->next;
+    p->hashed = 0;
+}
+
+/*
+ * Find the channel a token belongs to.  Only its bucket is searched, but
+ * every token there is compared in full, so that the time taken says
+ * nothing about how much of one matched.
+ */
+static int find_token(const unsigned char *token) {
+    int found = -1;
+
+    pthread_mutex_lock(&token_lock);
+    for (int i = buckets[token_bucket(token)]; i >= 0; i = peers[i].next) {
+        unsigned char diff = 0;
+        for (int j = 0; j < UDP_TOKEN_SIZE; j++)
+            diff |= peers[i].token[j] ^ token[j];
+        if (!diff)
+            found = i;
+    }
+    pthread_mutex_unlock(&token_lock);
+    return found;
+}
+
+static void *udp_thread(void *arg) {
+    unsigned char buf[64];
+    struct sockaddr_in from;
+
+    while (1) {
+        // A registration is answered with a view, which must not be sent
+        // while a handoff is passing the connections on.
+        if (handoff_wait_readable(udp_fd) < 0)
+            break;
+        socklen_t fromlen = sizeof(from);
+        ssize_t n = recvfrom(udp_fd, buf, sizeof(buf), 0, (struct sockaddr *)&from, &fromlen);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0 || !atomic_load(&udp_enabled))
+            break;
+
+        int slot = n == UDP_TOKEN_SIZE ? find_token(buf) : -1;
+        if (slot < 0) {
+            atomic_fetch_add_explicit(&bad_tokens, 1, memory_order_relaxed);
+            continue;
+        }
+        struct udp_peer *p = &peers[slot];
+        pthread_mutex_lock(&p->lock);
+        p->addr = from;
+        p->held_len = 0;
+        atomic_store(&p->active, 1);
+        pthread_mutex_unlock(&p->lock);
+        atomic_fetch_add_explicit(&registrations, 1, memory_order_relaxed);
+        debug("UDP channel for player %d in room %d registered from %s:%d",
+              slot % room_capacity() + 1, slot / room_capacity(), inet_ntoa(from.sin_addr), ntohs(from.sin_port));
+
+        // The answer is a full view, which also tells the client the
+        // channel works.
+        room_enter(slot / room_capacity());
+        PLAYER *player = player_get_by_id(slot % room_capacity() + 1);
+        if (player) {
+            player_invalidate_view(player);
+            player_update_view(player);
+            player_unref(player, "udp register");
+        }
+    }
+    handoff_leave();
+    return NULL;
+}
+
+int udp_init(int port, int loss, int reorder, int dup) {
+    struct sockaddr_in addr;
+
+    if ((udp_fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0) {
+        perror("socket");
+        return -1;
+    }
+    int optval = 1;
+    setsockopt(udp_fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (bind(udp_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("UDP socket");
+        close(udp_fd);
+        udp_fd = -1;
+        return -1;
+    }
+
+    npeers = room_count() * room_capacity();
+    unsigned int nbuckets = 16;
+    while (nbuckets < 2u * npeers)
+        nbuckets <<= 1;
+    peers = calloc(npeers, sizeof(*peers));
+    buckets = malloc(nbuckets * sizeof(*buckets));
+    if (!peers || !buckets) {
+        free(peers);
+        free(buckets);
+        close(udp_fd);
+        udp_fd = -1;
+        return -1;
+    }
+    for (int i = 0; i < npeers; i++)
+        pthread_mutex_init(&peers[i].lock, NULL);
+    for (unsigned int i = 0; i < nbuckets; i++)
+        buckets[i] = -1;
+    bucket_mask = nbuckets - 1;
+    udp_port = port;
+    loss_pct = loss;
+    reorder_pct = reorder;
+    dup_pct = dup;
+    atomic_store(&udp_enabled, 1);
+
+    handoff_enter();
+    if (pthread_create(&udp_tid, NULL, udp_thread, NULL) != 0) {
+        handoff_leave();
+        error("Failed to start UDP thread");
+        atomic_store(&udp_enabled, 0);
+        close(udp_fd);
+        udp_fd = -1;
+        return -1;
+    }
+    info("Views also sent over UDP port %d", port);
+    if (loss || reorder || dup)
+        info("Simulating a lossy link: %d%% lost, %d%% reordered, %d%% duplicated",
+             loss, reorder, dup);
+    return 0;
+}
+
+void udp_fini(void) {
+    if (udp_fd < 0)
+        return;
+
+    // Shutting down a UDP socket wakes a thread blocked receiving on it.
+    atomic_store(&udp_enabled, 0);
+    shutdown(udp_fd, SHUT_RDWR);
+    pthread_join(udp_tid, NULL);
+    close(udp_fd);
+    udp_fd = -1;
+}
+
+int udp_open(int slot, unsigned char token[UDP_TOKEN_SIZE]) {
+    if (udp_fd < 0)
+        return -1;
+
+    // Tokens must not be guessable, so they do not come from rng.h.
+    if (getrandom(token, UDP_TOKEN_SIZE, 0) != UDP_TOKEN_SIZE)
+        return -1;
+    struct udp_peer *p = &peers[slot];
+    pthread_mutex_lock(&token_lock);
+    unhash_token(slot);
+    memcpy(p->token, token, UDP_TOKEN_SIZE);
+    p->next = buckets[token_bucket(token)];
+    buckets[token_bucket(token)] = slot;
+    p->hashed = 1;
+    pthread_mutex_unlock(&token_lock);
+
+    pthread_mutex_lock(&p->lock);
+    p->open = 1;
+    atomic_store(&p->active, 0);
+    p->seq = 0;
+    p->held_len = 0;
+    pthread_mutex_unlock(&p->lock);
+    return udp_port;
+}
+
+void udp_close(int slot) {
+    if (udp_fd < 0)
+        return;
+
+    struct udp_peer *p = &peers[slot];
+    pthread_mutex_lock(&token_lock);
+    unhash_token(slot);
+    memset(p->token, 0, sizeof(p->token));
+    pthread_mutex_unlock(&token_lock);
+
+    pthread_mutex_lock(&p->lock);
+    p->open = 0;
+    atomic_store(&p->active, 0);
+    p->held_len = 0;
+    pthread_mutex_unlock(&p->lock);
+}
+
+int udp_active(int slot) {
+    return atomic_load_explicit(&udp_enabled, memory_order_relaxed) &&
+        atomic_load_explicit(&peers[slot].active, memory_order_relaxed);
+}
+
+int udp_send(int slot, MZW_PACKET *pkt, void *data) {
+    if (!udp_active(slot))
+        return -1;
+    if (!(pkt->type == MZW_VIEW_PKT && pkt->param1 == MZW_VIEW_FULL) &&
+        !(pkt->type == MZW_SCORE_PKT && pkt->size == 0 && pkt->param2 >= 0))
+        return -1;
+
+    char buf[UDP_DATAGRAM_MAX];
+    size_t size = data ? pkt->size : 0;
+    if (4 + sizeof(*pkt) + size > sizeof(buf))
+        return -1;
+
+    struct udp_peer *p = &peers[slot];
+    pthread_mutex_lock(&p->lock);
+    if (!atomic_load(&p->active)) {
+        pthread_mutex_unlock(&p->lock);
+        return -1;
+    }
+
+    uint32_t seq = htonl(++p->seq);
+    MZW_PACKET wire = *pkt;
+    wire.size = htons(pkt->size);
+    wire.timestamp_sec = htonl(pkt->timestamp_sec);
+    wire.timestamp_nsec = htonl(pkt->timestamp_nsec);
+    memcpy(buf, &seq, 4);
+    memcpy(buf + 4, &wire, sizeof(wire));
+    if (size)
+        memcpy(buf + 4 + sizeof(wire), data, size);
+    size_t len = 4 + sizeof(wire) + size;
+
+    if (loss_pct && (int)rng_below(100) < loss_pct) {
+        atomic_fetch_add_explicit(&sim_dropped, 1, memory_order_relaxed);
+    } else if (reorder_pct && !p->held_len && (int)rng_below(100) < reorder_pct) {
+        // Sent after the next datagram, or never if there is none.
+        memcpy(p->held, buf, len);
+        p->held_len = len;
+        atomic_fetch_add_explicit(&sim_reordered, 1, memory_order_relaxed);
+    } else {
+        transmit(p, buf, len);
+        if (dup_pct && (int)rng_below(100) < dup_pct) {
+            transmit(p, buf, len);
+            atomic_fetch_add_explicit(&sim_duplicated, 1, memory_order_relaxed);
+        }
+        if (p->held_len) {
+            transmit(p, p->held, p->held_len);
+            p->held_len = 0;
+        }
+    }
+    pthread_mutex_unlock(&p->lock);
+    return 0;
+}
+
+void udp_show(FILE *out) {
+    if (udp_fd < 0) {
+        fprintf(out, "udp: off\n");
+        return;
+    }
+    int open = 0, active = 0;
+    for (int i = 0; i < npeers; i++) {
+        pthread_mutex_lock(&peers[i].lock);
+        open += peers[i].open;
+        active += atomic_load(&peers[i].active);
+        pthread_mutex_unlock(&peers[i].lock);
+    }
+    fprintf(out, "udp: port %d, %d channels offered, %d registered, %lu registrations, "
+            "%lu bad tokens\n", udp_port, open, active, atomic_load(&registrations),
+            atomic_load(&bad_tokens));
+    fprintf(out, "udp: %lu datagrams, %lu bytes sent\n", atomic_load(&datagrams_sent),
+            atomic_load(&bytes_sent));
+    if (loss_pct || reorder_pct || dup_pct)
+        fprintf(out, "udp: simulated %d%%/%d%%/%d%% loss/reorder/dup: %lu dropped, "
+                "%lu reordered, %lu duplicated\n", loss_pct, reorder_pct, dup_pct,
+                atomic_load(&sim_dropped), atomic_load(&sim_reordered),
+                atomic_load(&sim_duplicated));
+}
@@ -0,0 +1,816 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <linux/io_uring.h>
+
+#include "uring.h"
+#include "debug.h"
+#include "log.h"
+
+#ifdef IORING_RECV_MULTISHOT
+
+#define URING_ENTRIES    4096                   // submission queue size
+#define URING_CQ_ENTRIES (4 * URING_ENTRIES)    // multishot recvs complete often
+#define URING_MAX_FDS    (1 << 20)
+#define BUF_GROUP        1
+#define BUF_COUNT        4096                   // provided buffers (power of two)
+#define BUF_SIZE         2048
+#define SEND_CHAIN_MAX   16                     // linked sends per connection per pass
+#define SEND_QUEUE_MAX   (256 * 1024)           // bytes queued for a client before it is dropped
+
+/*
+ * Operations are identified in user_data by a pointer with the operation
+ * in its low bits.
+ */
+#define OP_RECV   1UL
+#define OP_SEND   2UL
+#define OP_CANCEL 3UL
+#define OP_PAUSE  4UL
+#define OP_MASK   7UL
+
+struct uring_send {
+    struct uring_send *next;
+    struct uring_conn *conn;
+    uint32_t len, off;                  // bytes to send, bytes sent
+    char data[];                        // header and payload, network order
+};
+
+struct uring_conn {
+    int fd;
+    void *ctx;
+    int closing;
+    int ops;                            // operations submitted and not completed
+    int recv_armed;                     // multishot recv outstanding
+    int paused;                         // packets are held back until a timeout
+    struct __kernel_timespec pause_ts;
+    char *in;                           // received bytes of an incomplete packet
+    size_t in_len, in_cap;
+    struct uring_send *head, *tail;     // sends not yet submitted
+    struct uring_send *sending;         // the chain in flight, in order
+    size_t queued;                      // bytes in the queue and the chain
+    int overflowed;                     // dropped for not reading
+    int inflight;
+    int dirty;                          // on the list of connections to flush
+    struct uring_conn *next_dirty;
+};
+
+struct ring {
+    int fd;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_size, cq_size;
+    atomic_uint *sq_head, *sq_tail;
+    unsigned sq_mask, sq_entries, *sq_array;
+    unsigned sq_local_tail;             // next SQE to fill
+    struct io_uring_sqe *sqes;
+    atomic_uint *cq_head, *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+};
+
+static struct ring ring = { .fd = -1 };
+static pthread_mutex_t sq_lock = PTHREAD_MUTEX_INITIALIZER;  // SQ, send queues
+static pthread_t ring_tid;
+static __thread int on_ring_thread = 0;
+
+static struct io_uring_buf_ring *buf_ring = NULL;
+static char *bufs = NULL;
+static unsigned short buf_tail = 0;
+
+static struct uring_conn *_Atomic *conns = NULL;   // indexed by fd
+static int max_fds = 0;
+static struct uring_conn *dirty = NULL;
+
+static uring_packet_fn packet_fn;
+static uring_close_fn close_fn;
+static uring_resume_fn resume_fn;
+
+static struct {
+    atomic_ulong enters, submitted, completions, max_batch;
+    atomic_ulong recv_bytes, packets, rearms;
+    atomic_ulong sends, send_bytes, short_sends, chains;
+    atomic_ulong pauses, overflows;
+    atomic_long connections;
+} stats;
+
+#define STAT_ADD(f, n) atomic_fetch_add_explicit(&stats.f, (n), memory_order_relaxed)
+
+static int sys_setup(unsigned entries, struct io_uring_params *p) {
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return syscall(__NR_io_uring_enter, ring.fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_register(unsigned opcode, void *arg, unsigned nargs) {
+    return syscall(__NR_io_uring_register, ring.fd, opcode, arg, nargs);
+}
+
+/*
+ * Map the rings of a newly created io_uring instance.
+ */
+static int ring_map(struct io_uring_params *p) {
+    ring.sq_size = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+    ring.cq_size = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring.cq_size > ring.sq_size)
+            ring.sq_size = ring.cq_size;
+        ring.cq_size = ring.sq_size;
+    }
+
+    ring.sq_ptr = mmap(NULL, ring.sq_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    if (ring.sq_ptr == MAP_FAILED)
+        return -1;
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        ring.cq_ptr = ring.sq_ptr;
+    } else {
+        ring.cq_ptr = mmap(NULL, ring.cq_size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+        if (ring.cq_ptr == MAP_FAILED)
+            return -1;
+    }
+    ring.sqes = mmap(NULL, p->sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+    if (ring.sqes == MAP_FAILED)
+        return -1;
+
+    char *sq = ring.sq_ptr, *cq = ring.cq_ptr;
+    ring.sq_head = (atomic_uint *)(sq + p->sq_off.head);
+    ring.sq_tail = (atomic_uint *)(sq + p->sq_off.tail);
+    ring.sq_mask = *(unsigned *)(sq + p->sq_off.ring_mask);
+    ring.sq_entries = p->sq_entries;
+    ring.sq_array = (unsigned *)(sq + p->sq_off.array);
+    ring.sq_local_tail = atomic_load(ring.sq_tail);
+    ring.cq_head = (atomic_uint *)(cq + p->cq_off.head);
+    ring.cq_tail = (atomic_uint *)(cq + p->cq_off.tail);
+    ring.cq_mask = *(unsigned *)(cq + p->cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)(cq + p->cq_off.cqes);
+    return 0;
+}
+
+static unsigned sq_space(void) {
+    return ring.sq_entries -
+        (ring.sq_local_tail - atomic_load_explicit(ring.sq_head, memory_order_acquire));
+}
+
+/*
+ * Make filled SQEs visible to the kernel and submit them.  Called with
+ * sq_lock held.
+ */
+static void submit(unsigned min_complete, unsigned flags) {
+    atomic_store_explicit(ring.sq_tail, ring.sq_local_tail, memory_order_release);
+    unsigned n = ring.sq_local_tail - atomic_load_explicit(ring.sq_head, memory_order_acquire);
+    int ret = sys_enter(n, min_complete, flags);
+    STAT_ADD(enters, 1);
+    if (ret > 0)
+        STAT_ADD(submitted, ret);
+}
+
+/*
+ * Get a free SQE, submitting what is queued if there is none.  Called with
+ * sq_lock held.
+ */
+static struct io_uring_sqe *get_sqe(void) {
+    while (sq_space() == 0)
+        submit(0, 0);
+
+    unsigned idx = ring.sq_local_tail & ring.sq_mask;
+    struct io_uring_sqe *sqe = &ring.sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    ring.sq_array[idx] = idx;
+    ring.sq_local_tail++;
+    return sqe;
+}
+
+static void buf_recycle(unsigned short bid) {
+    struct io_uring_buf *buf = &buf_ring->bufs[buf_tail & (BUF_COUNT - 1)];
+    buf->addr = (uintptr_t)(bufs + (size_t)bid * BUF_SIZE);
+    buf->len = BUF_SIZE;
+    buf->bid = bid;
+    buf_tail++;
+    atomic_store_explicit((_Atomic unsigned short *)&buf_ring->tail, buf_tail,
+                          memory_order_release);
+}
+
+/*
+ * Arm a multishot recv on a connection.  Called with sq_lock held.
+ */
+static void arm_recv(struct uring_conn *c) {
+    struct io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUF_GROUP;
+    sqe->user_data = (uintptr_t)c | OP_RECV;
+    c->recv_armed = 1;
+    c->ops++;
+}
+
+/*
+ * Submit a connection's queued sends as a chain of linked SQEs, unless a
+ * chain is already in flight.  Called with sq_lock held.
+ */
+static void flush_conn(struct uring_conn *c) {
+    if (c->inflight || !c->head)
+        return;
+
+    // A chain must not be split across submissions, or its link is lost.
+    if (sq_space() < SEND_CHAIN_MAX)
+        submit(0, 0);
+
+    struct uring_send **last = &c->sending;
+    struct io_uring_sqe *sqe = NULL;
+    while (c->head && c->inflight < SEND_CHAIN_MAX && sq_space() > 0) {
+        struct uring_send *s = c->head;
+        c->head = s->next;
+        if (!c->head)
+            c->tail = NULL;
+        s->next = NULL;
+        *last = s;
+        last = &s->next;
+
+        if (sqe)
+            sqe->flags |= IOSQE_IO_LINK;
+        sqe = get_sqe();
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = c->fd;
+        sqe->addr = (uintptr_t)(s->data + s->off);
+        sqe->len = s->len - s->off;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        sqe->user_data = (uintptr_t)s | OP_SEND;
+        c->inflight++;
+        c->ops++;
+    }
+    STAT_ADD(chains, 1);
+}
+
+static void mark_dirty(struct uring_conn *c) {
+    if (!c->dirty) {
+        c->dirty = 1;
+        c->next_dirty = dirty;
+        dirty = c;
+    }
+}
+
+static void free_sends(struct uring_send *s) {
+    while (s) {
+        struct uring_send *next = s->next;
+        free(s);
+        s = next;
+    }
+}
+
+/*
+ * Release a closing connection once nothing refers to it any more.
+ */
+static void maybe_free(struct uring_conn *c) {
+    pthread_mutex_lock(&sq_lock);
+    int done = c->closing && c->ops == 0 && !c->head && !c->dirty;
+    if (done)
+        atomic_store(&conns[c->fd], NULL);
+    pthread_mutex_unlock(&sq_lock);
+    if (!done)
+        return;
+
+    close(c->fd);
+    free(c->in);
+    free_sends(c->sending);
+    free(c);
+    atomic_fetch_sub(&stats.connections, 1);
+}
+
+/*
+ * Begin closing a connection: stop receiving, but let queued sends (such
+ * as a final INUSE reply) go out before the descriptor is closed.
+ */
+static void close_conn(struct uring_conn *c) {
+    if (c->closing)
+        return;
+    pthread_mutex_lock(&sq_lock);
+    c->closing = 1;
+    pthread_mutex_unlock(&sq_lock);
+    close_fn(c->ctx);
+
+    pthread_mutex_lock(&sq_lock);
+    if (c->recv_armed) {
+        struct io_uring_sqe *sqe = get_sqe();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = (uintptr_t)c | OP_RECV;
+        sqe->user_data = (uintptr_t)c | OP_CANCEL;
+        c->ops++;
+    }
+    pthread_mutex_unlock(&sq_lock);
+}
+
+/*
+ * Hold back a connection's packets for a time.  Called on the ring thread.
+ */
+static void pause_conn(struct uring_conn *c, int ms) {
+    pthread_mutex_lock(&sq_lock);
+    c->paused = 1;
+    c->pause_ts.tv_sec = ms / 1000;
+    c->pause_ts.tv_nsec = (ms % 1000) * 1000000L;
+    struct io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uintptr_t)&c->pause_ts;
+    sqe->len = 1;
+    sqe->user_data = (uintptr_t)c | OP_PAUSE;
+    c->ops++;
+    pthread_mutex_unlock(&sq_lock);
+    STAT_ADD(pauses, 1);
+}
+
+/*
+ * Hand every complete packet in a buffer to the packet function, until
+ * the connection closes or is paused.  Returns the number of bytes
+ * consumed.
+ */
+static size_t parse(struct uring_conn *c, char *buf, size_t len) {
+    size_t off = 0;
+
+    while (!c->closing && !c->paused && len - off >= sizeof(MZW_PACKET)) {
+        MZW_PACKET pkt;
+        memcpy(&pkt, buf + off, sizeof(pkt));
+        pkt.size = ntohs(pkt.size);
+        pkt.timestamp_sec = ntohl(pkt.timestamp_sec);
+        pkt.timestamp_nsec = ntohl(pkt.timestamp_nsec);
+        if (len - off < sizeof(pkt) + pkt.size)
+            break;
+
+        void *payload = pkt.size ? buf + off + sizeof(pkt) : NULL;
+        int ret = packet_fn(c->ctx, &pkt, payload);
+        if (ret > 0) {
+            // Not consumed: it is handed over again after the pause.
+            pause_conn(c, ret);
+            break;
+        }
+        off += sizeof(pkt) + pkt.size;
+        STAT_ADD(packets, 1);
+        if (ret < 0)
+            close_conn(c);
+    }
+    return off;
+}
+
+/*
+ * A connection's pause is over: resume it and handle the packets that
+ * have arrived meanwhile.
+ */
+static void pause_complete(struct uring_conn *c) {
+    pthread_mutex_lock(&sq_lock);
+    c->ops--;
+    c->paused = 0;
+    pthread_mutex_unlock(&sq_lock);
+    if (c->closing)
+        return;
+
+    resume_fn(c->ctx);
+    size_t used = parse(c, c->in, c->in_len);
+    memmove(c->in, c->in + used, c->in_len - used);
+    c->in_len -= used;
+}
+
+static void recv_data(struct uring_conn *c, char *data, size_t len) {
+    STAT_ADD(recv_bytes, len);
+    if (c->closing)
+        return;
+
+    // Usually whole packets arrive together and are parsed in place; only
+    // an incomplete tail, or what arrives while paused, is copied.
+    if (c->in_len == 0) {
+        size_t used = parse(c, data, len);
+        data += used;
+        len -= used;
+        if (len == 0 || c->closing)
+            return;
+    }
+
+    if (c->in_len + len > c->in_cap) {
+        size_t cap = c->in_cap ? c->in_cap : BUF_SIZE;
+        while (cap < c->in_len + len)
+            cap *= 2;
+        char *in = realloc(c->in, cap);
+        if (!in) {
+            close_conn(c);
+            return;
+        }
+        c->in = in;
+        c->in_cap = cap;
+    }
+    memcpy(c->in + c->in_len, data, len);
+    c->in_len += len;
+
+    size_t used = parse(c, c->in, c->in_len);
+    memmove(c->in, c->in + used, c->in_len - used);
+    c->in_len -= used;
+}
+
+static void recv_complete(struct uring_conn *c, struct io_uring_cqe *cqe) {
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (cqe->res > 0)
+            recv_data(c, bufs + (size_t)bid * BUF_SIZE, cqe->res);
+        buf_recycle(bid);
+    }
+    if (cqe->flags & IORING_CQE_F_MORE)
+        return;
+
+    // The multishot recv has ended: on EOF or error the connection goes;
+    // if the buffers ran out it is simply re-armed.
+    pthread_mutex_lock(&sq_lock);
+    c->recv_armed = 0;
+    c->ops--;
+    pthread_mutex_unlock(&sq_lock);
+    if (cqe->res == 0 || (cqe->res < 0 && cqe->res != -ENOBUFS)) {
+        close_conn(c);
+    } else if (!c->closing) {
+        STAT_ADD(rearms, 1);
+        pthread_mutex_lock(&sq_lock);
+        arm_recv(c);
+        pthread_mutex_unlock(&sq_lock);
+    }
+}
+
+static void send_complete(struct uring_send *s, int res) {
+    struct uring_conn *c = s->conn;
+    int failed = 0;
+
+    pthread_mutex_lock(&sq_lock);
+    c->ops--;
+    c->inflight--;
+    if (res > 0) {
+        s->off += res;
+        STAT_ADD(send_bytes, res);
+        if (s->off < s->len)
+            STAT_ADD(short_sends, 1);
+    } else if (res != -ECANCELED) {
+        failed = 1;
+    }
+
+    // Once the whole chain has completed, whatever was not sent (after a
+    // short send the rest of the chain is cancelled) goes back on the front
+    // of the queue in its original order.
+    if (c->inflight == 0) {
+        struct uring_send *keep = NULL, *keep_tail = NULL;
+        struct uring_send *next;
+        for (struct uring_send *t = c->sending; t; t = next) {
+            next = t->next;
+            if (t->off == t->len || failed || c->closing) {
+                c->queued -= t->len;
+                free(t);
+                continue;
+            }
+            t->next = NULL;
+            if (keep_tail)
+                keep_tail->next = t;
+            else
+                keep = t;
+            keep_tail = t;
+        }
+        c->sending = NULL;
+        if (keep) {
+            keep_tail->next = c->head;
+            if (!c->head)
+                c->tail = keep_tail;
+            c->head = keep;
+        }
+        if (failed || c->closing) {
+            free_sends(c->head);
+            c->head = c->tail = NULL;
+            c->queued = 0;
+        }
+        if (c->head)
+            mark_dirty(c);
+    }
+    pthread_mutex_unlock(&sq_lock);
+
+    if (failed)
+        close_conn(c);
+}
+
+static void *ring_thread(void *arg) {
+    on_ring_thread = 1;
+
+    while (1) {
+        pthread_mutex_lock(&sq_lock);
+        struct uring_conn *c = dirty;
+        dirty = NULL;
+        while (c) {
+            struct uring_conn *next = c->next_dirty;
+            c->dirty = 0;
+            flush_conn(c);
+            c = next;
+        }
+        // One io_uring_enter() both submits everything queued during the
+        // last pass and waits for the next completions.
+        atomic_store_explicit(ring.sq_tail, ring.sq_local_tail, memory_order_release);
+        unsigned n = ring.sq_local_tail - atomic_load_explicit(ring.sq_head, memory_order_acquire);
+        pthread_mutex_unlock(&sq_lock);
+
+        int ret = sys_enter(n, 1, IORING_ENTER_GETEVENTS);
+        STAT_ADD(enters, 1);
+        if (ret > 0)
+            STAT_ADD(submitted, ret);
+        else if (ret < 0 && errno != EINTR && errno != EBUSY && errno != EAGAIN)
+            log_error("io_uring_enter failed (errno=%d)", errno);
+
+        unsigned head = atomic_load_explicit(ring.cq_head, memory_order_relaxed);
+        unsigned tail = atomic_load_explicit(ring.cq_tail, memory_order_acquire);
+        unsigned batch = tail - head;
+        for (; head != tail; head++) {
+            struct io_uring_cqe cqe = ring.cqes[head & ring.cq_mask];
+            // Free the CQE slot at once: handling it may submit more work.
+            atomic_store_explicit(ring.cq_head, head + 1, memory_order_release);
+
+            void *ptr = (void *)(uintptr_t)(cqe.user_data & ~OP_MASK);
+            switch (cqe.user_data & OP_MASK) {
+            case OP_RECV:
+                recv_complete(ptr, &cqe);
+                maybe_free(ptr);
+                break;
+            case OP_SEND: {
+                struct uring_conn *conn = ((struct uring_send *)ptr)->conn;
+                send_complete(ptr, cqe.res);
+                maybe_free(conn);
+                break;
+            }
+            case OP_PAUSE:
+                pause_complete(ptr);
+                maybe_free(ptr);
+                break;
+            case OP_CANCEL:
+                pthread_mutex_lock(&sq_lock);
+                ((struct uring_conn *)ptr)->ops--;
+                pthread_mutex_unlock(&sq_lock);
+                maybe_free(ptr);
+                break;
+            }
+        }
+        STAT_ADD(completions, batch);
+        if (batch > atomic_load_explicit(&stats.max_batch, memory_order_relaxed))
+            atomic_store_explicit(&stats.max_batch, batch, memory_order_relaxed);
+    }
+    return NULL;
+}
+
+/*
+ * Check that multishot recv into provided buffers works, using a socket
+ * pair.  Kernels before 6.0 accept the setup but fail the recv.
+ */
+static int probe_multishot(void) {
+    int sp[2];
+    int ok = 0;
+    struct uring_conn probe = { 0 };
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sp) < 0)
+        return -1;
+    probe.fd = sp[0];
+    arm_recv(&probe);
+    if (write(sp[1], "x", 1) != 1)
+        goto out;
+    submit(1, IORING_ENTER_GETEVENTS);
+    close(sp[1]);
+    sp[1] = -1;
+
+    // Expect the byte with more to come, then EOF ending the recv.
+    while (probe.recv_armed) {
+        unsigned head = atomic_load(ring.cq_head);
+        if (head == atomic_load(ring.cq_tail)) {
+            if (sys_enter(0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR)
+                break;
+            continue;
+        }
+        struct io_uring_cqe *cqe = &ring.cqes[head & ring.cq_mask];
+        if (cqe->res == 1 && (cqe->flags & IORING_CQE_F_BUFFER) &&
+            (cqe->flags & IORING_CQE_F_MORE))
+            ok = 1;
+        if (cqe->flags & IORING_CQE_F_BUFFER)
+            buf_recycle(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        if (!(cqe->flags & IORING_CQE_F_MORE))
+            probe.recv_armed = 0;
+        atomic_store(ring.cq_head, head + 1);
+    }
+
+out:
+    close(sp[0]);
+    if (sp[1] >= 0)
+        close(sp[1]);
+    return ok ? 0 : -1;
+}
+
+int uring_init(uring_packet_fn packet, uring_close_fn closed, uring_resume_fn resumed) {
+    struct io_uring_params p;
+    struct rlimit rl;
+
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = URING_CQ_ENTRIES;
+    if ((ring.fd = sys_setup(URING_ENTRIES, &p)) < 0) {
+        log_warn("io_uring unavailable (errno=%d)", errno);
+        return -1;
+    }
+    if (!(p.features & IORING_FEAT_NODROP) || ring_map(&p) < 0) {
+        log_warn("io_uring: kernel too old or mmap failed");
+        goto fail;
+    }
+
+    // Provided buffer ring, shared by all connections.
+    bufs = malloc((size_t)BUF_COUNT * BUF_SIZE);
+    if (!bufs || posix_memalign((void **)&buf_ring, sysconf(_SC_PAGESIZE),
+                                BUF_COUNT * sizeof(struct io_uring_buf)) != 0)
+        goto fail;
+    memset(buf_ring, 0, BUF_COUNT * sizeof(struct io_uring_buf));
+    struct io_uring_buf_reg reg = {
+        .ring_addr = (uintptr_t)buf_ring, .ring_entries = BUF_COUNT, .bgid = BUF_GROUP
+    };
+    if (sys_register(IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        log_warn("io_uring: provided buffer rings unsupported (errno=%d)", errno);
+        goto fail;
+    }
+    for (int i = 0; i < BUF_COUNT; i++)
+        buf_recycle(i);
+
+    if (probe_multishot() < 0) {
+        log_warn("io_uring: multishot recv unsupported");
+        goto fail;
+    }
+
+    max_fds = URING_MAX_FDS;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < (rlim_t)max_fds)
+        max_fds = rl.rlim_cur;
+    conns = calloc(max_fds, sizeof(*conns));
+    if (!conns)
+        goto fail;
+
+    packet_fn = packet;
+    close_fn = closed;
+    resume_fn = resumed;
+    if (pthread_create(&ring_tid, NULL, ring_thread, NULL) != 0)
+        goto fail;
+    pthread_detach(ring_tid);
+
+    log_info("io_uring backend started: %d SQ entries, %d x %d byte buffers",
+             ring.sq_entries, BUF_COUNT, BUF_SIZE);
+    return 0;
+
+fail:
+    // The ring's mappings go with the process; only the ring is closed, so
+    // that a fallback transport sees a clean slate.
+    free(conns);
+    conns = NULL;
+    free(bufs);
+    bufs = NULL;
+    free(buf_ring);
+    buf_ring = NULL;
+    close(ring.fd);
+    ring.fd = -1;
+    return -1;
+}
+
+int uring_add(int fd, void *ctx) {
+    if (!conns || fd < 0 || fd >= max_fds)
+        return -1;
+
+    struct uring_conn *c = calloc(1, sizeof(*c));
+    if (!c)
+        return -1;
+    c->fd = fd;
+    c->ctx = ctx;
+
+    pthread_mutex_lock(&sq_lock);
+    atomic_store(&conns[fd], c);
+    arm_recv(c);
+    // The ring thread submits in its own loop; anyone else must submit now,
+    // since the ring thread may be blocked waiting for completions.
+    if (!on_ring_thread)
+        submit(0, 0);
+    pthread_mutex_unlock(&sq_lock);
+
+    atomic_fetch_add(&stats.connections, 1);
+    return 0;
+}
+
+int uring_owns(int fd) {
+    return conns && fd >= 0 && fd < max_fds &&
+        atomic_load_explicit(&conns[fd], memory_order_acquire) != NULL;
+}
+
+int uring_send_packet(int fd, MZW_PACKET *pkt, void *data) {
+    size_t size = (pkt->size > 0 && data) ? pkt->size : 0;
+    struct uring_send *s = malloc(sizeof(*s) + sizeof(*pkt) + size);
+    if (!s)
+        return -1;
+
+    MZW_PACKET net_pkt = *pkt;
+    net_pkt.size = htons(pkt->size);
+    net_pkt.timestamp_sec = htonl(pkt->timestamp_sec);
+    net_pkt.timestamp_nsec = htonl(pkt->timestamp_nsec);
+    memcpy(s->data, &net_pkt, sizeof(net_pkt));
+    if (size)
+        memcpy(s->data + sizeof(net_pkt), data, size);
+    s->len = sizeof(net_pkt) + size;
+    s->off = 0;
+    s->next = NULL;
+
+    pthread_mutex_lock(&sq_lock);
+    struct uring_conn *c = atomic_load(&conns[fd]);
+    if (!c || c->closing || c->overflowed) {
+        pthread_mutex_unlock(&sq_lock);
+        free(s);
+        errno = EPIPE;
+        return -1;
+    }
+    if (c->queued + s->len > SEND_QUEUE_MAX) {
+        // The client is not reading.  Shutting the socket down fails the
+        // sends in flight and ends the recv, and the ring thread then
+        // closes the connection as if the client had gone.
+        c->overflowed = 1;
+        shutdown(fd, SHUT_RDWR);
+        pthread_mutex_unlock(&sq_lock);
+        free(s);
+        STAT_ADD(overflows, 1);
+        log_warn("io_uring: dropping client fd=%d, %lu bytes queued", fd, (long)c->queued);
+        errno = ENOBUFS;
+        return -1;
+    }
+    s->conn = c;
+    c->queued += s->len;
+    if (c->tail)
+        c->tail->next = s;
+    else
+        c->head = s;
+    c->tail = s;
+    STAT_ADD(sends, 1);
+
+    if (on_ring_thread) {
+        mark_dirty(c);
+    } else {
+        flush_conn(c);
+        submit(0, 0);
+    }
+    pthread_mutex_unlock(&sq_lock);
+    return 0;
+}
+
+void uring_show(FILE *out) {
+    if (!conns) {
+        fprintf(out, "io_uring: off\n");
+        return;
+    }
+
+    unsigned long enters = atomic_load(&stats.enters);
+    unsigned long submitted = atomic_load(&stats.submitted);
+    unsigned long completions = atomic_load(&stats.completions);
+    fprintf(out, "io_uring: %ld connections\n", atomic_load(&stats.connections));
+    fprintf(out, "  enters %lu, submitted %lu (%.1f per enter), completions %lu, "
+            "largest batch %lu\n", enters, submitted,
+            enters ? (double)submitted / enters : 0.0, completions,
+            atomic_load(&stats.max_batch));
+    fprintf(out, "  recv: %lu bytes, %lu packets, %lu re-arms (buffers exhausted)\n",
+            atomic_load(&stats.recv_bytes), atomic_load(&stats.packets),
+            atomic_load(&stats.rearms));
+    fprintf(out, "  send: %lu packets, %lu bytes, %lu chains, %lu short sends\n",
+            atomic_load(&stats.sends), atomic_load(&stats.send_bytes),
+            atomic_load(&stats.chains), atomic_load(&stats.short_sends));
+    fprintf(out, "  %lu pauses (purgatory), %lu clients dropped with %d bytes queued\n",
+            atomic_load(&stats.pauses), atomic_load(&stats.overflows), SEND_QUEUE_MAX);
+}
+
+#else   // kernel headers without multishot recv
+
+int uring_init(uring_packet_fn packet, uring_close_fn closed, uring_resume_fn resumed) {
+    log_warn("io_uring backend not built: kernel headers too old");
+    return -1;
+}
+
+int uring_add(int fd, void *conn) {
+    return -1;
+}
+
+int uring_owns(int fd) {
+    return 0;
+}
+
+int uring_send_packet(int fd, MZW_PACKET *pkt, void *data) {
+    errno = ENOSYS;
+    return -1;
+}
+
+void uring_show(FILE *out) {
+    fprintf(out, "io_uring: not built\n");
+}
+
+#endif
@@ -5,6 +5,34 @@
 #include <fcntl.h>
 #include <signal.h>
 #include <wait.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/select.h>
+#include <sys/resource.h>
+
+#include "rng.h"
+#include "slab.h"
+#include "latency.h"
+#include "log.h"
+#include "maze.h"
+#include "maze_ext.h"
+#include "room.h"
+#include "protocol.h"
+#include "protocol_ext.h"
+#include "player_ext.h"
+#include "udp.h"
+#include "handoff.h"
+#include "client_registry.h"
+#include "client_registry_ext.h"
+#include "shm.h"
 
 static void init() {
 #ifndef NO_SERVER
@@ -71,3 +99,1237 @@ Test(student_suite, 01_connect, .init = init, .fini = fini, .timeout = 5) {
     int ret = system("util/tclient -p 9999 </dev/null | grep 'Connected to server'");
     cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
 }
+
+/*
+ * Draw from the first thread of a fresh process, so that the stream does
+ * not depend on what this process has drawn already.
+ */
+static void draw_in_child(uint64_t seed, uint64_t *out, int n) {
+    int fds[2];
+    cr_assert_eq(pipe(fds), 0, "pipe failed");
+    pid_t pid = fork();
+    cr_assert_neq(pid, -1, "fork failed");
+    if(pid == 0) {
+	close(fds[0]);
+	rng_init(seed, 1);
+	for(int i = 0; i < n; i++)
+	    out[i] = rng_next();
+	_exit(write(fds[1], out, n * sizeof(*out)) == (ssize_t)(n * sizeof(*out)) ? 0 : 1);
+    }
+    close(fds[1]);
+    size_t got = 0;
+    ssize_t r;
+    while(got < n * sizeof(*out) &&
+	  (r = read(fds[0], (char *)out + got, n * sizeof(*out) - got)) > 0)
+	got += r;
+    close(fds[0]);
+    int status;
+    waitpid(pid, &status, 0);
+    cr_assert_eq(got, n * sizeof(*out), "child drew %zu bytes", got);
+}
+
+static void *draw_thread(void *arg) {
+    uint64_t *out = arg;
+    for(int i = 0; i < 8; i++)
+	out[i] = rng_next();
+    return NULL;
+}
+
+Test(unit_suite, 02_rng_seed, .timeout = 5) {
+    fprintf(stderr, "unit_suite/02_rng_seed\n");
+    uint64_t a[8], b[8], c[8], t[8];
+    draw_in_child(12345, a, 8);
+    draw_in_child(12345, b, 8);
+    draw_in_child(12346, c, 8);
+    cr_assert(memcmp(a, b, sizeof(a)) == 0, "Same seed gave different streams");
+    cr_assert(memcmp(a, c, sizeof(a)) != 0, "Different seeds gave the same stream");
+
+    int fixed = 0;
+    rng_init(12345, 1);
+    cr_assert_eq(rng_seed(&fixed), 12345);
+    cr_assert_eq(fixed, 1);
+    for(int i = 0; i < 8; i++)
+	t[i] = rng_next();
+    cr_assert(memcmp(a, t, sizeof(a)) == 0, "First thread did not get the first stream");
+    pthread_t tid;
+    pthread_create(&tid, NULL, draw_thread, t);
+    pthread_join(tid, NULL);
+    cr_assert(memcmp(a, t, sizeof(a)) != 0, "Second thread got the first stream");
+}
+
+Test(unit_suite, 03_rng_below, .timeout = 5) {
+    fprintf(stderr, "unit_suite/03_rng_below\n");
+    static const uint32_t bounds[] = { 1, 2, 3, 7, 1000, 0x80000001u, UINT32_MAX };
+    rng_init(1, 1);
+    for(size_t b = 0; b < sizeof(bounds) / sizeof(bounds[0]); b++) {
+	uint32_t n = bounds[b];
+	for(int i = 0; i < 10000; i++) {
+	    uint32_t v = rng_below(n);
+	    cr_assert_lt(v, n, "rng_below(%u) returned %u", n, v);
+	}
+    }
+    // Every value of a small bound turns up, and about as often as the others.
+    int seen[7] = { 0 };
+    for(int i = 0; i < 70000; i++)
+	seen[rng_below(7)]++;
+    for(int v = 0; v < 7; v++)
+	cr_assert(seen[v] > 9000 && seen[v] < 11000, "rng_below(7) gave %d %d times", v, seen[v]);
+}
+
+static struct slab_cache test_cache = SLAB_CACHE_INITIALIZER("test", 100);
+static struct slab_cache line_cache = SLAB_CACHE_INITIALIZER("test_line", 128);
+
+static void *alloc_thread(void *arg) {
+    return slab_alloc(&test_cache);
+}
+
+Test(unit_suite, 04_slab_alloc_free, .timeout = 5) {
+    fprintf(stderr, "unit_suite/04_slab_alloc_free\n");
+    enum { N = 1000 };
+    static unsigned char *objs[N];
+    for(int i = 0; i < N; i++) {
+	objs[i] = slab_alloc(&test_cache);
+	cr_assert_not_null(objs[i]);
+	cr_assert_eq((uintptr_t)objs[i] % 16, 0, "Object %d is not aligned", i);
+	memset(objs[i], i & 0xff, test_cache.size);
+    }
+    for(int i = 0; i < N; i++)
+	for(size_t j = 0; j < test_cache.size; j++)
+	    cr_assert_eq(objs[i][j], i & 0xff, "Object %d overlaps another", i);
+    cr_assert_eq(atomic_load(&test_cache.live), N);
+    cr_assert_eq(atomic_load(&test_cache.high_water), N);
+    for(int i = 0; i < N; i++)
+	slab_free(&test_cache, objs[i]);
+    slab_free(&test_cache, NULL);
+    cr_assert_eq(atomic_load(&test_cache.live), 0);
+
+    // The last object freed is the first one reused.
+    void *p = slab_alloc(&test_cache);
+    cr_assert_eq(p, objs[N - 1]);
+    slab_free(&test_cache, p);
+
+    // An object may be freed by a thread other than the one that allocated it.
+    pthread_t tid;
+    pthread_create(&tid, NULL, alloc_thread, NULL);
+    pthread_join(tid, &p);
+    cr_assert_not_null(p);
+    cr_assert_eq(atomic_load(&test_cache.live), 1);
+    slab_free(&test_cache, p);
+    cr_assert_eq(atomic_load(&test_cache.live), 0);
+
+    for(int i = 0; i < 100; i++) {
+	objs[i] = slab_alloc(&line_cache);
+	cr_assert_eq((uintptr_t)objs[i] % 64, 0, "Object %d is not on a cache line", i);
+    }
+    for(int i = 0; i < 100; i++)
+	slab_free(&line_cache, objs[i]);
+}
+
+Test(unit_suite, 05_slab_buf, .timeout = 5) {
+    fprintf(stderr, "unit_suite/05_slab_buf\n");
+    static const size_t sizes[] = { 1, 16, 17, 100, SLAB_BUF_MAX, SLAB_BUF_MAX + 1, 100000 };
+    enum { NSIZES = sizeof(sizes) / sizeof(sizes[0]) };
+    unsigned char *bufs[NSIZES];
+    for(int i = 0; i < NSIZES; i++) {
+	bufs[i] = slab_buf_alloc(sizes[i]);
+	cr_assert_not_null(bufs[i]);
+	cr_assert_eq((uintptr_t)bufs[i] % 16, 0, "Buffer of %zu bytes is not aligned", sizes[i]);
+	memset(bufs[i], i + 1, sizes[i]);
+    }
+    for(int i = 0; i < NSIZES; i++) {
+	for(size_t j = 0; j < sizes[i]; j++)
+	    cr_assert_eq(bufs[i][j], i + 1, "Buffer of %zu bytes overlaps another", sizes[i]);
+	slab_buf_free(bufs[i]);
+    }
+    slab_buf_free(NULL);
+}
+
+Test(unit_suite, 06_latency_buckets, .timeout = 5) {
+    fprintf(stderr, "unit_suite/06_latency_buckets\n");
+    cr_assert_eq(latency_bucket(0), 0);
+    for(int b = 0; b < LATENCY_BUCKETS; b++) {
+	unsigned long high = latency_bucket_high(b);
+	cr_assert_eq(latency_bucket(high), b, "Bucket %d: high %lu falls in %d", b, high,
+		     latency_bucket(high));
+	if(b + 1 < LATENCY_BUCKETS)
+	    cr_assert_eq(latency_bucket(high + 1), b + 1, "Bucket %d: %lu falls in %d",
+			 b + 1, high + 1, latency_bucket(high + 1));
+    }
+    cr_assert_eq(latency_bucket_high(LATENCY_BUCKETS - 1), (1UL << LATENCY_MAX_BITS) - 1);
+    cr_assert_eq(latency_bucket(1UL << LATENCY_MAX_BITS), LATENCY_BUCKETS - 1);
+    cr_assert_eq(latency_bucket(~0UL), LATENCY_BUCKETS - 1);
+
+    // A reported value is within 1/2^LATENCY_SUB_BITS of the true one.
+    for(unsigned long ns = 1; ns < (1UL << LATENCY_MAX_BITS); ns = ns * 3 / 2 + 1) {
+	unsigned long high = latency_bucket_high(latency_bucket(ns));
+	cr_assert(high >= ns && high - ns <= ns >> LATENCY_SUB_BITS,
+		  "%lu is reported as %lu", ns, high);
+    }
+}
+
+/*
+ * Send stderr to a temporary file, or back, returning what was written.
+ */
+static int saved_stderr = -1;
+
+static void capture_stderr(void) {
+    fflush(stderr);
+    saved_stderr = dup(STDERR_FILENO);
+    FILE *f = tmpfile();
+    cr_assert_not_null(f);
+    dup2(fileno(f), STDERR_FILENO);
+}
+
+static char *release_stderr(void) {
+    fflush(stderr);
+    off_t len = lseek(STDERR_FILENO, 0, SEEK_END);
+    char *out = calloc(1, len + 1);
+    cr_assert_eq(pread(STDERR_FILENO, out, len, 0), len);
+    dup2(saved_stderr, STDERR_FILENO);
+    close(saved_stderr);
+    return out;
+}
+
+/*
+ * Check one formatted record: level, timestamp, location, then message.
+ */
+static void check_record(const char *line, const char *level, const char *where,
+			 const char *msg) {
+    size_t n = strlen(level);
+    cr_assert(strncmp(line, level, n) == 0, "Record starts \"%.40s\"", line);
+    line += n;
+    char *end;
+    strtoul(line, &end, 10);
+    cr_assert(end > line && *end == '.', "Bad seconds in \"%.40s\"", line);
+    line = end + 1;
+    strtoul(line, &end, 10);
+    cr_assert_eq(end - line, 6, "Bad microseconds in \"%.40s\"", line);
+    cr_assert_eq(*end, ' ');
+    line = end + 1;
+    n = strlen(where);
+    cr_assert(strncmp(line, where, n) == 0, "Expected \"%s\", got \"%.40s\"", where, line);
+    line += n;
+    n = strlen(msg);
+    cr_assert(strncmp(line, msg, n) == 0 && line[n] == '\n',
+	      "Expected \"%s\", got \"%.40s\"", msg, line);
+}
+
+#define TEST_FORMAT "%d|%5u|%x|%c|%s|%-3s|%%|%ld|%lu"
+#define TEST_MESSAGE "-5|   42|ff|z|abc|ab |%|123456789012|3"
+
+static void write_test_record(void) {
+    long args[] = { -5, 42, 255, 'z', (long)"abc", (long)"ab", 123456789012L, 3 };
+    log_write(LOG_WARN, "file.c", "func", 7, TEST_FORMAT, 8, args);
+}
+
+Test(unit_suite, 07_log_format, .timeout = 5) {
+    fprintf(stderr, "unit_suite/07_log_format\n");
+    // Before log_init() the record is written at once, after it by the writer.
+    capture_stderr();
+    write_test_record();
+    char *out = release_stderr();
+    check_record(out, KYEL "WARN: ", "file.c:func:7 " KNRM, TEST_MESSAGE);
+    free(out);
+
+    capture_stderr();
+    log_init();
+    write_test_record();
+    log_fini();
+    out = release_stderr();
+    check_record(out, KYEL "WARN: ", "file.c:func:7 " KNRM, TEST_MESSAGE);
+    cr_assert_eq(strchr(out, '\n')[1], '\0', "More than one record written");
+    free(out);
+}
+
+struct pipe_reader {
+    int fd;
+    char *buf;
+    size_t len;
+};
+
+static void *read_pipe(void *arg) {
+    struct pipe_reader *r = arg;
+    size_t cap = 0;
+    ssize_t n;
+    do {
+	if(cap - r->len < 65536)
+	    r->buf = realloc(r->buf, cap += 1 << 20);
+	n = read(r->fd, r->buf + r->len, cap - r->len - 1);
+	if(n > 0)
+	    r->len += n;
+    } while(n > 0);
+    r->buf[r->len] = '\0';
+    return NULL;
+}
+
+Test(unit_suite, 08_log_drops, .timeout = 10) {
+    fprintf(stderr, "unit_suite/08_log_drops\n");
+    enum { N = 20000 };
+    // Nobody reads the pipe at first, so the writer stalls and the ring fills.
+    int fds[2];
+    cr_assert_eq(pipe(fds), 0);
+    fflush(stderr);
+    int saved = dup(STDERR_FILENO);
+    dup2(fds[1], STDERR_FILENO);
+    close(fds[1]);
+
+    log_init();
+    for(long i = 0; i < N; i++)
+	log_write(LOG_INFO, "file.c", "func", 1, "record %ld", 1, &i);
+    unsigned long dropped = log_dropped();
+
+    struct pipe_reader reader = { .fd = fds[0] };
+    pthread_t tid;
+    pthread_create(&tid, NULL, read_pipe, &reader);
+    log_fini();
+    dup2(saved, STDERR_FILENO);
+    close(saved);
+    pthread_join(tid, NULL);
+    close(fds[0]);
+
+    cr_assert_gt(dropped, 0, "No records were dropped");
+    cr_assert_eq(log_dropped(), dropped);
+    unsigned long written = 0, reported = 0;
+    long last = -1;
+    for(char *line = reader.buf; *line; line = strchr(line, '\n') + 1) {
+	static const char drop[] = KYEL "WARN: " KNRM "log: ";
+	if(strncmp(line, drop, sizeof(drop) - 1) == 0) {
+	    char *end;
+	    reported += strtoul(line + sizeof(drop) - 1, &end, 10);
+	    cr_assert(strncmp(end, " records dropped (ring full)\n", 29) == 0,
+		      "Bad drop report \"%.60s\"", line);
+	    continue;
+	}
+	char *msg = strstr(line, "record ");
+	cr_assert_not_null(msg, "Unexpected line \"%.40s\"", line);
+	long i = strtol(msg + 7, NULL, 10);
+	cr_assert_gt(i, last, "Record %ld written after %ld", i, last);
+	last = i;
+	written++;
+    }
+    cr_assert_eq(reported, dropped, "%lu drops reported, %lu counted", reported, dropped);
+    cr_assert_eq(written + dropped, N, "%lu written and %lu dropped of %d",
+		 written, dropped, N);
+    free(reader.buf);
+}
+
+/*
+ * Apply an MZW_VIEW_DELTA payload to the previous view, as a client would.
+ */
+static int apply_delta(char *view, int n, const char *delta, int len) {
+    int i = 0, d = 0;
+    while(d < len) {
+	if(d + 2 > len)
+	    return -1;
+	int keep = (unsigned char)delta[d], change = (unsigned char)delta[d + 1];
+	d += 2;
+	if(i + keep + change > n || d + change > len)
+	    return -1;
+	i += keep;
+	memcpy(view + i, delta + d, change);
+	i += change;
+	d += change;
+    }
+    return 0;
+}
+
+Test(unit_suite, 09_view_delta, .timeout = 5) {
+    fprintf(stderr, "unit_suite/09_view_delta\n");
+    enum { N = VIEW_DEPTH * VIEW_WIDTH };
+    char old[N], cur[N], out[N], view[N];
+    memset(old, '*', N);
+    memcpy(cur, old, N);
+
+    cr_assert_eq(player_view_delta(old, cur, N, out), 0, "Unchanged view has a delta");
+
+    cur[10] = 'A';
+    cr_assert_eq(player_view_delta(old, cur, N, out), 3);
+    cr_assert(out[0] == 10 && out[1] == 1 && out[2] == 'A', "Bad run %d %d %c",
+	      out[0], out[1], out[2]);
+
+    memset(cur, ' ', N);
+    cr_assert_eq(player_view_delta(old, cur, N, out), -1, "Delta of a new view is not shorter");
+
+    // Random views with a few changes decode to the new view.
+    rng_init(7, 1);
+    for(int t = 0; t < 1000; t++) {
+	int n = (1 + rng_below(VIEW_DEPTH)) * VIEW_WIDTH;
+	for(int i = 0; i < n; i++)
+	    old[i] = " *AB"[rng_below(4)];
+	memcpy(cur, old, n);
+	int changes = rng_below(n / 2 + 1);
+	for(int i = 0; i < changes; i++)
+	    cur[rng_below(n)] = " *AB"[rng_below(4)];
+	int len = player_view_delta(old, cur, n, out);
+	if(len < 0)
+	    continue;
+	cr_assert_lt(len, n, "Delta of %d bytes for %d cells", len, n);
+	memcpy(view, old, n);
+	cr_assert_eq(apply_delta(view, n, out, len), 0, "Malformed delta");
+	cr_assert(memcmp(view, cur, n) == 0, "Delta does not give the new view");
+    }
+}
+
+/*
+ * Servers started by the tests below each listen on a port of their own, so
+ * that the tests can run in parallel.
+ */
+#ifndef SERVER_BIN
+#define SERVER_BIN "bin/mazewar"
+#endif
+
+static int connect_server(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port),
+				.sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    if(fd < 0)
+	return -1;
+    if(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+	close(fd);
+	return -1;
+    }
+    return fd;
+}
+
+/*
+ * Run the server with the given arguments (NULL-terminated) after -p <port>.
+ */
+static pid_t spawn_server(int port, const char *const *args) {
+    pid_t pid = fork();
+    cr_assert_neq(pid, -1, "fork failed");
+    if(pid == 0) {
+	char portstr[16];
+	const char *argv[32] = { SERVER_BIN, "-p", portstr };
+	int argc = 3;
+	snprintf(portstr, sizeof(portstr), "%d", port);
+	while(args && *args && argc < 31)
+	    argv[argc++] = *args++;
+	argv[argc] = NULL;
+	int null = open("/dev/null", O_WRONLY);
+	dup2(null, STDERR_FILENO);
+	execv(SERVER_BIN, (char **)argv);
+	_exit(127);
+    }
+    return pid;
+}
+
+/*
+ * Start the server and wait until it accepts connections.
+ */
+static pid_t start_server(int port, const char *const *args) {
+    pid_t pid = spawn_server(port, args);
+    for(int i = 0; i < 300; i++) {
+	int fd = connect_server(port);
+	if(fd >= 0) {
+	    close(fd);
+	    return pid;
+	}
+	if(waitpid(pid, NULL, WNOHANG) == pid)
+	    cr_assert_fail("Server exited at startup");
+	usleep(10000);
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    cr_assert_fail("Server did not start");
+    return -1;
+}
+
+static void stop_server(pid_t pid) {
+    int status;
+    kill(pid, SIGHUP);
+    for(int i = 0; i < 500 && waitpid(pid, &status, WNOHANG) == 0; i++)
+	usleep(10000);
+    if(waitpid(pid, &status, WNOHANG) == 0) {
+	kill(pid, SIGKILL);
+	waitpid(pid, &status, 0);
+	cr_assert_fail("Server did not terminate after SIGHUP");
+    }
+    cr_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0, "Server exit status was not 0");
+}
+
+static void send_packet(int fd, int type, int param1, int param3, const void *data, int size) {
+    MZW_PACKET pkt = { .type = type, .param1 = param1, .param3 = param3, .size = size };
+    cr_assert_eq(proto_send_packet(fd, &pkt, (void *)data), 0, "Send failed");
+}
+
+/*
+ * Receive a packet, waiting at most ms milliseconds for it to start.
+ * Returns its type, or -1 on timeout or EOF.  A payload is freed unless
+ * datap is given.
+ */
+static int recv_packet(int fd, MZW_PACKET *pkt, void **datap, int ms) {
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    MZW_PACKET dummy;
+    void *data = NULL;
+    if(!pkt)
+	pkt = &dummy;
+    if(poll(&pfd, 1, ms) <= 0 || proto_recv_packet(fd, pkt, &data) != 0)
+	return -1;
+    if(datap)
+	*datap = data;
+    else
+	free(data);
+    return pkt->type;
+}
+
+/*
+ * Receive packets until one of the given type, or until none has arrived
+ * for ms milliseconds.  Returns the type, or -1.
+ */
+static int recv_until(int fd, int type, MZW_PACKET *pkt, void **datap, int ms) {
+    int t;
+    while((t = recv_packet(fd, pkt, datap, ms)) >= 0 && t != type) {
+	if(datap) {
+	    free(*datap);
+	    *datap = NULL;
+	}
+    }
+    return t;
+}
+
+/*
+ * A 40 x 40 maze, open inside a wall.
+ */
+static char **open_maze(void) {
+    static char rows[40][41];
+    static char *template[41];
+    for(int r = 0; r < 40; r++) {
+	for(int c = 0; c < 40; c++)
+	    rows[r][c] = (r == 0 || c == 0 || r == 39 || c == 39) ? '*' : ' ';
+	rows[r][40] = '\0';
+	template[r] = rows[r];
+    }
+    template[40] = NULL;
+    return template;
+}
+
+static int has_id(const int *ids, int n, int id) {
+    for(int i = 0; i < n; i++)
+	if(ids[i] == id)
+	    return 1;
+    return 0;
+}
+
+Test(unit_suite, 10_maze_watchers_bands, .timeout = 5) {
+    fprintf(stderr, "unit_suite/10_maze_watchers_bands\n");
+    cr_assert_eq(room_init(1, 1000), 0);
+    maze_init(open_maze());
+
+    // { row, col, seen } around (20, 20).
+    static const int cells[][3] = {
+	{ 20, 20, 1 },                                  // the cell itself
+	{ 20, 20 + VIEW_DEPTH - 1, 1 }, { 20, 20 + VIEW_DEPTH, 0 },        // its row
+	{ 19, 20 - (VIEW_DEPTH - 1), 1 }, { 21, 20 - VIEW_DEPTH, 0 },      // the rows beside
+	{ 20 - (VIEW_DEPTH - 1), 20, 1 }, { 20 + VIEW_DEPTH, 20, 0 },      // its column
+	{ 20 + VIEW_DEPTH - 1, 21, 1 }, { 20 - VIEW_DEPTH, 19, 0 },        // the columns beside
+	{ 22, 22, 0 }, { 18, 18, 0 },                   // off both bands
+    };
+    int ncells = sizeof(cells) / sizeof(cells[0]);
+    for(int i = 0; i < ncells; i++)
+	cr_assert_eq(maze_place(i + 1, 'A', cells[i][0], cells[i][1]), 0,
+		     "Could not place %d at (%d, %d)", i + 1, cells[i][0], cells[i][1]);
+
+    int ids[MAZE_WATCHERS_MAX];
+    int n = maze_watchers(20, 20, ids, MAZE_WATCHERS_MAX);
+    int expected = 0;
+    for(int i = 0; i < ncells; i++) {
+	expected += cells[i][2];
+	cr_assert_eq(has_id(ids, n, i + 1), cells[i][2], "Player at (%d, %d) %s",
+		     cells[i][0], cells[i][1], cells[i][2] ? "not found" : "found");
+    }
+    cr_assert_eq(n, expected, "%d ids for %d watchers", n, expected);
+}
+
+Test(unit_suite, 11_maze_watchers_edge, .timeout = 5) {
+    fprintf(stderr, "unit_suite/11_maze_watchers_edge\n");
+    cr_assert_eq(room_init(1, 1000), 0);
+    maze_init(open_maze());
+
+    // The bands around a corner run off two sides of the maze.
+    static const int cells[][3] = {
+	{ 1, 1, 1 }, { 1, VIEW_DEPTH - 1, 1 }, { 1, VIEW_DEPTH, 0 },
+	{ VIEW_DEPTH - 1, 1, 1 }, { VIEW_DEPTH, 1, 0 }, { 2, 2, 0 },
+	{ 38, 38, 0 },
+    };
+    int ncells = sizeof(cells) / sizeof(cells[0]);
+    for(int i = 0; i < ncells; i++)
+	cr_assert_eq(maze_place(i + 1, 'A', cells[i][0], cells[i][1]), 0);
+
+    int ids[MAZE_WATCHERS_MAX];
+    int n = maze_watchers(0, 0, ids, MAZE_WATCHERS_MAX);
+    int expected = 0;
+    for(int i = 0; i < ncells; i++) {
+	expected += cells[i][2];
+	cr_assert_eq(has_id(ids, n, i + 1), cells[i][2], "Player at (%d, %d) %s",
+		     cells[i][0], cells[i][1], cells[i][2] ? "not found" : "found");
+    }
+    cr_assert_eq(n, expected);
+
+    // And around the opposite corner.
+    n = maze_watchers(39, 39, ids, MAZE_WATCHERS_MAX);
+    cr_assert_eq(n, 1);
+    cr_assert_eq(ids[0], ncells);
+}
+
+Test(unit_suite, 12_maze_watchers_max, .timeout = 5) {
+    fprintf(stderr, "unit_suite/12_maze_watchers_max\n");
+    const int reach = VIEW_DEPTH - 1;
+    cr_assert_eq(room_init(1, 1000), 0);
+    maze_init(open_maze());
+
+    // Fill every cell of both bands.
+    int placed = 0;
+    for(int r = 20 - reach; r <= 20 + reach; r++)
+	for(int c = 20 - reach; c <= 20 + reach; c++)
+	    if((r >= 19 && r <= 21) || (c >= 19 && c <= 21))
+		cr_assert_eq(maze_place(++placed, 'A', r, c), 0);
+    cr_assert_leq(placed, MAZE_WATCHERS_MAX);
+
+    int ids[MAZE_WATCHERS_MAX + 1];
+    ids[MAZE_WATCHERS_MAX] = -1;
+    int n = maze_watchers(20, 20, ids, MAZE_WATCHERS_MAX);
+    cr_assert_eq(n, placed, "%d ids for %d watchers", n, placed);
+    for(int id = 1; id <= placed; id++)
+	cr_assert(has_id(ids, n, id), "Player %d not found", id);
+
+    // A short array is filled and not overrun.
+    ids[10] = -1;
+    n = maze_watchers(20, 20, ids, 10);
+    cr_assert_eq(n, 10);
+    cr_assert_eq(ids[10], -1, "maze_watchers() wrote past max");
+}
+
+Test(server_suite, 13_large_room_login, .timeout = 20) {
+    fprintf(stderr, "server_suite/13_large_room_login\n");
+    static const char *const args[] = { "-X", "100", NULL };
+    pid_t pid = start_server(9931, args);
+    MZW_PACKET pkt;
+    void *data = NULL;
+
+    // A client that cannot tell players apart by id is refused.
+    int fd = connect_server(9931);
+    send_packet(fd, MZW_LOGIN_PKT, 'A', 0, "legacy", 6);
+    cr_assert_eq(recv_packet(fd, NULL, NULL, 2000), MZW_INUSE_PKT, "Legacy LOGIN not refused");
+    close(fd);
+
+    // So is one that does not log in first.
+    fd = connect_server(9931);
+    send_packet(fd, MZW_REFRESH_PKT, 0, 0, NULL, 0);
+    cr_assert_eq(recv_packet(fd, NULL, NULL, 2000), MZW_INUSE_PKT, "Auto-login not refused");
+    close(fd);
+
+    // Two clients with wide ids may share a letter, and get their ids.
+    int a = connect_server(9931), b = connect_server(9931);
+    send_packet(a, MZW_LOGIN_PKT, 'A', MZW_LOGIN_WIDE_ID, "first", 5);
+    cr_assert_eq(recv_until(a, MZW_READY_PKT, &pkt, &data, 2000), MZW_READY_PKT);
+    cr_assert(pkt.param1 & MZW_LOGIN_WIDE_ID, "READY does not say ids are wide");
+    cr_assert_geq(pkt.size, 2);
+    int id_a = ntohs(*(uint16_t *)data);
+    free(data);
+    data = NULL;
+    send_packet(b, MZW_LOGIN_PKT, 'A', MZW_LOGIN_WIDE_ID, "second", 6);
+    cr_assert_eq(recv_until(b, MZW_READY_PKT, &pkt, &data, 2000), MZW_READY_PKT,
+		 "Second login with the same letter refused");
+    int id_b = ntohs(*(uint16_t *)data);
+    free(data);
+    data = NULL;
+    cr_assert(id_a >= 1 && id_b >= 1 && id_a != id_b, "Ids %d and %d", id_a, id_b);
+
+    // Scores come as SCORE_ID, never as SCORE.
+    int t;
+    int scores = 0;
+    while((t = recv_packet(b, &pkt, &data, 500)) >= 0) {
+	cr_assert_neq(t, MZW_SCORE_PKT, "SCORE sent to a client with wide ids");
+	if(t == MZW_SCORE_ID_PKT) {
+	    cr_assert_geq(pkt.size, 4);
+	    int id = ntohs(((uint16_t *)data)[0]);
+	    cr_assert(id == id_a || id == id_b, "SCORE_ID for unknown id %d", id);
+	    scores++;
+	}
+	free(data);
+	data = NULL;
+    }
+    cr_assert_geq(scores, 2, "Only %d SCORE_ID packets", scores);
+    close(a);
+    close(b);
+    stop_server(pid);
+}
+
+/*
+ * Run the server with arguments it should refuse, and return its exit
+ * status.
+ */
+static int refused_status(int port, const char *const *args) {
+    pid_t pid = spawn_server(port, args);
+    int status;
+    for(int i = 0; i < 300 && waitpid(pid, &status, WNOHANG) == 0; i++)
+	usleep(10000);
+    if(waitpid(pid, &status, WNOHANG) == 0) {
+	kill(pid, SIGHUP);
+	waitpid(pid, &status, 0);
+	cr_assert_fail("Server started with bad arguments");
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+Test(server_suite, 14_udp_loss_args, .timeout = 20) {
+    fprintf(stderr, "server_suite/14_udp_loss_args\n");
+    static const char *const bad[][5] = {
+	{ "-U", "9936", "-L", "5x", NULL },
+	{ "-U", "9936", "-L", "101", NULL },
+	{ "-U", "9936", "-L", "-1", NULL },
+	{ "-U", "9936", "-L", "1,2,3,4", NULL },
+	{ "-U", "9936", "-L", "1,,3", NULL },
+	{ "-U", "9936", "-L", "", NULL },
+    };
+    for(size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++)
+	cr_assert_neq(refused_status(9935, bad[i]), 0, "-L \"%s\" accepted", bad[i][3]);
+
+    static const char *const good[] = { "-U", "9936", "-L", "5,10,100", NULL };
+    stop_server(start_server(9935, good));
+}
+
+/*
+ * Receive a datagram on a UDP channel, waiting at most ms milliseconds.
+ * Returns its length, or -1.
+ */
+static int recv_datagram(int fd, unsigned char *buf, size_t size, int ms) {
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    if(poll(&pfd, 1, ms) <= 0)
+	return -1;
+    return recv(fd, buf, size, 0);
+}
+
+Test(server_suite, 15_udp_token, .timeout = 20) {
+    fprintf(stderr, "server_suite/15_udp_token\n");
+    static const char *const args[] = { "-U", "9938", NULL };
+    pid_t pid = start_server(9937, args);
+
+    int fd = connect_server(9937);
+    MZW_PACKET login = { .type = MZW_LOGIN_PKT, .param1 = 'A', .size = 3,
+			 .param2 = (int8_t)(MZW_LOGIN_COMPACT_VIEW | MZW_LOGIN_UDP_VIEW) };
+    cr_assert_eq(proto_send_packet(fd, &login, "udp"), 0);
+    MZW_PACKET pkt;
+    unsigned char *data = NULL;
+    cr_assert_eq(recv_until(fd, MZW_READY_PKT, &pkt, (void **)&data, 2000), MZW_READY_PKT);
+    cr_assert(pkt.param1 & MZW_LOGIN_UDP_VIEW, "No UDP channel offered");
+    cr_assert_eq(pkt.size, UDP_TOKEN_SIZE + 2);
+    unsigned char token[UDP_TOKEN_SIZE];
+    memcpy(token, data, UDP_TOKEN_SIZE);
+    int port = data[UDP_TOKEN_SIZE] << 8 | data[UDP_TOKEN_SIZE + 1];
+    free(data);
+    cr_assert_eq(port, 9938);
+
+    int ufd = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port),
+				.sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    cr_assert_eq(connect(ufd, (struct sockaddr *)&addr, sizeof(addr)), 0);
+    unsigned char buf[2048];
+
+    // A wrong token, or a short one, registers nothing and is not answered.
+    unsigned char wrong[UDP_TOKEN_SIZE];
+    memcpy(wrong, token, UDP_TOKEN_SIZE);
+    wrong[UDP_TOKEN_SIZE - 1] ^= 1;
+    send(ufd, wrong, UDP_TOKEN_SIZE, 0);
+    send(ufd, token, UDP_TOKEN_SIZE - 1, 0);
+    cr_assert_eq(recv_datagram(ufd, buf, sizeof(buf), 500), -1, "Bad token answered");
+
+    // The right one is answered with a full view, and each later view comes
+    // with a higher sequence number.
+    send(ufd, token, UDP_TOKEN_SIZE, 0);
+    uint32_t last = 0;
+    for(int i = 0; i < 4; i++) {
+	int n = recv_datagram(ufd, buf, sizeof(buf), 2000);
+	cr_assert_geq(n, 4 + (int)sizeof(MZW_PACKET), "View %d did not come over UDP", i);
+	uint32_t seq;
+	MZW_PACKET hdr;
+	memcpy(&seq, buf, 4);
+	memcpy(&hdr, buf + 4, sizeof(hdr));
+	seq = ntohl(seq);
+	cr_assert_eq(hdr.type, MZW_VIEW_PKT, "Datagram of type %d", hdr.type);
+	cr_assert_eq(hdr.param1, MZW_VIEW_FULL);
+	cr_assert_eq(n, 4 + (int)sizeof(MZW_PACKET) + ntohs(hdr.size));
+	cr_assert(i == 0 || seq > last, "Sequence %u after %u", seq, last);
+	last = seq;
+	send_packet(fd, MZW_TURN_PKT, 1, 0, NULL, 0);
+    }
+    close(ufd);
+    close(fd);
+    stop_server(pid);
+}
+
+Test(unit_suite, 16_handoff_state_round_trip, .timeout = 5) {
+    fprintf(stderr, "unit_suite/16_handoff_state_round_trip\n");
+    maze_init(open_maze());
+    player_init();
+
+    // The players' views go to sockets nobody reads; they are not checked.
+    int sa[2], sb[2];
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sa), 0);
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sb), 0);
+    PLAYER *a = player_login(sa[0], 'A', "alice");
+    PLAYER *b = player_login(sb[0], 'B', "bob");
+    cr_assert(a && b, "Login failed");
+    player_reset(a);
+    player_reset(b);
+    player_rotate(a, 1);
+    player_set_view_flags(b, MZW_LOGIN_COMPACT_VIEW);
+    player_set_view_limits(b, 5, 10);
+
+    // What the old process sends...
+    static struct player_state before[MAX_PLAYERS], after[MAX_PLAYERS];
+    int rows = maze_get_rows(), cols = maze_get_cols();
+    char *cells = malloc(rows * cols), *restored = malloc(rows * cols);
+    int n = player_snapshot(before, MAX_PLAYERS);
+    cr_assert_eq(n, 2);
+    cr_assert_eq(maze_snapshot(cells, rows * cols), rows * cols);
+    player_fini();
+    maze_fini();
+
+    // ...is what the new one rebuilds.
+    char **template = calloc(rows + 1, sizeof(char *));
+    for(int r = 0; r < rows; r++)
+	template[r] = strndup(cells + r * cols, cols);
+    maze_init(template);
+    player_init();
+    for(int i = 0; i < n; i++)
+	cr_assert_not_null(player_restore(&before[i]), "Player %c not restored", before[i].avatar);
+
+    cr_assert_eq(player_snapshot(after, MAX_PLAYERS), n);
+    cr_assert_eq(maze_snapshot(restored, rows * cols), rows * cols);
+    cr_assert(memcmp(cells, restored, rows * cols) == 0, "Maze differs after restore");
+    for(int i = 0; i < n; i++) {
+	struct player_state *x = &before[i], *y = &after[i];
+	cr_assert(x->avatar == y->avatar && x->fd == y->fd && x->score == y->score &&
+		  x->row == y->row && x->col == y->col && x->dir == y->dir &&
+		  x->view_flags == y->view_flags && x->view_max_depth == y->view_max_depth &&
+		  x->view_max_rate == y->view_max_rate && strcmp(x->name, y->name) == 0,
+		  "Player %c differs after restore", x->avatar);
+    }
+    cr_assert_eq(after[1].view_max_depth, 5);
+    cr_assert_eq(after[1].view_flags, MZW_LOGIN_COMPACT_VIEW);
+    for(int r = 0; r < rows; r++)
+	free(template[r]);
+    free(template);
+    free(cells);
+    free(restored);
+}
+
+/*
+ * Listen on a handoff socket as an old server would.
+ */
+static int handoff_socket(char *path, size_t size) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    snprintf(path, size, "/tmp/mazewar_test_handoff.%d", getpid());
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    unlink(path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    cr_assert(fd >= 0 && bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0 &&
+	      listen(fd, 1) == 0, "Cannot listen on %s", path);
+    return fd;
+}
+
+Test(server_suite, 17_handoff_version_refused, .timeout = 20) {
+    fprintf(stderr, "server_suite/17_handoff_version_refused\n");
+    char path[108];
+    int lfd = handoff_socket(path, sizeof(path));
+    const char *const args[] = { "-R", path, NULL };
+    pid_t pid = spawn_server(9939, args);
+
+    struct pollfd pfd = { .fd = lfd, .events = POLLIN };
+    cr_assert_eq(poll(&pfd, 1, 5000), 1, "Replacement did not connect");
+    int sock = accept(lfd, NULL, NULL);
+    struct handoff_header hdr = {
+	.magic = HANDOFF_MAGIC, .version = HANDOFF_VERSION + 1,
+	.rows = 1, .cols = 1, .nlisten = 1, .nclients = 0, .nplayers = 0
+    };
+    cr_assert_eq(write(sock, &hdr, sizeof(hdr)), sizeof(hdr));
+
+    // The replacement must neither acknowledge the snapshot nor keep running.
+    char ack;
+    pfd.fd = sock;
+    cr_assert_eq(poll(&pfd, 1, 5000), 1, "Replacement neither answered nor exited");
+    cr_assert_eq(read(sock, &ack, 1), 0, "Snapshot of another version acknowledged");
+    int status;
+    for(int i = 0; i < 300 && waitpid(pid, &status, WNOHANG) == 0; i++)
+	usleep(10000);
+    if(waitpid(pid, &status, WNOHANG) == 0) {
+	kill(pid, SIGKILL);
+	waitpid(pid, &status, 0);
+	cr_assert_fail("Replacement still running");
+    }
+    cr_assert(WIFEXITED(status) && WEXITSTATUS(status) != 0, "Replacement exited with 0");
+    close(sock);
+    close(lfd);
+    unlink(path);
+}
+
+Test(server_suite, 18_handoff_keeps_players, .timeout = 30) {
+    fprintf(stderr, "server_suite/18_handoff_keeps_players\n");
+    char path[108];
+    snprintf(path, sizeof(path), "/tmp/mazewar_test_handoff.%d", getpid());
+    const char *const old_args[] = { "-H", path, NULL };
+    pid_t old = start_server(9940, old_args);
+
+    int fd = connect_server(9940);
+    send_packet(fd, MZW_LOGIN_PKT, 'A', 0, "alice", 5);
+    cr_assert_eq(recv_until(fd, MZW_READY_PKT, NULL, NULL, 2000), MZW_READY_PKT);
+    while(recv_packet(fd, NULL, NULL, 200) >= 0)
+	;
+
+    const char *const new_args[] = { "-R", path, NULL };
+    pid_t new = spawn_server(9940, new_args);
+    int status;
+    for(int i = 0; i < 500 && waitpid(old, &status, WNOHANG) == 0; i++)
+	usleep(10000);
+    cr_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0, "Old server did not hand off");
+
+    // The connection and the player carry over: a refresh is answered, and
+    // the avatar is still taken.
+    send_packet(fd, MZW_REFRESH_PKT, 0, 0, NULL, 0);
+    int t = recv_packet(fd, NULL, NULL, 2000);
+    cr_assert(t == MZW_CLEAR_PKT || t == MZW_SHOW_PKT, "Refresh after handoff answered with %d", t);
+    int fd2 = connect_server(9940);
+    send_packet(fd2, MZW_LOGIN_PKT, 'A', 0, "mallory", 7);
+    cr_assert_eq(recv_packet(fd2, NULL, NULL, 2000), MZW_INUSE_PKT, "Avatar free after handoff");
+    close(fd2);
+    close(fd);
+    stop_server(new);
+}
+
+Test(server_suite, 19_pool_partial_header, .timeout = 20) {
+    fprintf(stderr, "server_suite/19_pool_partial_header\n");
+    static const char *const args[] = { "-w", "1", NULL };
+    pid_t pid = start_server(9941, args);
+
+    // Half a LOGIN header, then nothing more for now.
+    MZW_PACKET login = { .type = MZW_LOGIN_PKT, .param1 = 'A', .size = htons(5) };
+    int slow = connect_server(9941);
+    cr_assert_eq(write(slow, &login, sizeof(login) / 2), sizeof(login) / 2);
+    usleep(100000);
+
+    // The only worker must still serve another client.
+    int fd = connect_server(9941);
+    send_packet(fd, MZW_LOGIN_PKT, 'B', 0, "bob", 3);
+    cr_assert_eq(recv_until(fd, MZW_READY_PKT, NULL, NULL, 2000), MZW_READY_PKT,
+		 "Login held up by a partial header");
+    while(recv_packet(fd, NULL, NULL, 200) >= 0)
+	;
+    send_packet(fd, MZW_REFRESH_PKT, 0, 0, NULL, 0);
+    int t = recv_packet(fd, NULL, NULL, 2000);
+    cr_assert(t == MZW_CLEAR_PKT || t == MZW_SHOW_PKT, "Refresh held up by a partial header");
+
+    // The rest of the packet is then read as one.
+    cr_assert_eq(write(slow, (char *)&login + sizeof(login) / 2, sizeof(login) - sizeof(login) / 2),
+		 sizeof(login) - sizeof(login) / 2);
+    cr_assert_eq(write(slow, "alice", 5), 5);
+    cr_assert_eq(recv_until(slow, MZW_READY_PKT, NULL, NULL, 2000), MZW_READY_PKT,
+		 "Partial LOGIN not completed");
+    close(slow);
+    close(fd);
+    stop_server(pid);
+}
+
+Test(server_suite, 20_pool_packet_order, .timeout = 20) {
+    fprintf(stderr, "server_suite/20_pool_packet_order\n");
+    static const char *const args[] = { "-w", "4", NULL };
+    pid_t pid = start_server(9942, args);
+    enum { N = 200 };
+
+    int fd = connect_server(9942);
+    send_packet(fd, MZW_LOGIN_PKT, 'A', 0, "alice", 5);
+    cr_assert_eq(recv_until(fd, MZW_READY_PKT, NULL, NULL, 2000), MZW_READY_PKT);
+
+    // A sender's chat is echoed to it, so pipelined messages must come
+    // back in the order sent, however many workers there are.
+    for(int i = 0; i < N; i++) {
+	char msg[16];
+	int len = snprintf(msg, sizeof(msg), "%d", i);
+	send_packet(fd, MZW_SEND_PKT, 0, 0, msg, len);
+    }
+    MZW_PACKET pkt;
+    char *data;
+    for(int i = 0; i < N; i++) {
+	data = NULL;
+	cr_assert_eq(recv_until(fd, MZW_CHAT_PKT, &pkt, (void **)&data, 2000), MZW_CHAT_PKT,
+		     "Chat %d not echoed", i);
+	char *msg = memchr(data, ']', pkt.size);
+	cr_assert_not_null(msg);
+	cr_assert_eq(strtol(msg + 2, NULL, 10), i, "Chat \"%.*s\" echoed as number %d",
+		     pkt.size, data, i);
+	free(data);
+    }
+    close(fd);
+    stop_server(pid);
+}
+
+/*
+ * Raise the descriptor limit so a test can open more than FD_SETSIZE.
+ */
+static void raise_nofile(rlim_t want) {
+    struct rlimit rl;
+    cr_assert_eq(getrlimit(RLIMIT_NOFILE, &rl), 0);
+    if(rl.rlim_cur < want) {
+	rl.rlim_cur = rl.rlim_max < want ? rl.rlim_max : want;
+	setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    cr_assert_eq(getrlimit(RLIMIT_NOFILE, &rl), 0);
+    cr_assert_geq(rl.rlim_cur, want, "Descriptor limit %lu too low", (unsigned long)rl.rlim_cur);
+}
+
+/*
+ * Check that a socket has been shut down for reading.
+ */
+static int is_shut_down(int fd) {
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    char c;
+    return poll(&pfd, 1, 0) == 1 && recv(fd, &c, 1, MSG_DONTWAIT) == 0;
+}
+
+Test(unit_suite, 21_creg_past_fd_setsize, .timeout = 5) {
+    fprintf(stderr, "unit_suite/21_creg_past_fd_setsize\n");
+    enum { N = 3 };
+    int want[N] = { 3 * FD_SETSIZE / 4, FD_SETSIZE + 1, 2 * FD_SETSIZE + 5 };
+    int peer[N];
+    raise_nofile(4 * FD_SETSIZE);
+
+    CLIENT_REGISTRY *cr = creg_init();
+    cr_assert_not_null(cr);
+    for(int i = 0; i < N; i++) {
+	int sv[2];
+	cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+	cr_assert_eq(dup2(sv[0], want[i]), want[i]);
+	close(sv[0]);
+	peer[i] = sv[1];
+	creg_register(cr, want[i]);
+    }
+    cr_assert_eq(creg_count(cr), N);
+    int fds[N + 1];
+    cr_assert_eq(creg_list(cr, fds, N + 1), N);
+    for(int i = 0; i < N; i++)
+	cr_assert_eq(fds[i], want[i]);
+
+    creg_shutdown_all(cr);
+    for(int i = 0; i < N; i++)
+	cr_assert(is_shut_down(want[i]), "fd %d not shut down", want[i]);
+
+    for(int i = 0; i < N; i++) {
+	creg_unregister(cr, want[i]);
+	close(want[i]);
+	close(peer[i]);
+    }
+    cr_assert_eq(creg_count(cr), 0);
+    creg_fini(cr);
+}
+
+struct creg_unregister_args {
+    CLIENT_REGISTRY *cr;
+    int first, step, count;
+    atomic_int *done;
+};
+
+static void *creg_unregister_thread(void *arg) {
+    struct creg_unregister_args *a = arg;
+    for(int i = 0; i < a->count; i++) {
+	usleep(1000);
+	creg_unregister(a->cr, a->first + i * a->step);
+	atomic_fetch_add(a->done, 1);
+    }
+    return NULL;
+}
+
+Test(unit_suite, 22_creg_wait_for_empty, .timeout = 5) {
+    fprintf(stderr, "unit_suite/22_creg_wait_for_empty\n");
+    enum { THREADS = 4, PER_THREAD = 40 };
+    CLIENT_REGISTRY *cr = creg_init();
+    cr_assert_not_null(cr);
+
+    // The registry only indexes by descriptor, so these need not be open.
+    for(int fd = 0; fd < THREADS * PER_THREAD; fd++)
+	creg_register(cr, fd + 100);
+    cr_assert_eq(creg_count(cr), THREADS * PER_THREAD);
+
+    // Each thread unregisters fds spread across all the count shards.
+    atomic_int done = 0;
+    pthread_t tids[THREADS];
+    struct creg_unregister_args args[THREADS];
+    for(int i = 0; i < THREADS; i++) {
+	args[i] = (struct creg_unregister_args){ cr, 100 + i, THREADS, PER_THREAD, &done };
+	cr_assert_eq(pthread_create(&tids[i], NULL, creg_unregister_thread, &args[i]), 0);
+    }
+    creg_wait_for_empty(cr);
+    cr_assert_eq(atomic_load(&done), THREADS * PER_THREAD, "Wait returned with %d of %d unregistered",
+		 atomic_load(&done), THREADS * PER_THREAD);
+    cr_assert_eq(creg_count(cr), 0);
+    for(int i = 0; i < THREADS; i++)
+	pthread_join(tids[i], NULL);
+
+    // An empty registry does not block.
+    creg_wait_for_empty(cr);
+    creg_fini(cr);
+}
+
+Test(unit_suite, 23_creg_shutdown_all_batches, .timeout = 5) {
+    fprintf(stderr, "unit_suite/23_creg_shutdown_all_batches\n");
+    // Enough clients for several batches, spread over the helper threads.
+    enum { N = 800 };
+    static int ends[N][2];
+    raise_nofile(2 * N + 64);
+
+    CLIENT_REGISTRY *cr = creg_init();
+    cr_assert_not_null(cr);
+    for(int i = 0; i < N; i++) {
+	cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, ends[i]), 0);
+	if(i % 3)
+	    creg_register(cr, ends[i][0]);
+    }
+    creg_shutdown_all(cr);
+
+    for(int i = 0; i < N; i++) {
+	if(i % 3)
+	    cr_assert(is_shut_down(ends[i][0]), "Registered fd %d not shut down", ends[i][0]);
+	else
+	    cr_assert(!is_shut_down(ends[i][0]), "Unregistered fd %d shut down", ends[i][0]);
+	creg_unregister(cr, ends[i][0]);
+	close(ends[i][0]);
+	close(ends[i][1]);
+    }
+    cr_assert_eq(creg_count(cr), 0);
+    creg_fini(cr);
+}
+
+/*
+ * The server side of the one shared-memory connection a test makes.
+ */
+static atomic_int shm_server_fd = -1;
+
+static void shm_accepted(int fd) {
+    atomic_store(&shm_server_fd, fd);
+}
+
+/*
+ * Open a shared-memory connection within the test process.
+ */
+static int shm_pair(const char *path, int *server) {
+    cr_assert_eq(shm_init(path, shm_accepted), 0);
+    int fd = shm_connect(path);
+    cr_assert_geq(fd, 0, "shm_connect: %s", strerror(errno));
+    for(int i = 0; i < 200 && atomic_load(&shm_server_fd) < 0; i++)
+	usleep(10000);
+    *server = atomic_load(&shm_server_fd);
+    cr_assert_geq(*server, 0, "Connection not accepted");
+    cr_assert(shm_owns(fd) && shm_owns(*server));
+    return fd;
+}
+
+#define SHM_BIG_PACKETS 20
+
+static int shm_big_size(int i) {
+    return 30000 + i * 1111;
+}
+
+static void *shm_big_reader(void *arg) {
+    int fd = *(int *)arg;
+    // Let the writer fill the ring first.
+    usleep(100000);
+    for(int i = 0; i < SHM_BIG_PACKETS; i++) {
+	MZW_PACKET pkt;
+	unsigned char *data = NULL;
+	if(proto_recv_packet(fd, &pkt, (void **)&data) < 0)
+	    return (void *)"recv failed";
+	if(pkt.type != MZW_CHAT_PKT || pkt.param1 != i || pkt.size != shm_big_size(i))
+	    return (void *)"wrong header";
+	for(int j = 0; j < pkt.size; j++) {
+	    if(data[j] != (unsigned char)(i * 31 + j)) {
+		free(data);
+		return (void *)"payload corrupted";
+	    }
+	}
+	free(data);
+    }
+    return NULL;
+}
+
+Test(unit_suite, 24_shm_ring_wrap, .timeout = 10) {
+    fprintf(stderr, "unit_suite/24_shm_ring_wrap\n");
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/mzw_shm_test_%d", getpid());
+    int server;
+    int fd = shm_pair(path, &server);
+
+    // Each packet is well over half the ring, so every one after the first
+    // waits for room, and most of them straddle the end of the ring.
+    pthread_t tid;
+    cr_assert_eq(pthread_create(&tid, NULL, shm_big_reader, &server), 0);
+    static unsigned char data[SHM_RING_SIZE];
+    for(int i = 0; i < SHM_BIG_PACKETS; i++) {
+	for(int j = 0; j < shm_big_size(i); j++)
+	    data[j] = i * 31 + j;
+	MZW_PACKET pkt = { .type = MZW_CHAT_PKT, .param1 = i, .size = shm_big_size(i) };
+	cr_assert_eq(proto_send_packet(fd, &pkt, data), 0, "Packet %d not sent", i);
+    }
+    void *err;
+    pthread_join(tid, &err);
+    cr_assert_null(err, "%s", (char *)err);
+
+    char status[512];
+    FILE *out = fmemopen(status, sizeof(status), "w");
+    shm_show(out);
+    fclose(out);
+    unsigned long stalls = 0;
+    char *p = strstr(status, " full-ring stalls");
+    cr_assert_not_null(p, "%s", status);
+    while(p > status && p[-1] >= '0' && p[-1] <= '9')
+	p--;
+    stalls = strtoul(p, NULL, 10);
+    cr_assert_geq(stalls, 1, "No write waited for room: %s", status);
+
+    shm_release(fd);
+    close(fd);
+    shm_release(server);
+    close(server);
+    shm_fini();
+}
+
+static void *shm_full_writer(void *arg) {
+    int fd = *(int *)arg;
+    static char data[SHM_RING_SIZE / 2];
+    MZW_PACKET pkt = { .type = MZW_CHAT_PKT, .size = sizeof(data) };
+    // Nobody reads, so the second or third packet waits for room.
+    for(int i = 0; i < 3; i++) {
+	if(proto_send_packet(fd, &pkt, data) < 0)
+	    return (void *)(intptr_t)errno;
+    }
+    return NULL;
+}
+
+Test(unit_suite, 25_shm_write_after_release, .timeout = 10) {
+    fprintf(stderr, "unit_suite/25_shm_write_after_release\n");
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/mzw_shm_test_%d", getpid());
+    int server;
+    int fd = shm_pair(path, &server);
+
+    // A write waiting for room gives up when the connection is released.
+    pthread_t tid;
+    cr_assert_eq(pthread_create(&tid, NULL, shm_full_writer, &server), 0);
+    usleep(200000);
+    shm_release(server);
+    void *err;
+    pthread_join(tid, &err);
+    cr_assert_eq((intptr_t)err, EPIPE, "Waiting write not failed with EPIPE");
+
+    // And a write made after it fails at once.
+    cr_assert(!shm_owns(server));
+    MZW_PACKET pkt = { .type = MZW_CHAT_PKT };
+    errno = 0;
+    cr_assert_eq(shm_write_packet(server, &pkt, NULL, 0), -1);
+    cr_assert_eq(errno, EBADF);
+    shm_release(fd);
+    cr_assert_eq(shm_write_packet(fd, &pkt, NULL, 0), -1);
+    cr_assert_eq(errno, EBADF);
+
+    close(fd);
+    close(server);
+    shm_fini();
+}
@@ -0,0 +1,837 @@
+/*
+ * mzw_loadgen: headless load generator for the MazeWar server.
+ *
+ * Opens a number of connections, spread over a number of threads each with
+ * its own epoll loop, logs each in with a distinct avatar, and then sends a
+ * weighted mix of MOVE, TURN, FIRE, SEND and REFRESH packets at a fixed
+ * rate per connection.  The time from when each packet was due to be sent
+ * (not when it was sent, so a slow server cannot hide its own backlog) to
+ * the first packet of its reply is recorded:
+ *
+ *   REFRESH, TURN  the CLEAR that starts the new view
+ *   MOVE           the CLEAR of the new view
+ *   SEND           the CHAT carrying the message back, matched by sequence
+ *   FIRE           no reply is expected, so it is not timed
+ *
+ * Views carry no request id, so they are matched to requests in order, and
+ * the order is kept by never asking for a view that may not come.  A MOVE
+ * is answered only if it succeeds, so it waits until no view is owed, and
+ * is then sent only if the last view shows the cell ahead empty and no
+ * other player close enough to step into it first (a TURN is sent instead
+ * otherwise); nothing more is sent on the connection until its view
+ * arrives.  A request still unanswered after REPLY_TIMEOUT_NS is given up.
+ *
+ * The server also pushes views on its own, when a player nearby respawns
+ * or is hit.  After the bot's own hit (an ALERT) the respawn view is
+ * skipped and the requests it delays are not timed, and a view followed
+ * straight away by another player's score, unchanged (as when a player
+ * respawns), is taken back from the request it was matched to.  A view of a hit player
+ * vanishing can still be taken for a reply, so for exact figures use a mix
+ * without FIRE.
+ *
+ * With -v the bots ask for compact views (see protocol_ext.h), and a VIEW
+ * packet takes the place of the CLEAR above.  With -D they ask for views
+ * only that deep; at depth 1 the cell ahead is never seen, so they only turn.
+ *
+ * Usage: mzw_loadgen -p <port> [-h <host>] [-n <connections>] [-t <threads>]
+ *            [-d <seconds>] [-w <warmup seconds>] [-r <ops/s per connection>]
+ *            [-m move=W,turn=W,fire=W,send=W,refresh=W] [-W <window>] [-v] [-D <depth>] [-j]
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+
+#include "protocol.h"
+#include "protocol_ext.h"
+#include "maze.h"
+
+#define MAX_AVATARS 26
+#define WINDOW_MAX 256                  // replies a connection may be owed, plus one
+#define RBUF_SIZE 65536
+#define WBUF_SIZE 16384
+#define DRAIN_NS 1000000000UL           // wait for late replies at the end
+#define REPLY_TIMEOUT_NS 1000000000UL   // a view not come by then never will
+#define SCORES_SEEN 64                  // other players' scores remembered
+#define TICK_MS 1
+
+// Log-linear latency histogram: 16 buckets per power of two of ns.
+#define SUB_BITS 4
+#define MAX_BITS 36
+#define BUCKETS ((MAX_BITS - SUB_BITS + 1) << SUB_BITS)
+
+enum op { OP_MOVE, OP_TURN, OP_FIRE, OP_SEND, OP_REFRESH, NOPS };
+
+static const char *op_names[NOPS] = { "move", "turn", "fire", "send", "refresh" };
+
+struct pending {
+    unsigned long due;                  // when the request was due, or 0 not to time it
+    unsigned long sent;                 // when it was queued
+    unsigned char op;
+    unsigned int seq;                   // SEND only
+};
+
+struct score_seen {
+    int key;                            // letter or id, plus one; 0 if none
+    int score;
+};
+
+struct ring {
+    struct pending items[WINDOW_MAX];
+    unsigned int head, tail;
+};
+
+struct stats {
+    unsigned long sent[NOPS];
+    unsigned long replies[NOPS];
+    unsigned long hist[NOPS][BUCKETS];
+    unsigned long skipped;              // sends dropped because the window was full
+    unsigned long packets_in;
+    unsigned long bytes_in;
+    unsigned long unsolicited;          // views or chats matching no request
+    unsigned long unanswered;           // view requests given up on
+};
+
+struct conn {
+    int fd;
+    char avatar;
+    int state;                          // LOGGING_IN, ACTIVE, DEAD
+    unsigned long next_due;
+    int id;                             // from the READY
+    char cells[VIEW_DEPTH * VIEW_WIDTH];  // last view, 0 where not (yet) shown
+    int depth;                          // rows the last view may have
+    int skip_views;                     // views coming that answer no request
+    int move_held;                      // a MOVE is waiting for the views owed
+    struct ring views;                  // REFRESH, TURN and MOVE awaiting a CLEAR
+    struct pending credited;            // the request the last view was matched to,
+    int credited_bucket;                // where it was recorded (-1: not timed),
+    int revocable;                      // and whether that may yet be taken back
+    struct score_seen scores[SCORES_SEEN];  // by key, the last of each seen
+    struct ring chats;                  // SEND awaiting its CHAT
+    unsigned int chat_seq;
+    char rbuf[RBUF_SIZE];
+    size_t rlen;
+    char wbuf[WBUF_SIZE];
+    size_t wlen;
+    struct worker *worker;
+};
+
+enum { LOGGING_IN, ACTIVE, DEAD };
+
+struct worker {
+    pthread_t tid;
+    int epfd;
+    struct conn **conns;
+    int nconns;
+    struct stats stats;
+    int logged_in;
+    int inuse;
+};
+
+// Options.
+static const char *host = "127.0.0.1";
+static int port = 0;
+static int nconns = MAX_AVATARS;
+static int nthreads = 1;
+static double duration = 10.0;
+static double warmup = 1.0;
+static double rate = 10.0;
+static int window = 32;
+static int weights[NOPS] = { 30, 30, 5, 5, 30 };
+static int json = 0;
+static int compact = 0;
+static int view_depth = 0;
+
+static unsigned long start_ns, measure_ns, stop_ns;
+static struct worker *workers;
+static struct sockaddr_storage server_addr;
+static socklen_t server_addr_len;
+
+static unsigned long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static int bucket(unsigned long ns) {
+    if (ns < (1UL << SUB_BITS))
+        return ns;
+    if (ns >= 1UL << MAX_BITS)
+        ns = (1UL << MAX_BITS) - 1;
+    int k = 63 - __builtin_clzl(ns);
+    return ((k - SUB_BITS + 1) << SUB_BITS) + (int)((ns >> (k - SUB_BITS)) - (1UL << SUB_BITS));
+}
+
+static unsigned long bucket_high(int b) {
+    if (b < (1 << SUB_BITS))
+        return b;
+    int k = (b >> SUB_BITS) + SUB_BITS - 1;
+    unsigned long sub = b & ((1UL << SUB_BITS) - 1);
+    return (((1UL << SUB_BITS) + sub + 1) << (k - SUB_BITS)) - 1;
+}
+
+static unsigned long quantile(unsigned long *hist, unsigned long n, double q) {
+    unsigned long seen = 0, want = (unsigned long)(q * n);
+    for (int b = 0; b < BUCKETS; b++) {
+        seen += hist[b];
+        if (seen > want)
+            return bucket_high(b);
+    }
+    return bucket_high(BUCKETS - 1);
+}
+
+static uint64_t rng_state;
+static __thread uint64_t thread_rng;
+
+static uint32_t next_random(void) {
+    // xorshift64*
+    thread_rng ^= thread_rng >> 12;
+    thread_rng ^= thread_rng << 25;
+    thread_rng ^= thread_rng >> 27;
+    return (thread_rng * 0x2545f4914f6cdd1dULL) >> 32;
+}
+
+static int ring_count(struct ring *r) {
+    return r->tail - r->head;
+}
+
+static void ring_push(struct ring *r, struct pending p) {
+    r->items[r->tail++ % WINDOW_MAX] = p;
+}
+
+static struct pending *ring_front(struct ring *r) {
+    return r->head == r->tail ? NULL : &r->items[r->head % WINDOW_MAX];
+}
+
+/*
+ * Queue a packet on a connection, to go out when the socket has room.
+ * Returns -1 if the connection has fallen too far behind to take it.
+ */
+static int queue_packet(struct conn *c, int type, int p1, int p2, int p3,
+                        const void *data, size_t size) {
+    MZW_PACKET pkt = {
+        .type = type, .param1 = p1, .param2 = p2, .param3 = p3,
+        .size = htons(size)
+    };
+    if (c->wlen + sizeof(pkt) + size > sizeof(c->wbuf))
+        return -1;
+    memcpy(c->wbuf + c->wlen, &pkt, sizeof(pkt));
+    if (size)
+        memcpy(c->wbuf + c->wlen + sizeof(pkt), data, size);
+    c->wlen += sizeof(pkt) + size;
+    return 0;
+}
+
+static void close_conn(struct conn *c) {
+    if (c->state == DEAD)
+        return;
+    epoll_ctl(c->worker->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->state = DEAD;
+}
+
+static void flush_conn(struct conn *c) {
+    size_t off = 0;
+    while (off < c->wlen) {
+        ssize_t n = send(c->fd, c->wbuf + off, c->wlen - off, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN)
+                close_conn(c);
+            break;
+        }
+        off += n;
+    }
+    memmove(c->wbuf, c->wbuf + off, c->wlen - off);
+    c->wlen -= off;
+
+    struct epoll_event ev = { .events = EPOLLIN | (c->wlen ? EPOLLOUT : 0), .data.ptr = c };
+    if (c->state != DEAD)
+        epoll_ctl(c->worker->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+/*
+ * Record a reply to a request, if it is timed.  Returns the histogram
+ * bucket, or -1.
+ */
+static int record(struct worker *w, struct pending *p, unsigned long now) {
+    if (p->due < measure_ns)
+        return -1;
+    int b = bucket(now > p->due ? now - p->due : 0);
+    w->stats.replies[p->op]++;
+    w->stats.hist[p->op][b]++;
+    return b;
+}
+
+/*
+ * Check whether a MOVE is sure to be answered with a view: none is owed
+ * (see send_op()), so the last view is current, and it shows the cell ahead empty and no
+ * other player within a step of it.  The bot's own avatar is the middle of
+ * the first row.
+ */
+static int can_move(struct conn *c) {
+    int rows = c->depth < 3 ? c->depth : 3;
+
+    if (rows < 2 || c->cells[VIEW_WIDTH + CORRIDOR] != EMPTY)
+        return 0;
+    for (int i = 0; i < rows * VIEW_WIDTH; i++)
+        if (!c->cells[i] || (i != CORRIDOR && IS_AVATAR(c->cells[i])))
+            return 0;
+    return 1;
+}
+
+/*
+ * Check whether the connection is waiting for the answer to a MOVE, which
+ * is then the only view owed.
+ */
+static int move_pending(struct conn *c) {
+    struct pending *p = ring_front(&c->views);
+    return p && p->op == OP_MOVE;
+}
+
+/*
+ * Give up on view requests that have gone unanswered for too long.  The
+ * clock stops while the bot is waiting to respawn.
+ */
+static void expire_views(struct conn *c, unsigned long now) {
+    struct pending *p;
+    while (!c->skip_views && (p = ring_front(&c->views)) && now - p->sent > REPLY_TIMEOUT_NS) {
+        if (p->due >= measure_ns)
+            c->worker->stats.unanswered++;
+        c->views.head++;
+    }
+}
+
+static enum op pick_op(void) {
+    int total = 0;
+    for (int i = 0; i < NOPS; i++)
+        total += weights[i];
+    int r = next_random() % total;
+    for (int i = 0; i < NOPS; i++) {
+        if (r < weights[i])
+            return i;
+        r -= weights[i];
+    }
+    return OP_REFRESH;
+}
+
+/*
+ * Send one request that was due at a given time.  Returns -1 if it is a
+ * MOVE that must wait for the views owed, when it is held for the next call.
+ */
+static int send_op(struct conn *c, unsigned long due, unsigned long now) {
+    struct worker *w = c->worker;
+    enum op op = c->move_held ? OP_MOVE : pick_op();
+
+    c->move_held = 0;
+    if (ring_count(&c->views) >= window || ring_count(&c->chats) >= window) {
+        w->stats.skipped++;
+        return 0;
+    }
+    if (op == OP_MOVE && ring_count(&c->views)) {
+        c->move_held = 1;
+        return -1;
+    }
+    if (op == OP_MOVE && !can_move(c))
+        op = OP_TURN;
+
+    int ret = 0;
+    switch (op) {
+        case OP_MOVE:
+            ret = queue_packet(c, MZW_MOVE_PKT, 1, 0, 0, NULL, 0);
+            break;
+        case OP_TURN:
+            ret = queue_packet(c, MZW_TURN_PKT, (next_random() & 1) ? 1 : -1, 0, 0, NULL, 0);
+            break;
+        case OP_FIRE:
+            ret = queue_packet(c, MZW_FIRE_PKT, 0, 0, 0, NULL, 0);
+            break;
+        case OP_REFRESH:
+            ret = queue_packet(c, MZW_REFRESH_PKT, 0, 0, 0, NULL, 0);
+            break;
+        case OP_SEND: {
+            char msg[32];
+            int len = snprintf(msg, sizeof(msg), "#%u", c->chat_seq);
+            ret = queue_packet(c, MZW_SEND_PKT, 0, 0, 0, msg, len);
+            break;
+        }
+        default:
+            break;
+    }
+    if (ret < 0) {
+        w->stats.skipped++;
+        return 0;
+    }
+
+    if (due >= measure_ns)
+        w->stats.sent[op]++;
+    // Until the bot respawns nothing is answered, so nothing is timed.
+    unsigned long timed = c->skip_views ? 0 : due;
+    if (op == OP_MOVE || op == OP_TURN || op == OP_REFRESH)
+        ring_push(&c->views, (struct pending){ timed, now, op, 0 });
+    else if (op == OP_SEND)
+        ring_push(&c->chats, (struct pending){ timed, now, op, c->chat_seq++ });
+    return 0;
+}
+
+/*
+ * Match a view that has started arriving to the request it answers.
+ */
+static void view_arrived(struct conn *c, unsigned long now) {
+    struct worker *w = c->worker;
+    struct pending *p = ring_front(&c->views);
+
+    if (c->skip_views) {
+        c->skip_views--;
+        for (unsigned int i = c->views.head; i != c->views.tail; i++)
+            c->views.items[i % WINDOW_MAX].sent = now;
+        // Requests that fell due while it waited are dropped, not sent late.
+        if (c->next_due && c->next_due < now)
+            c->next_due = now;
+    } else if (p) {
+        c->credited = *p;
+        c->credited_bucket = record(w, p, now);
+        c->revocable = 1;
+        c->views.head++;
+    } else if (now >= measure_ns) {
+        w->stats.unsolicited++;
+    }
+}
+
+/*
+ * Note a player's score, or its removal if negative.  Returns 1 if it is
+ * the score last seen for the player, as when a player that has respawned
+ * is put back on the scoreboard.
+ */
+static int score_repeated(struct conn *c, int key, int score) {
+    struct score_seen *s = &c->scores[key % SCORES_SEEN];
+    int same = s->key == key + 1 && s->score == score;
+
+    s->key = score < 0 ? 0 : key + 1;
+    s->score = score;
+    return same;
+}
+
+/*
+ * Take back the match of the last view, which the server sent on its own:
+ * the request is owed a view again.  The ring always has a slot for it.
+ */
+static void revoke_view(struct conn *c, unsigned long now) {
+    struct worker *w = c->worker;
+
+    if (c->credited_bucket >= 0) {
+        w->stats.replies[c->credited.op]--;
+        w->stats.hist[c->credited.op][c->credited_bucket]--;
+    }
+    c->views.items[--c->views.head % WINDOW_MAX] = c->credited;
+    if (now >= measure_ns)
+        w->stats.unsolicited++;
+}
+
+static void handle_packet(struct conn *c, MZW_PACKET *pkt, char *payload, unsigned long now) {
+    struct worker *w = c->worker;
+
+    // A view's match may be taken back only by the next packet after it.
+    int revocable = c->revocable;
+    if (pkt->type != MZW_SHOW_PKT)
+        c->revocable = 0;
+
+    switch (pkt->type) {
+        case MZW_READY_PKT:
+            if (c->state == LOGGING_IN) {
+                c->state = ACTIVE;
+                w->logged_in++;
+                if ((pkt->param1 & MZW_LOGIN_WIDE_ID) && pkt->size >= 2)
+                    c->id = (unsigned char)payload[0] << 8 | (unsigned char)payload[1];
+            }
+            break;
+        case MZW_INUSE_PKT:
+            if (c->state == LOGGING_IN) {
+                w->inuse++;
+                close_conn(c);
+            }
+            break;
+        case MZW_CLEAR_PKT:
+            // The SHOWs that follow fill in as many rows as the view has.
+            memset(c->cells, 0, sizeof(c->cells));
+            c->depth = view_depth ? view_depth : VIEW_DEPTH;
+            view_arrived(c, now);
+            break;
+        case MZW_VIEW_PKT: {
+            // Apply the view, then count it as the reply a CLEAR would be.
+            int n = pkt->param2 * VIEW_WIDTH;
+            if (n < 0 || n > sizeof(c->cells))
+                break;
+            if (pkt->param1 == MZW_VIEW_FULL) {
+                memset(c->cells, 0, sizeof(c->cells));
+                memcpy(c->cells, payload, pkt->size < n ? pkt->size : n);
+            } else {
+                for (int i = 0, j = 0; j + 2 <= pkt->size; ) {
+                    int keep = (unsigned char)payload[j], change = (unsigned char)payload[j + 1];
+                    i += keep;
+                    if (i + change > n || j + 2 + change > pkt->size)
+                        break;
+                    memcpy(c->cells + i, payload + j + 2, change);
+                    i += change;
+                    j += 2 + change;
+                }
+            }
+            c->depth = pkt->param2;
+            view_arrived(c, now);
+            break;
+        }
+        case MZW_SHOW_PKT:
+            if (pkt->param3 >= 0 && pkt->param3 < VIEW_DEPTH && pkt->param2 >= 0 &&
+                pkt->param2 < VIEW_WIDTH)
+                c->cells[pkt->param3 * VIEW_WIDTH + pkt->param2] = pkt->param1;
+            break;
+        case MZW_SCORE_PKT:
+            if (score_repeated(c, (unsigned char)pkt->param1, pkt->param2) && revocable &&
+                pkt->param1 != c->avatar)
+                revoke_view(c, now);
+            break;
+        case MZW_SCORE_ID_PKT: {
+            if (pkt->size < 4)
+                break;
+            int id = (unsigned char)payload[0] << 8 | (unsigned char)payload[1];
+            int score = pkt->param2 < 0 ? -1 : (unsigned char)payload[2] << 8 | (unsigned char)payload[3];
+            if (score_repeated(c, id, score) && revocable && id != c->id)
+                revoke_view(c, now);
+            break;
+        }
+        case MZW_ALERT_PKT:
+            // Hit: the server answers nothing more until the respawn, and
+            // then sends the new view before the answers still owed.
+            for (unsigned int i = c->views.head; i != c->views.tail; i++)
+                c->views.items[i % WINDOW_MAX].due = 0;
+            for (unsigned int i = c->chats.head; i != c->chats.tail; i++)
+                c->chats.items[i % WINDOW_MAX].due = 0;
+            c->skip_views++;
+            break;
+        case MZW_CHAT_PKT: {
+            // Our own messages come back as "name[A] #seq".
+            char mark[4] = { '[', c->avatar, ']', 0 };
+            char *m = payload ? memmem(payload, pkt->size, mark, 3) : NULL;
+            struct pending *p = ring_front(&c->chats);
+            if (m && p && m + 5 <= payload + pkt->size && m[4] == '#') {
+                record(w, p, now);
+                c->chats.head++;
+            }
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+static void read_conn(struct conn *c, unsigned long now) {
+    struct worker *w = c->worker;
+
+    while (c->state != DEAD) {
+        ssize_t n = recv(c->fd, c->rbuf + c->rlen, sizeof(c->rbuf) - c->rlen, 0);
+        if (n <= 0) {
+            if (n < 0 && (errno == EINTR))
+                continue;
+            if (n == 0 || errno != EAGAIN)
+                close_conn(c);
+            break;
+        }
+        c->rlen += n;
+        if (now >= measure_ns)
+            w->stats.bytes_in += n;
+
+        size_t off = 0;
+        while (c->rlen - off >= sizeof(MZW_PACKET)) {
+            MZW_PACKET pkt;
+            memcpy(&pkt, c->rbuf + off, sizeof(pkt));
+            pkt.size = ntohs(pkt.size);
+            if (c->rlen - off < sizeof(pkt) + pkt.size)
+                break;
+            if (now >= measure_ns)
+                w->stats.packets_in++;
+            handle_packet(c, &pkt, pkt.size ? c->rbuf + off + sizeof(pkt) : NULL, now);
+            off += sizeof(pkt) + pkt.size;
+        }
+        memmove(c->rbuf, c->rbuf + off, c->rlen - off);
+        c->rlen -= off;
+    }
+}
+
+static void *worker_thread(void *arg) {
+    struct worker *w = arg;
+    struct epoll_event events[64];
+    unsigned long interval = rate > 0 ? (unsigned long)(1e9 / rate) : 0;
+
+    thread_rng = (rng_state ^ ((uint64_t)(w - workers) * 0x9e3779b97f4a7c15ULL)) | 1;
+
+    while (1) {
+        unsigned long now = now_ns();
+        if (now >= stop_ns + DRAIN_NS)
+            break;
+
+        // Send whatever is due.  Connections start staggered over one
+        // interval, so that they do not all send in the same tick.
+        if (now < stop_ns) {
+            for (int i = 0; i < w->nconns; i++) {
+                struct conn *c = w->conns[i];
+                if (c->state != ACTIVE)
+                    continue;
+                expire_views(c, now);
+                if (!interval) {
+                    while (!move_pending(c) &&
+                           ring_count(&c->views) + ring_count(&c->chats) < window &&
+                           c->wlen + 64 < sizeof(c->wbuf) && send_op(c, now, now) == 0)
+                        ;
+                } else {
+                    // Requests that fall due while a MOVE waits or is
+                    // unanswered wait too, and are timed from when they
+                    // fell due.
+                    if (!c->next_due)
+                        c->next_due = now + next_random() % interval;
+                    while (c->next_due <= now && !move_pending(c) &&
+                           send_op(c, c->next_due, now) == 0)
+                        c->next_due += interval;
+                }
+                if (c->wlen)
+                    flush_conn(c);
+            }
+        }
+
+        int n = epoll_wait(w->epfd, events, 64, TICK_MS);
+        now = now_ns();
+        for (int i = 0; i < n; i++) {
+            struct conn *c = events[i].data.ptr;
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                read_conn(c, now);
+            if (c->state != DEAD && (events[i].events & EPOLLOUT))
+                flush_conn(c);
+        }
+    }
+
+    for (int i = 0; i < w->nconns; i++)
+        close_conn(w->conns[i]);
+    return NULL;
+}
+
+static int resolve(void) {
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM }, *res;
+    char service[16];
+    snprintf(service, sizeof(service), "%d", port);
+    if (getaddrinfo(host, service, &hints, &res) != 0) {
+        fprintf(stderr, "mzw_loadgen: cannot resolve %s\n", host);
+        return -1;
+    }
+    memcpy(&server_addr, res->ai_addr, res->ai_addrlen);
+    server_addr_len = res->ai_addrlen;
+    freeaddrinfo(res);
+    return 0;
+}
+
+static struct conn *open_conn(struct worker *w, int i) {
+    struct conn *c = calloc(1, sizeof(*c));
+    if (!c)
+        return NULL;
+    c->worker = w;
+    c->avatar = 'A' + i % MAX_AVATARS;
+    c->fd = socket(server_addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (c->fd < 0 || connect(c->fd, (struct sockaddr *)&server_addr, server_addr_len) < 0) {
+        perror("mzw_loadgen: connect");
+        if (c->fd >= 0)
+            close(c->fd);
+        free(c);
+        return NULL;
+    }
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK);
+
+    char name[16];
+    int len = snprintf(name, sizeof(name), "bot%d", i);
+    // Wide ids are asked for so that a large room (-X) takes the bots.
+    queue_packet(c, MZW_LOGIN_PKT, c->avatar, compact ? MZW_LOGIN_COMPACT_VIEW : 0,
+                 view_depth | MZW_LOGIN_WIDE_ID, name, len);
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+    epoll_ctl(w->epfd, EPOLL_CTL_ADD, c->fd, &ev);
+    flush_conn(c);
+    return c;
+}
+
+static int parse_mix(char *spec) {
+    int w[NOPS] = { 0 }, total = 0;
+    for (char *save = NULL, *tok = strtok_r(spec, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        char *eq = strchr(tok, '=');
+        int i;
+        if (!eq)
+            return -1;
+        *eq = '\0';
+        for (i = 0; i < NOPS && strcmp(tok, op_names[i]); i++)
+            ;
+        if (i == NOPS || atoi(eq + 1) < 0)
+            return -1;
+        total += w[i] = atoi(eq + 1);
+    }
+    if (total <= 0)
+        return -1;
+    memcpy(weights, w, sizeof(weights));
+    return 0;
+}
+
+static void report(struct stats *s, int logged_in, int inuse, double elapsed) {
+    unsigned long total_sent = 0, total_replies = 0;
+    for (int i = 0; i < NOPS; i++) {
+        total_sent += s->sent[i];
+        total_replies += s->replies[i];
+    }
+
+    if (json) {
+        printf("{\"connections\":%d,\"logged_in\":%d,\"inuse\":%d,\"threads\":%d,"
+               "\"compact_views\":%s,\"view_depth\":%d,\"seconds\":%.3f,\"rate_per_conn\":%.1f,\"ops_per_sec\":%.1f,"
+               "\"packets_in_per_sec\":%.1f,\"bytes_in_per_sec\":%.1f,\"skipped\":%lu,"
+               "\"unsolicited\":%lu,\"unanswered\":%lu,\"ops\":{",
+               nconns, logged_in, inuse, nthreads, compact ? "true" : "false",
+               view_depth ? view_depth : VIEW_DEPTH, elapsed, rate, total_sent / elapsed,
+               s->packets_in / elapsed, s->bytes_in / elapsed, s->skipped, s->unsolicited,
+               s->unanswered);
+        for (int i = 0; i < NOPS; i++) {
+            unsigned long n = s->replies[i];
+            printf("%s\"%s\":{\"sent\":%lu,\"replies\":%lu", i ? "," : "", op_names[i],
+                   s->sent[i], n);
+            if (n)
+                printf(",\"p50_us\":%.1f,\"p90_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f",
+                       quantile(s->hist[i], n, 0.5) / 1e3, quantile(s->hist[i], n, 0.9) / 1e3,
+                       quantile(s->hist[i], n, 0.99) / 1e3, quantile(s->hist[i], n, 0.999) / 1e3);
+            printf("}");
+        }
+        printf("}}\n");
+        return;
+    }
+
+    printf("mzw_loadgen: %d connections (%d logged in, %d in use), %d threads, %.1f s measured\n",
+           nconns, logged_in, inuse, nthreads, elapsed);
+    printf("OP       SENT       REPLIES    P50_US     P90_US     P99_US     P999_US\n");
+    for (int i = 0; i < NOPS; i++) {
+        unsigned long n = s->replies[i];
+        printf("%-8s %-10lu %-10lu", op_names[i], s->sent[i], n);
+        if (n)
+            printf(" %-10.1f %-10.1f %-10.1f %.1f", quantile(s->hist[i], n, 0.5) / 1e3,
+                   quantile(s->hist[i], n, 0.9) / 1e3, quantile(s->hist[i], n, 0.99) / 1e3,
+                   quantile(s->hist[i], n, 0.999) / 1e3);
+        printf("\n");
+    }
+    printf("throughput: %.1f ops/s sent, %.1f replies/s, %.1f packets/s and %.1f kB/s received\n",
+           total_sent / elapsed, total_replies / elapsed, s->packets_in / elapsed,
+           s->bytes_in / elapsed / 1024);
+    printf("skipped (window full): %lu, unsolicited views: %lu, unanswered: %lu\n",
+           s->skipped, s->unsolicited, s->unanswered);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s -p <port> [-h <host>] [-n <connections>] [-t <threads>] "
+            "[-d <seconds>] [-w <warmup seconds>] [-r <ops/s per connection, 0 = max>] "
+            "[-m move=W,turn=W,fire=W,send=W,refresh=W] [-W <window>] [-v] [-D <depth>] [-j]\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+
+    while ((opt = getopt(argc, argv, "h:p:n:t:d:w:r:m:W:vD:j")) != -1) {
+        switch (opt) {
+            case 'h': host = optarg; break;
+            case 'p': port = atoi(optarg); break;
+            case 'n': nconns = atoi(optarg); break;
+            case 't': nthreads = atoi(optarg); break;
+            case 'd': duration = atof(optarg); break;
+            case 'w': warmup = atof(optarg); break;
+            case 'r': rate = atof(optarg); break;
+            case 'W': window = atoi(optarg); break;
+            case 'j': json = 1; break;
+            case 'v': compact = 1; break;
+            case 'D': view_depth = atoi(optarg); break;
+            case 'm':
+                if (parse_mix(optarg) < 0) {
+                    fprintf(stderr, "mzw_loadgen: bad mix '%s'\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (port <= 0 || nconns <= 0 || nthreads <= 0 || duration <= 0 || warmup < 0 || rate < 0 ||
+        view_depth < 0 || view_depth > VIEW_DEPTH)
+        usage(argv[0]);
+    if (nthreads > nconns)
+        nthreads = nconns;
+    if (window <= 0 || window >= WINDOW_MAX)
+        window = window <= 0 ? 1 : WINDOW_MAX - 1;
+    if (nconns > MAX_AVATARS)
+        fprintf(stderr, "mzw_loadgen: only %d avatars; connections beyond that share them "
+                "and will be refused\n", MAX_AVATARS);
+    if (resolve() < 0)
+        exit(EXIT_FAILURE);
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    rng_state = ts.tv_nsec ^ ((uint64_t)getpid() << 32);
+
+    workers = calloc(nthreads, sizeof(*workers));
+    for (int t = 0; t < nthreads; t++) {
+        workers[t].epfd = epoll_create1(EPOLL_CLOEXEC);
+        workers[t].conns = calloc(nconns / nthreads + 1, sizeof(struct conn *));
+    }
+    for (int i = 0; i < nconns; i++) {
+        struct worker *w = &workers[i % nthreads];
+        struct conn *c = open_conn(w, i);
+        if (c)
+            w->conns[w->nconns++] = c;
+    }
+
+    start_ns = now_ns();
+    measure_ns = start_ns + (unsigned long)(warmup * 1e9);
+    stop_ns = measure_ns + (unsigned long)(duration * 1e9);
+    for (int t = 0; t < nthreads; t++)
+        pthread_create(&workers[t].tid, NULL, worker_thread, &workers[t]);
+
+    struct stats total = { 0 };
+    int logged_in = 0, inuse = 0;
+    for (int t = 0; t < nthreads; t++) {
+        struct worker *w = &workers[t];
+        pthread_join(w->tid, NULL);
+        logged_in += w->logged_in;
+        inuse += w->inuse;
+        for (int i = 0; i < NOPS; i++) {
+            total.sent[i] += w->stats.sent[i];
+            total.replies[i] += w->stats.replies[i];
+            for (int b = 0; b < BUCKETS; b++)
+                total.hist[i][b] += w->stats.hist[i][b];
+        }
+        total.skipped += w->stats.skipped;
+        total.packets_in += w->stats.packets_in;
+        total.bytes_in += w->stats.bytes_in;
+        total.unsolicited += w->stats.unsolicited;
+        total.unanswered += w->stats.unanswered;
+        for (int i = 0; i < w->nconns; i++)
+            free(w->conns[i]);
+        free(w->conns);
+        close(w->epfd);
+    }
+    free(workers);
+
+    report(&total, logged_in, inuse, duration);
+    return 0;
+}
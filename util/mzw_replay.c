@@ -0,0 +1,305 @@
+/*
+ * mzw_replay: replay a packet recording made with mazewar -r.
+ *
+ * Opens one connection to the server for each connection in the recording,
+ * at its first packet, sends its packets in the recorded order and closes
+ * it where it was closed.  If the server closes a connection first, the
+ * rest of its packets are skipped.  Everything the server sends back is
+ * read and discarded.  By default packets go out as fast as the server takes them;
+ * with -s they are paced as recorded, sped up by the given factor.
+ *
+ * Packets on one connection always arrive in order, but at full speed the
+ * server may handle packets from different connections in another order
+ * than when they were recorded, so that, for instance, a laser misses a
+ * player who has already moved on.  For a run that plays out exactly as
+ * recorded, replay at recorded pacing against a server started with the
+ * same -S seed as the recorded one.
+ *
+ * Usage: mzw_replay -p <port> [-h <host>] [-s <speed>] [-j] <record file>
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+
+#include "record.h"
+
+#define IDLE_NS 500000000UL             // how long to wait for the server to go quiet
+
+struct conn {
+    int fd;                             // -1 until opened, or once closed
+    int opened;                         // never reopened once closed
+    int closing;                        // close once the output is written
+    char *wbuf;
+    size_t wlen, wcap;
+};
+
+static const char *host = "127.0.0.1";
+static int port = 0;
+static double speed = 0;
+static int json = 0;
+
+static struct sockaddr_storage server_addr;
+static socklen_t server_addr_len;
+static int epfd;
+static struct conn *conns = NULL;
+static unsigned int nconns = 0;
+static unsigned long bytes_in = 0, bytes_out = 0, packets = 0, skipped = 0, opened = 0;
+
+static unsigned long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static int resolve(void) {
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM }, *res;
+    char service[16];
+    snprintf(service, sizeof(service), "%d", port);
+    if (getaddrinfo(host, service, &hints, &res) != 0) {
+        fprintf(stderr, "mzw_replay: cannot resolve %s\n", host);
+        return -1;
+    }
+    memcpy(&server_addr, res->ai_addr, res->ai_addrlen);
+    server_addr_len = res->ai_addrlen;
+    freeaddrinfo(res);
+    return 0;
+}
+
+static struct conn *get_conn(unsigned int id) {
+    if (id >= nconns) {
+        unsigned int n = nconns ? nconns : 64;
+        while (n <= id)
+            n *= 2;
+        conns = realloc(conns, n * sizeof(*conns));
+        for (unsigned int i = nconns; i < n; i++)
+            conns[i] = (struct conn){ .fd = -1 };
+        nconns = n;
+    }
+    return &conns[id];
+}
+
+static void close_conn(struct conn *c) {
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->fd = -1;
+    c->wlen = 0;
+}
+
+static int open_conn(struct conn *c, unsigned int id) {
+    c->fd = socket(server_addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (c->fd < 0 || connect(c->fd, (struct sockaddr *)&server_addr, server_addr_len) < 0) {
+        fprintf(stderr, "mzw_replay: connection %u: %s\n", id, strerror(errno));
+        if (c->fd >= 0)
+            close(c->fd);
+        c->fd = -1;
+        return -1;
+    }
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK);
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+    epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev);
+    c->opened = 1;
+    opened++;
+    return 0;
+}
+
+static void flush_conn(struct conn *c) {
+    size_t off = 0;
+    while (off < c->wlen) {
+        ssize_t n = send(c->fd, c->wbuf + off, c->wlen - off, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN) {
+                close_conn(c);
+                return;
+            }
+            break;
+        }
+        off += n;
+        bytes_out += n;
+    }
+    memmove(c->wbuf, c->wbuf + off, c->wlen - off);
+    c->wlen -= off;
+
+    if (!c->wlen && c->closing) {
+        close_conn(c);
+        return;
+    }
+    struct epoll_event ev = { .events = EPOLLIN | (c->wlen ? EPOLLOUT : 0), .data.ptr = c };
+    epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+static void queue(struct conn *c, const void *data, size_t len) {
+    if (c->wlen + len > c->wcap) {
+        c->wcap = (c->wlen + len) * 2;
+        c->wbuf = realloc(c->wbuf, c->wcap);
+    }
+    memcpy(c->wbuf + c->wlen, data, len);
+    c->wlen += len;
+}
+
+/*
+ * Wait for, and handle, events until a deadline, or for one round of
+ * events if there is no deadline.  Returns the number of events.
+ */
+static int poll_events(unsigned long deadline) {
+    static char buf[65536];
+    struct epoll_event events[64];
+    unsigned long now = now_ns();
+    int timeout = deadline > now ? (int)((deadline - now + 999999) / 1000000) : 0;
+
+    int n = epoll_wait(epfd, events, 64, timeout);
+    for (int i = 0; i < n; i++) {
+        struct conn *c = events[i].data.ptr;
+        if (c->fd < 0)
+            continue;
+        if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+            ssize_t r;
+            while ((r = read(c->fd, buf, sizeof(buf))) > 0)
+                bytes_in += r;
+            if (r == 0 || (r < 0 && errno != EAGAIN && errno != EINTR)) {
+                close_conn(c);
+                continue;
+            }
+        }
+        if (events[i].events & EPOLLOUT)
+            flush_conn(c);
+    }
+    return n > 0 ? n : 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s -p <port> [-h <host>] [-s <speed, 0 = max>] [-j] <record file>\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+
+    while ((opt = getopt(argc, argv, "h:p:s:j")) != -1) {
+        switch (opt) {
+            case 'h': host = optarg; break;
+            case 'p': port = atoi(optarg); break;
+            case 's': speed = atof(optarg); break;
+            case 'j': json = 1; break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (port <= 0 || speed < 0 || optind != argc - 1)
+        usage(argv[0]);
+
+    // The whole recording is read in, so that replay is not paced by the disk.
+    FILE *f = fopen(argv[optind], "r");
+    struct stat st;
+    if (!f || fstat(fileno(f), &st) < 0) {
+        perror(argv[optind]);
+        exit(EXIT_FAILURE);
+    }
+    char *data = malloc(st.st_size);
+    struct record_file_header fh;
+    if (!data || fread(data, 1, st.st_size, f) != (size_t)st.st_size ||
+        st.st_size < (off_t)sizeof(fh)) {
+        fprintf(stderr, "mzw_replay: cannot read %s\n", argv[optind]);
+        exit(EXIT_FAILURE);
+    }
+    fclose(f);
+    memcpy(&fh, data, sizeof(fh));
+    if (memcmp(fh.magic, RECORD_MAGIC, sizeof(RECORD_MAGIC)) || fh.version != RECORD_VERSION) {
+        fprintf(stderr, "mzw_replay: %s is not a version %d recording\n", argv[optind], RECORD_VERSION);
+        exit(EXIT_FAILURE);
+    }
+
+    if (resolve() < 0)
+        exit(EXIT_FAILURE);
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+
+    unsigned long start = now_ns(), last = start;
+    size_t off = sizeof(fh);
+    while (off + sizeof(struct record_header) <= (size_t)st.st_size) {
+        struct record_header h;
+        memcpy(&h, data + off, sizeof(h));
+        if (off + sizeof(h) + h.size > (size_t)st.st_size) {
+            fprintf(stderr, "mzw_replay: recording truncated\n");
+            break;
+        }
+        char *body = data + off + sizeof(h);
+        off += sizeof(h) + h.size;
+
+        if (speed > 0) {
+            unsigned long due = start + (unsigned long)(h.time_ns / speed);
+            while (now_ns() < due)
+                poll_events(due);
+        }
+
+        struct conn *c = get_conn(h.conn);
+        if (h.kind == RECORD_PACKET) {
+            // Packets for a connection the server has closed are skipped.
+            if (c->fd < 0 && (c->opened || open_conn(c, h.conn) < 0)) {
+                c->opened = 1;
+                skipped++;
+                continue;
+            }
+            queue(c, body, h.size);
+            flush_conn(c);
+            packets++;
+        } else if (h.kind == RECORD_CLOSE && c->fd >= 0) {
+            c->closing = 1;
+            flush_conn(c);
+        }
+        // Keep the server's replies moving, so that neither side blocks.
+        if (!speed && !(packets % 64))
+            while (poll_events(0))
+                ;
+        last = now_ns();
+    }
+
+    // Let the output drain, then wait for the server to go quiet.
+    while (1) {
+        int pending = 0;
+        for (unsigned int i = 0; i < nconns; i++)
+            pending |= conns[i].fd >= 0 && conns[i].wlen;
+        if (pending) {
+            poll_events(now_ns() + IDLE_NS);
+            last = now_ns();
+        } else if (!poll_events(now_ns() + IDLE_NS)) {
+            break;
+        }
+    }
+    for (unsigned int i = 0; i < nconns; i++) {
+        if (conns[i].fd >= 0)
+            close_conn(&conns[i]);
+        free(conns[i].wbuf);
+    }
+
+    double secs = (last - start) / 1e9;
+    if (secs <= 0)
+        secs = 1e-9;
+    if (json)
+        printf("{\"connections\":%lu,\"packets\":%lu,\"skipped\":%lu,\"seconds\":%.6f,\"packets_per_sec\":%.1f,"
+               "\"bytes_out\":%lu,\"bytes_in\":%lu,\"speed\":%g}\n",
+               opened, packets, skipped, secs, packets / secs, bytes_out, bytes_in, speed);
+    else
+        printf("mzw_replay: %lu packets on %lu connections in %.3f s (%.1f packets/s), "
+               "%lu bytes sent, %lu received, %lu packets skipped as the server had closed "
+               "their connection\n", packets, opened, secs, packets / secs, bytes_out, bytes_in,
+               skipped);
+    free(conns);
+    free(data);
+    close(epfd);
+    return 0;
+}